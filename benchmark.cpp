@@ -0,0 +1,504 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "corpusGenerator.h"
+
+// Reproducible benchmarks of the indexer and the search engine, without any data to download (make bench):
+// 1. Generate a synthetic corpus (see corpusGenerator.h) into a work directory
+// 2. Index it with a few indexer options: time, documents/s, MB/s, peak memory (RSS) and index size
+// 3. Run sets of generated queries of different lengths and word frequencies in every query mode, through a
+//    search engine server (1 thread, 1 query at a time, so the latency is the latency of a single query): p50/p95/p99 and QPS
+// The results are written as JSON, to compare runs and catch regressions.
+
+// Command line options of the benchmark
+struct BenchmarkOptions {
+	CorpusOptions corpus;
+	uint32_t queriesPerSet;
+	uint32_t warmUpQueries; // Run before measuring every query set
+	std::string workDirectory; // For the corpus and the index files
+	std::string outputFileName; // JSON results, empty for stdout
+	std::string binaryDirectory; // Where ./indexer and ./searchEngine are
+	bool keepFiles; // Keep the corpus and the index after the benchmark
+
+	BenchmarkOptions() {
+		this->queriesPerSet = 200;
+		this->warmUpQueries = 20;
+		this->workDirectory = "benchmark_data";
+		this->binaryDirectory = ".";
+		this->keepFiles = false;
+	}
+};
+
+// An indexer configuration to measure
+struct IndexingCase {
+	std::string name;
+	std::vector<std::string> arguments;
+};
+
+// A set of queries with the same number of words, drawn from the same band of word ranks
+struct QuerySet {
+	std::string name;
+	uint32_t wordCount;
+	uint32_t minRank;
+	uint32_t maxRank;
+};
+
+struct ProcessResult {
+	bool succeeded;
+	double seconds;
+	double peakMemoryMB; // Maximum resident set size
+};
+
+std::string jsonString(const std::string& text) {
+	std::string result = "\"";
+	for (size_t i = 0; i < text.length(); ++i) {
+		if (text[i] == '"' || text[i] == '\\')
+			result += '\\';
+		result += text[i];
+	}
+	return result + "\"";
+}
+
+// Replace stdin, stdout and stderr of a child process with /dev/null
+void redirectToNull(bool input) {
+	int null = open("/dev/null", O_RDWR);
+	if (input)
+		dup2(null, 0);
+	dup2(null, 1);
+	dup2(null, 2);
+	close(null);
+}
+
+std::vector<char*> toArgv(const std::vector<std::string>& arguments) {
+	std::vector<char*> argv;
+	for (size_t i = 0; i < arguments.size(); ++i)
+		argv.push_back(const_cast<char*>(arguments[i].c_str()));
+	argv.push_back(NULL);
+	return argv;
+}
+
+// Run a program in a directory and wait for it, with its output discarded
+ProcessResult runProcess(const std::vector<std::string>& arguments, const std::string& directory) {
+	ProcessResult result;
+	result.succeeded = false;
+	result.seconds = 0;
+	result.peakMemoryMB = 0;
+
+	std::vector<char*> argv = toArgv(arguments);
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		redirectToNull(true);
+		if (chdir(directory.c_str()) == 0)
+			execv(argv[0], argv.data());
+		_exit(127);
+	}
+	if (pid < 0)
+		return result;
+
+	int status = 0;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return result;
+	std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+
+	result.succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	result.seconds = std::chrono::duration<double>(endTime - startTime).count();
+	result.peakMemoryMB = usage.ru_maxrss / 1024.0; // In KB on Linux
+	return result;
+}
+
+// A search engine server (./searchEngine --server) with its stdin and stdout connected to pipes,
+// answering one query at a time
+class SearchEngineProcess {
+
+private:
+	pid_t pid;
+	int queryFd; // The server's stdin
+	int answerFd; // The server's stdout
+	std::string received;
+
+	// Read one line of the answer, without the '\n'. Return false at the end of the output.
+	bool readLine(std::string& line) {
+		size_t lineEnd = 0;
+		while ((lineEnd = this->received.find('\n')) == std::string::npos) {
+			char buffer[65536];
+			ssize_t bytesRead = read(this->answerFd, buffer, sizeof(buffer));
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+			if (bytesRead <= 0)
+				return false;
+			this->received.append(buffer, bytesRead);
+		}
+		line.assign(this->received, 0, lineEnd);
+		this->received.erase(0, lineEnd + 1);
+		return true;
+	}
+
+public:
+	SearchEngineProcess() {
+		this->pid = -1;
+		this->queryFd = -1;
+		this->answerFd = -1;
+	}
+
+	~SearchEngineProcess() {
+		this->stop();
+	}
+
+	bool start(const std::vector<std::string>& arguments, const std::string& directory) {
+		int queryPipe[2];
+		int answerPipe[2];
+		if (pipe(queryPipe) != 0)
+			return false;
+		if (pipe(answerPipe) != 0) {
+			close(queryPipe[0]);
+			close(queryPipe[1]);
+			return false;
+		}
+
+		std::vector<char*> argv = toArgv(arguments);
+		this->pid = fork();
+		if (this->pid == 0) {
+			redirectToNull(false);
+			dup2(queryPipe[0], 0);
+			dup2(answerPipe[1], 1);
+			close(queryPipe[0]);
+			close(queryPipe[1]);
+			close(answerPipe[0]);
+			close(answerPipe[1]);
+			if (chdir(directory.c_str()) == 0)
+				execv(argv[0], argv.data());
+			_exit(127);
+		}
+		close(queryPipe[0]);
+		close(answerPipe[1]);
+		this->queryFd = queryPipe[1];
+		this->answerFd = answerPipe[0];
+		return this->pid > 0;
+	}
+
+	// Send a query and wait for its answer: result lines, then a blank line
+	// return false if the server is gone
+	bool query(const std::string& query, uint32_t& resultCount) {
+		std::string line = query + "\n";
+		if (write(this->queryFd, line.data(), line.size()) != (ssize_t)line.size())
+			return false;
+
+		resultCount = 0;
+		while (this->readLine(line)) {
+			if (line.empty())
+				return true;
+			++resultCount;
+		}
+		return false;
+	}
+
+	// Close the server's stdin, so that it stops after the last query
+	void stop() {
+		if (this->pid <= 0)
+			return;
+		close(this->queryFd);
+		close(this->answerFd);
+		waitpid(this->pid, NULL, 0);
+		this->pid = -1;
+	}
+};
+
+// The value at a percentile of sorted values
+double percentile(const std::vector<double>& sortedValues, uint32_t percent) {
+	if (sortedValues.empty())
+		return 0;
+	size_t index = std::min(sortedValues.size() - 1, sortedValues.size() * percent / 100);
+	return sortedValues[index];
+}
+
+class Benchmark {
+
+private:
+	BenchmarkOptions options;
+	CorpusGenerator generator;
+	std::string corpusFileName;
+	uint64_t corpusBytes;
+	std::ostringstream json;
+
+	std::string getBinary(const std::string& name) {
+		return this->options.binaryDirectory + "/" + name;
+	}
+
+	// The index files in the work directory
+	std::vector<std::string> listIndexFiles() {
+		std::vector<std::string> fileNames;
+		DIR* directory = opendir(this->options.workDirectory.c_str());
+		if (directory == NULL)
+			return fileNames;
+		struct dirent* entry = NULL;
+		while ((entry = readdir(directory)) != NULL) {
+			if (strncmp(entry->d_name, "index", 5) == 0)
+				fileNames.push_back(this->options.workDirectory + "/" + entry->d_name);
+		}
+		closedir(directory);
+		return fileNames;
+	}
+
+	void removeIndexFiles() {
+		std::vector<std::string> fileNames = this->listIndexFiles();
+		for (size_t i = 0; i < fileNames.size(); ++i)
+			unlink(fileNames[i].c_str());
+	}
+
+	uint64_t getIndexBytes() {
+		uint64_t bytes = 0;
+		std::vector<std::string> fileNames = this->listIndexFiles();
+		for (size_t i = 0; i < fileNames.size(); ++i) {
+			struct stat fileStat;
+			if (stat(fileNames[i].c_str(), &fileStat) == 0)
+				bytes += fileStat.st_size;
+		}
+		return bytes;
+	}
+
+	void generateCorpus() {
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		std::ofstream file(this->corpusFileName.c_str(), std::ofstream::binary);
+		this->corpusBytes = this->generator.writeCorpus(file);
+		file.close();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		const CorpusOptions& corpus = this->options.corpus;
+		std::cerr << "Corpus: " << corpus.documentCount << " documents, " << this->corpusBytes / 1048576.0 << " MB" << std::endl;
+		this->json << "  \"corpus\": {\"documents\": " << corpus.documentCount << ", \"bytes\": " << this->corpusBytes
+			<< ", \"averageDocumentLength\": " << corpus.averageDocumentLength << ", \"vocabulary\": " << corpus.vocabularySize
+			<< ", \"zipfExponent\": " << corpus.zipfExponent << ", \"seed\": " << corpus.seed << ", \"generateSeconds\": " << seconds << "},\n";
+	}
+
+	// Index the corpus with every configuration. The last one is kept for the query benchmarks.
+	bool benchmarkIndexing(const std::vector<IndexingCase>& cases) {
+		this->json << "  \"indexing\": [\n";
+		for (size_t i = 0; i < cases.size(); ++i) {
+			this->removeIndexFiles();
+			std::vector<std::string> arguments(1, this->getBinary("indexer"));
+			arguments.insert(arguments.end(), cases[i].arguments.begin(), cases[i].arguments.end());
+			arguments.push_back("corpus.xml");
+
+			ProcessResult result = runProcess(arguments, this->options.workDirectory);
+			if (!result.succeeded) {
+				std::cerr << "Indexing failed: " << cases[i].name << std::endl;
+				return false;
+			}
+
+			double documentsPerSecond = this->options.corpus.documentCount / result.seconds;
+			double megabytesPerSecond = this->corpusBytes / 1048576.0 / result.seconds;
+			uint64_t indexBytes = this->getIndexBytes();
+			std::cerr << "Indexing " << cases[i].name << ": " << result.seconds << " s, " << documentsPerSecond << " docs/s, "
+				<< megabytesPerSecond << " MB/s, peak memory " << result.peakMemoryMB << " MB" << std::endl;
+
+			std::string argumentText;
+			for (size_t j = 0; j < cases[i].arguments.size(); ++j)
+				argumentText += (j > 0 ? " " : "") + cases[i].arguments[j];
+			this->json << "    {\"name\": " << jsonString(cases[i].name) << ", \"arguments\": " << jsonString(argumentText)
+				<< ", \"seconds\": " << result.seconds << ", \"documentsPerSecond\": " << documentsPerSecond
+				<< ", \"megabytesPerSecond\": " << megabytesPerSecond << ", \"peakMemoryMB\": " << result.peakMemoryMB
+				<< ", \"indexBytes\": " << indexBytes << "}" << (i + 1 < cases.size() ? "," : "") << "\n";
+		}
+		this->json << "  ],\n";
+		return true;
+	}
+
+	// Run every query set in every query mode, each mode with its own server
+	bool benchmarkQueries(const std::vector<std::string>& modes, const std::vector<QuerySet>& querySets) {
+		this->json << "  \"queries\": [\n";
+		bool first = true;
+		for (size_t i = 0; i < modes.size(); ++i) {
+			SearchEngineProcess server;
+			std::vector<std::string> arguments;
+			arguments.push_back(this->getBinary("searchEngine"));
+			arguments.push_back("--server");
+			arguments.push_back("--threads=1");
+			arguments.push_back("--mode=" + modes[i]);
+			arguments.push_back("--k=10");
+			if (!server.start(arguments, this->options.workDirectory)) {
+				std::cerr << "Can't start the search engine" << std::endl;
+				return false;
+			}
+
+			for (size_t j = 0; j < querySets.size(); ++j) {
+				const QuerySet& querySet = querySets[j];
+				std::vector<std::string> queries = this->generator.generateQueries(this->options.queriesPerSet + this->options.warmUpQueries,
+					querySet.wordCount, querySet.minRank, querySet.maxRank, this->options.corpus.seed + j);
+
+				std::vector<double> latencies;
+				uint64_t resultCount = 0;
+				std::chrono::steady_clock::time_point setStartTime;
+				for (size_t k = 0; k < queries.size(); ++k) {
+					if (k == this->options.warmUpQueries)
+						setStartTime = std::chrono::steady_clock::now();
+
+					uint32_t queryResultCount = 0;
+					std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+					if (!server.query(queries[k], queryResultCount)) {
+						std::cerr << "The search engine stopped" << std::endl;
+						return false;
+					}
+					std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+
+					if (k >= this->options.warmUpQueries) {
+						latencies.push_back(std::chrono::duration<double, std::micro>(endTime - startTime).count());
+						resultCount += queryResultCount;
+					}
+				}
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setStartTime).count();
+
+				std::sort(latencies.begin(), latencies.end());
+				double sum = 0;
+				for (size_t k = 0; k < latencies.size(); ++k)
+					sum += latencies[k];
+				double mean = latencies.empty() ? 0 : sum / latencies.size();
+				double qps = seconds > 0 ? latencies.size() / seconds : 0;
+				std::cerr << "Queries " << modes[i] << " " << querySet.name << ": p50 " << percentile(latencies, 50) << " us, p95 "
+					<< percentile(latencies, 95) << " us, p99 " << percentile(latencies, 99) << " us, QPS " << qps << std::endl;
+
+				this->json << (first ? "" : ",\n") << "    {\"mode\": " << jsonString(modes[i]) << ", \"querySet\": " << jsonString(querySet.name)
+					<< ", \"words\": " << querySet.wordCount << ", \"minRank\": " << querySet.minRank << ", \"maxRank\": " << querySet.maxRank
+					<< ", \"queries\": " << latencies.size() << ", \"averageResults\": " << (latencies.empty() ? 0 : (double)resultCount / latencies.size())
+					<< ", \"p50Us\": " << percentile(latencies, 50) << ", \"p95Us\": " << percentile(latencies, 95)
+					<< ", \"p99Us\": " << percentile(latencies, 99) << ", \"maxUs\": " << (latencies.empty() ? 0 : latencies.back())
+					<< ", \"meanUs\": " << mean << ", \"qps\": " << qps << "}";
+				first = false;
+			}
+			server.stop();
+		}
+		this->json << "\n  ]\n";
+		return true;
+	}
+
+public:
+	Benchmark(const BenchmarkOptions& options) : generator(options.corpus) {
+		this->options = options;
+		this->corpusFileName = options.workDirectory + "/corpus.xml";
+		this->corpusBytes = 0;
+	}
+
+	bool run() {
+		mkdir(this->options.workDirectory.c_str(), 0755);
+		signal(SIGPIPE, SIG_IGN); // A search engine that exits early shows up as a failed write
+
+		this->json << "{\n  \"timestamp\": " << (uint64_t)time(NULL) << ",\n  \"cores\": " << std::thread::hardware_concurrency() << ",\n";
+		this->generateCorpus();
+
+		std::vector<IndexingCase> indexingCases;
+		indexingCases.push_back(IndexingCase{"files-raw", {}});
+		indexingCases.push_back(IndexingCase{"files-compressed", {"--postings=compressed"}});
+		if (std::thread::hardware_concurrency() > 1)
+			indexingCases.push_back(IndexingCase{"files-compressed-threads", {"--postings=compressed", "--threads=" + std::to_string(std::thread::hardware_concurrency())}});
+		indexingCases.push_back(IndexingCase{"container-compressed", {"--container", "--postings=compressed"}});
+		// Last, so that every query mode has what it needs
+		indexingCases.push_back(IndexingCase{"container-compressed-impacts-positions-quantized", {"--impacts", "--positions", "--quantized=8", "--postings=compressed"}});
+
+		// Frequent words are in a large part of the documents, rare ones in a few
+		uint32_t vocabularySize = this->options.corpus.vocabularySize;
+		std::vector<QuerySet> querySets;
+		uint32_t wordCounts[] = {1, 2, 4};
+		for (size_t i = 0; i < 3; ++i) {
+			std::string words = std::to_string(wordCounts[i]) + (wordCounts[i] == 1 ? " word" : " words");
+			querySets.push_back(QuerySet{words + ", frequent", wordCounts[i], 1, 100});
+			querySets.push_back(QuerySet{words + ", medium", wordCounts[i], 101, 5000});
+			querySets.push_back(QuerySet{words + ", rare", wordCounts[i], 5001, vocabularySize});
+		}
+
+		std::vector<std::string> modes = {"exhaustive", "taat", "bmw", "saat", "and", "quantized"};
+
+		bool succeeded = this->benchmarkIndexing(indexingCases) && this->benchmarkQueries(modes, querySets);
+		this->json << "}\n";
+
+		if (!this->options.keepFiles) {
+			this->removeIndexFiles();
+			unlink(this->corpusFileName.c_str());
+			rmdir(this->options.workDirectory.c_str()); // Only if it's empty now
+		}
+		if (!succeeded)
+			return false;
+
+		if (this->options.outputFileName.empty()) {
+			std::cout << this->json.str() << std::flush;
+		}
+		else {
+			std::ofstream output(this->options.outputFileName.c_str());
+			output << this->json.str();
+			std::cerr << "Results written to " << this->options.outputFileName << std::endl;
+		}
+		return true;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	BenchmarkOptions options;
+	std::string generateFileName = "";
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 7, "--docs=") == 0)
+			options.corpus.documentCount = (uint32_t)std::strtoul(arg.c_str() + 7, NULL, 10);
+		else if (arg.compare(0, 13, "--doc-length=") == 0)
+			options.corpus.averageDocumentLength = std::max(2ul, std::strtoul(arg.c_str() + 13, NULL, 10));
+		else if (arg.compare(0, 13, "--vocabulary=") == 0)
+			options.corpus.vocabularySize = std::max(5001ul, std::strtoul(arg.c_str() + 13, NULL, 10));
+		else if (arg.compare(0, 7, "--zipf=") == 0)
+			options.corpus.zipfExponent = std::strtod(arg.c_str() + 7, NULL);
+		else if (arg.compare(0, 7, "--seed=") == 0)
+			options.corpus.seed = std::strtoull(arg.c_str() + 7, NULL, 10);
+		else if (arg.compare(0, 10, "--queries=") == 0)
+			options.queriesPerSet = std::max(1ul, std::strtoul(arg.c_str() + 10, NULL, 10));
+		else if (arg.compare(0, 6, "--dir=") == 0)
+			options.workDirectory = arg.substr(6);
+		else if (arg.compare(0, 9, "--output=") == 0)
+			options.outputFileName = arg.substr(9);
+		else if (arg == "--keep")
+			options.keepFiles = true;
+		else if (arg.compare(0, 11, "--generate=") == 0)
+			generateFileName = arg.substr(11);
+		else {
+			std::cout << "Usage: ./benchmark [--docs=50000] [--doc-length=250] [--vocabulary=100000] [--zipf=1.0] [--seed=42]" << std::endl;
+			std::cout << "                   [--queries=200] [--dir=benchmark_data] [--output=results.json] [--keep]" << std::endl;
+			std::cout << "       ./benchmark --generate=corpus.xml [corpus options]: only write the corpus" << std::endl;
+			return 0;
+		}
+	}
+
+	if (generateFileName.length() > 0) {
+		CorpusGenerator generator(options.corpus);
+		std::ofstream file(generateFileName.c_str(), std::ofstream::binary);
+		uint64_t bytes = generator.writeCorpus(file);
+		std::cerr << options.corpus.documentCount << " documents, " << bytes << " bytes written to " << generateFileName << std::endl;
+		return 0;
+	}
+
+	// ./indexer and ./searchEngine are next to ./benchmark, and are run in the work directory
+	char binaryPath[PATH_MAX];
+	if (realpath(argv[0], binaryPath) != NULL) {
+		options.binaryDirectory = binaryPath;
+		options.binaryDirectory.erase(options.binaryDirectory.rfind('/'));
+	}
+
+	Benchmark benchmark(options);
+	return benchmark.run() ? 0 : 1;
+}
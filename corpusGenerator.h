@@ -0,0 +1,197 @@
+#ifndef CORPUS_GENERATOR_H
+#define CORPUS_GENERATOR_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+// Synthetic TREC-style corpus for benchmarks, the same for the same options on any machine:
+// <DOC>
+// <DOCNO> SYN870101-0001 </DOCNO>
+// <HL> Some headline words </HL>
+// <TEXT>
+// Sentences of words. Drawn from a Zipfian distribution.
+// </TEXT>
+// </DOC>
+//
+// Word ranks follow Zipf's law: the word of rank r (from 1) is drawn with probability proportional to 1 / r^zipfExponent,
+// like natural language, so a few words are in almost every document and most words are rare.
+// Frequent words are shorter, also like natural language. Uses its own random number generator (xorshift64*)
+// instead of <random>, whose distributions can differ between standard libraries.
+
+struct CorpusOptions {
+	uint32_t documentCount;
+	uint32_t averageDocumentLength; // Words per document, lengths are uniform in [average / 2, average * 3 / 2]
+	uint32_t vocabularySize;
+	double zipfExponent;
+	uint64_t seed;
+
+	CorpusOptions() {
+		this->documentCount = 50000;
+		this->averageDocumentLength = 250;
+		this->vocabularySize = 100000;
+		this->zipfExponent = 1.0;
+		this->seed = 42;
+	}
+};
+
+// xorshift64* (Vigna), small and fully specified
+class CorpusRandom {
+
+private:
+	uint64_t state;
+
+public:
+	CorpusRandom(uint64_t seed) {
+		this->state = seed * 0x9E3779B97F4A7C15ull + 1; // Never 0
+	}
+
+	uint64_t next() {
+		this->state ^= this->state >> 12;
+		this->state ^= this->state << 25;
+		this->state ^= this->state >> 27;
+		return this->state * 0x2545F4914F6CDD1Dull;
+	}
+
+	// Uniform in [0, 1)
+	double nextDouble() {
+		return (this->next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// Uniform in [0, bound)
+	uint32_t nextBelow(uint32_t bound) {
+		return (uint32_t)(this->nextDouble() * bound);
+	}
+};
+
+class CorpusGenerator {
+
+private:
+	CorpusOptions options;
+	std::vector<std::string> words; // rank - 1 -> word
+	std::vector<double> cumulative; // rank - 1 -> probability of a rank <= rank
+
+	// A distinct word for every rank, 2 letters for the most frequent ones up to about 12 for the rarest
+	void generateVocabulary() {
+		CorpusRandom random(this->options.seed ^ 0x564F434142ull);
+		std::unordered_set<std::string> seen;
+		this->words.reserve(this->options.vocabularySize);
+		for (uint32_t rank = 1; rank <= this->options.vocabularySize; ++rank) {
+			uint32_t length = 2 + (uint32_t)(std::log2((double)rank) / 2) + random.nextBelow(3);
+			std::string word;
+			do {
+				word.clear();
+				for (uint32_t i = 0; i < length; ++i)
+					word += (char)('a' + random.nextBelow(26));
+				++length; // Longer if it's taken, there are few short words
+			} while (!seen.insert(word).second);
+			this->words.push_back(word);
+		}
+	}
+
+	void computeDistribution() {
+		this->cumulative.resize(this->options.vocabularySize);
+		double sum = 0;
+		for (uint32_t rank = 1; rank <= this->options.vocabularySize; ++rank) {
+			sum += 1.0 / std::pow((double)rank, this->options.zipfExponent);
+			this->cumulative[rank - 1] = sum;
+		}
+		for (size_t i = 0; i < this->cumulative.size(); ++i)
+			this->cumulative[i] /= sum;
+	}
+
+public:
+	CorpusGenerator(const CorpusOptions& options) {
+		this->options = options;
+		this->generateVocabulary();
+		this->computeDistribution();
+	}
+
+	const CorpusOptions& getOptions() const {
+		return this->options;
+	}
+
+	// Word of a rank, from 1
+	const std::string& getWord(uint32_t rank) const {
+		return this->words[rank - 1];
+	}
+
+	// A rank drawn from the Zipfian distribution
+	uint32_t drawRank(CorpusRandom& random) const {
+		double value = random.nextDouble();
+		return (uint32_t)(std::upper_bound(this->cumulative.begin(), this->cumulative.end(), value) - this->cumulative.begin()) + 1;
+	}
+
+	// Write the whole corpus, return the number of bytes written
+	uint64_t writeCorpus(std::ostream& out) const {
+		CorpusRandom random(this->options.seed);
+		uint64_t bytes = 0;
+		std::string document;
+		char docNo[64];
+		for (uint32_t i = 0; i < this->options.documentCount; ++i) {
+			// 100 documents a day, like a news feed
+			snprintf(docNo, sizeof(docNo), "SYN%06u-%04u", 870101 + i / 100, i % 100);
+			document = "<DOC>\n<DOCNO> ";
+			document += docNo;
+			document += " </DOCNO>\n<HL> ";
+			this->appendSentence(random, 4 + random.nextBelow(6), document);
+			document += " </HL>\n<TEXT>\n";
+
+			uint32_t length = this->options.averageDocumentLength / 2 + random.nextBelow(this->options.averageDocumentLength + 1);
+			while (length > 0) {
+				uint32_t sentenceLength = std::min(length, 5 + random.nextBelow(20));
+				this->appendSentence(random, sentenceLength, document);
+				document += '\n';
+				length -= sentenceLength;
+			}
+			document += "</TEXT>\n</DOC>\n";
+
+			out.write(document.data(), document.size());
+			bytes += document.size();
+		}
+		return bytes;
+	}
+
+	// Words separated by spaces, the first one capitalized, ending with a period
+	void appendSentence(CorpusRandom& random, uint32_t length, std::string& out) const {
+		for (uint32_t i = 0; i < length; ++i) {
+			if (i > 0)
+				out += ' ';
+			size_t start = out.length();
+			out += this->getWord(this->drawRank(random));
+			if (i == 0)
+				out[start] = out[start] - 'a' + 'A';
+		}
+		out += '.';
+	}
+
+	// Queries of wordCount distinct words with ranks in [minRank, maxRank] (uniformly, so each band is evenly covered)
+	std::vector<std::string> generateQueries(uint32_t queryCount, uint32_t wordCount, uint32_t minRank, uint32_t maxRank, uint64_t seed) const {
+		CorpusRandom random(seed);
+		maxRank = std::min(maxRank, this->options.vocabularySize);
+		std::vector<std::string> queries;
+		for (uint32_t i = 0; i < queryCount; ++i) {
+			std::vector<uint32_t> ranks;
+			while (ranks.size() < wordCount && ranks.size() < maxRank - minRank + 1) {
+				uint32_t rank = minRank + random.nextBelow(maxRank - minRank + 1);
+				if (std::find(ranks.begin(), ranks.end(), rank) == ranks.end())
+					ranks.push_back(rank);
+			}
+			std::string query;
+			for (size_t j = 0; j < ranks.size(); ++j) {
+				if (j > 0)
+					query += ' ';
+				query += this->getWord(ranks[j]);
+			}
+			queries.push_back(query);
+		}
+		return queries;
+	}
+};
+
+#endif
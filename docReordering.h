@@ -0,0 +1,187 @@
+#ifndef DOC_REORDERING_H
+#define DOC_REORDERING_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// Document reordering: the indexer can give the documents new docIds before saving the postings, so that documents sharing
+// words get close docIds. The docId gaps in the postings are then smaller, so they compress better, and the maximum scores
+// of the blocks of 128 postings are tighter, so Block-Max WAND skips more blocks.
+//
+// -- DOC_ORDER_FILE: the order of the documents in the file (default)
+// -- DOC_ORDER_DOCNO: sorted by DOCNO, which starts with the date for WSJ (e.g. wsj870324), a cheap approximation
+// -- DOC_ORDER_BISECTION: recursive graph bisection (Dhulipala et al., "Compressing Graphs and Indexes with Recursive
+//    Graph Bisection", KDD 2016). The documents are split in two halves, and documents are swapped between the halves to
+//    lower the estimated cost of the docId gaps, for a few iterations; then each half is split again, down to small parts.
+
+enum DocumentOrder {
+	DOC_ORDER_FILE = 0,
+	DOC_ORDER_DOCNO = 1,
+	DOC_ORDER_BISECTION = 2
+};
+
+const uint32_t BISECTION_ITERATIONS = 20; // Swap rounds for every split, fewer if no document moves
+const uint32_t BISECTION_MIN_PART_SIZE = 16; // Parts smaller than 2 * this are not split
+
+// Forward index for the bisection: the termIds of document d (0, 1, 2, ...) are terms[offsets[d] ... offsets[d + 1]),
+// each once. Only words in 2 documents or more matter, so the others can be left out.
+struct ForwardIndex {
+	std::vector<uint64_t> offsets;
+	std::vector<uint32_t> terms;
+	uint32_t termCount;
+};
+
+class GraphBisection {
+
+private:
+	const ForwardIndex& index;
+	uint32_t threadCount;
+
+	// Scratch state of one thread, indexed by termId. Only the words of the current part are reset.
+	struct Scratch {
+		std::vector<uint32_t> leftDegrees; // Documents of the left half containing the word
+		std::vector<uint32_t> rightDegrees;
+		std::vector<float> leftGains; // Lower cost if a left document containing the word moves to the right
+		std::vector<float> rightGains;
+		std::vector<uint8_t> seen;
+		std::vector<uint32_t> partTerms; // Words of the current part
+		std::vector<std::pair<float, uint32_t> > leftMoves; // (gain, document) of the left half
+		std::vector<std::pair<float, uint32_t> > rightMoves;
+
+		Scratch(uint32_t termCount) : leftDegrees(termCount, 0), rightDegrees(termCount, 0), leftGains(termCount, 0),
+			rightGains(termCount, 0), seen(termCount, 0) {}
+	};
+
+	// Estimated bits of the gaps of a word in a part of n documents, degree of them containing it: degree * log2(n / (degree + 1))
+	static float getCost(uint32_t degree, uint32_t n) {
+		return degree * std::log2((float)n / (degree + 1));
+	}
+
+	// Lower cost when a document containing the word moves from the part with fromDegree of fromSize documents to the other
+	static float getMoveGain(uint32_t fromDegree, uint32_t toDegree, uint32_t fromSize, uint32_t toSize) {
+		float before = getCost(fromDegree, fromSize) + getCost(toDegree, toSize);
+		float after = getCost(fromDegree - 1, fromSize) + getCost(toDegree + 1, toSize);
+		return before - after;
+	}
+
+	void addDegrees(uint32_t document, std::vector<uint32_t>& degrees, int32_t delta) const {
+		for (uint64_t i = this->index.offsets[document]; i < this->index.offsets[document + 1]; ++i)
+			degrees[this->index.terms[i]] += delta;
+	}
+
+	float getDocumentGain(uint32_t document, const std::vector<float>& gains) const {
+		float gain = 0;
+		for (uint64_t i = this->index.offsets[document]; i < this->index.offsets[document + 1]; ++i)
+			gain += gains[this->index.terms[i]];
+		return gain;
+	}
+
+	// Split documents[0 ... count) into two halves with fewer words in common, swapping documents between them
+	void bisect(uint32_t* documents, size_t count, Scratch& scratch) const {
+		size_t leftCount = count / 2;
+		uint32_t* right = documents + leftCount;
+		size_t rightCount = count - leftCount;
+
+		scratch.partTerms.clear();
+		for (size_t d = 0; d < count; ++d) {
+			for (uint64_t i = this->index.offsets[documents[d]]; i < this->index.offsets[documents[d] + 1]; ++i) {
+				uint32_t term = this->index.terms[i];
+				if (!scratch.seen[term]) {
+					scratch.seen[term] = 1;
+					scratch.partTerms.push_back(term);
+				}
+			}
+		}
+		for (size_t d = 0; d < leftCount; ++d)
+			this->addDegrees(documents[d], scratch.leftDegrees, 1);
+		for (size_t d = 0; d < rightCount; ++d)
+			this->addDegrees(right[d], scratch.rightDegrees, 1);
+
+		for (uint32_t iteration = 0; iteration < BISECTION_ITERATIONS; ++iteration) {
+			for (size_t i = 0; i < scratch.partTerms.size(); ++i) {
+				uint32_t term = scratch.partTerms[i];
+				uint32_t leftDegree = scratch.leftDegrees[term];
+				uint32_t rightDegree = scratch.rightDegrees[term];
+				scratch.leftGains[term] = leftDegree > 0 ? getMoveGain(leftDegree, rightDegree, (uint32_t)leftCount, (uint32_t)rightCount) : 0;
+				scratch.rightGains[term] = rightDegree > 0 ? getMoveGain(rightDegree, leftDegree, (uint32_t)rightCount, (uint32_t)leftCount) : 0;
+			}
+
+			scratch.leftMoves.resize(leftCount);
+			for (size_t d = 0; d < leftCount; ++d)
+				scratch.leftMoves[d] = std::pair<float, uint32_t>(this->getDocumentGain(documents[d], scratch.leftGains), (uint32_t)d);
+			scratch.rightMoves.resize(rightCount);
+			for (size_t d = 0; d < rightCount; ++d)
+				scratch.rightMoves[d] = std::pair<float, uint32_t>(this->getDocumentGain(right[d], scratch.rightGains), (uint32_t)d);
+			std::sort(scratch.leftMoves.begin(), scratch.leftMoves.end(), std::greater<std::pair<float, uint32_t> >());
+			std::sort(scratch.rightMoves.begin(), scratch.rightMoves.end(), std::greater<std::pair<float, uint32_t> >());
+
+			// Swap the documents with the largest gains in pairs, while a swap still lowers the cost
+			size_t swapCount = 0;
+			for (size_t i = 0; i < std::min(leftCount, rightCount); ++i) {
+				if (scratch.leftMoves[i].first + scratch.rightMoves[i].first <= 0)
+					break;
+				uint32_t& leftDocument = documents[scratch.leftMoves[i].second];
+				uint32_t& rightDocument = right[scratch.rightMoves[i].second];
+				this->addDegrees(leftDocument, scratch.leftDegrees, -1);
+				this->addDegrees(leftDocument, scratch.rightDegrees, 1);
+				this->addDegrees(rightDocument, scratch.rightDegrees, -1);
+				this->addDegrees(rightDocument, scratch.leftDegrees, 1);
+				std::swap(leftDocument, rightDocument);
+				++swapCount;
+			}
+			if (swapCount == 0)
+				break;
+		}
+
+		for (size_t i = 0; i < scratch.partTerms.size(); ++i) {
+			uint32_t term = scratch.partTerms[i];
+			scratch.leftDegrees[term] = 0;
+			scratch.rightDegrees[term] = 0;
+			scratch.seen[term] = 0;
+		}
+	}
+
+	// Bisect the part, then each half, on parallelism threads (the left half on a new thread while there's more than one)
+	void reorder(uint32_t* documents, size_t count, uint32_t parallelism, Scratch& scratch) const {
+		if (count < 2 * BISECTION_MIN_PART_SIZE) {
+			std::sort(documents, documents + count); // Keep the order of the file within small parts
+			return;
+		}
+		this->bisect(documents, count, scratch);
+
+		size_t leftCount = count / 2;
+		if (parallelism > 1) {
+			std::thread leftThread([this, documents, leftCount, parallelism]() {
+				Scratch leftScratch(this->index.termCount);
+				this->reorder(documents, leftCount, parallelism / 2, leftScratch);
+			});
+			this->reorder(documents + leftCount, count - leftCount, parallelism - parallelism / 2, scratch);
+			leftThread.join();
+		}
+		else {
+			this->reorder(documents, leftCount, 1, scratch);
+			this->reorder(documents + leftCount, count - leftCount, 1, scratch);
+		}
+	}
+
+public:
+	GraphBisection(const ForwardIndex& index, uint32_t threadCount) : index(index) {
+		this->threadCount = std::max(1u, threadCount);
+	}
+
+	// return: the documents (0, 1, 2, ...) in their new order
+	std::vector<uint32_t> computeOrder() const {
+		std::vector<uint32_t> documents(this->index.offsets.size() - 1);
+		for (uint32_t d = 0; d < documents.size(); ++d)
+			documents[d] = d;
+		Scratch scratch(this->index.termCount);
+		this->reorder(documents.data(), documents.size(), this->threadCount, scratch);
+		return documents;
+	}
+};
+
+#endif
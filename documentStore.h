@@ -0,0 +1,240 @@
+#ifndef DOCUMENT_STORE_H
+#define DOCUMENT_STORE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "termDictionary.h"
+#include "textCompressor.h"
+
+// Document store (index_store.bin, ./indexer --store): the text of every document, so the search engine can show
+// snippets of its results without reading the XML again.
+//
+// The texts are concatenated in file order and cut into blocks of at least DOCUMENT_STORE_BLOCK_SIZE bytes (a document
+// is never split), and every block is compressed on its own (see textCompressor.h). A document is found with its
+// entry in the document table: its block, and its offset and length in the decompressed block. So showing a document
+// decompresses one block, which the search engine caches.
+//
+// Format: magic "SEDS", version, document count (4 bytes), block count (4 bytes),
+//   block offsets (8 bytes each, block count + 1, from the start of the blocks),
+//   document table (block, offset, length, 4 bytes each, by docId), then the blocks:
+//   decompressed size (4 bytes) + compressed bytes
+
+const char* const STORE_FILE_NAME = "index_store.bin";
+const char DOCUMENT_STORE_MAGIC[4] = {'S', 'E', 'D', 'S'};
+const uint32_t DOCUMENT_STORE_VERSION = 1;
+const size_t DOCUMENT_STORE_BLOCK_SIZE = 64 << 10;
+
+struct StoredDocument {
+	uint32_t block;
+	uint32_t offset; // In the decompressed block
+	uint32_t length;
+};
+
+// Compresses the documents as they are added, so only the compressed text is kept in memory
+class DocumentStoreWriter {
+
+private:
+	std::vector<uint8_t> blocks; // Compressed blocks
+	std::vector<uint64_t> blockOffsets;
+	std::vector<StoredDocument> documents; // docId - 1 -> where the document is
+	std::string currentBlock; // Texts of the block being filled
+	uint64_t textBytes;
+
+	void compressBlock() {
+		if (this->currentBlock.empty())
+			return;
+		this->blockOffsets.push_back(this->blocks.size());
+		uint32_t size = (uint32_t)this->currentBlock.size();
+		this->blocks.insert(this->blocks.end(), (const uint8_t*)&size, (const uint8_t*)&size + 4);
+		compressText((const uint8_t*)this->currentBlock.data(), this->currentBlock.size(), this->blocks);
+		this->currentBlock.clear();
+	}
+
+public:
+	DocumentStoreWriter() {
+		this->textBytes = 0;
+	}
+
+	// Add the text of the next document
+	void add(std::string_view text) {
+		StoredDocument document;
+		document.block = (uint32_t)this->blockOffsets.size();
+		document.offset = (uint32_t)this->currentBlock.size();
+		document.length = (uint32_t)text.length();
+		this->documents.push_back(document);
+		this->currentBlock.append(text.data(), text.length());
+		this->textBytes += text.length();
+		if (this->currentBlock.size() >= DOCUMENT_STORE_BLOCK_SIZE)
+			this->compressBlock();
+	}
+
+	// Add the documents of another store after these ones (a later part of the file), and empty it
+	void append(DocumentStoreWriter& part) {
+		this->compressBlock();
+		part.compressBlock();
+		uint32_t blockBase = (uint32_t)this->blockOffsets.size();
+		uint64_t byteBase = this->blocks.size();
+		for (size_t i = 0; i < part.blockOffsets.size(); ++i)
+			this->blockOffsets.push_back(byteBase + part.blockOffsets[i]);
+		this->blocks.insert(this->blocks.end(), part.blocks.begin(), part.blocks.end());
+		for (size_t i = 0; i < part.documents.size(); ++i) {
+			StoredDocument document = part.documents[i];
+			document.block += blockBase;
+			this->documents.push_back(document);
+		}
+		this->textBytes += part.textBytes;
+		part = DocumentStoreWriter();
+	}
+
+	// Give the documents new docIds: order is the docId - 1 of the documents in their new order (see docReordering.h).
+	// The blocks stay in file order, only the document table is reordered.
+	void reorder(const std::vector<uint32_t>& order) {
+		std::vector<StoredDocument> documents(order.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			documents[i] = this->documents[order[i]];
+		this->documents.swap(documents);
+	}
+
+	uint32_t getDocumentCount() const {
+		return (uint32_t)this->documents.size();
+	}
+
+	uint64_t getTextBytes() const {
+		return this->textBytes;
+	}
+
+	// Compressed bytes so far, without the document being filled
+	uint64_t getCompressedBytes() const {
+		return this->blocks.size();
+	}
+
+	// Return false if the file couldn't be written
+	bool save(const std::string& fileName) {
+		this->compressBlock();
+		uint32_t documentCount = (uint32_t)this->documents.size();
+		uint32_t blockCount = (uint32_t)this->blockOffsets.size();
+		this->blockOffsets.push_back(this->blocks.size());
+
+		BulkWriter file(fileName);
+		file.write(DOCUMENT_STORE_MAGIC, 4);
+		file.write(&DOCUMENT_STORE_VERSION, 4);
+		file.write(&documentCount, 4);
+		file.write(&blockCount, 4);
+		file.write(this->blockOffsets.data(), this->blockOffsets.size() * 8);
+		file.write(this->documents.data(), this->documents.size() * sizeof(StoredDocument));
+		file.write(this->blocks.data(), this->blocks.size());
+		this->blockOffsets.pop_back();
+		return file.close();
+	}
+};
+
+// Memory-mapped document store, read-only and safe to use from many threads
+class DocumentStore {
+
+private:
+	const uint8_t* data;
+	size_t size;
+	uint32_t documentCount;
+	uint32_t blockCount;
+	const uint64_t* blockOffsets;
+	const StoredDocument* documents;
+	const uint8_t* blocks;
+
+public:
+	DocumentStore() {
+		this->data = NULL;
+		this->size = 0;
+		this->documentCount = 0;
+		this->blockCount = 0;
+		this->blockOffsets = NULL;
+		this->documents = NULL;
+		this->blocks = NULL;
+	}
+
+	~DocumentStore() {
+		if (this->data != NULL)
+			munmap((void*)this->data, this->size);
+	}
+
+	DocumentStore(const DocumentStore&) = delete;
+	DocumentStore& operator=(const DocumentStore&) = delete;
+
+	// Memory-map the store and check its header
+	// return false if there's no valid store
+	bool open(const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		struct stat fileStat;
+		if (fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size < 16) {
+			if (fd >= 0)
+				::close(fd);
+			return false;
+		}
+		void* mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapping == MAP_FAILED)
+			return false;
+		this->data = (const uint8_t*)mapping;
+		this->size = fileStat.st_size;
+		madvise(mapping, this->size, MADV_RANDOM); // Only the blocks of the results are read
+
+		uint32_t header[4];
+		memcpy(header, this->data, 16);
+		uint64_t blocksStart = 16 + ((uint64_t)header[3] + 1) * 8 + (uint64_t)header[2] * sizeof(StoredDocument);
+		if (memcmp(this->data, DOCUMENT_STORE_MAGIC, 4) != 0 || header[1] != DOCUMENT_STORE_VERSION || blocksStart > this->size
+			|| ((const uint64_t*)(this->data + 16))[header[3]] > this->size - blocksStart)
+		{
+			munmap(mapping, this->size);
+			this->data = NULL;
+			return false;
+		}
+		this->documentCount = header[2];
+		this->blockCount = header[3];
+		this->blockOffsets = (const uint64_t*)(this->data + 16);
+		this->documents = (const StoredDocument*)(this->data + 16 + ((uint64_t)this->blockCount + 1) * 8);
+		this->blocks = this->data + blocksStart;
+		return true;
+	}
+
+	bool isOpen() const {
+		return this->data != NULL;
+	}
+
+	uint32_t getDocumentCount() const {
+		return this->documentCount;
+	}
+
+	// Where the document is (docId from 1)
+	// return false if there's no such document
+	bool getDocument(uint32_t docId, StoredDocument& document) const {
+		if (docId == 0 || docId > this->documentCount)
+			return false;
+		document = this->documents[docId - 1];
+		return document.block < this->blockCount;
+	}
+
+	// Decompress a block
+	// return false if it isn't valid
+	bool readBlock(uint32_t block, std::string& text) const {
+		if (block >= this->blockCount)
+			return false;
+		const uint8_t* start = this->blocks + this->blockOffsets[block];
+		const uint8_t* end = this->blocks + this->blockOffsets[block + 1];
+		if (end - start < 4)
+			return false;
+		uint32_t textSize = 0;
+		memcpy(&textSize, start, 4);
+		text.resize(textSize);
+		return decompressText(start + 4, end - start - 4, (uint8_t*)&text[0], textSize);
+	}
+};
+
+#endif
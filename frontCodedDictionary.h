@@ -0,0 +1,263 @@
+#ifndef FRONT_CODED_DICTIONARY_H
+#define FRONT_CODED_DICTIONARY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "postingsCodec.h"
+#include "termDictionary.h"
+
+// Sorted, front-coded dictionary of the four-file index (index_dictionary.bin), next to index_words.bin.
+// It's memory-mapped and searched in place, so the search engine doesn't build a hash map of every word at load time,
+// and the words with a prefix are next to each other, so a wildcard like rosenf* is a range scan.
+//
+// The words are sorted and grouped in blocks of DICTIONARY_BLOCK_SIZE. The first word of a block (its head) is stored whole,
+// the others as the length of the prefix they share with the previous word and the rest of the word. A lookup binary
+// searches the block heads, then decodes one block.
+// e.g. rosenberg, rosenfeld, rosenfield -> 9 "rosenberg", 5 4 "feld", 8 2 "ield"
+//
+// Format: magic "SEFC", version, word count (4 bytes), block count (4 bytes),
+//   block offsets (8 bytes each, block count + 1, from the start of the blocks), then the blocks:
+//   head: length (1 byte) + word; other words: shared prefix length (1 byte), suffix length (1 byte), suffix
+//   every word followed by its pos and docCount (vbyte), the same as in index_words.bin
+
+const char* const DICTIONARY_FILE_NAME = "index_dictionary.bin";
+const char DICTIONARY_MAGIC[4] = {'S', 'E', 'F', 'C'};
+const uint32_t DICTIONARY_VERSION = 1;
+const uint32_t DICTIONARY_BLOCK_SIZE = 16;
+
+// Collects the words in sorted order, then saves the dictionary
+class FrontCodedDictionaryWriter {
+
+private:
+	std::vector<uint8_t> blocks;
+	std::vector<uint64_t> blockOffsets;
+	std::string previousWord;
+	uint32_t wordCount;
+
+public:
+	FrontCodedDictionaryWriter() {
+		this->wordCount = 0;
+	}
+
+	// Words must be added in sorted order
+	void add(std::string_view word, uint32_t pos, uint32_t docCount) {
+		if (this->wordCount % DICTIONARY_BLOCK_SIZE == 0) {
+			this->blockOffsets.push_back(this->blocks.size());
+			this->blocks.push_back((uint8_t)word.length());
+			this->blocks.insert(this->blocks.end(), word.begin(), word.end());
+		}
+		else {
+			size_t shared = 0;
+			while (shared < word.length() && shared < this->previousWord.length() && word[shared] == this->previousWord[shared])
+				++shared;
+			this->blocks.push_back((uint8_t)shared);
+			this->blocks.push_back((uint8_t)(word.length() - shared));
+			this->blocks.insert(this->blocks.end(), word.begin() + shared, word.end());
+		}
+		writeVByte(pos, this->blocks);
+		writeVByte(docCount, this->blocks);
+		this->previousWord.assign(word.data(), word.length());
+		++this->wordCount;
+	}
+
+	// Return false if the file couldn't be written
+	bool save(const std::string& fileName) {
+		uint32_t blockCount = (uint32_t)this->blockOffsets.size();
+		this->blockOffsets.push_back(this->blocks.size());
+
+		BulkWriter file(fileName);
+		file.write(DICTIONARY_MAGIC, 4);
+		file.write(&DICTIONARY_VERSION, 4);
+		file.write(&this->wordCount, 4);
+		file.write(&blockCount, 4);
+		file.write(this->blockOffsets.data(), this->blockOffsets.size() * 8);
+		file.write(this->blocks.data(), this->blocks.size());
+		return file.close();
+	}
+};
+
+// Memory-mapped dictionary, read-only and safe to search from many threads
+class FrontCodedDictionary {
+
+private:
+	const uint8_t* data;
+	size_t size;
+	uint32_t wordCount;
+	uint32_t blockCount;
+	const uint64_t* blockOffsets;
+	const uint8_t* blocks;
+
+	std::string_view getBlockHead(uint32_t blockIndex) const {
+		const uint8_t* head = this->blocks + this->blockOffsets[blockIndex];
+		return std::string_view((const char*)head + 1, *head);
+	}
+
+	// The last block whose head is < word (or <= word with orEqual), 0 if there's none
+	uint32_t findBlock(std::string_view word, bool orEqual) const {
+		uint32_t low = 0;
+		uint32_t high = this->blockCount;
+		while (low + 1 < high) {
+			uint32_t middle = low + (high - low) / 2;
+			int compare = this->getBlockHead(middle).compare(word);
+			if (compare < 0 || (orEqual && compare == 0))
+				low = middle;
+			else
+				high = middle;
+		}
+		return low;
+	}
+
+	// Decode the words of the blocks from blockIndex on, calling function(wordIndex, word, pos, docCount) for each
+	// until it returns false
+	template <typename Function>
+	void scan(uint32_t blockIndex, Function function) const {
+		char word[256];
+		size_t wordLength = 0;
+		const uint8_t* pointer = NULL;
+		for (uint32_t wordIndex = blockIndex * DICTIONARY_BLOCK_SIZE; wordIndex < this->wordCount; ++wordIndex) {
+			if (wordIndex % DICTIONARY_BLOCK_SIZE == 0) {
+				pointer = this->blocks + this->blockOffsets[wordIndex / DICTIONARY_BLOCK_SIZE];
+				wordLength = *pointer++;
+				memcpy(word, pointer, wordLength);
+				pointer += wordLength;
+			}
+			else {
+				size_t shared = *pointer++;
+				size_t suffixLength = *pointer++;
+				memcpy(word + shared, pointer, suffixLength);
+				pointer += suffixLength;
+				wordLength = shared + suffixLength;
+			}
+			uint32_t pos = 0;
+			uint32_t docCount = 0;
+			pointer = readVByte(pointer, pos);
+			pointer = readVByte(pointer, docCount);
+			if (!function(wordIndex, std::string_view(word, wordLength), pos, docCount))
+				return;
+		}
+	}
+
+public:
+	FrontCodedDictionary() {
+		this->data = NULL;
+		this->size = 0;
+		this->wordCount = 0;
+		this->blockCount = 0;
+		this->blockOffsets = NULL;
+		this->blocks = NULL;
+	}
+
+	~FrontCodedDictionary() {
+		if (this->data != NULL)
+			munmap((void*)this->data, this->size);
+	}
+
+	FrontCodedDictionary(const FrontCodedDictionary&) = delete;
+	FrontCodedDictionary& operator=(const FrontCodedDictionary&) = delete;
+
+	// Memory-map the dictionary and check its header
+	// return false if there's no valid dictionary
+	bool open(const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		struct stat fileStat;
+		if (fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size < 16) {
+			if (fd >= 0)
+				::close(fd);
+			return false;
+		}
+		void* mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapping == MAP_FAILED)
+			return false;
+		this->data = (const uint8_t*)mapping;
+		this->size = fileStat.st_size;
+
+		uint32_t header[4];
+		memcpy(header, this->data, 16);
+		uint64_t blocksStart = 16 + ((uint64_t)header[3] + 1) * 8;
+		if (memcmp(this->data, DICTIONARY_MAGIC, 4) != 0 || header[1] != DICTIONARY_VERSION || blocksStart > this->size
+			|| header[3] != (header[2] + DICTIONARY_BLOCK_SIZE - 1) / DICTIONARY_BLOCK_SIZE)
+		{
+			munmap(mapping, this->size);
+			this->data = NULL;
+			return false;
+		}
+		this->wordCount = header[2];
+		this->blockCount = header[3];
+		this->blockOffsets = (const uint64_t*)(this->data + 16);
+		this->blocks = this->data + blocksStart;
+		if (this->blockOffsets[this->blockCount] > this->size - blocksStart) {
+			munmap(mapping, this->size);
+			this->data = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	bool isOpen() const {
+		return this->data != NULL;
+	}
+
+	uint32_t getWordCount() const {
+		return this->wordCount;
+	}
+
+	// Find a word
+	// wordIndex: its index in sorted order
+	// return false if the word doesn't exist
+	bool find(std::string_view word, uint32_t& wordIndex, uint32_t& pos, uint32_t& docCount) const {
+		if (this->wordCount == 0)
+			return false;
+		bool found = false;
+		uint32_t blockIndex = this->findBlock(word, true);
+		this->scan(blockIndex, [&](uint32_t index, std::string_view current, uint32_t currentPos, uint32_t currentDocCount) {
+			int compare = current.compare(word);
+			if (compare == 0) {
+				wordIndex = index;
+				pos = currentPos;
+				docCount = currentDocCount;
+				found = true;
+			}
+			return compare < 0 && (index + 1) % DICTIONARY_BLOCK_SIZE != 0; // Only the block can have the word
+		});
+		return found;
+	}
+
+	// pos of the word at wordIndex in sorted order
+	// return false if there's no such word
+	bool getPos(uint32_t wordIndex, uint32_t& pos) const {
+		if (wordIndex >= this->wordCount)
+			return false;
+		this->scan(wordIndex / DICTIONARY_BLOCK_SIZE, [&](uint32_t index, std::string_view, uint32_t currentPos, uint32_t) {
+			pos = currentPos;
+			return index < wordIndex;
+		});
+		return true;
+	}
+
+	// Call function(word, pos, docCount) for every word starting with prefix, in sorted order
+	template <typename Function>
+	void forEachPrefix(std::string_view prefix, Function function) const {
+		if (this->wordCount == 0)
+			return;
+		this->scan(this->findBlock(prefix, false), [&](uint32_t, std::string_view word, uint32_t pos, uint32_t docCount) {
+			if (word.compare(0, prefix.length(), prefix) == 0) {
+				function(word, pos, docCount);
+				return true;
+			}
+			return word < prefix; // Before the range, or after it
+		});
+	}
+};
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Single-file index container (index.bin), memory-mapped by the search engine and used in place.
+//
+// Layout: header + section table + sections (each section starts at an 8 byte aligned offset)
+// -- Header: magic(4 bytes) + version(4 bytes) + sectionCount(4 bytes) + reserved(4 bytes)
+// -- Section table: [(sectionId(4 bytes), reserved(4 bytes), offset(8 bytes), size(8 bytes)), ...]
+// All offsets and sizes are 64-bit, so the index is not limited to 4GB or 2^32 postings.
+
+const uint32_t INDEX_FILE_MAGIC = 0x58494553; // "SEIX" in little-endian
+const uint32_t INDEX_FILE_VERSION = 1;
+const char* const INDEX_FILE_NAME = "index.bin";
+const char* const TIER1_FILE_NAME = "index_tier1.bin"; // Statically pruned first tier of index.bin (./indexer --tier1=N)
+const uint32_t INDEX_FILE_MAX_SECTIONS = 32; // Space reserved for the section table
+
+enum IndexSectionId {
+	SECTION_STATS = 1, // IndexStats
+	SECTION_DOC_LENGTHS = 2, // [docLength1, docLength2, ...] each 4 bytes
+	SECTION_DOCNO_OFFSETS = 3, // [offset of docNo1, offset of docNo2, ..., end] each 8 bytes, into SECTION_DOCNO
+	SECTION_DOCNO = 4, // docNo strings splitted by \0
+	SECTION_POSTINGS = 5, // Raw or compressed postings of all the words, same as index_wordPostings.bin (without the magic)
+	SECTION_TERMS = 6, // [TermEntry, ...] sorted by word, with an extra entry at the end for the end of the word strings
+	SECTION_TERM_STRINGS = 7, // All words concatenated in sorted order (no separator)
+	SECTION_TERM_BLOCK_MAX = 8, // [TermBlockMax, ...] parallel to SECTION_TERMS (without the extra entry)
+	SECTION_BLOCK_MAX = 9, // [BlockMaxEntry, ...] for every block of 128 postings of every word
+	SECTION_IMPACT_STATS = 10, // ImpactStats (only with --impacts)
+	SECTION_IMPACT_TERMS = 11, // [TermImpacts, ...] parallel to SECTION_TERMS (without the extra entry)
+	SECTION_IMPACT_SEGMENTS = 12, // [ImpactSegment, ...] of every word, highest impact first
+	SECTION_IMPACT_POSTINGS = 13, // docIds of every segment, compressed like the postings (see postingsCodec.h) with all tf = 1
+	SECTION_POSITIONS = 14, // Positions of every posting of every word, in postings order (only with --positions). For each posting,
+							// its tf positions (word index in the document, from 0) as variable bytes: the first position, then the gaps
+	SECTION_POSITION_BLOCKS = 15, // [offset, ...] each 8 bytes, parallel to SECTION_BLOCK_MAX: where every block's positions start in SECTION_POSITIONS
+	SECTION_BLOCK_BOUNDS = 16, // [BlockBoundEntry, ...] parallel to SECTION_BLOCK_MAX
+	SECTION_COLLECTION_STATS = 17, // CollectionStats (only in shards, see shards.h, and in a first tier)
+	SECTION_COLLECTION_DOC_COUNTS = 18, // [docCount, ...] each 4 bytes, parallel to SECTION_TERMS (without the extra entry): how many documents
+										// of the whole collection the word appears in (only in shards and in a first tier)
+	SECTION_TIER_BOUNDS = 19, // [score, ...] each a 4 byte float, parallel to SECTION_TERMS (without the extra entry): the largest BM25 score
+							  // of the word's postings that were left out of the first tier, 0 if it has all of them (only in a first tier)
+	SECTION_QUANTIZED_STATS = 20, // QuantizedStats (only with --quantized)
+	SECTION_QUANTIZED_OFFSETS = 21, // [index of the word's first impact, ...] each 8 bytes, parallel to SECTION_TERMS (without the extra entry)
+	SECTION_QUANTIZED_IMPACTS = 22 // Quantized BM25 score of every posting of every word, in postings order, 1 or 2 bytes each (QuantizedStats::bits)
+};
+
+struct IndexStats {
+	uint64_t totalDocuments;
+	uint64_t totalLength; // Sum of all the document lengths
+	uint32_t termCount;
+	uint32_t postingsFormat; // PostingsFormat
+};
+
+// Statistics of the whole collection, for a shard holding a range of its documents. The maximum scores and impacts of a shard
+// are computed with them, and the search engine uses them for the idf and the average document length, so the scores of
+// every shard are the same as the scores of one index of the whole collection.
+struct CollectionStats {
+	uint64_t totalDocuments;
+	uint64_t totalLength;
+	uint32_t docIdOffset; // Documents before the shard: docId d of the shard is docId docIdOffset + d of the collection
+	uint32_t shardCount;
+};
+
+struct TermEntry {
+	uint64_t postingsOffset; // Byte offset of the word's postings in SECTION_POSTINGS
+	uint32_t docCount; // How many documents the word appears in
+	uint32_t termOffset; // Offset of the word in SECTION_TERM_STRINGS. Word length = next entry's termOffset - termOffset
+};
+
+// Maximum BM25 score of a word, for dynamic pruning (Block-Max WAND)
+struct TermBlockMax {
+	uint64_t blockOffset; // Index of the word's first BlockMaxEntry in SECTION_BLOCK_MAX. Block count = ceil(docCount / 128)
+	float maxScore; // Maximum BM25 score of the word in any document
+	uint32_t reserved;
+};
+
+// A block of POSTINGS_BLOCK_SIZE postings (the last block of a word may be smaller)
+struct BlockMaxEntry {
+	uint32_t lastDocId; // The largest docId in the block
+	float maxScore; // Maximum BM25 score in the block
+};
+
+// What the maximum score of a block depends on besides the collection statistics, so that it can be recomputed when
+// the index is a segment searched with the statistics of all the segments (see segments.h).
+// BM25 increases with tf and decreases with the document length, so getBM25Score(maxTf, minDocLength, ...) is an upper bound.
+struct BlockBoundEntry {
+	uint32_t maxTf; // The largest tf in the block
+	uint32_t minDocLength; // The shortest document in the block
+};
+
+// Impact-ordered index, for score-at-a-time queries.
+// Every posting's BM25 score is quantized to an impact (see quantizeScore in ranking.h), and the postings of a word
+// are grouped into segments of the same impact.
+struct ImpactStats {
+	float maxScore; // Largest BM25 score of any posting, maps to the largest impact
+	uint32_t bits; // Impacts are in [1, 2^bits - 1]
+};
+
+struct TermImpacts {
+	uint64_t segmentOffset; // Index of the word's first ImpactSegment
+	uint32_t segmentCount;
+	uint32_t reserved;
+};
+
+struct ImpactSegment {
+	uint32_t impact;
+	uint32_t docCount;
+	uint64_t postingsOffset; // Byte offset of the segment's docIds in SECTION_IMPACT_POSTINGS
+};
+
+// Quantized index, for the quantized query mode: the BM25 score of every posting, computed at index time with BM25_K1 and BM25_B
+// and quantized to 8 or 16 bits (see quantizeScore in ranking.h), in postings order. A query adds integer impacts instead of
+// computing BM25 for every posting.
+struct QuantizedStats {
+	float maxScore; // Largest BM25 score of any posting, maps to the largest impact
+	uint32_t bits; // 8 (uint8_t impacts) or 16 (uint16_t impacts), in [1, 2^bits - 1]
+	float k1; // BM25 parameters the scores were computed with
+	float b;
+	float maxError; // Largest difference between a posting's BM25 score and its dequantized impact
+	uint32_t reserved;
+};
+
+struct SectionEntry {
+	uint32_t sectionId;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+};
+
+// Writes sections one by one, then goes back to fill the section table
+class IndexFileWriter {
+
+private:
+	std::string fileName;
+	std::ofstream file;
+	std::vector<SectionEntry> sections;
+	uint32_t maxSections;
+	uint64_t position;
+
+public:
+	IndexFileWriter(const std::string& fileName, uint32_t maxSections = INDEX_FILE_MAX_SECTIONS) {
+		this->fileName = fileName;
+		this->file.open(fileName.c_str(), std::ofstream::binary);
+		this->maxSections = maxSections;
+
+		// Reserve space for the header and the section table
+		this->position = 16 + (uint64_t)maxSections * sizeof(SectionEntry);
+		std::vector<char> zeros(this->position, 0);
+		this->file.write(zeros.data(), zeros.size());
+	}
+
+	void beginSection(uint32_t sectionId) {
+		// Only maxSections fit in the section table: the file fails, and nothing more is written to it
+		if (this->sections.size() >= this->maxSections) {
+			this->file.setstate(std::ofstream::failbit);
+			return;
+		}
+
+		// Align every section to 8 bytes so that the arrays can be used in place
+		while (this->position % 8 != 0) {
+			this->file.put(0);
+			++this->position;
+		}
+
+		SectionEntry entry;
+		entry.sectionId = sectionId;
+		entry.reserved = 0;
+		entry.offset = this->position;
+		entry.size = 0;
+		this->sections.push_back(entry);
+	}
+
+	void write(const void* data, uint64_t size) {
+		if (!this->file.good())
+			return;
+		this->file.write((const char*)data, size);
+		this->position += size;
+		this->sections.back().size += size;
+	}
+
+	// Size of the current section so far
+	uint64_t sectionSize() {
+		return this->sections.back().size;
+	}
+
+	void writeSection(uint32_t sectionId, const void* data, uint64_t size) {
+		this->beginSection(sectionId);
+		this->write(data, size);
+	}
+
+	// Write the header and the section table
+	// return false if the file couldn't be written (e.g. the disk is full) or had too many sections, and then remove it,
+	// so that a failed save never leaves a file that looks like a valid index
+	bool close() {
+		uint32_t header[4] = {INDEX_FILE_MAGIC, INDEX_FILE_VERSION, (uint32_t)this->sections.size(), 0};
+		this->file.seekp(0, std::ofstream::beg);
+		this->file.write((const char*)header, sizeof(header));
+		this->file.write((const char*)this->sections.data(), this->sections.size() * sizeof(SectionEntry));
+		this->file.close();
+		if (this->file.good())
+			return true;
+		unlink(this->fileName.c_str());
+		return false;
+	}
+};
+
+// Memory-maps index.bin, and gives pointers to the sections
+class IndexFile {
+
+private:
+	const uint8_t* data;
+	uint64_t fileSize;
+	const SectionEntry* sections;
+	uint32_t sectionCount;
+
+public:
+	IndexFile() {
+		this->data = NULL;
+		this->fileSize = 0;
+		this->sections = NULL;
+		this->sectionCount = 0;
+	}
+
+	~IndexFile() {
+		if (this->data != NULL)
+			munmap((void*)this->data, this->fileSize);
+	}
+
+	// Return false if the file doesn't exist or isn't a valid index container
+	bool open(const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size < 16) {
+			::close(fd);
+			return false;
+		}
+
+		void* mapped = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd); // The mapping stays valid after closing the file
+		if (mapped == MAP_FAILED)
+			return false;
+
+		this->data = (const uint8_t*)mapped;
+		this->fileSize = fileStat.st_size;
+
+		const uint32_t* header = (const uint32_t*)this->data;
+		if (header[0] != INDEX_FILE_MAGIC || header[1] != INDEX_FILE_VERSION
+			|| 16 + (uint64_t)header[2] * sizeof(SectionEntry) > this->fileSize) {
+			munmap(mapped, this->fileSize);
+			this->data = NULL;
+			return false;
+		}
+
+		this->sectionCount = header[2];
+		this->sections = (const SectionEntry*)(this->data + 16);
+		return true;
+	}
+
+	// Return the start of a section and set its size, or NULL if the section doesn't exist
+	const uint8_t* getSection(uint32_t sectionId, uint64_t& size) const {
+		for (uint32_t i = 0; i < this->sectionCount; ++i) {
+			if (this->sections[i].sectionId == sectionId && this->sections[i].offset + this->sections[i].size <= this->fileSize) {
+				size = this->sections[i].size;
+				return this->data + this->sections[i].offset;
+			}
+		}
+		size = 0;
+		return NULL;
+	}
+
+	const uint8_t* getSection(uint32_t sectionId) const {
+		uint64_t size = 0;
+		return this->getSection(sectionId, size);
+	}
+};
+
+#endif
@@ -3,38 +3,32 @@
 #include <sstream>
 #include <vector>
 #include <string>
-#include <unordered_map>
-
-// Extract words from a text string
-std::vector<std::string> extractWords(const std::string& text) {
-	std::vector<std::string> words;
-
-	std::string word;
-	for (size_t i = 0; i < text.size(); ++i){
-		if (std::isalpha(text[i]))
-			word += std::tolower(text[i]);
-		else if (std::isdigit(text[i]))
-			word += text[i];
-		// else if (text[i] == '-') { // Some words have '-', such as "well-being"
-		// 	if (i > 0 && std::isalnum(text[i - 1])) { // Ignore words starting with '-'
-		// 		word += text[i];
-		// 	}
-		// }
-		else {
-			if (word.length() > 0) {
-				if (word.length() > 255) { // Length is stored in uint8_t, so truncate the word if its length > 255
-					word = word.substr(0, 255);
-				}
-				words.push_back(word);
-			}
-			word = "";
-		}
-	}
-	if (word.length() > 0)
-		words.push_back(word);
+#include <algorithm>
+#include <thread>
+#include <queue>
+#include <functional>
+#include <cstdio>
+#include <chrono>
+#include <numeric>
 
-	return words;
-}
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "postingsCodec.h"
+#include "indexFile.h"
+#include "ranking.h"
+#include "tokenizer.h"
+#include "termDictionary.h"
+#include "segments.h"
+#include "shards.h"
+#include "tokenStream.h"
+#include "docReordering.h"
+#include "frontCodedDictionary.h"
+#include "documentStore.h"
 
 // Strip the spaces from the beginning and the end of a string
 std::string stripString(const std::string& text) {
@@ -54,15 +48,133 @@ std::string stripString(const std::string& text) {
 	return text.substr(start, end - start + 1);
 }
 
+// Reads a chunk of memory as a stream, without copying it
+class MemoryStreamBuffer : public std::streambuf {
+
+public:
+	MemoryStreamBuffer(const char* begin, const char* end) {
+		this->setg(const_cast<char*>(begin), const_cast<char*>(begin), const_cast<char*>(end));
+	}
+};
+
+// Command line options of the indexer
+struct IndexerOptions {
+	// How index_wordPostings.bin is stored: raw 4 byte (docId, tf) or compressed (see postingsCodec.h)
+	PostingsFormat postingsFormat;
+
+	// Save all the index to a single index.bin container (see indexFile.h) instead of the four index_*.bin files
+	bool useContainer;
+
+	// Also save impact-ordered postings to index.bin, for score-at-a-time queries
+	bool saveImpacts;
+
+	// Also save the BM25 score of every posting to index.bin, quantized to this many bits (8 or 16), for quantized queries. 0 for none
+	uint32_t quantizedBits;
+
+	// Also save the positions of every word in the documents to index.bin, for phrase queries
+	bool savePositions;
+
+	// Parse the file with this many threads, each building a partial index of a chunk of the file
+	uint32_t threadCount;
+
+	// Memory for the postings in bytes (0: no limit). When it's full, the postings are flushed to a sorted run file,
+	// and the run files are merged at the end (single-pass in-memory indexing, SPIMI)
+	uint64_t memoryBudget;
+
+	// Add the documents as a new segment (see segments.h) instead of replacing the index
+	bool useSegment;
+
+	// Save the index as this many document-partitioned shards (see shards.h), 0 for a single index
+	uint32_t shardCount;
+
+	// Also save a first tier (index_tier1.bin) with the this many highest scoring postings of every word, 0 for none
+	uint32_t tierPostings;
+
+	// docIds of the documents: in file order, or reordered before saving to shrink the gaps (see docReordering.h)
+	DocumentOrder documentOrder;
+
+	// Also save the text of the documents to index_store.bin, for result snippets (see documentStore.h)
+	bool saveStore;
+
+	IndexerOptions() {
+		this->postingsFormat = POSTINGS_FORMAT_RAW;
+		this->useContainer = false;
+		this->saveImpacts = false;
+		this->quantizedBits = 0;
+		this->savePositions = false;
+		this->threadCount = 1;
+		this->memoryBudget = 0;
+		this->useSegment = false;
+		this->shardCount = 0;
+		this->tierPostings = 0;
+		this->documentOrder = DOC_ORDER_FILE;
+		this->saveStore = false;
+	}
+};
+
+const uint32_t IMPACT_BITS = 8; // Impacts are quantized to [1, 255]
+
+const size_t RUN_IO_BUFFER_SIZE = 1 << 20; // Stream buffer of every run file while merging
+const size_t MIN_RUN_IO_BUFFER_SIZE = 64 << 10; // With many runs, the buffers share the memory budget, but are at least this large
+
+// Sorted run file, flushed when the postings reach the memory budget
+// Stored as: [(wordLength(1 byte), word, docCount(4 bytes), [(docId, tf), ...] each 4 bytes), ...] sorted by word
+class RunReader {
+
+private:
+	std::ifstream file;
+	std::vector<char> buffer;
+
+public:
+	std::string word; // Current word, empty after the last word
+	uint32_t docCount;
+
+	RunReader(const std::string& fileName, size_t bufferSize) : buffer(bufferSize) {
+		this->file.rdbuf()->pubsetbuf(this->buffer.data(), this->buffer.size());
+		this->file.open(fileName.c_str(), std::ifstream::binary);
+		this->docCount = 0;
+		this->nextWord();
+	}
+
+	// Read the next word and its docCount. Its postings must be read with readPostings() before the next call
+	void nextWord() {
+		uint8_t wordLength = 0;
+		if (!this->file.read((char*)&wordLength, 1)) {
+			this->word.clear();
+			return;
+		}
+		this->word.resize(wordLength);
+		this->file.read(&this->word[0], wordLength);
+		this->file.read((char*)&this->docCount, 4);
+	}
+
+	// Append the postings of the current word
+	void readPostings(std::vector<std::pair<uint32_t, uint32_t> >& postings) {
+		size_t start = postings.size();
+		postings.resize(start + this->docCount);
+		this->file.read((char*)&postings[start], (std::streamsize)this->docCount * 8);
+	}
+};
+
 class Indexer {
 
 private:
 	std::string fileName;
 
-	// word -> [(docid_1, term frequency), (docid_1, term frequency), ...]
+	IndexerOptions options;
+
+	// word -> termId (0, 1, 2, ... in the order words are first seen)
+	// e.g. {"aircraft": 0, "first": 1, ...}
+	TermDictionary terms;
+
+	// termId -> [(docid_1, term frequency), (docid_1, term frequency), ...]
 	// (docid: 1, 2, 3, ...)
-	// e.g. {"aircraft": [(6, 1), ...], "first": [(5, 1), (6, 2), ...], ...}
-	std::unordered_map<std::string, std::vector<std::pair<uint32_t, uint32_t> > > wordToPostings; 
+	// e.g. {0: [(6, 1), ...], 1: [(5, 1), (6, 2), ...], ...}
+	PostingsPool termPostings;
+
+	// termId -> positions of the word in its documents, tf positions for every posting (with options.savePositions)
+	// e.g. {0: [17, ...], 1: [3, 0, 42, ...], ...}
+	PositionsPool termPositions;
 
 	// DOCNO list 
 	// e.g. [WSJ870324-0001, WSJ870323-0181, ...]
@@ -72,87 +184,730 @@ private:
 	// e.g. [159, 64, 48, 30, 106, 129, ...]
 	std::vector<uint32_t> documentLengthList;
 
+	// Sorted run files flushed so far (with memoryBudget)
+	std::vector<std::string> runFileNames;
+
+	// Compressed text of the documents (with options.saveStore)
+	DocumentStoreWriter documentStore;
+
+	// A run file couldn't be written (e.g. the disk is full), so the index can't be saved
+	bool runFailed;
+
 public:
-	Indexer(std::string fileName) {
+	Indexer(std::string fileName, const IndexerOptions& options) {
 		this->fileName = fileName;
+		this->options = options;
+		this->runFailed = false;
 	}
 
-	void saveIndexToFiles() {
-		// Save document length list
-		std::ofstream docLengthsFile("index_docLengths.bin"); // an uint32_t(4 byte) for each document length
-		for (size_t i = 0; i < documentLengthList.size(); ++i) {
-			docLengthsFile.write((const char*)&documentLengthList[i], 4);
+	// Bytes used by the words and the postings, compared with options.memoryBudget
+	uint64_t getPostingsMemory() const {
+		return this->terms.memoryUsage(true) + this->termPostings.memoryUsage(true) + this->termPositions.memoryUsage(true);
+	}
+
+	// Compute the maximum BM25 score of the word and of every block of POSTINGS_BLOCK_SIZE postings,
+	// with the same formula as the search engine, and the largest tf and shortest document of every block
+	// docLengths: docId - 1 -> document length, for the docIds of the postings
+	void addBlockMaxScores(const std::vector<std::pair<uint32_t, uint32_t> >& postings, float idf, const uint32_t* docLengths, float averageDocumentLength,
+		std::vector<TermBlockMax>& termBlockMaxList, std::vector<BlockMaxEntry>& blockMaxList, std::vector<BlockBoundEntry>& blockBoundList)
+	{
+		TermBlockMax termBlockMax;
+		termBlockMax.blockOffset = blockMaxList.size();
+		termBlockMax.maxScore = 0;
+		termBlockMax.reserved = 0;
+
+		for (size_t start = 0; start < postings.size(); start += POSTINGS_BLOCK_SIZE) {
+			size_t end = std::min(start + POSTINGS_BLOCK_SIZE, postings.size());
+
+			BlockMaxEntry block;
+			block.lastDocId = postings[end - 1].first;
+			block.maxScore = 0;
+			BlockBoundEntry bound;
+			bound.maxTf = 0;
+			bound.minDocLength = 0xFFFFFFFF;
+			for (size_t i = start; i < end; ++i) {
+				uint32_t docLength = docLengths[postings[i].first - 1];
+				float score = getBM25Score(postings[i].second, docLength, idf, averageDocumentLength);
+				block.maxScore = std::max(block.maxScore, score);
+				bound.maxTf = std::max(bound.maxTf, postings[i].second);
+				bound.minDocLength = std::min(bound.minDocLength, docLength);
+			}
+			blockMaxList.push_back(block);
+			blockBoundList.push_back(bound);
+
+			termBlockMax.maxScore = std::max(termBlockMax.maxScore, block.maxScore);
+		}
+
+		termBlockMaxList.push_back(termBlockMax);
+	}
+
+	// Keep the postings of the shard's documents, with their docIds in the shard (from 1). All of them without a shard.
+	// return: the number of positions of the word in the documents before the shard
+	uint64_t selectShardPostings(const ShardInfo* shard, std::vector<std::pair<uint32_t, uint32_t> >& postings) {
+		if (shard == NULL)
+			return 0;
+
+		// Postings are sorted by docId
+		std::vector<std::pair<uint32_t, uint32_t> >::iterator first = std::lower_bound(postings.begin(), postings.end(), 
+			std::pair<uint32_t, uint32_t>(shard->docIdOffset + 1, 0));
+		std::vector<std::pair<uint32_t, uint32_t> >::iterator last = std::lower_bound(first, postings.end(), 
+			std::pair<uint32_t, uint32_t>(shard->docIdOffset + shard->documentCount + 1, 0));
+
+		uint64_t positionSkip = 0;
+		for (std::vector<std::pair<uint32_t, uint32_t> >::iterator it = postings.begin(); it != first; ++it)
+			positionSkip += it->second;
+
+		postings.erase(last, postings.end());
+		postings.erase(postings.begin(), first);
+		for (size_t i = 0; i < postings.size(); ++i)
+			postings[i].first -= shard->docIdOffset;
+		return positionSkip;
+	}
+
+	// Static pruning for the first tier: keep the tierPostings postings of a word with the highest BM25 scores (the lowest docId
+	// first among equal scores), in docId order
+	// return: the largest score of the postings left out, 0 if all of them are kept
+	float selectTierPostings(std::vector<std::pair<uint32_t, uint32_t> >& postings, uint32_t tierPostings, float idf, 
+		const uint32_t* docLengths, float averageDocumentLength) 
+	{
+		if (postings.size() <= tierPostings)
+			return 0;
+
+		// (score, docId) of every posting, best first
+		std::vector<std::pair<float, uint32_t> > scores(postings.size());
+		for (size_t i = 0; i < postings.size(); ++i) {
+			uint32_t docLength = docLengths[postings[i].first - 1];
+			scores[i] = std::pair<float, uint32_t>(getBM25Score(postings[i].second, docLength, idf, averageDocumentLength), (uint32_t)i);
+		}
+		std::nth_element(scores.begin(), scores.begin() + tierPostings, scores.end(), 
+			[](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) { 
+				return a.first > b.first || (a.first == b.first && a.second < b.second); 
+			});
+		float tierBound = 0;
+		for (size_t i = tierPostings; i < scores.size(); ++i)
+			tierBound = std::max(tierBound, scores[i].first);
+
+		std::vector<uint32_t> keptIndexes(tierPostings);
+		for (uint32_t i = 0; i < tierPostings; ++i)
+			keptIndexes[i] = scores[i].second;
+		std::sort(keptIndexes.begin(), keptIndexes.end());
+		for (uint32_t i = 0; i < tierPostings; ++i)
+			postings[i] = postings[keptIndexes[i]];
+		postings.resize(tierPostings);
+		return tierBound;
+	}
+
+	// Largest BM25 score of any posting, with the statistics of the whole collection. Shards quantize their impacts with it,
+	// so that the same score is the same impact in every shard.
+	float getMaxScore(uint32_t totalDocuments, float averageDocumentLength) {
+		float maxScore = 0;
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		for (uint32_t termId = 0; termId < this->terms.size(); ++termId) {
+			this->termPostings.getPostings(termId, postings);
+			float idf = getIdf(totalDocuments, (uint32_t)postings.size());
+			for (size_t i = 0; i < postings.size(); ++i) {
+				uint32_t docLength = this->documentLengthList[postings[i].first - 1];
+				maxScore = std::max(maxScore, getBM25Score(postings[i].second, docLength, idf, averageDocumentLength));
+			}
 		}
+		return maxScore;
+	}
+
+	// Save the impact-ordered postings of every word (in sorted word order) to index.bin.
+	// Scores are quantized to IMPACT_BITS with maxScore (the largest BM25 score of any posting), and each word's postings
+	// are grouped into segments of equal impact, highest impact first, docIds increasing in a segment.
+	void saveImpacts(IndexFileWriter& writer, const std::vector<uint32_t>& sortedTermIds, float maxScore, uint32_t totalDocuments, 
+		float averageDocumentLength, const ShardInfo* shard)
+	{
+		ImpactStats impactStats;
+		impactStats.maxScore = maxScore;
+		impactStats.bits = IMPACT_BITS;
+		writer.writeSection(SECTION_IMPACT_STATS, &impactStats, sizeof(impactStats));
+
+		const uint32_t* docLengths = this->documentLengthList.data() + (shard != NULL ? shard->docIdOffset : 0);
+		uint32_t maxImpact = (1u << IMPACT_BITS) - 1;
+		std::vector<TermImpacts> termImpactsList;
+		termImpactsList.reserve(sortedTermIds.size());
+		std::vector<ImpactSegment> segments;
+		std::vector<std::vector<std::pair<uint32_t, uint32_t> > > impactToPostings(maxImpact + 1); // impact -> [(docId, 1), ...]
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		std::vector<uint8_t> encoded;
+
+		writer.beginSection(SECTION_IMPACT_POSTINGS);
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			this->termPostings.getPostings(sortedTermIds[i], postings);
+			float idf = getIdf(totalDocuments, (uint32_t)postings.size());
+			this->selectShardPostings(shard, postings);
+
+			for (size_t j = 0; j < postings.size(); ++j) {
+				uint32_t docLength = docLengths[postings[j].first - 1];
+				float score = getBM25Score(postings[j].second, docLength, idf, averageDocumentLength);
+				uint32_t impact = quantizeScore(score, impactStats.maxScore, IMPACT_BITS);
+				impactToPostings[impact].push_back(std::pair<uint32_t, uint32_t>(postings[j].first, 1));
+			}
+
+			TermImpacts termImpacts;
+			termImpacts.segmentOffset = segments.size();
+			termImpacts.segmentCount = 0;
+			termImpacts.reserved = 0;
+
+			for (uint32_t impact = maxImpact; impact >= 1; --impact) {
+				if (impactToPostings[impact].empty())
+					continue;
+
+				ImpactSegment segment;
+				segment.impact = impact;
+				segment.docCount = (uint32_t)impactToPostings[impact].size();
+				segment.postingsOffset = writer.sectionSize();
+				segments.push_back(segment);
+				++termImpacts.segmentCount;
+
+				encoded.clear();
+				encodePostings(impactToPostings[impact], encoded);
+				writer.write(encoded.data(), encoded.size());
+				impactToPostings[impact].clear();
+			}
+			termImpactsList.push_back(termImpacts);
+		}
+
+		writer.writeSection(SECTION_IMPACT_TERMS, termImpactsList.data(), termImpactsList.size() * sizeof(TermImpacts));
+		writer.writeSection(SECTION_IMPACT_SEGMENTS, segments.data(), segments.size() * sizeof(ImpactSegment));
+	}
+
+	// Save the quantized BM25 score of every posting of every word (in sorted word order) to index.bin, in postings order,
+	// as options.quantizedBits integers. Scores are quantized with maxScore like the impacts, so that the largest one
+	// uses the whole range. Every word's impacts start at its entry of SECTION_QUANTIZED_OFFSETS.
+	// return the largest difference between a score and its dequantized impact
+	template <typename Impact>
+	float saveQuantizedImpacts(IndexFileWriter& writer, const std::vector<uint32_t>& sortedTermIds, float maxScore, uint32_t totalDocuments,
+		float averageDocumentLength, const ShardInfo* shard)
+	{
+		const uint32_t bits = sizeof(Impact) * 8;
+		const uint32_t* docLengths = this->documentLengthList.data() + (shard != NULL ? shard->docIdOffset : 0);
+		std::vector<uint64_t> offsets;
+		offsets.reserve(sortedTermIds.size());
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		std::vector<Impact> impacts;
+		uint64_t impactCount = 0;
+		float maxError = 0;
+
+		writer.beginSection(SECTION_QUANTIZED_IMPACTS);
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			this->termPostings.getPostings(sortedTermIds[i], postings);
+			float idf = getIdf(totalDocuments, (uint32_t)postings.size());
+			this->selectShardPostings(shard, postings);
+
+			impacts.resize(postings.size());
+			for (size_t j = 0; j < postings.size(); ++j) {
+				uint32_t docLength = docLengths[postings[j].first - 1];
+				float score = getBM25Score(postings[j].second, docLength, idf, averageDocumentLength);
+				uint32_t impact = quantizeScore(score, maxScore, bits);
+				maxError = std::max(maxError, std::fabs(dequantizeScore(impact, maxScore, bits) - score));
+				impacts[j] = (Impact)impact;
+			}
+			offsets.push_back(impactCount);
+			writer.write(impacts.data(), impacts.size() * sizeof(Impact));
+			impactCount += impacts.size();
+		}
+
+		writer.writeSection(SECTION_QUANTIZED_OFFSETS, offsets.data(), offsets.size() * 8);
+		return maxError;
+	}
+
+	void saveQuantized(IndexFileWriter& writer, const std::vector<uint32_t>& sortedTermIds, float maxScore, uint32_t totalDocuments,
+		float averageDocumentLength, const ShardInfo* shard)
+	{
+		QuantizedStats quantizedStats;
+		memset(&quantizedStats, 0, sizeof(quantizedStats));
+		quantizedStats.maxScore = maxScore;
+		quantizedStats.bits = this->options.quantizedBits;
+		quantizedStats.k1 = BM25_K1;
+		quantizedStats.b = BM25_B;
+		if (quantizedStats.bits == 8)
+			quantizedStats.maxError = this->saveQuantizedImpacts<uint8_t>(writer, sortedTermIds, maxScore, totalDocuments, averageDocumentLength, shard);
+		else
+			quantizedStats.maxError = this->saveQuantizedImpacts<uint16_t>(writer, sortedTermIds, maxScore, totalDocuments, averageDocumentLength, shard);
+		writer.writeSection(SECTION_QUANTIZED_STATS, &quantizedStats, sizeof(quantizedStats));
+		std::cout << "Quantized BM25 scores to " << quantizedStats.bits << " bits: every score within " << quantizedStats.maxError 
+			<< " of BM25 (largest score " << maxScore << ")" << std::endl;
+	}
+
+	// Save the positions of every word (in sorted word order) to index.bin, and where the positions of every block of
+	// POSTINGS_BLOCK_SIZE postings start, so that the positions of a posting are found without decoding the other blocks
+	void savePositions(IndexFileWriter& writer, const std::vector<uint32_t>& sortedTermIds, const ShardInfo* shard) {
+		std::vector<uint64_t> blockOffsets; // Parallel to the block max entries
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		std::vector<uint32_t> positions;
+		std::vector<uint8_t> encoded;
+
+		writer.beginSection(SECTION_POSITIONS);
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			this->termPostings.getPostings(sortedTermIds[i], postings);
+			this->termPositions.getPositions(sortedTermIds[i], positions);
+
+			encoded.clear();
+			size_t positionIndex = this->selectShardPostings(shard, postings);
+			for (size_t j = 0; j < postings.size(); ++j) {
+				if (j % POSTINGS_BLOCK_SIZE == 0)
+					blockOffsets.push_back(writer.sectionSize() + encoded.size());
+
+				// The first position, then the gaps
+				uint32_t previousPosition = 0;
+				for (uint32_t k = 0; k < postings[j].second; ++k, ++positionIndex) {
+					writeVByte(positions[positionIndex] - previousPosition, encoded);
+					previousPosition = positions[positionIndex];
+				}
+			}
+			writer.write(encoded.data(), encoded.size());
+		}
+
+		writer.writeSection(SECTION_POSITION_BLOCKS, blockOffsets.data(), blockOffsets.size() * 8);
+	}
+
+	// Save everything to index.bin (or a segment). Words are sorted so that the search engine can binary search them in place.
+	// shard: only save the documents of the shard, with the maximum scores and impacts of the whole collection (see shards.h)
+	// maxScore: the largest BM25 score of the whole collection, for the impacts of a shard
+	// tierPostings: save a first tier instead, with the tierPostings best postings of every word and the collection statistics
+	// (no positions or impacts)
+	// Return false if the file couldn't be written
+	bool saveIndexToContainer(const std::string& indexFileName = INDEX_FILE_NAME, const ShardInfo* shard = NULL, float maxScore = 0, 
+		uint32_t tierPostings = 0) 
+	{
+		IndexFileWriter writer(indexFileName);
+
+		// Collection statistics, and the documents of this file
+		CollectionStats collectionStats;
+		memset(&collectionStats, 0, sizeof(collectionStats));
+		collectionStats.totalDocuments = this->documentLengthList.size();
+		for (size_t i = 0; i < this->documentLengthList.size(); ++i)
+			collectionStats.totalLength += this->documentLengthList[i];
+		uint32_t firstDocument = shard != NULL ? shard->docIdOffset : 0;
+		uint32_t documentCount = shard != NULL ? shard->documentCount : (uint32_t)this->documentLengthList.size();
+		const uint32_t* docLengths = this->documentLengthList.data() + firstDocument;
+
+		IndexStats stats;
+		memset(&stats, 0, sizeof(stats));
+		stats.totalDocuments = documentCount;
+		for (uint32_t i = 0; i < documentCount; ++i)
+			stats.totalLength += docLengths[i];
+		stats.postingsFormat = this->options.postingsFormat;
+
+		// Document lengths
+		writer.writeSection(SECTION_DOC_LENGTHS, docLengths, (uint64_t)documentCount * 4);
+
+		// DOCNO offsets and strings
+		std::vector<uint64_t> docNoOffsets;
+		uint64_t docNoOffset = 0;
+		for (uint32_t i = firstDocument; i < firstDocument + documentCount; ++i) {
+			docNoOffsets.push_back(docNoOffset);
+			docNoOffset += this->docNoList[i].length() + 1;
+		}
+		docNoOffsets.push_back(docNoOffset);
+		writer.writeSection(SECTION_DOCNO_OFFSETS, docNoOffsets.data(), docNoOffsets.size() * 8);
+
+		writer.beginSection(SECTION_DOCNO);
+		for (uint32_t i = firstDocument; i < firstDocument + documentCount; ++i)
+			writer.write(this->docNoList[i].c_str(), this->docNoList[i].length() + 1); // Including the '\0'
+
+		// Sort the words. A shard only has the words of its documents.
+		std::vector<uint32_t> sortedTermIds = this->terms.getSortedTermIds();
+		std::vector<uint32_t> savedTermIds;
+		savedTermIds.reserve(sortedTermIds.size());
+		std::vector<uint32_t> collectionDocCounts; // Parallel to savedTermIds
+
+		// Postings, in the order of the sorted words
+		std::vector<TermEntry> termEntries;
+		termEntries.reserve(sortedTermIds.size() + 1);
+		uint32_t termOffset = 0;
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		std::vector<uint8_t> encoded;
+
+		// Maximum BM25 scores of every word and every block of 128 postings, for Block-Max WAND
+		std::vector<TermBlockMax> termBlockMaxList;
+		termBlockMaxList.reserve(sortedTermIds.size());
+		std::vector<BlockMaxEntry> blockMaxList;
+		std::vector<BlockBoundEntry> blockBoundList;
+		float averageDocumentLength = getAverageDocumentLength(collectionStats.totalLength, collectionStats.totalDocuments);
+		std::vector<float> tierBounds; // Parallel to savedTermIds, in a first tier
+
+		writer.beginSection(SECTION_POSTINGS);
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			this->termPostings.getPostings(sortedTermIds[i], postings);
+			uint32_t collectionDocCount = (uint32_t)postings.size();
+			this->selectShardPostings(shard, postings);
+			// A shard keeps the words none of its documents contain (with no postings), so that every shard has the words of the
+			// whole collection and expands a wildcard to the same words as one index would
+			if (postings.empty() && shard == NULL)
+				continue;
+			savedTermIds.push_back(sortedTermIds[i]);
+			collectionDocCounts.push_back(collectionDocCount);
+
+			float idf = getIdf((uint32_t)collectionStats.totalDocuments, collectionDocCount);
+			if (tierPostings > 0)
+				tierBounds.push_back(this->selectTierPostings(postings, tierPostings, idf, docLengths, averageDocumentLength));
+
+			TermEntry entry;
+			entry.postingsOffset = writer.sectionSize();
+			entry.docCount = (uint32_t)postings.size();
+			entry.termOffset = termOffset;
+			termEntries.push_back(entry);
+			termOffset += this->terms.getTerm(sortedTermIds[i]).length();
+
+			this->addBlockMaxScores(postings, idf, docLengths, averageDocumentLength, termBlockMaxList, blockMaxList, blockBoundList);
+
+			if (this->options.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+				encoded.clear();
+				encodePostings(postings, encoded);
+				uint32_t byteLength = (uint32_t)encoded.size();
+				writer.write(&byteLength, 4);
+				writer.write(encoded.data(), byteLength);
+			}
+			else {
+				writer.write(postings.data(), postings.size() * 8); // (docId, tf) pairs, each 4 bytes
+			}
+		}
+
+		// An extra entry to mark the end of the last word
+		TermEntry endEntry;
+		endEntry.postingsOffset = writer.sectionSize();
+		endEntry.docCount = 0;
+		endEntry.termOffset = termOffset;
+		termEntries.push_back(endEntry);
+
+		writer.beginSection(SECTION_TERM_STRINGS);
+		for (size_t i = 0; i < savedTermIds.size(); ++i) {
+			std::string_view term = this->terms.getTerm(savedTermIds[i]);
+			writer.write(term.data(), term.length());
+		}
+
+		writer.writeSection(SECTION_TERMS, termEntries.data(), termEntries.size() * sizeof(TermEntry));
+
+		// Stats
+		stats.termCount = savedTermIds.size();
+		writer.writeSection(SECTION_STATS, &stats, sizeof(stats));
+
+		writer.writeSection(SECTION_TERM_BLOCK_MAX, termBlockMaxList.data(), termBlockMaxList.size() * sizeof(TermBlockMax));
+		writer.writeSection(SECTION_BLOCK_MAX, blockMaxList.data(), blockMaxList.size() * sizeof(BlockMaxEntry));
+		writer.writeSection(SECTION_BLOCK_BOUNDS, blockBoundList.data(), blockBoundList.size() * sizeof(BlockBoundEntry));
+
+		if (shard != NULL || tierPostings > 0) {
+			if (shard != NULL) {
+				collectionStats.docIdOffset = shard->docIdOffset;
+				collectionStats.shardCount = this->options.shardCount;
+			}
+			writer.writeSection(SECTION_COLLECTION_STATS, &collectionStats, sizeof(collectionStats));
+			writer.writeSection(SECTION_COLLECTION_DOC_COUNTS, collectionDocCounts.data(), collectionDocCounts.size() * 4);
+		}
+
+		if (tierPostings > 0) {
+			writer.writeSection(SECTION_TIER_BOUNDS, tierBounds.data(), tierBounds.size() * sizeof(float));
+			return writer.close();
+		}
+
+		if (this->options.savePositions)
+			this->savePositions(writer, savedTermIds, shard);
+
+		if (shard == NULL) {
+			for (size_t i = 0; i < termBlockMaxList.size(); ++i)
+				maxScore = std::max(maxScore, termBlockMaxList[i].maxScore);
+		}
+		if (this->options.saveImpacts)
+			this->saveImpacts(writer, savedTermIds, maxScore, (uint32_t)collectionStats.totalDocuments, averageDocumentLength, shard);
+		if (this->options.quantizedBits > 0)
+			this->saveQuantized(writer, savedTermIds, maxScore, (uint32_t)collectionStats.totalDocuments, averageDocumentLength, shard);
+
+		return writer.close();
+	}
+
+	// Save the documents as options.shardCount shards of consecutive documents, and the shard manifest (see shards.h)
+	// Return false if a shard couldn't be written, and then remove the shards and the manifest
+	bool saveShards() {
+		ShardManifest manifest;
+		manifest.split((uint32_t)this->documentLengthList.size(), this->options.shardCount);
+
+		float maxScore = 0;
+		if (this->options.saveImpacts || this->options.quantizedBits > 0) {
+			uint64_t totalLength = 0;
+			for (size_t i = 0; i < this->documentLengthList.size(); ++i)
+				totalLength += this->documentLengthList[i];
+			maxScore = this->getMaxScore((uint32_t)this->documentLengthList.size(), getAverageDocumentLength(totalLength, this->documentLengthList.size()));
+		}
+
+		for (uint32_t i = 0; i < this->options.shardCount; ++i) {
+			if (!this->saveIndexToContainer(getShardFileName(i), &manifest.shards[i], maxScore)) {
+				std::cerr << "Can't write " << getShardFileName(i) << std::endl;
+				for (uint32_t j = 0; j < i; ++j)
+					unlink(getShardFileName(j).c_str());
+				unlink(SHARD_MANIFEST_NAME); // Of older shards, some of them just overwritten
+				return false;
+			}
+			std::cout << "Saved shard " << i << ": " << manifest.shards[i].documentCount << " documents from docId " 
+				<< manifest.shards[i].docIdOffset + 1 << std::endl;
+		}
+		return manifest.save();
+	}
+
+	// Save the index as a new segment, and add it after the live segments in the manifest (see segments.h)
+	// Return false if the segment couldn't be written, the manifest is left as it was
+	bool saveSegment() {
+		SegmentManifest manifest;
+		uint64_t segmentId = 0;
+		{
+			// Reserve a segment id, so that indexers running at the same time write different files
+			SegmentLock lock(SEGMENT_LOCK_NAME, true);
+			manifest.load();
+			segmentId = manifest.nextSegmentId++;
+			manifest.save();
+		}
+
+		if (!this->saveIndexToContainer(getSegmentFileName(segmentId))) {
+			std::cerr << "Can't write " << getSegmentFileName(segmentId) << std::endl;
+			return false;
+		}
+
+		SegmentLock lock(SEGMENT_LOCK_NAME, true);
+		manifest.load(); // Again, it may have been changed by a merge meanwhile
+		SegmentInfo segment;
+		segment.segmentId = segmentId;
+		segment.documentCount = (uint32_t)this->documentLengthList.size();
+		segment.deletedCount = 0;
+		manifest.segments.push_back(segment);
+		manifest.save();
+		std::cout << "Added segment " << segmentId << " (" << manifest.segments.size() << " segments)" << std::endl;
+		return true;
+	}
+
+	// Return false if a file couldn't be written
+	bool saveDocumentsToFiles() {
+		// Save document length list
+		BulkWriter docLengthsFile("index_docLengths.bin"); // an uint32_t(4 byte) for each document length
+		docLengthsFile.write(this->documentLengthList.data(), this->documentLengthList.size() * 4);
 
 		// Save DOCNO list
-		std::ofstream docNoFile("index_docNo.bin"); // docNo("WSJ870324-0001") string splitted by \0
+		BulkWriter docNoFile("index_docNo.bin"); // docNo("WSJ870324-0001") string splitted by \0
 		for (size_t i = 0; i < this->docNoList.size(); ++i) {
-			std::string s = this->docNoList[i] + '\0'; // Add '\0' to the end to split strings
-			docNoFile.write(s.c_str(), s.length());
+			docNoFile.write(this->docNoList[i].c_str(), this->docNoList[i].length() + 1); // Including the '\0' to split strings
 		}
+		bool saved = docLengthsFile.close();
+		return docNoFile.close() && saved;
+	}
+
+	// Remove index.bin, the four index_*.bin files and the dictionary after a failed save, so that no incomplete or older
+	// index is searched
+	void removeIndexFiles() {
+		unlink(INDEX_FILE_NAME);
+		unlink(TIER1_FILE_NAME);
+		unlink("index_words.bin");
+		unlink("index_wordPostings.bin");
+		unlink("index_docLengths.bin");
+		unlink("index_docNo.bin");
+		unlink(DICTIONARY_FILE_NAME);
+	}
 
-		// Save wordToPostings
-		// Stored as (docId1 for word1, term frequency 1 for word1, docId2 for word1, tf2 for word1, 
+	// Write a word to index_words.bin and index_dictionary.bin, and its postings to index_wordPostings.bin
+	// docCounter (raw) or byteOffset (compressed) is the pos of the word, and is moved after its postings
+	void writeWordPostings(BulkWriter& wordsFile, BulkWriter& wordPostingsFile, FrontCodedDictionaryWriter& dictionary, std::string_view word, 
+		const std::vector<std::pair<uint32_t, uint32_t> >& postings, uint32_t& docCounter, uint32_t& byteOffset, std::vector<uint8_t>& encoded)
+	{
+		uint32_t docCount = postings.size();
+
+		uint8_t wordLength = (uint8_t)word.length();
+		wordsFile.write(&wordLength, 1);
+		wordsFile.write(word.data(), wordLength);
+		dictionary.add(word, this->options.postingsFormat == POSTINGS_FORMAT_COMPRESSED ? byteOffset : docCounter, docCount);
+
+		if (this->options.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+			encoded.clear();
+			encodePostings(postings, encoded);
+			uint32_t byteLength = (uint32_t)encoded.size();
+
+			wordsFile.write(&byteOffset, 4);
+			wordsFile.write(&docCount, 4);
+
+			wordPostingsFile.write(&byteLength, 4);
+			wordPostingsFile.write(encoded.data(), byteLength);
+			byteOffset += 4 + byteLength;
+			return;
+		}
+
+		wordsFile.write(&docCounter, 4);
+		wordsFile.write(&docCount, 4);
+
+		// (docId, tf) pairs are already stored as 4 byte docId + 4 byte tf in the vector
+		wordPostingsFile.write(postings.data(), (size_t)docCount * 8);
+		docCounter += docCount;
+	}
+
+	// Return false if a file couldn't be written
+	bool saveIndexToFiles() {
+		bool saved = this->saveDocumentsToFiles();
+
+		// Save the postings of every word
+		// Raw: stored as (docId1 for word1, term frequency 1 for word1, docId2 for word1, tf2 for word1, 
 		// 				docId1 for word2, tf1 for word2, ...) each in 4 bytes uint32_t
-		std::ofstream wordPostingsFile("index_wordPostings.bin");
+		// Compressed: magic + (byteLength, blocks) for each word, see postingsCodec.h
+		BulkWriter wordPostingsFile("index_wordPostings.bin");
 		
 		// Stored as: 4 byte word count + [(wordLength(1 byte), word, pos(4 bytes), docCount(4 bytes)), ...]
-		// -- pos: how many documents before the word's first document
+		// -- pos: raw: how many documents before the word's first document
+		// 		compressed: byte offset of the word's postings in index_wordPostings.bin
 		// -- docCount: how many documents the word appears in (vector's size) 
-		std::ofstream wordsFile("index_words.bin");
+		BulkWriter wordsFile("index_words.bin");
 
-		uint32_t wordCount = (uint32_t)wordToPostings.size();
-		wordsFile.write((const char*)&wordCount, 4); // 4 byte word count
+		uint32_t wordCount = this->terms.size();
+		wordsFile.write(&wordCount, 4); // 4 byte word count
 
 		uint32_t docCounter = 0;
-		for (std::unordered_map<std::string, std::vector<std::pair<uint32_t, uint32_t> > >::iterator it 
-					= wordToPostings.begin(); it != wordToPostings.end(); ++it) 
-		{
-			std::string word = it->first;
-			std::vector<std::pair<uint32_t, uint32_t> > postings = it->second;
-			uint32_t docCount = postings.size();
 
+		uint32_t byteOffset = 0;
+		std::vector<std::pair<uint32_t, uint32_t> > postings; // Reused buffer for the postings of a word
+		std::vector<uint8_t> encoded; // Reused buffer for the compressed postings of a word
+		if (this->options.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+			wordPostingsFile.write(&COMPRESSED_POSTINGS_MAGIC, 4);
+			byteOffset = 4;
+		}
+		// In sorted order, for the front-coded dictionary (and so a word's postings end where the next word's start)
+		FrontCodedDictionaryWriter dictionary;
+		std::vector<uint32_t> sortedTermIds = this->terms.getSortedTermIds();
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			this->termPostings.getPostings(sortedTermIds[i], postings);
+			this->writeWordPostings(wordsFile, wordPostingsFile, dictionary, this->terms.getTerm(sortedTermIds[i]), postings, docCounter, byteOffset, encoded);
+		}
+		saved = wordsFile.close() && saved;
+		saved = wordPostingsFile.close() && saved;
+		return dictionary.save(DICTIONARY_FILE_NAME) && saved;
+	}
+
+	// Write the postings in memory to a new run file, sorted by word, and empty the words and postings
+	void flushRun() {
+		std::string runFileName = "index_run" + std::to_string(this->runFileNames.size()) + ".tmp";
+		this->runFileNames.push_back(runFileName);
+
+		std::vector<uint32_t> sortedTermIds = this->terms.getSortedTermIds();
+
+		BulkWriter runFile(runFileName);
+		for (size_t i = 0; i < sortedTermIds.size(); ++i) {
+			std::string_view word = this->terms.getTerm(sortedTermIds[i]);
 			uint8_t wordLength = (uint8_t)word.length();
-			wordsFile.write((const char*)&wordLength, 1);
-			wordsFile.write(word.c_str(), wordLength);
-			wordsFile.write((const char*)&docCounter, 4);
-			wordsFile.write((const char*)&docCount, 4);
-
-			for (uint32_t i = 0; i < docCount; ++i) {
-				uint32_t docId = postings[i].first;
-				uint32_t tf = postings[i].second;
-				wordPostingsFile.write((const char*)&docId, 4);
-				wordPostingsFile.write((const char*)&tf, 4);
-
-				++docCounter;
-			}
+			uint32_t docCount = this->termPostings.getDocCount(sortedTermIds[i]);
+			runFile.write(&wordLength, 1);
+			runFile.write(word.data(), wordLength);
+			runFile.write(&docCount, 4);
+			// The blocks are already (docId, tf) each in 4 bytes
+			this->termPostings.forEachBlock(sortedTermIds[i], [&runFile](const Posting* postings, uint32_t count) {
+				runFile.write(postings, (size_t)count * sizeof(Posting));
+			});
+		}
+		if (!runFile.close()) {
+			std::cerr << "Can't write " << runFileName << std::endl;
+			this->runFailed = true;
 		}
+
+		std::cout << "Flushed " << sortedTermIds.size() << " words to " << runFileName << std::endl;
+
+		this->terms.clear(); // Release the memory
+		this->termPostings.clear();
+		this->termPositions.clear();
 	}
 
-	void addWordToPostings(const std::string& word, uint32_t docId) {
-		// Since all documents are processed one by one, the current document is always the last one in postings.
-		// So don't need wordToPostings.find(word), just access the last one
-		std::vector<std::pair<uint32_t, uint32_t> >& postings = wordToPostings[word];
-		if (postings.size() == 0 || postings[postings.size() - 1].first != docId) {
-			postings.push_back(std::pair<uint32_t, uint32_t>(docId, 1));
+	// k-way merge the run files into index_words.bin, index_dictionary.bin and index_wordPostings.bin (words in sorted order), then delete them.
+	// Runs hold increasing docIds, so the postings of a word are concatenated in run order.
+	// Return false if a run or an index file couldn't be written
+	bool mergeRunsToFiles() {
+		if (this->runFailed) {
+			for (size_t i = 0; i < this->runFileNames.size(); ++i)
+				std::remove(this->runFileNames[i].c_str());
+			return false;
 		}
-		else {
-			postings[postings.size() - 1].second += 1;
+		bool saved = this->saveDocumentsToFiles();
+
+		BulkWriter wordsFile("index_words.bin");
+		BulkWriter wordPostingsFile("index_wordPostings.bin");
+
+		uint32_t wordCount = 0;
+		wordsFile.write(&wordCount, 4); // Filled after the merge
+
+		uint32_t docCounter = 0;
+		uint32_t byteOffset = 0;
+		std::vector<uint8_t> encoded;
+		if (this->options.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+			wordPostingsFile.write(&COMPRESSED_POSTINGS_MAGIC, 4);
+			byteOffset = 4;
+		}
+
+		std::vector<RunReader*> runs;
+		// (word, run index), smallest word first, then earliest run
+		std::priority_queue<std::pair<std::string, uint32_t>, std::vector<std::pair<std::string, uint32_t> >, 
+			std::greater<std::pair<std::string, uint32_t> > > queue;
+		size_t bufferSize = std::min(RUN_IO_BUFFER_SIZE, 
+			std::max(MIN_RUN_IO_BUFFER_SIZE, (size_t)(this->options.memoryBudget / this->runFileNames.size())));
+		for (size_t i = 0; i < this->runFileNames.size(); ++i) {
+			runs.push_back(new RunReader(this->runFileNames[i], bufferSize));
+			if (!runs[i]->word.empty())
+				queue.push(std::pair<std::string, uint32_t>(runs[i]->word, (uint32_t)i));
+		}
+
+		FrontCodedDictionaryWriter dictionary;
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		while (!queue.empty()) {
+			std::string word = queue.top().first;
+			postings.clear();
+			while (!queue.empty() && queue.top().first == word) {
+				RunReader* run = runs[queue.top().second];
+				uint32_t runIndex = queue.top().second;
+				queue.pop();
+
+				run->readPostings(postings);
+				run->nextWord();
+				if (!run->word.empty())
+					queue.push(std::pair<std::string, uint32_t>(run->word, runIndex));
+			}
+
+			this->writeWordPostings(wordsFile, wordPostingsFile, dictionary, word, postings, docCounter, byteOffset, encoded);
+			++wordCount;
 		}
+
+		wordsFile.writeAt(0, &wordCount, 4);
+		saved = wordsFile.close() && saved;
+		saved = wordPostingsFile.close() && saved;
+		saved = dictionary.save(DICTIONARY_FILE_NAME) && saved;
+
+		for (size_t i = 0; i < runs.size(); ++i) {
+			delete runs[i];
+			std::remove(this->runFileNames[i].c_str());
+		}
+		std::cout << "Merged " << runs.size() << " runs, " << wordCount << " words." << std::endl;
+		return saved;
 	}
 
-	void runIndexer() {
-		std::ifstream file(this->fileName);
+	// position: index of the word in the document, from 0
+	void addWordToPostings(std::string_view word, uint32_t docId, uint32_t position) {
+		this->addTermToPostings(this->terms.getOrAdd(word), docId, position);
+	}
+
+	void addTermToPostings(uint32_t termId, uint32_t docId, uint32_t position) {
+		// Since all documents are processed one by one, the current document is always the last one in postings,
+		// so the pool only checks the last posting of the word
+		this->termPostings.add(termId, docId);
+		if (this->options.savePositions)
+			this->termPositions.append(termId, position);
+	}
+
+	// Parse the documents of an XML stream and add them to the index. docIds start from 1 for every stream.
+	// startInContent: the stream starts right after a </DOC> (a chunk of the file) instead of at the beginning of the file
+	// return: the number of documents
+	uint32_t parseDocuments(std::istream& file, bool startInContent, bool showProgress) {
 		std::string line = "";
 
 		bool readingTag = false;
-		bool readingContent = false;
+		bool readingContent = startInContent;
 
 		size_t readStartIndex = 0;
 		std::string currentTagName = "";
 		std::string currentText = "";
 		std::string currentDocNo = "";
 		uint32_t currentDocumentLength = 0;
+		std::string currentDocumentText = ""; // Text of the document's tags, for the document store
 
 		uint32_t documentIndex = 0; // ++ when encounter </DOC>
 
@@ -165,28 +920,28 @@ public:
 				// Start of a tag
 				if (line[i] == '<') {
 					if (readingContent) {
-						std::string content = line.substr(readStartIndex, i - readStartIndex);
-						currentText += content;
-
-						// Extract and print all the words
-						std::vector<std::string> words = extractWords(currentText);
-
-						if (currentTagName == "DOCNO") { // the '<' of </DOCNO>, the close tag of a document no.
-							currentDocNo = words[0]; //stripString(currentText); // Don't need to strip, extracted words are in good format
-							this->docNoList.push_back(currentDocNo);
-						}
+						currentText.append(line, readStartIndex, i - readStartIndex);
+						if (this->options.saveStore)
+							currentDocumentText.append(line, readStartIndex, i - readStartIndex);
 
-						// Output the words, and save to postings
-						for (size_t wordIndex = 0; wordIndex < words.size(); ++wordIndex) {
-							std::string word = words[wordIndex];
+						// Extract the words in place, and save to postings
+						Tokenizer tokenizer(&currentText[0], currentText.length());
+						std::string_view word;
+						uint32_t wordCount = 0;
+						uint32_t docId = documentIndex + 1;
+						while (tokenizer.next(word)) {
+							if (wordCount == 0 && currentTagName == "DOCNO") { // the '<' of </DOCNO>, the close tag of a document no.
+								currentDocNo.assign(word.data(), word.length()); // Don't need to strip, extracted words are in good format
+								this->docNoList.push_back(currentDocNo);
+							}
 							// std::cout << "token:" << word << std::endl; // output each word as a line
 
-							uint32_t docId = documentIndex + 1;
-							this->addWordToPostings(word, docId);
+							this->addWordToPostings(word, docId, currentDocumentLength + wordCount);
+							++wordCount;
 						}
 
 						// Save document length
-						currentDocumentLength += words.size();
+						currentDocumentLength += wordCount;
 
 						readingContent = false;
 					}
@@ -201,33 +956,42 @@ public:
 				// End of a tag
 				if (line[i] == '>') {
 					if (readingTag) {
-						std::string tagName = line.substr(readStartIndex, i - readStartIndex);
-						if (tagName[0] != '/') { // It's an open tag. e.g. <DOC>
-							currentTagName = tagName;
+						std::string_view tagName(line.data() + readStartIndex, i - readStartIndex);
+						if (tagName.empty() || tagName[0] != '/') { // It's an open tag. e.g. <DOC>
+							currentTagName.assign(tagName.data(), tagName.length());
 						}
 						else { // It's a close tag. e.g. </DOC>
 
 							// Reach the end of a document
 							if (tagName == "/DOC") { 
-								currentDocNo = "";
+								currentDocNo.clear();
 
 								// Save current document length
 								this->documentLengthList.push_back(currentDocumentLength);
 								currentDocumentLength = 0;
 
+								if (this->options.saveStore) {
+									this->documentStore.add(stripString(currentDocumentText));
+									currentDocumentText.clear();
+								}
+
 
 								// Output an blank line between documents
 								// std::cout << std::endl;
 
-								if (documentIndex % 1000 == 0) 
+								if (showProgress && documentIndex % 1000 == 0) 
 								{
 									std::cout << documentIndex << " documents processed." << std::endl;
 								}
 								++documentIndex;
+
+								// Only flushed between documents, so the tf of a word in a document is never split
+								if (this->options.memoryBudget > 0 && this->getPostingsMemory() >= this->options.memoryBudget)
+									this->flushRun();
 							}
 
-							currentTagName = "";
-							currentText = "";
+							currentTagName.clear();
+							currentText.clear();
 						}
 						
 						readingTag = false;
@@ -243,27 +1007,743 @@ public:
 
 			// Add the rest of the line to currentText
 			if (readingContent) {
-				std::string content = line.substr(readStartIndex, line.length() - readStartIndex);
-				currentText += content + "\n";
+				currentText.append(line, readStartIndex, line.length() - readStartIndex);
+				currentText += '\n';
+				if (this->options.saveStore) {
+					currentDocumentText.append(line, readStartIndex, line.length() - readStartIndex);
+					currentDocumentText += '\n';
+				}
+			}
+		}
+
+		return documentIndex;
+	}
+
+	// Add the documents of a token stream (see tokenStream.h) to the index, without parsing XML. The words are looked up
+	// once per termId of the stream, not once per token. The index is the same as from the XML the stream was made from.
+	// return: the number of documents
+	uint32_t parseTokenStream(TokenStreamReader& reader, bool showProgress) {
+		const uint32_t NO_TERM = 0xFFFFFFFF;
+		std::vector<uint32_t> termIds; // termId in the stream -> termId in this->terms, NO_TERM if not looked up yet
+		std::string_view docNo;
+		uint32_t tokenCount = 0;
+		uint32_t documentIndex = 0;
+		while (reader.nextDocument(docNo, tokenCount)) {
+			uint32_t docId = documentIndex + 1;
+			if (!docNo.empty())
+				this->docNoList.push_back(std::string(docNo));
+
+			uint32_t streamTermId = 0;
+			uint32_t position = 0;
+			for (; position < tokenCount && reader.nextToken(streamTermId); ++position) {
+				if (streamTermId >= termIds.size())
+					termIds.resize(streamTermId + 1, NO_TERM);
+				if (termIds[streamTermId] == NO_TERM)
+					termIds[streamTermId] = this->terms.getOrAdd(reader.getTerm(streamTermId));
+				this->addTermToPostings(termIds[streamTermId], docId, position);
+			}
+			this->documentLengthList.push_back(position);
+
+			if (showProgress && documentIndex % 1000 == 0)
+				std::cout << documentIndex << " documents processed." << std::endl;
+			++documentIndex;
+
+			if (this->options.memoryBudget > 0 && this->getPostingsMemory() >= this->options.memoryBudget) {
+				this->flushRun();
+				termIds.assign(termIds.size(), NO_TERM); // The words were emptied
+			}
+		}
+
+		if (reader.isTruncated())
+			std::cout << this->fileName << " is truncated, indexed the documents before the end" << std::endl;
+		return documentIndex;
+	}
+
+	// Average log2 of the docId gaps of all the postings (the first docId is a gap from 0), about the bits of a compressed docId
+	double getAverageGapBits() const {
+		double bits = 0;
+		uint64_t postingCount = 0;
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		for (uint32_t termId = 0; termId < this->terms.size(); ++termId) {
+			this->termPostings.getPostings(termId, postings);
+			uint32_t previousDocId = 0;
+			for (size_t i = 0; i < postings.size(); ++i) {
+				bits += std::log2((double)(postings[i].first - previousDocId));
+				previousDocId = postings[i].first;
+			}
+			postingCount += postings.size();
+		}
+		return postingCount > 0 ? bits / postingCount : 0;
+	}
+
+	// The words of every document for the graph bisection, only the words in 2 documents or more (with new dense termIds)
+	ForwardIndex getForwardIndex() const {
+		uint32_t documentCount = (uint32_t)this->documentLengthList.size();
+		ForwardIndex index;
+		index.offsets.assign(documentCount + 1, 0);
+		for (uint32_t termId = 0; termId < this->terms.size(); ++termId) {
+			if (this->termPostings.getDocCount(termId) < 2)
+				continue;
+			this->termPostings.forEachBlock(termId, [&index](const Posting* postings, uint32_t count) {
+				for (uint32_t i = 0; i < count; ++i)
+					++index.offsets[postings[i].docId]; // Counted at docId, so that offsets[docId - 1] is the start after the sums
+			});
+		}
+		for (uint32_t d = 0; d < documentCount; ++d)
+			index.offsets[d + 1] += index.offsets[d];
+
+		index.terms.resize(index.offsets[documentCount]);
+		std::vector<uint64_t> positions(index.offsets.begin(), index.offsets.end() - 1);
+		index.termCount = 0;
+		for (uint32_t termId = 0; termId < this->terms.size(); ++termId) {
+			if (this->termPostings.getDocCount(termId) < 2)
+				continue;
+			uint32_t denseTermId = index.termCount++;
+			this->termPostings.forEachBlock(termId, [&index, &positions, denseTermId](const Posting* postings, uint32_t count) {
+				for (uint32_t i = 0; i < count; ++i)
+					index.terms[positions[postings[i].docId - 1]++] = denseTermId;
+			});
+		}
+		return index;
+	}
+
+	// Give the documents new docIds with options.documentOrder (see docReordering.h), before anything is saved:
+	// the postings (and positions) of every word are remapped and sorted again, and the DOCNOs and document lengths are
+	// moved to their new docIds
+	void reorderDocuments() {
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		uint32_t documentCount = (uint32_t)this->documentLengthList.size();
+		double gapBitsBefore = this->getAverageGapBits();
+
+		std::vector<uint32_t> order; // docId - 1 of the documents in their new order
+		if (this->options.documentOrder == DOC_ORDER_DOCNO) {
+			if (this->docNoList.size() != documentCount) {
+				std::cout << "Not every document has a DOCNO, keeping the file order" << std::endl;
+				return;
+			}
+			order.resize(documentCount);
+			std::iota(order.begin(), order.end(), 0);
+			std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return this->docNoList[a] < this->docNoList[b]; });
+		}
+		else
+			order = GraphBisection(this->getForwardIndex(), this->options.threadCount).computeOrder();
+
+		std::vector<uint32_t> newDocIds(documentCount + 1, 0); // docId -> new docId
+		for (uint32_t i = 0; i < documentCount; ++i)
+			newDocIds[order[i] + 1] = i + 1;
+
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		std::vector<uint32_t> postingOrder;
+		std::vector<Posting> remappedPostings;
+		std::vector<uint32_t> positions;
+		std::vector<uint32_t> positionStarts;
+		std::vector<uint32_t> remappedPositions;
+		for (uint32_t termId = 0; termId < this->terms.size(); ++termId) {
+			this->termPostings.getPostings(termId, postings);
+			postingOrder.resize(postings.size());
+			std::iota(postingOrder.begin(), postingOrder.end(), 0);
+			std::sort(postingOrder.begin(), postingOrder.end(), [&postings, &newDocIds](uint32_t a, uint32_t b) { 
+				return newDocIds[postings[a].first] < newDocIds[postings[b].first]; 
+			});
+			remappedPostings.resize(postings.size());
+			for (size_t i = 0; i < postings.size(); ++i)
+				remappedPostings[i] = Posting{newDocIds[postings[postingOrder[i]].first], postings[postingOrder[i]].second};
+			this->termPostings.replace(termId, remappedPostings.data());
+
+			if (this->options.savePositions) {
+				// tf positions for every posting, moved with their postings
+				this->termPositions.getPositions(termId, positions);
+				positionStarts.resize(postings.size());
+				uint32_t start = 0;
+				for (size_t i = 0; i < postings.size(); ++i) {
+					positionStarts[i] = start;
+					start += postings[i].second;
+				}
+				remappedPositions.clear();
+				for (size_t i = 0; i < postings.size(); ++i) {
+					const uint32_t* first = positions.data() + positionStarts[postingOrder[i]];
+					remappedPositions.insert(remappedPositions.end(), first, first + postings[postingOrder[i]].second);
+				}
+				this->termPositions.replace(termId, remappedPositions.data());
+			}
+		}
+
+		std::vector<uint32_t> documentLengths(documentCount);
+		for (uint32_t i = 0; i < documentCount; ++i)
+			documentLengths[i] = this->documentLengthList[order[i]];
+		this->documentLengthList.swap(documentLengths);
+		if (this->docNoList.size() == documentCount) {
+			std::vector<std::string> docNos(documentCount);
+			for (uint32_t i = 0; i < documentCount; ++i)
+				docNos[i].swap(this->docNoList[order[i]]);
+			this->docNoList.swap(docNos);
+		}
+		if (this->options.saveStore)
+			this->documentStore.reorder(order);
+
+		std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+		std::cout << "Reordered " << documentCount << " documents in " << std::chrono::duration<double>(endTime - startTime).count() 
+			<< " s, average docId gap: " << gapBitsBefore << " bits before, " << this->getAverageGapBits() << " bits after" << std::endl;
+	}
+
+	// Add a partial index of a later part of the file. Its docIds are shifted by docIdOffset (the number of documents before it).
+	// The partial index is emptied.
+	void mergeFrom(Indexer& part, uint32_t docIdOffset) {
+		for (uint32_t partTermId = 0; partTermId < part.terms.size(); ++partTermId) {
+			uint32_t termId = this->terms.getOrAdd(part.terms.getTerm(partTermId));
+			part.termPostings.forEachBlock(partTermId, [this, termId, docIdOffset](const Posting* postings, uint32_t count) {
+				for (uint32_t i = 0; i < count; ++i)
+					this->termPostings.append(termId, Posting{postings[i].docId + docIdOffset, postings[i].tf});
+			});
+			part.termPositions.forEachBlock(partTermId, [this, termId](const uint32_t* positions, uint32_t count) {
+				for (uint32_t i = 0; i < count; ++i)
+					this->termPositions.append(termId, positions[i]);
+			});
+		}
+		part.terms.clear();
+		part.termPostings.clear();
+		part.termPositions.clear();
+
+		this->docNoList.insert(this->docNoList.end(), part.docNoList.begin(), part.docNoList.end());
+		this->documentLengthList.insert(this->documentLengthList.end(), part.documentLengthList.begin(), part.documentLengthList.end());
+		part.docNoList.clear();
+		part.documentLengthList.clear();
+		this->documentStore.append(part.documentStore);
+	}
+
+	// Add the documents of a segment that aren't deleted after the documents already in the index, for merging segments.
+	// docIdMap: set to the new docId of every docId of the segment (index docId - 1), 0 for the deleted documents
+	// return: the number of documents added
+	uint32_t addSegment(const IndexFile& segment, const DeletedDocuments& deletedDocuments, std::vector<uint32_t>& docIdMap) {
+		const IndexStats* stats = (const IndexStats*)segment.getSection(SECTION_STATS);
+		const uint32_t* docLengths = (const uint32_t*)segment.getSection(SECTION_DOC_LENGTHS);
+		const uint64_t* docNoOffsets = (const uint64_t*)segment.getSection(SECTION_DOCNO_OFFSETS);
+		const char* docNoStrings = (const char*)segment.getSection(SECTION_DOCNO);
+		const uint8_t* postingsData = segment.getSection(SECTION_POSTINGS);
+		const TermEntry* termEntries = (const TermEntry*)segment.getSection(SECTION_TERMS);
+		const char* termStrings = (const char*)segment.getSection(SECTION_TERM_STRINGS);
+		const TermBlockMax* termBlockMax = (const TermBlockMax*)segment.getSection(SECTION_TERM_BLOCK_MAX);
+		const uint8_t* positionsData = segment.getSection(SECTION_POSITIONS);
+		const uint64_t* positionBlocks = (const uint64_t*)segment.getSection(SECTION_POSITION_BLOCKS);
+
+		uint32_t documentCount = (uint32_t)stats->totalDocuments;
+		uint32_t addedCount = 0;
+		docIdMap.assign(documentCount, 0);
+		for (uint32_t docId = 1; docId <= documentCount; ++docId) {
+			if (deletedDocuments.isDeleted(docId))
+				continue;
+			docIdMap[docId - 1] = (uint32_t)this->documentLengthList.size() + 1;
+			this->documentLengthList.push_back(docLengths[docId - 1]);
+			this->docNoList.push_back(docNoStrings + docNoOffsets[docId - 1]);
+			++addedCount;
+		}
+
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		for (uint32_t i = 0; i < stats->termCount; ++i) {
+			const TermEntry& entry = termEntries[i];
+			std::string_view word(termStrings + entry.termOffset, termEntries[i + 1].termOffset - entry.termOffset);
+
+			postings.clear();
+			if ((PostingsFormat)stats->postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+				decodePostings(postingsData + entry.postingsOffset + 4, entry.docCount, postings); // + 4 to skip the byteLength
+			}
+			else {
+				const uint32_t* values = (const uint32_t*)(postingsData + entry.postingsOffset);
+				for (uint32_t j = 0; j < entry.docCount; ++j)
+					postings.push_back(std::pair<uint32_t, uint32_t>(values[j * 2], values[j * 2 + 1]));
+			}
+
+			// The positions of the word are stored together, from its first block
+			const uint8_t* in = NULL;
+			if (this->options.savePositions && entry.docCount > 0)
+				in = positionsData + positionBlocks[termBlockMax[i].blockOffset];
+
+			uint32_t termId = 0;
+			bool added = false;
+			for (size_t j = 0; j < postings.size(); ++j) {
+				uint32_t newDocId = docIdMap[postings[j].first - 1];
+				if (newDocId != 0) {
+					if (!added) {
+						termId = this->terms.getOrAdd(word); // Words only in deleted documents are dropped
+						added = true;
+					}
+					this->termPostings.append(termId, Posting{newDocId, postings[j].second});
+				}
+				if (in != NULL) {
+					uint32_t position = 0;
+					for (uint32_t k = 0; k < postings[j].second; ++k) {
+						uint32_t gap = 0;
+						in = readVByte(in, gap);
+						position += gap;
+						if (newDocId != 0)
+							this->termPositions.append(termId, position);
+					}
+				}
 			}
 		}
 
-		std::cout << "All " << documentIndex << " documents processed." << std::endl;
+		return addedCount;
+	}
+
+	// Split the file into chunks that end right after a </DOC>, parse every chunk on its own thread into a partial index,
+	// then merge the partial indexes in file order. docIds are the same as parsing the whole file sequentially.
+	// return: the number of documents
+	uint32_t parseDocumentsInParallel() {
+		int fd = open(this->fileName.c_str(), O_RDONLY);
+		struct stat fileStat;
+		if (fd < 0 || fstat(fd, &fileStat) != 0) {
+			std::cout << "Can't open " << this->fileName << std::endl;
+			return 0;
+		}
+		size_t fileSize = fileStat.st_size;
+		const char* data = NULL;
+		if (fileSize > 0) {
+			data = (const char*)mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == (const char*)MAP_FAILED) {
+				close(fd);
+				std::cout << "Can't map " << this->fileName << std::endl;
+				return 0;
+			}
+			madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+		}
+		close(fd);
 
-		this->saveIndexToFiles();
+		// Chunk boundaries, each right after a </DOC>
+		const std::string endTag = "</DOC>";
+		std::vector<size_t> boundaries(1, 0);
+		for (uint32_t i = 1; i < this->options.threadCount; ++i) {
+			size_t target = std::max(fileSize / this->options.threadCount * i, boundaries.back());
+			const char* found = std::search(data + target, data + fileSize, endTag.begin(), endTag.end());
+			if (found == data + fileSize)
+				break;
+			boundaries.push_back(found - data + endTag.length());
+		}
+		boundaries.push_back(fileSize);
+
+		size_t chunkCount = boundaries.size() - 1;
+		std::vector<Indexer*> parts;
+		std::vector<uint32_t> documentCounts(chunkCount, 0);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < chunkCount; ++i) {
+			parts.push_back(new Indexer(this->fileName, this->options));
+			threads.push_back(std::thread(parseChunk, parts[i], data + boundaries[i], data + boundaries[i + 1], i > 0, &documentCounts[i]));
+		}
+
+		uint32_t documentCount = 0;
+		for (size_t i = 0; i < chunkCount; ++i) {
+			threads[i].join();
+			this->mergeFrom(*parts[i], documentCount);
+			delete parts[i];
+			documentCount += documentCounts[i];
+			std::cout << documentCount << " documents processed." << std::endl;
+		}
+
+		if (data != NULL)
+			munmap((void*)data, fileSize);
+		return documentCount;
+	}
+
+	static void parseChunk(Indexer* part, const char* begin, const char* end, bool startInContent, uint32_t* documentCount) {
+		MemoryStreamBuffer buffer(begin, end);
+		std::istream stream(&buffer);
+		*documentCount = part->parseDocuments(stream, startInContent, false);
+	}
+
+	// Return false if the index couldn't be saved
+	bool runIndexer() {
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		uint32_t documentCount = 0;
+		if (TokenStreamReader::isTokenStream(this->fileName)) {
+			// Already tokenized, read on one thread
+			TokenStreamReader reader;
+			if (reader.open(this->fileName))
+				documentCount = this->parseTokenStream(reader, true);
+			else
+				std::cout << "Can't read the token stream " << this->fileName << std::endl;
+		}
+		else if (this->options.threadCount > 1) {
+			documentCount = this->parseDocumentsInParallel();
+		}
+		else {
+			std::ifstream file(this->fileName);
+			documentCount = this->parseDocuments(file, false, true);
+		}
+
+		std::cout << "All " << documentCount << " documents processed." << std::endl;
+
+		std::chrono::steady_clock::time_point parsedTime = std::chrono::steady_clock::now();
+		uint32_t termCount = this->terms.size();
+		uint64_t dictionaryMemory = this->terms.memoryUsage();
+		uint64_t postingsMemory = this->termPostings.memoryUsage();
+		uint64_t postingsBlockCount = this->termPostings.getBlockCount();
+
+		if (this->options.documentOrder != DOC_ORDER_FILE)
+			this->reorderDocuments();
+		std::chrono::steady_clock::time_point saveStartTime = std::chrono::steady_clock::now();
+
+		bool saved = true;
+		if (this->options.useSegment)
+			saved = this->saveSegment();
+		else if (this->options.shardCount > 0)
+			saved = this->saveShards();
+		else if (this->options.useContainer) {
+			saved = this->saveIndexToContainer();
+			if (this->options.tierPostings > 0)
+				saved = saved && this->saveIndexToContainer(TIER1_FILE_NAME, NULL, 0, this->options.tierPostings);
+			else
+				unlink(TIER1_FILE_NAME); // A first tier of an older index.bin
+		}
+		else if (!this->runFileNames.empty()) {
+			this->flushRun(); // The rest of the postings
+			saved = this->mergeRunsToFiles();
+		}
+		else
+			saved = this->saveIndexToFiles();
+		if (!saved) {
+			std::cerr << "Can't write the index files, no index saved" << std::endl;
+			if (!this->options.useSegment && this->options.shardCount == 0)
+				this->removeIndexFiles();
+			return false;
+		}
+		if (!this->options.useContainer) {
+			// The search engine opens index.bin before the four index_*.bin files
+			unlink(INDEX_FILE_NAME); // Of an older index
+			unlink(TIER1_FILE_NAME);
+		}
+		if (!this->options.useSegment && this->options.shardCount == 0) {
+			// The search engine opens the segments before index.bin and the four files
+			size_t segmentCount = removeSegments();
+			if (segmentCount > 0)
+				std::cout << "Removed " << segmentCount << (segmentCount == 1 ? " segment" : " segments") << " of an older index" << std::endl;
+		}
+
+		if (this->options.saveStore) {
+			if (!this->documentStore.save(STORE_FILE_NAME)) {
+				std::cerr << "Can't write " << STORE_FILE_NAME << std::endl;
+				return false;
+			}
+			std::cout << "Document store: " << this->documentStore.getTextBytes() / (1024.0 * 1024.0) << " MB of text compressed to " 
+				<< this->documentStore.getCompressedBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+		}
+		else if (!this->options.useSegment && this->options.shardCount == 0)
+			unlink(STORE_FILE_NAME); // The store of an older index
 
 		std::cout << "Saved to index files." << std::endl;
+
+		// Memory and time report
+		std::chrono::steady_clock::time_point savedTime = std::chrono::steady_clock::now();
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		const double MB = 1024.0 * 1024.0;
+		std::cout << "Words in memory: " << termCount << ", dictionary: " << dictionaryMemory / MB << " MB, postings: " 
+			<< postingsMemory / MB << " MB in " << postingsBlockCount << " blocks" << std::endl;
+		std::cout << "Parse time: " << std::chrono::duration<double>(parsedTime - startTime).count() << " s, save time: " 
+			<< std::chrono::duration<double>(savedTime - saveStartTime).count() << " s, peak memory: " << usage.ru_maxrss / 1024.0 << " MB" << std::endl;
+		return true;
 	}
 };
 
+// Run the merge policy (see segments.h) until there's nothing left to merge. Only one process merges at a time.
+// The merged segments are read and written without holding the manifest lock, so segments can be added, searched and
+// have documents deleted meanwhile. Deletions made during a merge are carried over to the merged segment.
+void mergeSegments(bool verbose) {
+	SegmentLock mergeLock(SEGMENT_MERGE_LOCK_NAME, true, false);
+	if (!mergeLock.isLocked())
+		return; // Another process is merging, and will pick up the new segments too
+
+	while (true) {
+		std::vector<SegmentInfo> sources;
+		uint64_t segmentId = 0;
+		{
+			SegmentLock lock(SEGMENT_LOCK_NAME, true);
+			SegmentManifest manifest;
+			size_t first = 0;
+			size_t count = 0;
+			if (!manifest.load() || !TieredMergePolicy::selectMerge(manifest.segments, first, count))
+				return;
+			sources.assign(manifest.segments.begin() + first, manifest.segments.begin() + first + count);
+			segmentId = manifest.nextSegmentId++;
+			manifest.save();
+		}
+
+		// Open the sources and take a snapshot of their deleted documents
+		std::vector<IndexFile*> files;
+		std::vector<DeletedDocuments> deleted(sources.size());
+		IndexerOptions options;
+		options.useContainer = true;
+		options.savePositions = true;
+		for (size_t i = 0; i < sources.size(); ++i) {
+			files.push_back(new IndexFile());
+			if (!files[i]->open(getSegmentFileName(sources[i].segmentId))) {
+				std::cerr << "Can't open " << getSegmentFileName(sources[i].segmentId) << std::endl;
+				for (size_t j = 0; j <= i; ++j)
+					delete files[j];
+				return;
+			}
+			const IndexStats* stats = (const IndexStats*)files[i]->getSection(SECTION_STATS);
+			deleted[i].load(getDeletedDocumentsFileName(sources[i].segmentId), (uint32_t)stats->totalDocuments);
+			if (i == 0)
+				options.postingsFormat = (PostingsFormat)stats->postingsFormat;
+			if (files[i]->getSection(SECTION_POSITIONS) == NULL)
+				options.savePositions = false; // Only if every source has positions
+		}
+
+		Indexer merged("", options);
+		std::vector<std::vector<uint32_t> > docIdMaps(sources.size());
+		uint32_t documentCount = 0;
+		for (size_t i = 0; i < sources.size(); ++i) {
+			documentCount += merged.addSegment(*files[i], deleted[i], docIdMaps[i]);
+			delete files[i];
+		}
+		if (documentCount > 0 && !merged.saveIndexToContainer(getSegmentFileName(segmentId))) {
+			std::cerr << "Can't write " << getSegmentFileName(segmentId) << ", segments not merged" << std::endl;
+			return; // The sources stay in the manifest
+		}
+
+		SegmentLock lock(SEGMENT_LOCK_NAME, true);
+		SegmentManifest manifest;
+		manifest.load();
+		size_t first = manifest.find(sources[0].segmentId);
+
+		// Documents deleted during the merge
+		DeletedDocuments mergedDeleted;
+		mergedDeleted.load(getDeletedDocumentsFileName(segmentId), documentCount);
+		for (size_t i = 0; i < sources.size(); ++i) {
+			DeletedDocuments current;
+			current.load(getDeletedDocumentsFileName(sources[i].segmentId), (uint32_t)docIdMaps[i].size());
+			if (current.getCount() == deleted[i].getCount())
+				continue;
+			for (uint32_t docId = 1; docId <= docIdMaps[i].size(); ++docId) {
+				if (current.isDeleted(docId) && docIdMaps[i][docId - 1] != 0)
+					mergedDeleted.remove(docIdMaps[i][docId - 1]);
+			}
+		}
+		if (mergedDeleted.getCount() > 0)
+			mergedDeleted.save(getDeletedDocumentsFileName(segmentId));
+
+		manifest.segments.erase(manifest.segments.begin() + first, manifest.segments.begin() + first + sources.size());
+		if (documentCount > 0) {
+			SegmentInfo segment;
+			segment.segmentId = segmentId;
+			segment.documentCount = documentCount;
+			segment.deletedCount = mergedDeleted.getCount();
+			manifest.segments.insert(manifest.segments.begin() + first, segment);
+		}
+		manifest.save();
+
+		// Searchers open segments while holding the lock, and the ones already memory-mapped stay readable
+		for (size_t i = 0; i < sources.size(); ++i) {
+			unlink(getSegmentFileName(sources[i].segmentId).c_str());
+			unlink(getDeletedDocumentsFileName(sources[i].segmentId).c_str());
+		}
+
+		if (verbose) {
+			std::cout << (documentCount > 0 ? "Merged segments" : "Dropped segments");
+			for (size_t i = 0; i < sources.size(); ++i)
+				std::cout << " " << sources[i].segmentId;
+			if (documentCount > 0)
+				std::cout << " into segment " << segmentId << " (" << documentCount << " documents, " << manifest.segments.size() << " segments)" << std::endl;
+			else
+				std::cout << ", all their documents are deleted (" << manifest.segments.size() << " segments)" << std::endl;
+		}
+	}
+}
+
+// Run mergeSegments in a background process, so that the indexer returns right away
+void mergeSegmentsInBackground() {
+	std::cout << std::flush;
+	pid_t pid = fork();
+	if (pid == 0) {
+		pid_t grandchild = fork(); // The merging process is adopted by init, so it doesn't become a zombie
+		if (grandchild == 0) {
+			setsid();
+			mergeSegments(false);
+		}
+		_exit(0);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+// Mark the documents with these DOCNOs as deleted in every segment
+// return: the number of documents deleted
+uint32_t deleteDocuments(const std::vector<std::string>& docNos) {
+	SegmentLock lock(SEGMENT_LOCK_NAME, true);
+	SegmentManifest manifest;
+	if (!manifest.load()) {
+		std::cout << "No segments, add some with --segment" << std::endl;
+		return 0;
+	}
+
+	uint32_t deletedCount = 0;
+	for (size_t i = 0; i < manifest.segments.size(); ++i) {
+		SegmentInfo& segment = manifest.segments[i];
+		IndexFile file;
+		if (!file.open(getSegmentFileName(segment.segmentId)))
+			continue;
+		const uint64_t* docNoOffsets = (const uint64_t*)file.getSection(SECTION_DOCNO_OFFSETS);
+		const char* docNoStrings = (const char*)file.getSection(SECTION_DOCNO);
+
+		DeletedDocuments deleted;
+		deleted.load(getDeletedDocumentsFileName(segment.segmentId), segment.documentCount);
+		uint32_t segmentDeletedCount = 0;
+		for (uint32_t docId = 1; docId <= segment.documentCount; ++docId) {
+			const char* docNo = docNoStrings + docNoOffsets[docId - 1];
+			if (std::find(docNos.begin(), docNos.end(), docNo) != docNos.end() && deleted.remove(docId))
+				++segmentDeletedCount;
+		}
+		if (segmentDeletedCount > 0) {
+			deleted.save(getDeletedDocumentsFileName(segment.segmentId));
+			segment.deletedCount = deleted.getCount();
+			deletedCount += segmentDeletedCount;
+		}
+	}
+	manifest.save();
+	return deletedCount;
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 2) {
+	std::string fileName = "";
+	IndexerOptions options;
+	std::vector<std::string> deleteDocNos;
+	bool merge = false;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--postings=raw")
+			options.postingsFormat = POSTINGS_FORMAT_RAW;
+		else if (arg == "--postings=compressed")
+			options.postingsFormat = POSTINGS_FORMAT_COMPRESSED;
+		else if (arg == "--container")
+			options.useContainer = true;
+		else if (arg == "--impacts") {
+			options.saveImpacts = true;
+			options.useContainer = true;
+		}
+		else if (arg.compare(0, 12, "--quantized=") == 0) {
+			options.quantizedBits = (uint32_t)atoi(arg.c_str() + 12);
+			options.useContainer = true;
+		}
+		else if (arg == "--positions") {
+			options.savePositions = true;
+			options.useContainer = true;
+		}
+		else if (arg.compare(0, 10, "--threads=") == 0)
+			options.threadCount = std::max(1, atoi(arg.c_str() + 10));
+		else if (arg.compare(0, 9, "--memory=") == 0)
+			options.memoryBudget = (uint64_t)std::max(1, atoi(arg.c_str() + 9)) << 20;
+		else if (arg == "--segment") {
+			options.useSegment = true;
+			options.useContainer = true;
+		}
+		else if (arg.compare(0, 9, "--shards=") == 0) {
+			options.shardCount = (uint32_t)std::max(1, atoi(arg.c_str() + 9));
+			options.useContainer = true;
+		}
+		else if (arg.compare(0, 8, "--tier1=") == 0) {
+			options.tierPostings = (uint32_t)std::max(1, atoi(arg.c_str() + 8));
+			options.useContainer = true;
+		}
+		else if (arg == "--reorder=bp")
+			options.documentOrder = DOC_ORDER_BISECTION;
+		else if (arg == "--reorder=docno")
+			options.documentOrder = DOC_ORDER_DOCNO;
+		else if (arg == "--store")
+			options.saveStore = true;
+		else if (arg.compare(0, 9, "--delete=") == 0)
+			deleteDocNos.push_back(arg.substr(9));
+		else if (arg == "--merge")
+			merge = true;
+		else
+			fileName = arg;
+	}
+
+	// Segment maintenance without a file to index
+	if (fileName.length() == 0 && (!deleteDocNos.empty() || merge)) {
+		if (!deleteDocNos.empty())
+			std::cout << deleteDocuments(deleteDocNos) << " documents deleted." << std::endl;
+		if (merge)
+			mergeSegments(true);
+		else
+			mergeSegmentsInBackground();
+		return 0;
+	}
+
+	if (fileName.length() == 0) {
 		std::cout << "Usage: enter a parameter as the file to create index. Example: ./indexer wsj.xml" << std::endl;
+		std::cout << "       The file can also be a token stream of ./parser --tokens=FILE, indexed without parsing the XML again" << std::endl;
+		std::cout << "Options: --postings=raw (default) or --postings=compressed" << std::endl;
+		std::cout << "         --container: save a single index.bin instead of the four index_*.bin files" << std::endl;
+		std::cout << "         --impacts: also save impact-ordered postings for score-at-a-time queries (implies --container)" << std::endl;
+		std::cout << "         --quantized=8 or --quantized=16: also save every posting's BM25 score quantized to 8 or 16 bits, for quantized queries (implies --container)" << std::endl;
+		std::cout << "         --positions: also save word positions for phrase queries (implies --container)" << std::endl;
+		std::cout << "         --threads=N: parse the file with N threads" << std::endl;
+		std::cout << "         --memory=MB: flush the postings to sorted run files when they reach MB megabytes, then merge them" << std::endl;
+		std::cout << "         --segment: add the documents as a new segment of the index, then merge segments in the background" << std::endl;
+		std::cout << "         --delete=DOCNO: delete the documents with this DOCNO from the segments (without a file)" << std::endl;
+		std::cout << "         --merge: merge segments in the foreground (with --segment, or without a file)" << std::endl;
+		std::cout << "         --shards=N: save N document-partitioned shards index_shard_K.bin, searched with ./searchEngine --shards" << std::endl;
+		std::cout << "         --tier1=N: also save index_tier1.bin with the N best postings of every word, searched first (implies --container)" << std::endl;
+		std::cout << "         --reorder=bp or --reorder=docno: give the documents new docIds by graph bisection or by DOCNO before saving" << std::endl;
+		std::cout << "         --store: also save the compressed text of the documents to index_store.bin, for ./searchEngine --snippets" << std::endl;
 		return 0;
 	}
 
-	Indexer indexer(argv[1]);
-	indexer.runIndexer();
+	if (options.memoryBudget > 0 && (options.useContainer || options.threadCount > 1)) {
+		std::cout << "--memory can't be used with --container, --impacts, --positions, --threads, --segment or --shards" << std::endl;
+		return 0;
+	}
+
+	if (options.memoryBudget > 0 && options.documentOrder != DOC_ORDER_FILE) {
+		std::cout << "--reorder can't be used with --memory" << std::endl;
+		return 0;
+	}
+
+	if (options.useSegment && options.saveImpacts) {
+		std::cout << "--impacts can't be used with --segment" << std::endl;
+		return 0;
+	}
+
+	if (options.quantizedBits != 0 && options.quantizedBits != 8 && options.quantizedBits != 16) {
+		std::cout << "--quantized must be 8 or 16" << std::endl;
+		return 0;
+	}
+
+	if (options.useSegment && options.quantizedBits > 0) {
+		std::cout << "--quantized can't be used with --segment" << std::endl;
+		return 0;
+	}
+
+	if (options.useSegment && options.shardCount > 0) {
+		std::cout << "--shards can't be used with --segment" << std::endl;
+		return 0;
+	}
+
+	if (options.tierPostings > 0 && (options.useSegment || options.shardCount > 0)) {
+		std::cout << "--tier1 can't be used with --segment or --shards" << std::endl;
+		return 0;
+	}
+
+	if (options.saveStore && (options.useSegment || options.shardCount > 0)) {
+		std::cout << "--store can't be used with --segment or --shards" << std::endl;
+		return 0;
+	}
+
+	if (options.saveStore && TokenStreamReader::isTokenStream(fileName)) {
+		std::cout << "--store needs the XML file, a token stream doesn't have the text of the documents" << std::endl;
+		return 0;
+	}
+
+	Indexer indexer(fileName, options);
+	if (!indexer.runIndexer())
+		return 1;
+
+	if (options.useSegment) {
+		if (merge)
+			mergeSegments(true);
+		else
+			mergeSegmentsInBackground();
+	}
 
 	return 0;
 }
@@ -4,45 +4,19 @@
 #include <vector>
 #include <string>
 
-// Extract words from a text string
-std::vector<std::string> extractWords(const std::string& text) {
-	std::vector<std::string> words;
-
-	std::string word;
-	for (size_t i = 0; i < text.size(); ++i){
-		if (std::isalpha(text[i]))
-			word += std::tolower(text[i]);
-		else if (std::isdigit(text[i]))
-			word += text[i];
-		// else if (text[i] == '-') { // Some words have '-', such as "well-being"
-		// 	if (i > 0 && std::isalnum(text[i - 1])) { // Ignore words starting with '-'
-		// 		word += text[i];
-		// 	}
-		// }
-		else {
-			if (word.length() > 0) {
-				if (word.length() > 255) { // Length is stored in uint8_t, so truncate the word if its length > 255
-					word = word.substr(0, 255);
-				}
-				words.push_back(word);
-			}
-			word = "";
-		}
-	}
-	if (word.length() > 0)
-		words.push_back(word);
-
-	return words;
-}
+#include "tokenizer.h"
+#include "tokenStream.h"
 
 class Parser {
 
 private:
 	std::string fileName;
+	TokenStreamWriter* tokenWriter; // Write a binary token stream (see tokenStream.h) instead of a word per line, or NULL
 
 public:
-	Parser(std::string fileName) {
+	Parser(std::string fileName, TokenStreamWriter* tokenWriter = NULL) {
 		this->fileName = fileName;
+		this->tokenWriter = tokenWriter;
 	}
 
 	void runParser() {
@@ -68,21 +42,25 @@ public:
 				// Start of a tag
 				if (line[i] == '<') {
 					if (readingContent) {
-						std::string content = line.substr(readStartIndex, i - readStartIndex);
-						currentText += content;
+						currentText.append(line, readStartIndex, i - readStartIndex);
 
 						// Extract and print all the words
-						std::vector<std::string> words = extractWords(currentText);
-
-						if (currentTagName == "DOCNO") { // the '<' of </DOCNO>, the close tag of a document no.
-							currentDocNo = words[0];
-							// Save the currentDocNo
-						}
+						Tokenizer tokenizer(&currentText[0], currentText.length());
+						std::string_view word;
+						bool isFirstWord = true;
+						while (tokenizer.next(word)) {
+							if (isFirstWord && currentTagName == "DOCNO") { // the '<' of </DOCNO>, the close tag of a document no.
+								currentDocNo.assign(word.data(), word.length());
+								// Save the currentDocNo
+								if (this->tokenWriter != NULL)
+									this->tokenWriter->setDocNo(word);
+							}
+							isFirstWord = false;
 
-						// Output the words
-						for (size_t wordIndex = 0; wordIndex < words.size(); ++wordIndex) {
-							std::string word = words[wordIndex];
-							std::cout << word << std::endl; // output each word as a line
+							if (this->tokenWriter != NULL)
+								this->tokenWriter->addToken(word);
+							else
+								std::cout << word << '\n'; // output each word as a line
 						}
 
 						readingContent = false;
@@ -98,18 +76,21 @@ public:
 				// End of a tag
 				if (line[i] == '>') {
 					if (readingTag) {
-						std::string tagName = line.substr(readStartIndex, i - readStartIndex);
-						if (tagName[0] != '/') { // It's an open tag. e.g. <DOC>
-							currentTagName = tagName;
+						std::string_view tagName(line.data() + readStartIndex, i - readStartIndex);
+						if (tagName.empty() || tagName[0] != '/') { // It's an open tag. e.g. <DOC>
+							currentTagName.assign(tagName.data(), tagName.length());
 						}
 						else { // It's a close tag. e.g. </DOC>
 
 							// Reach the end of a document
 							if (tagName == "/DOC") { 
-								currentDocNo = "";
+								currentDocNo.clear();
 
 								// Output an blank line between documents
-								std::cout << std::endl; 
+								if (this->tokenWriter != NULL)
+									this->tokenWriter->endDocument();
+								else
+									std::cout << '\n'; 
 
 								// if (documentIndex % 1000 == 0) 
 								// {
@@ -118,8 +99,8 @@ public:
 								// ++documentIndex;
 							}
 
-							currentTagName = "";
-							currentText = "";
+							currentTagName.clear();
+							currentText.clear();
 						}
 						
 						readingTag = false;
@@ -135,8 +116,8 @@ public:
 
 			// Add the rest of the line to currentText
 			if (readingContent) {
-				std::string content = line.substr(readStartIndex, line.length() - readStartIndex);
-				currentText += content + "\n";
+				currentText.append(line, readStartIndex, line.length() - readStartIndex);
+				currentText += '\n';
 			}
 		}
 
@@ -146,13 +127,40 @@ public:
 };
 
 int main(int argc, char* argv[]) {
-	if (argc != 2) {
+	std::string fileName = "";
+	std::string tokensFileName = "";
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 9, "--tokens=") == 0)
+			tokensFileName = arg.substr(9);
+		else
+			fileName = arg;
+	}
+
+	if (fileName.length() == 0) {
 		std::cout << "Usage: enter a parameter as the file to parse. Example: ./parser wsj.xml" << std::endl;
+		std::cout << "Options: --tokens=FILE: write a binary token stream to FILE instead of a word per line, indexed with ./indexer FILE" << std::endl;
+		return 0;
+	}
+
+	if (tokensFileName.length() == 0) {
+		Parser parser(fileName);
+		parser.runParser();
 		return 0;
 	}
 
-	Parser parser(argv[1]);
+	TokenStreamWriter tokenWriter(tokensFileName);
+	if (!tokenWriter.isOpen()) {
+		std::cout << "Can't create " << tokensFileName << std::endl;
+		return 1;
+	}
+	Parser parser(fileName, &tokenWriter);
 	parser.runParser();
+	if (!tokenWriter.close()) {
+		std::cout << "Can't write " << tokensFileName << std::endl;
+		return 1;
+	}
+	std::cout << "Token stream saved to " << tokensFileName << ", " << tokenWriter.getBytesWritten() << " bytes" << std::endl;
 
 	return 0;
 }
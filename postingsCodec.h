@@ -0,0 +1,240 @@
+#ifndef POSTINGS_CODEC_H
+#define POSTINGS_CODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#define POSTINGS_CODEC_SSE2
+#endif
+
+// Compressed postings format for index_wordPostings.bin
+//
+// File: 4 byte magic (COMPRESSED_POSTINGS_MAGIC) + the postings of every word.
+// The pos stored in index_words.bin is the byte offset of the word's postings in this file.
+//
+// Postings of a word: 4 byte byteLength + blocks
+// -- Every full block of 128 postings: bitsDocGap(1 byte), bitsTf(1 byte), packed docId gaps (bitsDocGap * 16 bytes), packed tf (bitsTf * 16 bytes)
+// -- The rest (< 128 postings): variable byte (docId gap, tf) pairs
+// docId gaps are stored as (docId - previous docId - 1) and tf as (tf - 1), since docIds are increasing and tf >= 1.
+//
+// The 128 values of a block are packed like SIMD-BP128: 4 interleaved lanes of 32 values, so that
+// one 128-bit load gives the next 32-bit word of all 4 lanes, and SSE2 shifts decode 4 values at a time.
+
+const uint32_t POSTINGS_BLOCK_SIZE = 128;
+const uint32_t COMPRESSED_POSTINGS_MAGIC = 0x31435042; // "BPC1" in little-endian
+
+enum PostingsFormat {
+	POSTINGS_FORMAT_RAW = 0, // (docId, tf) each in 4 bytes
+	POSTINGS_FORMAT_COMPRESSED = 1 // delta-gap + bit-packing, described above
+};
+
+// How many bits are needed to store the value. e.g. 0 -> 0, 1 -> 1, 5 -> 3
+inline uint32_t bitsNeeded(uint32_t value) {
+	return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+inline uint32_t maxBitsNeeded(const uint32_t* values, uint32_t count) {
+	uint32_t orValue = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		orValue |= values[i];
+	return bitsNeeded(orValue);
+}
+
+// Pack 128 values with `bits` bits each. Writes bits * 16 bytes to out.
+inline void packBlock(const uint32_t* values, uint32_t bits, uint8_t* out) {
+	uint32_t words[POSTINGS_BLOCK_SIZE]; // 4 lanes * 32 words at most
+	memset(words, 0, sizeof(words));
+
+	for (uint32_t lane = 0; lane < 4; ++lane) {
+		for (uint32_t j = 0; j < 32; ++j) {
+			uint32_t value = values[j * 4 + lane];
+			uint32_t bitPos = j * bits;
+			uint32_t wordIndex = bitPos >> 5;
+			uint32_t shift = bitPos & 31;
+
+			words[wordIndex * 4 + lane] |= value << shift;
+			if (shift + bits > 32) // The value crosses two words
+				words[(wordIndex + 1) * 4 + lane] |= value >> (32 - shift);
+		}
+	}
+
+	memcpy(out, words, bits * 16);
+}
+
+// Unpack 128 values with `bits` bits each (reverse of packBlock)
+inline void unpackBlock(const uint8_t* in, uint32_t bits, uint32_t* values) {
+	if (bits == 0) {
+		memset(values, 0, POSTINGS_BLOCK_SIZE * 4);
+		return;
+	}
+	uint32_t mask = bits == 32 ? 0xFFFFFFFF : (1u << bits) - 1;
+
+#ifdef POSTINGS_CODEC_SSE2
+	const __m128i* words = reinterpret_cast<const __m128i*>(in);
+	__m128i maskVector = _mm_set1_epi32((int)mask);
+	for (uint32_t j = 0; j < 32; ++j) {
+		uint32_t bitPos = j * bits;
+		uint32_t wordIndex = bitPos >> 5;
+		uint32_t shift = bitPos & 31;
+
+		__m128i value = _mm_srl_epi32(_mm_loadu_si128(words + wordIndex), _mm_cvtsi32_si128(shift));
+		if (shift + bits > 32)
+			value = _mm_or_si128(value, _mm_sll_epi32(_mm_loadu_si128(words + wordIndex + 1), _mm_cvtsi32_si128(32 - shift)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(values + j * 4), _mm_and_si128(value, maskVector));
+	}
+#else
+	uint32_t words[POSTINGS_BLOCK_SIZE];
+	memcpy(words, in, bits * 16);
+	for (uint32_t j = 0; j < 32; ++j) {
+		uint32_t bitPos = j * bits;
+		uint32_t wordIndex = bitPos >> 5;
+		uint32_t shift = bitPos & 31;
+
+		for (uint32_t lane = 0; lane < 4; ++lane) {
+			uint32_t value = words[wordIndex * 4 + lane] >> shift;
+			if (shift + bits > 32)
+				value |= words[(wordIndex + 1) * 4 + lane] << (32 - shift);
+			values[j * 4 + lane] = value & mask;
+		}
+	}
+#endif
+}
+
+// Turn 128 stored gaps (docId - previous docId - 1) back to docIds, in place
+inline void gapsToDocIds(uint32_t* values, uint32_t previousDocId) {
+#ifdef POSTINGS_CODEC_SSE2
+	__m128i ones = _mm_set1_epi32(1);
+	__m128i previous = _mm_set1_epi32((int)previousDocId);
+	for (uint32_t i = 0; i < POSTINGS_BLOCK_SIZE; i += 4) {
+		__m128i v = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)), ones);
+		// Prefix sum of 4 lanes
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, previous);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), v);
+		previous = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)); // Broadcast the last docId
+	}
+#else
+	for (uint32_t i = 0; i < POSTINGS_BLOCK_SIZE; ++i) {
+		previousDocId += values[i] + 1;
+		values[i] = previousDocId;
+	}
+#endif
+}
+
+inline void writeVByte(uint32_t value, std::vector<uint8_t>& out) {
+	while (value >= 0x80) {
+		out.push_back((uint8_t)(value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+inline const uint8_t* readVByte(const uint8_t* in, uint32_t& value) {
+	value = 0;
+	uint32_t shift = 0;
+	while (*in & 0x80) {
+		value |= (uint32_t)(*in & 0x7F) << shift;
+		shift += 7;
+		++in;
+	}
+	value |= (uint32_t)(*in) << shift;
+	return in + 1;
+}
+
+// Encode the postings of a word and append to out (without the 4 byte byteLength)
+// postings: [(docId1, tf1), (docId2, tf2), ...] sorted by docId
+inline void encodePostings(const std::vector<std::pair<uint32_t, uint32_t> >& postings, std::vector<uint8_t>& out) {
+	uint32_t gaps[POSTINGS_BLOCK_SIZE];
+	uint32_t tfs[POSTINGS_BLOCK_SIZE];
+
+	uint32_t previousDocId = 0;
+	size_t i = 0;
+	for (; i + POSTINGS_BLOCK_SIZE <= postings.size(); i += POSTINGS_BLOCK_SIZE) {
+		for (uint32_t j = 0; j < POSTINGS_BLOCK_SIZE; ++j) {
+			gaps[j] = postings[i + j].first - previousDocId - 1;
+			tfs[j] = postings[i + j].second - 1;
+			previousDocId = postings[i + j].first;
+		}
+
+		uint32_t bitsDocGap = maxBitsNeeded(gaps, POSTINGS_BLOCK_SIZE);
+		uint32_t bitsTf = maxBitsNeeded(tfs, POSTINGS_BLOCK_SIZE);
+		out.push_back((uint8_t)bitsDocGap);
+		out.push_back((uint8_t)bitsTf);
+
+		size_t start = out.size();
+		out.resize(start + (bitsDocGap + bitsTf) * 16);
+		packBlock(gaps, bitsDocGap, &out[start]);
+		packBlock(tfs, bitsTf, &out[start + bitsDocGap * 16]);
+	}
+
+	for (; i < postings.size(); ++i) {
+		writeVByte(postings[i].first - previousDocId - 1, out);
+		writeVByte(postings[i].second - 1, out);
+		previousDocId = postings[i].first;
+	}
+}
+
+// Decode a full block of 128 postings, return the pointer to the next block
+// previousDocId: the last docId of the previous block, or 0 for the first block
+inline const uint8_t* decodeBlock(const uint8_t* in, uint32_t previousDocId, uint32_t* docIds, uint32_t* tfs) {
+	uint32_t bitsDocGap = in[0];
+	uint32_t bitsTf = in[1];
+	in += 2;
+
+	unpackBlock(in, bitsDocGap, docIds);
+	in += bitsDocGap * 16;
+	unpackBlock(in, bitsTf, tfs);
+	in += bitsTf * 16;
+
+	gapsToDocIds(docIds, previousDocId);
+	for (uint32_t j = 0; j < POSTINGS_BLOCK_SIZE; ++j)
+		tfs[j] += 1;
+	return in;
+}
+
+// Skip a full block without decoding it, return the pointer to the next block
+inline const uint8_t* skipBlock(const uint8_t* in) {
+	return in + 2 + ((uint32_t)in[0] + in[1]) * 16;
+}
+
+// Decode the variable byte postings after the last full block (count < 128)
+inline const uint8_t* decodeTail(const uint8_t* in, uint32_t count, uint32_t previousDocId, uint32_t* docIds, uint32_t* tfs) {
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t gap = 0;
+		uint32_t tf = 0;
+		in = readVByte(in, gap);
+		in = readVByte(in, tf);
+		previousDocId += gap + 1;
+		docIds[i] = previousDocId;
+		tfs[i] = tf + 1;
+	}
+	return in;
+}
+
+// Decode docCount postings encoded by encodePostings, append to postings
+inline void decodePostings(const uint8_t* in, uint32_t docCount, std::vector<std::pair<uint32_t, uint32_t> >& postings) {
+	uint32_t docIds[POSTINGS_BLOCK_SIZE];
+	uint32_t tfs[POSTINGS_BLOCK_SIZE];
+
+	postings.reserve(postings.size() + docCount);
+
+	uint32_t previousDocId = 0;
+	for (uint32_t i = 0; i < docCount; i += POSTINGS_BLOCK_SIZE) {
+		uint32_t count = std::min(docCount - i, POSTINGS_BLOCK_SIZE);
+		if (count == POSTINGS_BLOCK_SIZE)
+			in = decodeBlock(in, previousDocId, docIds, tfs);
+		else
+			in = decodeTail(in, count, previousDocId, docIds, tfs);
+		previousDocId = docIds[count - 1];
+
+		for (uint32_t j = 0; j < count; ++j)
+			postings.push_back(std::pair<uint32_t, uint32_t>(docIds[j], tfs[j]));
+	}
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef POSTINGS_CURSOR_H
+#define POSTINGS_CURSOR_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "postingsCodec.h"
+#include "indexFile.h"
+
+const uint32_t END_DOC_ID = 0xFFFFFFFF; // docId of a cursor after its last posting
+
+// Index of the first value >= target in values[start, size), or size if none. values are increasing docIds (< 2^31).
+inline uint32_t findGEQ(const uint32_t* values, uint32_t start, uint32_t size, uint32_t target) {
+	uint32_t i = start;
+#ifdef POSTINGS_CODEC_SSE2
+	// Compare 4 docIds at a time, the first one that isn't < target is the answer
+	__m128i targetVector = _mm_set1_epi32((int)target);
+	for (; i + 4 <= size; i += 4) {
+		__m128i less = _mm_cmplt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)), targetVector);
+		uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(less));
+		if (mask != 0xF)
+			return i + __builtin_ctz(~mask);
+	}
+#endif
+	while (i < size && values[i] < target)
+		++i;
+	return i;
+}
+
+// Walks through the postings of a word in index.bin (raw or compressed), one block of 128 postings at a time.
+// Blocks are only decoded when a posting in them is needed, and nextGEQ() jumps over blocks using their
+// last docIds, so compressed blocks that are skipped are never unpacked.
+class PostingsCursor {
+
+private:
+	PostingsFormat format;
+	const uint8_t* data; // Start of the word's postings (after the byteLength for compressed)
+	uint32_t docCount;
+	const BlockMaxEntry* blocks;
+	uint32_t blockCount;
+
+	uint32_t blockIndex; // Current block
+	const uint8_t* blockData; // Start of the current block (compressed)
+	bool blockDecoded;
+	uint32_t blockSize; // Number of postings in the current block
+	uint32_t position; // Position in the current block
+	uint32_t currentDocId;
+
+	uint32_t shallowBlockIndex; // Block used for the block-max score, moved without decoding
+	float blockScoreScale; // The block maximum scores are multiplied by this
+
+	uint32_t docIds[POSTINGS_BLOCK_SIZE];
+	uint32_t tfs[POSTINGS_BLOCK_SIZE];
+
+	// Move to a later block (without decoding it)
+	void moveToBlock(uint32_t newBlockIndex) {
+		if (this->format == POSTINGS_FORMAT_COMPRESSED) {
+			// Full blocks know their own size, so skipping is just pointer arithmetic.
+			// Only the last block can be a variable byte tail, and it's never skipped over.
+			while (this->blockIndex < newBlockIndex && this->blockIndex + 1 < this->blockCount) {
+				this->blockData = skipBlock(this->blockData);
+				++this->blockIndex;
+			}
+		}
+		this->blockIndex = newBlockIndex;
+		this->blockDecoded = false;
+		this->position = 0;
+	}
+
+	void decodeCurrentBlock() {
+		uint32_t start = this->blockIndex * POSTINGS_BLOCK_SIZE;
+		this->blockSize = std::min(this->docCount - start, POSTINGS_BLOCK_SIZE);
+		uint32_t previousDocId = this->blockIndex == 0 ? 0 : this->blocks[this->blockIndex - 1].lastDocId;
+
+		if (this->format == POSTINGS_FORMAT_COMPRESSED) {
+			const uint8_t* blockEnd = NULL;
+			if (this->blockSize == POSTINGS_BLOCK_SIZE)
+				blockEnd = decodeBlock(this->blockData, previousDocId, this->docIds, this->tfs);
+			else
+				blockEnd = decodeTail(this->blockData, this->blockSize, previousDocId, this->docIds, this->tfs);
+			this->decodedBytes += blockEnd - this->blockData;
+		}
+		else {
+			const uint32_t* values = (const uint32_t*)this->data + (uint64_t)start * 2;
+			for (uint32_t i = 0; i < this->blockSize; ++i) {
+				this->docIds[i] = values[i * 2];
+				this->tfs[i] = values[i * 2 + 1];
+			}
+			this->decodedBytes += this->blockSize * 8;
+		}
+		this->decodedPostings += this->blockSize;
+		this->blockDecoded = true;
+	}
+
+	void updateCurrentDocId() {
+		if (this->blockIndex >= this->blockCount) {
+			this->currentDocId = END_DOC_ID;
+			return;
+		}
+		if (!this->blockDecoded)
+			this->decodeCurrentBlock();
+		this->currentDocId = this->docIds[this->position];
+	}
+
+public:
+	float idf;
+	float maxScore; // Maximum score of the word in any document
+	uint64_t decodedPostings; // Postings in the blocks decoded so far, for the query trace
+	uint64_t decodedBytes; // Bytes of those blocks
+
+	PostingsCursor() {
+		this->docCount = 0;
+		this->blockCount = 0;
+		this->currentDocId = END_DOC_ID;
+	}
+
+	// postings: start of the word's postings in the postings section of index.bin
+	// blockScoreScale: for block maximum scores stored without the idf (e.g. 1 for the scores of index.bin, idf for bounds without it)
+	void init(PostingsFormat format, const uint8_t* postings, uint32_t docCount, const BlockMaxEntry* blocks, float idf, float maxScore, 
+		float blockScoreScale = 1) 
+	{
+		this->format = format;
+		this->data = format == POSTINGS_FORMAT_COMPRESSED ? postings + 4 : postings; // + 4 to skip the byteLength
+		this->docCount = docCount;
+		this->blocks = blocks;
+		this->blockCount = (docCount + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE;
+		this->idf = idf;
+		this->maxScore = maxScore;
+		this->blockScoreScale = blockScoreScale;
+
+		this->blockIndex = 0;
+		this->blockData = this->data;
+		this->blockDecoded = false;
+		this->position = 0;
+		this->shallowBlockIndex = 0;
+		this->decodedPostings = 0;
+		this->decodedBytes = 0;
+		this->updateCurrentDocId();
+	}
+
+	uint32_t docId() const {
+		return this->currentDocId;
+	}
+
+	uint32_t tf() const {
+		return this->tfs[this->position];
+	}
+
+	uint32_t size() const {
+		return this->docCount;
+	}
+
+	void next() {
+		++this->position;
+		if (this->position == this->blockSize)
+			this->moveToBlock(this->blockIndex + 1);
+		this->updateCurrentDocId();
+	}
+
+	// Move to the first posting with docId >= target
+	void nextGEQ(uint32_t target) {
+		if (target <= this->currentDocId)
+			return;
+
+		// The last docIds of the blocks are skip pointers: gallop over them (1, 2, 4, ... blocks ahead),
+		// then binary search, to find the first block whose last docId >= target
+		if (this->blocks[this->blockIndex].lastDocId < target) {
+			uint32_t low = this->blockIndex; // blocks[low].lastDocId < target
+			uint32_t step = 1;
+			uint32_t high = low + 1;
+			while (high < this->blockCount && this->blocks[high].lastDocId < target) {
+				low = high;
+				step *= 2;
+				high = low + step;
+			}
+			high = std::min(high, this->blockCount); // blocks[high].lastDocId >= target, or no such block
+			while (low + 1 < high) {
+				uint32_t middle = low + (high - low) / 2;
+				if (this->blocks[middle].lastDocId < target)
+					low = middle;
+				else
+					high = middle;
+			}
+			this->moveToBlock(high);
+		}
+
+		if (this->blockIndex >= this->blockCount) {
+			this->currentDocId = END_DOC_ID;
+			return;
+		}
+		if (!this->blockDecoded)
+			this->decodeCurrentBlock();
+
+		// The target is in this block, since its last docId >= target
+		this->position = findGEQ(this->docIds, this->position, this->blockSize, target);
+		this->currentDocId = this->docIds[this->position];
+	}
+
+	// Positions of the current posting (see SECTION_POSITIONS in indexFile.h)
+	// positionsData: the positions section, positionBlocks: the word's first block offset in SECTION_POSITION_BLOCKS
+	void getPositions(const uint8_t* positionsData, const uint64_t* positionBlocks, std::vector<uint32_t>& positions) {
+		const uint8_t* in = positionsData + positionBlocks[this->blockIndex];
+
+		// Skip the positions of the postings before this one in the block: one variable byte value ends at every byte < 0x80
+		uint32_t skipCount = 0;
+		for (uint32_t i = 0; i < this->position; ++i)
+			skipCount += this->tfs[i];
+		while (skipCount > 0) {
+			if (*in < 0x80)
+				--skipCount;
+			++in;
+		}
+
+		positions.clear();
+		uint32_t position = 0;
+		for (uint32_t i = 0; i < this->tfs[this->position]; ++i) {
+			uint32_t gap = 0;
+			in = readVByte(in, gap);
+			position += gap;
+			positions.push_back(position);
+		}
+	}
+
+	// Maximum score of the block that would contain target, without moving the cursor or decoding anything
+	// Return 0 if target is after the last posting
+	float blockMaxScore(uint32_t target) {
+		while (this->shallowBlockIndex > 0 && this->blocks[this->shallowBlockIndex - 1].lastDocId >= target)
+			--this->shallowBlockIndex;
+		while (this->shallowBlockIndex < this->blockCount && this->blocks[this->shallowBlockIndex].lastDocId < target)
+			++this->shallowBlockIndex;
+		if (this->shallowBlockIndex >= this->blockCount)
+			return 0;
+		return this->blocks[this->shallowBlockIndex].maxScore * this->blockScoreScale;
+	}
+
+	// Last docId of the block used by the latest blockMaxScore()
+	uint32_t blockLastDocId() const {
+		if (this->shallowBlockIndex >= this->blockCount)
+			return END_DOC_ID;
+		return this->blocks[this->shallowBlockIndex].lastDocId;
+	}
+};
+
+#endif
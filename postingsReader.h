@@ -0,0 +1,330 @@
+#ifndef POSTINGS_READER_H
+#define POSTINGS_READER_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Batched reads of many ranges of one file, e.g. the postings of all the words of a query.
+//
+// All the reads are issued up front, and completed reads are returned one at a time as they arrive, so the caller can
+// decode a postings list while the others are still being read. On a cold page cache, the latency of a query is then
+// about the latency of its slowest read instead of the sum of all of them.
+// Ranges already in the page cache are read at once with preadv2(RWF_NOWAIT), which fails instead of waiting for the disk,
+// so a query on a hot index makes one system call per range, like plain pread; only the other ranges are read in the background:
+// -- io_uring (Linux 5.6+): every range is one IORING_OP_READ, submitted together with a single system call. Used with the
+//    kernel's own interface (<linux/io_uring.h> and raw system calls), there's no dependency on liburing.
+// -- Otherwise (other systems, older kernels, io_uring disabled by a sandbox, or built with -DNO_IO_URING): posix_fadvise
+//    WILLNEED starts the reads of all the ranges in the background, then each range is read with pread in order.
+//
+// A BatchReader is used by one thread at a time; every query thread has its own (see QueryContext).
+
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#endif
+#endif
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+const uint32_t BATCH_READER_QUEUE_DEPTH = 32; // Reads in flight at the same time
+
+// A range of the file to read into buffer
+struct ReadRequest {
+	uint64_t offset;
+	uint32_t size;
+	uint8_t* buffer;
+	bool succeeded; // Set when the request is returned by BatchReader::next()
+};
+
+class BatchReader {
+
+private:
+	int fd;
+	std::vector<ReadRequest>* requests;
+	std::vector<size_t> pending; // Indexes of the requests that weren't in the page cache
+	size_t submitted; // Pending requests handed to the kernel (or read, without io_uring)
+	size_t returned; // Requests returned by next()
+	std::deque<size_t> completed; // Indexes of completed requests, not returned yet
+
+#ifdef USE_IO_URING
+	int ringFd; // -1 if io_uring isn't available
+	bool ringChecked; // Setting up io_uring was tried
+	void* submissionRing;
+	size_t submissionRingSize;
+	void* completionRing;
+	size_t completionRingSize;
+	io_uring_sqe* submissionEntries;
+	size_t submissionEntriesSize;
+	uint32_t* submissionTail;
+	uint32_t submissionMask;
+	uint32_t* submissionArray;
+	uint32_t* completionHead;
+	uint32_t* completionTail;
+	uint32_t completionMask;
+	io_uring_cqe* completionEntries;
+	uint32_t inFlight;
+	std::vector<bool> reaped; // Request index -> its completion was taken from the ring
+
+	// Map the rings of a new io_uring instance, return false if the kernel doesn't allow it
+	bool setupRing() {
+		this->ringChecked = true;
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int ringFd = (int)syscall(__NR_io_uring_setup, BATCH_READER_QUEUE_DEPTH, &params);
+		if (ringFd < 0)
+			return false;
+
+		this->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		this->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			this->submissionRingSize = std::max(this->submissionRingSize, this->completionRingSize);
+			this->completionRingSize = this->submissionRingSize;
+		}
+		this->submissionRing = mmap(NULL, this->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if (this->submissionRing == MAP_FAILED) {
+			close(ringFd);
+			return false;
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			this->completionRing = this->submissionRing;
+		else
+			this->completionRing = mmap(NULL, this->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		this->submissionEntriesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void* entries = this->completionRing == MAP_FAILED ? MAP_FAILED
+			: mmap(NULL, this->submissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if (entries == MAP_FAILED) {
+			if (this->completionRing != MAP_FAILED && this->completionRing != this->submissionRing)
+				munmap(this->completionRing, this->completionRingSize);
+			munmap(this->submissionRing, this->submissionRingSize);
+			close(ringFd);
+			return false;
+		}
+
+		uint8_t* submission = (uint8_t*)this->submissionRing;
+		uint8_t* completion = (uint8_t*)this->completionRing;
+		this->submissionEntries = (io_uring_sqe*)entries;
+		this->submissionTail = (uint32_t*)(submission + params.sq_off.tail);
+		this->submissionMask = *(uint32_t*)(submission + params.sq_off.ring_mask);
+		this->submissionArray = (uint32_t*)(submission + params.sq_off.array);
+		this->completionHead = (uint32_t*)(completion + params.cq_off.head);
+		this->completionTail = (uint32_t*)(completion + params.cq_off.tail);
+		this->completionMask = *(uint32_t*)(completion + params.cq_off.ring_mask);
+		this->completionEntries = (io_uring_cqe*)(completion + params.cq_off.cqes);
+		this->ringFd = ringFd;
+		return true;
+	}
+
+	// Queue reads until the ring is full, then submit them and wait for at least waitCount completions
+	// return false if io_uring_enter fails
+	bool submitAndWait(uint32_t waitCount) {
+		uint32_t queued = 0;
+		uint32_t tail = *this->submissionTail; // Only this thread writes the tail
+		while (this->submitted < this->pending.size() && this->inFlight + queued < BATCH_READER_QUEUE_DEPTH) {
+			const ReadRequest& request = (*this->requests)[this->pending[this->submitted]];
+			uint32_t index = tail & this->submissionMask;
+			io_uring_sqe& entry = this->submissionEntries[index];
+			memset(&entry, 0, sizeof(entry));
+			entry.opcode = IORING_OP_READ;
+			entry.fd = this->fd;
+			entry.off = request.offset;
+			entry.addr = (uint64_t)(uintptr_t)request.buffer;
+			entry.len = request.size;
+			entry.user_data = this->pending[this->submitted];
+			this->submissionArray[index] = index;
+			++tail;
+			++queued;
+			++this->submitted;
+		}
+		__atomic_store_n(this->submissionTail, tail, __ATOMIC_RELEASE);
+		this->inFlight += queued;
+
+		int result = 0;
+		do {
+			result = (int)syscall(__NR_io_uring_enter, this->ringFd, queued, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		} while (result < 0 && errno == EINTR);
+		return result >= 0;
+	}
+
+	// Move the completions from the ring to this->completed. A read that failed or returned fewer bytes
+	// (e.g. an opcode the kernel doesn't know) is finished with pread.
+	void reapCompletions() {
+		uint32_t head = *this->completionHead;
+		uint32_t tail = __atomic_load_n(this->completionTail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			const io_uring_cqe& entry = this->completionEntries[head & this->completionMask];
+			size_t index = (size_t)entry.user_data;
+			ReadRequest& request = (*this->requests)[index];
+			uint32_t bytesRead = entry.res > 0 ? (uint32_t)entry.res : 0;
+			request.succeeded = bytesRead == request.size
+				|| readFully(this->fd, request.buffer + bytesRead, request.size - bytesRead, request.offset + bytesRead);
+			this->reaped[index] = true;
+			this->completed.push_back(index);
+			--this->inFlight;
+			++head;
+		}
+		__atomic_store_n(this->completionHead, head, __ATOMIC_RELEASE);
+	}
+
+	void closeRing() {
+		munmap(this->submissionEntries, this->submissionEntriesSize);
+		if (this->completionRing != this->submissionRing)
+			munmap(this->completionRing, this->completionRingSize);
+		munmap(this->submissionRing, this->submissionRingSize);
+		close(this->ringFd);
+		this->ringFd = -1;
+	}
+
+	// io_uring_enter failed: stop using io_uring and read everything that hasn't completed with pread.
+	// Closing the ring cancels the reads still in flight.
+	void abandonRing() {
+		this->reapCompletions();
+		this->closeRing();
+		for (size_t i = 0; i < this->pending.size(); ++i) {
+			if (this->reaped[this->pending[i]])
+				continue;
+			ReadRequest& request = (*this->requests)[this->pending[i]];
+			request.succeeded = readFully(this->fd, request.buffer, request.size, request.offset);
+			this->completed.push_back(this->pending[i]);
+		}
+		this->submitted = this->pending.size();
+		this->inFlight = 0;
+	}
+#endif
+
+public:
+	BatchReader() {
+		this->fd = -1;
+		this->requests = NULL;
+		this->submitted = 0;
+		this->returned = 0;
+#ifdef USE_IO_URING
+		this->ringFd = -1;
+		this->ringChecked = false;
+		this->inFlight = 0;
+#endif
+	}
+
+	~BatchReader() {
+#ifdef USE_IO_URING
+		if (this->ringFd >= 0)
+			this->closeRing();
+#endif
+	}
+
+	BatchReader(const BatchReader&) = delete;
+	BatchReader& operator=(const BatchReader&) = delete;
+
+	// Read size bytes at offset, return false if the file is shorter
+	static bool readFully(int fd, uint8_t* buffer, size_t size, uint64_t offset) {
+		while (size > 0) {
+			ssize_t bytesRead = pread(fd, buffer, size, (off_t)offset);
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+			if (bytesRead <= 0)
+				return false;
+			buffer += bytesRead;
+			size -= bytesRead;
+			offset += bytesRead;
+		}
+		return true;
+	}
+
+	// Read the whole range if it's in the page cache, without waiting for the disk
+	static bool readCached(int fd, uint8_t* buffer, size_t size, uint64_t offset) {
+#ifdef RWF_NOWAIT
+		struct iovec vector;
+		vector.iov_base = buffer;
+		vector.iov_len = size;
+		return preadv2(fd, &vector, 1, (off_t)offset, RWF_NOWAIT) == (ssize_t)size;
+#else
+		return false;
+#endif
+	}
+
+	// Whether reads go through io_uring (known after the first start())
+	bool usesIoUring() const {
+#ifdef USE_IO_URING
+		return this->ringFd >= 0;
+#else
+		return false;
+#endif
+	}
+
+	// Issue the reads of all the requests. The requests and their buffers must stay valid, and next() must be called,
+	// until next() returns false.
+	void start(int fd, std::vector<ReadRequest>& requests) {
+		this->fd = fd;
+		this->requests = &requests;
+		this->pending.clear();
+		this->submitted = 0;
+		this->returned = 0;
+		this->completed.clear();
+		for (size_t i = 0; i < requests.size(); ++i) {
+			if (readCached(fd, requests[i].buffer, requests[i].size, requests[i].offset)) {
+				requests[i].succeeded = true;
+				this->completed.push_back(i);
+			}
+			else
+				this->pending.push_back(i);
+		}
+		if (this->pending.empty())
+			return;
+
+#ifdef USE_IO_URING
+		if (!this->ringChecked)
+			this->setupRing();
+		if (this->ringFd >= 0) {
+			this->reaped.assign(requests.size(), false);
+			if (!this->submitAndWait(0))
+				this->abandonRing();
+			return;
+		}
+#endif
+		for (size_t i = 0; this->pending.size() > 1 && i < this->pending.size(); ++i) {
+			const ReadRequest& request = requests[this->pending[i]];
+			posix_fadvise(fd, (off_t)request.offset, (off_t)request.size, POSIX_FADV_WILLNEED);
+		}
+	}
+
+	// Wait for the next completed request: the ones in the page cache first, then the others in the order they arrive
+	// (in the order of the requests without io_uring)
+	// return false when all the requests have been returned
+	bool next(size_t& index) {
+		if (this->requests == NULL || this->returned == this->requests->size())
+			return false;
+#ifdef USE_IO_URING
+		while (this->ringFd >= 0 && this->completed.empty()) {
+			this->reapCompletions();
+			if (this->completed.empty() && !this->submitAndWait(1))
+				this->abandonRing();
+		}
+		// Refill the ring before a completed read is decoded, so the kernel keeps reading in the meantime
+		if (this->ringFd >= 0 && this->submitted < this->pending.size() && !this->submitAndWait(0))
+			this->abandonRing();
+#endif
+		++this->returned;
+		if (!this->completed.empty()) {
+			index = this->completed.front();
+			this->completed.pop_front();
+			return true;
+		}
+		index = this->pending[this->submitted++];
+		ReadRequest& request = (*this->requests)[index];
+		request.succeeded = readFully(this->fd, request.buffer, request.size, request.offset);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef QUANTIZED_SCORING_H
+#define QUANTIZED_SCORING_H
+
+#include <cstdint>
+
+#if defined(__AVX2__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define QUANTIZED_SCORING_AVX2
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#define QUANTIZED_SCORING_SSE2
+#endif
+
+// Integer kernels of the quantized query mode (./indexer --quantized=8 or 16, ./searchEngine --mode=quantized).
+// The BM25 score of every posting is precomputed and quantized at index time, so scoring a posting is a load and an add
+// into the integer accumulators, and picking the top k is a scan for the accumulators above the k-th best.
+//
+// -- accumulateImpacts: scores[docId] += impact for a block of postings. With AVX2, 8 postings at a time: the impacts are
+//    widened to 32 bits, the 8 accumulators gathered and added, and stored back one by one (AVX2 has no scatter; the
+//    docIds of a word are all different, so the 8 lanes never collide)
+// -- findScoreAbove: the next accumulator above a threshold, comparing 8 (AVX2) or 4 (SSE2) at a time
+// Build with -mavx2 for the AVX2 kernels, or -DNO_SIMD for the scalar ones (SSE2 only speeds up findScoreAbove).
+
+#ifdef QUANTIZED_SCORING_AVX2
+// 8 impacts widened to 32 bits
+inline __m256i loadImpacts(const uint8_t* impacts) {
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(impacts)));
+}
+
+inline __m256i loadImpacts(const uint16_t* impacts) {
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(impacts)));
+}
+#endif
+
+// scores[docIds[i]] += impacts[i] for i in [0, count). docIds are increasing (< 2^29), Impact is uint8_t or uint16_t.
+template <typename Impact>
+inline void accumulateImpacts(uint32_t* scores, const uint32_t* docIds, const Impact* impacts, uint32_t count) {
+	uint32_t i = 0;
+#ifdef QUANTIZED_SCORING_AVX2
+	alignas(32) uint32_t sums[8];
+	for (; i + 8 <= count; i += 8) {
+		__m256i indexes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(docIds + i));
+		__m256i current = _mm256_i32gather_epi32(reinterpret_cast<const int*>(scores), indexes, 4);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(sums), _mm256_add_epi32(current, loadImpacts(impacts + i)));
+		for (uint32_t j = 0; j < 8; ++j)
+			scores[docIds[i + j]] = sums[j];
+	}
+#endif
+	for (; i < count; ++i)
+		scores[docIds[i]] += impacts[i];
+}
+
+// Index of the first score > threshold in scores[start, size), or size if none. Scores are sums of impacts (< 2^31).
+inline uint32_t findScoreAbove(const uint32_t* scores, uint32_t start, uint32_t size, uint32_t threshold) {
+	uint32_t i = start;
+#if defined(QUANTIZED_SCORING_AVX2)
+	__m256i thresholdVector = _mm256_set1_epi32((int)threshold);
+	for (; i + 8 <= size; i += 8) {
+		__m256i above = _mm256_cmpgt_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(scores + i)), thresholdVector);
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(above));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(QUANTIZED_SCORING_SSE2)
+	__m128i thresholdVector = _mm_set1_epi32((int)threshold);
+	for (; i + 4 <= size; i += 4) {
+		__m128i above = _mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(scores + i)), thresholdVector);
+		uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(above));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < size && scores[i] <= threshold)
+		++i;
+	return i;
+}
+
+#endif
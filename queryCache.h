@@ -0,0 +1,216 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// Caches of the search engine, safe to use from many query threads at the same time:
+// -- the result cache: normalized query (its words after extractWords) -> top-k results
+// -- the postings cache: word -> decoded postings, for the hot words of the exhaustive and term-at-a-time modes
+//
+// Both are ConcurrentCache: a size-bounded LRU split into shards, each with its own mutex, so threads looking up
+// different keys rarely wait for each other. Values are shared_ptr<const Value>, so an entry evicted while a query
+// still uses it stays valid until the query is done.
+//
+// The postings cache also uses TinyLFU admission: a count-min sketch counts how often every key is looked up
+// (including misses), and a new entry only evicts the LRU victim if it's looked up more often. So a long tail of
+// words seen once doesn't flush the hot words out.
+
+const uint32_t CACHE_SHARD_COUNT = 16;
+const uint32_t FREQUENCY_SKETCH_WIDTH = 4096; // Counters per row, a power of 2
+const uint32_t FREQUENCY_SKETCH_ROWS = 4;
+const size_t CACHE_ENTRY_OVERHEAD = 96; // Estimated bytes of an entry besides its key and value (list node, hash node, shared_ptr)
+
+// Approximate counts of how often keys are seen, with 8-bit counters that are all halved every
+// 10 * FREQUENCY_SKETCH_WIDTH increments, so old popularity fades out
+class FrequencySketch {
+
+private:
+	std::vector<uint8_t> counters; // FREQUENCY_SKETCH_ROWS rows
+	uint32_t additions;
+
+	uint32_t getIndex(uint64_t hash, uint32_t row) const {
+		uint64_t step = (hash >> 32) | 1;
+		return row * FREQUENCY_SKETCH_WIDTH + (uint32_t)((hash + row * step) & (FREQUENCY_SKETCH_WIDTH - 1));
+	}
+
+public:
+	FrequencySketch() : counters(FREQUENCY_SKETCH_ROWS * FREQUENCY_SKETCH_WIDTH, 0) {
+		this->additions = 0;
+	}
+
+	void add(uint64_t hash) {
+		for (uint32_t row = 0; row < FREQUENCY_SKETCH_ROWS; ++row) {
+			uint8_t& counter = this->counters[this->getIndex(hash, row)];
+			if (counter < 255)
+				++counter;
+		}
+		if (++this->additions >= 10 * FREQUENCY_SKETCH_WIDTH) {
+			for (size_t i = 0; i < this->counters.size(); ++i)
+				this->counters[i] >>= 1;
+			this->additions = 0;
+		}
+	}
+
+	uint32_t estimate(uint64_t hash) const {
+		uint32_t minimum = 255;
+		for (uint32_t row = 0; row < FREQUENCY_SKETCH_ROWS; ++row)
+			minimum = std::min(minimum, (uint32_t)this->counters[this->getIndex(hash, row)]);
+		return minimum;
+	}
+};
+
+struct CacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t rejected; // New entries not admitted (TinyLFU) or too large
+	uint64_t evictions;
+	uint64_t entries;
+	uint64_t bytes;
+	uint64_t capacityBytes;
+
+	double hitRate() const {
+		return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+	}
+};
+
+template <typename Value>
+class ConcurrentCache {
+
+private:
+	struct Entry {
+		std::string key;
+		uint64_t hash;
+		std::shared_ptr<const Value> value;
+		size_t bytes;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::list<Entry> entries; // Most recently used first
+		std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+		size_t bytes;
+		FrequencySketch sketch; // Only with admission
+
+		Shard() {
+			this->bytes = 0;
+		}
+	};
+
+	std::vector<std::unique_ptr<Shard> > shards;
+	size_t shardCapacity; // Bytes per shard, 0 if the cache is disabled
+	bool useAdmission;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> rejected;
+	std::atomic<uint64_t> evictions;
+
+	Shard& getShard(uint64_t hash) {
+		return *this->shards[(hash >> 16) % CACHE_SHARD_COUNT];
+	}
+
+public:
+	// capacityBytes: 0 to disable the cache
+	// useAdmission: TinyLFU admission, otherwise plain LRU
+	ConcurrentCache(size_t capacityBytes, bool useAdmission) : hits(0), misses(0), rejected(0), evictions(0) {
+		this->shardCapacity = capacityBytes / CACHE_SHARD_COUNT;
+		this->useAdmission = useAdmission;
+		if (this->shardCapacity > 0) {
+			for (uint32_t i = 0; i < CACHE_SHARD_COUNT; ++i)
+				this->shards.push_back(std::unique_ptr<Shard>(new Shard()));
+		}
+	}
+
+	bool isEnabled() const {
+		return this->shardCapacity > 0;
+	}
+
+	// Return the cached value, or NULL
+	std::shared_ptr<const Value> get(const std::string& key) {
+		if (!this->isEnabled())
+			return std::shared_ptr<const Value>();
+
+		uint64_t hash = std::hash<std::string>()(key);
+		Shard& shard = this->getShard(hash);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (this->useAdmission)
+			shard.sketch.add(hash);
+
+		typename std::unordered_map<std::string, typename std::list<Entry>::iterator>::iterator it = shard.index.find(key);
+		if (it == shard.index.end()) {
+			++this->misses;
+			return std::shared_ptr<const Value>();
+		}
+		++this->hits;
+		shard.entries.splice(shard.entries.begin(), shard.entries, it->second); // Move to the front
+		return it->second->value;
+	}
+
+	// Add a value of valueBytes bytes, evicting the least recently used entries if needed
+	void put(const std::string& key, const std::shared_ptr<const Value>& value, size_t valueBytes) {
+		if (!this->isEnabled())
+			return;
+
+		size_t bytes = valueBytes + key.length() + CACHE_ENTRY_OVERHEAD;
+		uint64_t hash = std::hash<std::string>()(key);
+		Shard& shard = this->getShard(hash);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (bytes > this->shardCapacity) {
+			++this->rejected;
+			return;
+		}
+		if (shard.index.find(key) != shard.index.end())
+			return; // Added by another thread in the meantime
+
+		if (this->useAdmission && shard.bytes + bytes > this->shardCapacity
+			&& shard.sketch.estimate(hash) <= shard.sketch.estimate(shard.entries.back().hash)) {
+			++this->rejected; // Not more popular than the entry it would evict
+			return;
+		}
+
+		while (shard.bytes + bytes > this->shardCapacity) {
+			Entry& victim = shard.entries.back();
+			shard.bytes -= victim.bytes;
+			shard.index.erase(victim.key);
+			shard.entries.pop_back();
+			++this->evictions;
+		}
+
+		Entry entry;
+		entry.key = key;
+		entry.hash = hash;
+		entry.value = value;
+		entry.bytes = bytes;
+		shard.entries.push_front(entry);
+		shard.index[key] = shard.entries.begin();
+		shard.bytes += bytes;
+	}
+
+	CacheStats getStats() {
+		CacheStats stats;
+		memset(&stats, 0, sizeof(stats));
+		stats.hits = this->hits;
+		stats.misses = this->misses;
+		stats.rejected = this->rejected;
+		stats.evictions = this->evictions;
+		stats.capacityBytes = this->shardCapacity * CACHE_SHARD_COUNT;
+		for (size_t i = 0; i < this->shards.size(); ++i) {
+			std::lock_guard<std::mutex> lock(this->shards[i]->mutex);
+			stats.entries += this->shards[i]->entries.size();
+			stats.bytes += this->shards[i]->bytes;
+		}
+		return stats;
+	}
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef QUERY_TRACE_H
+#define QUERY_TRACE_H
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+// Observability of the search engine:
+// -- QueryTrace: where the time of one query went (tokenize, dictionary lookup, postings, scoring, top k selection,
+//    output formatting) and how much work it did (postings bytes read and decoded, documents scored, cache hits).
+//    Only recorded when tracing is on (./searchEngine --trace=file): a query without a trace only checks a NULL pointer
+//    once per phase, never per posting. Written as one JSON line per query, e.g.
+//    {"query": "wall street", "mode": "bmw", "totalUs": 41.2, "tokenizeUs": 0.6, "lookupUs": 1.1, "postingsUs": 0, "scoringUs": 35.4,
+//     "topKUs": 0.3, "formatUs": 2.9, "postingsBytes": 10432, "postingsDecoded": 3968, "documentsScored": 212, "results": 10,
+//     "resultCacheHit": false, "postingsCacheHits": 0}
+// -- EngineMetrics: process-wide counters and a latency histogram, always on (a few relaxed atomic additions per query),
+//    dumped as one JSON line at exit (./searchEngine --metrics=file) or on request (":metrics" to the server).
+//
+// In the modes with postings cursors (bmw, and, phrase) and in saat, blocks are decoded lazily while scoring, so their
+// decoding time is part of scoringUs and postingsUs is 0.
+
+enum QueryPhase {
+	QUERY_PHASE_TOKENIZE = 0,
+	QUERY_PHASE_LOOKUP = 1, // Finding the query words in the dictionary
+	QUERY_PHASE_POSTINGS = 2, // Reading and decoding whole postings lists (exhaustive and taat)
+	QUERY_PHASE_SCORING = 3,
+	QUERY_PHASE_TOP_K = 4, // Selecting and sorting the best documents
+	QUERY_PHASE_FORMAT = 5, // Output lines of the results
+	QUERY_PHASE_COUNT = 6
+};
+
+const char* const QUERY_PHASE_NAMES[QUERY_PHASE_COUNT] = {"tokenize", "lookup", "postings", "scoring", "topK", "format"};
+
+const uint32_t LATENCY_HISTOGRAM_BUCKETS = 32; // Bucket i: latencies in [2^(i-1), 2^i) microseconds, bucket 0: < 1us
+
+struct QueryTrace {
+	std::string query;
+	uint64_t phaseNanoseconds[QUERY_PHASE_COUNT];
+	uint64_t totalNanoseconds;
+	uint64_t postingsBytes; // Postings read from the files, or in the decoded blocks of index.bin
+	uint64_t postingsDecoded;
+	uint64_t documentsScored; // Postings scored (exhaustive, taat, saat) or documents scored (bmw, and, phrase)
+	uint32_t resultCount;
+	bool resultCacheHit;
+	uint32_t postingsCacheHits;
+
+	QueryTrace() {
+		this->clear("");
+	}
+
+	void clear(const std::string& query) {
+		this->query = query;
+		for (uint32_t i = 0; i < QUERY_PHASE_COUNT; ++i)
+			this->phaseNanoseconds[i] = 0;
+		this->totalNanoseconds = 0;
+		this->postingsBytes = 0;
+		this->postingsDecoded = 0;
+		this->documentsScored = 0;
+		this->resultCount = 0;
+		this->resultCacheHit = false;
+		this->postingsCacheHits = 0;
+	}
+
+	// shardIndex: of a shard worker (./searchEngine --shards), -1 otherwise
+	std::string toJson(const char* mode, int32_t shardIndex = -1) const {
+		std::ostringstream json;
+		json << "{\"query\": \"";
+		for (size_t i = 0; i < this->query.length(); ++i) {
+			unsigned char c = this->query[i];
+			if (c == '"' || c == '\\')
+				json << '\\' << c;
+			else if (c >= 0x20)
+				json << c;
+		}
+		json << "\", \"mode\": \"" << mode << "\"";
+		if (shardIndex >= 0)
+			json << ", \"shard\": " << shardIndex;
+		json << ", \"totalUs\": " << this->totalNanoseconds / 1000.0;
+		for (uint32_t i = 0; i < QUERY_PHASE_COUNT; ++i)
+			json << ", \"" << QUERY_PHASE_NAMES[i] << "Us\": " << this->phaseNanoseconds[i] / 1000.0;
+		json << ", \"postingsBytes\": " << this->postingsBytes << ", \"postingsDecoded\": " << this->postingsDecoded
+			<< ", \"documentsScored\": " << this->documentsScored << ", \"results\": " << this->resultCount
+			<< ", \"resultCacheHit\": " << (this->resultCacheHit ? "true" : "false") << ", \"postingsCacheHits\": " << this->postingsCacheHits << "}";
+		return json.str();
+	}
+};
+
+// Adds the time until it's destroyed (or stop()) to a phase of the trace. Does nothing if the trace is NULL.
+class PhaseTimer {
+
+private:
+	QueryTrace* trace;
+	QueryPhase phase;
+	std::chrono::steady_clock::time_point startTime;
+
+public:
+	PhaseTimer(QueryTrace* trace, QueryPhase phase) {
+		this->trace = trace;
+		this->phase = phase;
+		if (trace != NULL)
+			this->startTime = std::chrono::steady_clock::now();
+	}
+
+	~PhaseTimer() {
+		this->stop();
+	}
+
+	void stop() {
+		if (this->trace == NULL)
+			return;
+		this->trace->phaseNanoseconds[this->phase] +=
+			std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->startTime).count();
+		this->trace = NULL;
+	}
+};
+
+// JSON lines written by many query threads to one file ("-" for stderr)
+class TraceWriter {
+
+private:
+	std::ofstream file;
+	std::ostream* output;
+	std::mutex mutex;
+
+public:
+	TraceWriter() {
+		this->output = NULL;
+	}
+
+	bool open(const std::string& fileName) {
+		if (fileName == "-") {
+			this->output = &std::cerr;
+			return true;
+		}
+		this->file.open(fileName.c_str(), std::ofstream::app);
+		this->output = this->file ? &this->file : NULL;
+		return this->output != NULL;
+	}
+
+	bool isOpen() const {
+		return this->output != NULL;
+	}
+
+	void write(const std::string& line) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		*this->output << line << '\n' << std::flush;
+	}
+};
+
+// Process-wide counters of the search engine, updated by every query thread
+class EngineMetrics {
+
+private:
+	std::chrono::steady_clock::time_point startTime;
+	std::atomic<uint64_t> loadMicroseconds;
+	std::atomic<uint64_t> queries;
+	std::atomic<uint64_t> emptyQueries; // Queries without results
+	std::atomic<uint64_t> totalLatencyMicroseconds;
+	std::atomic<uint64_t> maxLatencyMicroseconds;
+	std::atomic<uint64_t> latencyHistogram[LATENCY_HISTOGRAM_BUCKETS];
+
+	static uint32_t getBucket(uint64_t microseconds) {
+		uint32_t bucket = microseconds == 0 ? 0 : 64 - __builtin_clzll(microseconds);
+		return bucket < LATENCY_HISTOGRAM_BUCKETS ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1;
+	}
+
+	// Upper bound of the latency at a percentile, from the histogram
+	uint64_t getPercentile(uint32_t percent, uint64_t count) const {
+		uint64_t rank = (count * percent + 99) / 100;
+		uint64_t seen = 0;
+		for (uint32_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+			seen += this->latencyHistogram[i].load(std::memory_order_relaxed);
+			if (seen >= rank && seen > 0)
+				return (uint64_t)1 << i;
+		}
+		return 0;
+	}
+
+public:
+	EngineMetrics() {
+		this->startTime = std::chrono::steady_clock::now();
+		this->loadMicroseconds = 0;
+		this->queries = 0;
+		this->emptyQueries = 0;
+		this->totalLatencyMicroseconds = 0;
+		this->maxLatencyMicroseconds = 0;
+		for (uint32_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i)
+			this->latencyHistogram[i] = 0;
+	}
+
+	void recordLoad(uint64_t microseconds) {
+		this->loadMicroseconds = microseconds;
+	}
+
+	void recordQuery(uint64_t microseconds, uint32_t resultCount) {
+		this->queries.fetch_add(1, std::memory_order_relaxed);
+		if (resultCount == 0)
+			this->emptyQueries.fetch_add(1, std::memory_order_relaxed);
+		this->totalLatencyMicroseconds.fetch_add(microseconds, std::memory_order_relaxed);
+		this->latencyHistogram[getBucket(microseconds)].fetch_add(1, std::memory_order_relaxed);
+		uint64_t maxLatency = this->maxLatencyMicroseconds.load(std::memory_order_relaxed);
+		while (microseconds > maxLatency && !this->maxLatencyMicroseconds.compare_exchange_weak(maxLatency, microseconds, std::memory_order_relaxed))
+			;
+	}
+
+	// The fields of the metrics (without the braces), e.g. "uptimeSeconds": 12.5, "loadUs": 5310, "queries": 1000, ...
+	// Latency percentiles are upper bounds (the end of their histogram bucket)
+	std::string getJsonFields() const {
+		uint64_t queryCount = this->queries.load(std::memory_order_relaxed);
+		std::ostringstream json;
+		json << "\"uptimeSeconds\": " << std::chrono::duration<double>(std::chrono::steady_clock::now() - this->startTime).count()
+			<< ", \"loadUs\": " << this->loadMicroseconds.load() << ", \"queries\": " << queryCount
+			<< ", \"emptyQueries\": " << this->emptyQueries.load(std::memory_order_relaxed)
+			<< ", \"meanLatencyUs\": " << (queryCount > 0 ? (double)this->totalLatencyMicroseconds.load(std::memory_order_relaxed) / queryCount : 0)
+			<< ", \"p50LatencyUs\": " << this->getPercentile(50, queryCount) << ", \"p95LatencyUs\": " << this->getPercentile(95, queryCount)
+			<< ", \"p99LatencyUs\": " << this->getPercentile(99, queryCount) << ", \"maxLatencyUs\": " << this->maxLatencyMicroseconds.load(std::memory_order_relaxed)
+			<< ", \"latencyHistogramUs\": [";
+		// Trailing empty buckets are left out
+		uint32_t bucketCount = LATENCY_HISTOGRAM_BUCKETS;
+		while (bucketCount > 1 && this->latencyHistogram[bucketCount - 1].load(std::memory_order_relaxed) == 0)
+			--bucketCount;
+		for (uint32_t i = 0; i < bucketCount; ++i)
+			json << (i > 0 ? ", " : "") << this->latencyHistogram[i].load(std::memory_order_relaxed);
+		json << "]";
+		return json.str();
+	}
+};
+
+#endif
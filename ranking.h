@@ -0,0 +1,45 @@
+#ifndef RANKING_H
+#define RANKING_H
+
+#include <cmath>
+#include <cstdint>
+
+// Okapi BM25 https://en.wikipedia.org/wiki/Okapi_BM25
+// Shared by the search engine and the indexer (which precomputes maximum scores), so both get exactly the same floats.
+
+const float BM25_K1 = 1.2f;
+const float BM25_B = 0.75f;
+
+inline float getAverageDocumentLength(uint64_t totalLength, uint64_t totalDocuments) {
+	return (float)((double)totalLength / totalDocuments);
+}
+
+// docCountContainWord: how many documents the word appears in
+inline float getIdf(uint32_t totalDocuments, uint32_t docCountContainWord) {
+	return std::log((totalDocuments - docCountContainWord + 0.5) / (docCountContainWord + 0.5) + 1); // Ensure positive
+}
+
+// tf_td: number of the term appears in doc
+// docLength: how many words in the document
+inline float getBM25Score(uint32_t tf_td, uint32_t docLength, float idf, float averageDocumentLength) {
+	float k1 = BM25_K1;
+	float b = BM25_B;
+	float K = k1 * ((1 - b) + b * (docLength / averageDocumentLength));
+	float score = idf * (tf_td * (k1 + 1) / (tf_td + K));
+	return score;
+}
+
+// Quantize a score to an integer impact in [1, 2^bits - 1], linearly from 0 to maxScore (the largest score in the collection).
+// Every posting gets at least 1, so that documents containing a query word always get some score.
+inline uint32_t quantizeScore(float score, float maxScore, uint32_t bits) {
+	uint32_t maxImpact = (1u << bits) - 1;
+	uint32_t impact = (uint32_t)(score / maxScore * maxImpact + 0.5f);
+	return impact < 1 ? 1 : (impact > maxImpact ? maxImpact : impact);
+}
+
+// Approximate score of a sum of impacts
+inline float dequantizeScore(uint32_t impactSum, float maxScore, uint32_t bits) {
+	return impactSum * maxScore / ((1u << bits) - 1);
+}
+
+#endif
@@ -0,0 +1,416 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "postingsCodec.h"
+#include "textCompressor.h"
+#include "documentStore.h"
+
+// Round trip checks of the codecs and the document store (make verify): every input is encoded, decoded and compared with the original,
+// and truncated or corrupt input must be rejected. Then a small index is built with ./indexer and searched with ./searchEngine,
+// for the cases a query must give the same results as on its own. Prints the checks that failed, and exits with 1 if any did.
+// e.g. ./roundTrip -> "All 151 checks passed"
+
+const char* const ROUND_TRIP_STORE_FILE_NAME = "roundTrip_store.tmp";
+const char* const ROUND_TRIP_INDEX_DIRECTORY = "roundTrip_index.tmp"; // Indexes of the search engine checks, removed at the end
+
+class RoundTripChecks {
+
+private:
+	uint32_t checkCount;
+	uint32_t failureCount;
+	std::mt19937 random; // Fixed seed, so a failure can be reproduced
+
+	void check(bool passed, const std::string& name) {
+		++this->checkCount;
+		if (!passed) {
+			++this->failureCount;
+			std::cout << "FAILED: " << name << std::endl;
+		}
+	}
+
+	// Bytes that don't compress (no 4 bytes repeat close enough to be found)
+	std::string randomText(size_t size) {
+		std::string text(size, '\0');
+		for (size_t i = 0; i < size; ++i)
+			text[i] = (char)(this->random() & 0xFF);
+		return text;
+	}
+
+	// Words of a small vocabulary, which compress like real text
+	std::string wordText(size_t size) {
+		const char* words[] = {"the ", "wall ", "street ", "journal ", "stock ", "market ", "shares ", "of ", "and ", "in "};
+		std::string text;
+		while (text.size() < size)
+			text += words[this->random() % 10];
+		text.resize(size);
+		return text;
+	}
+
+	static std::vector<uint8_t> compress(const std::string& text) {
+		std::vector<uint8_t> compressed;
+		compressText((const uint8_t*)text.data(), text.size(), compressed);
+		return compressed;
+	}
+
+	// Compress and decompress text, return true if it comes back the same
+	static bool textRoundTrip(const std::string& text) {
+		std::vector<uint8_t> compressed = compress(text);
+		std::string decompressed(text.size(), '\0');
+		return decompressText(compressed.data(), compressed.size(), (uint8_t*)&decompressed[0], decompressed.size()) && decompressed == text;
+	}
+
+	static bool decompresses(const std::vector<uint8_t>& compressed, size_t outputSize) {
+		std::vector<uint8_t> output(outputSize + 1); // + 1 so that &output[0] is valid for 0 bytes
+		return decompressText(compressed.data(), compressed.size(), output.data(), outputSize);
+	}
+
+	typedef std::vector<std::pair<uint32_t, uint32_t> > Postings;
+
+	// count postings with docId gaps (docId - previous docId - 1) up to maxGap and tf - 1 up to maxTf
+	Postings randomPostings(uint32_t count, uint32_t maxGap, uint32_t maxTf) {
+		Postings postings;
+		uint32_t docId = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			docId += (maxGap == 0 ? 0 : this->random() % ((uint64_t)maxGap + 1)) + 1;
+			postings.push_back(std::pair<uint32_t, uint32_t>(docId, (maxTf == 0 ? 0 : this->random() % ((uint64_t)maxTf + 1)) + 1));
+		}
+		return postings;
+	}
+
+	// Encode and decode postings, return true if they come back the same. Decoded block by block like PostingsCursor,
+	// every block must end where skipBlock() says, and the last one at the end of the encoded bytes.
+	static bool postingsRoundTrip(const Postings& postings) {
+		std::vector<uint8_t> encoded;
+		encodePostings(postings, encoded);
+		encoded.push_back(0); // So that &encoded[0] is valid without postings
+
+		uint32_t docIds[POSTINGS_BLOCK_SIZE];
+		uint32_t tfs[POSTINGS_BLOCK_SIZE];
+		const uint8_t* in = encoded.data();
+		uint32_t previousDocId = 0;
+		for (size_t i = 0; i < postings.size(); i += POSTINGS_BLOCK_SIZE) {
+			uint32_t count = (uint32_t)std::min<size_t>(postings.size() - i, POSTINGS_BLOCK_SIZE);
+			const uint8_t* next = NULL;
+			if (count == POSTINGS_BLOCK_SIZE) {
+				next = decodeBlock(in, previousDocId, docIds, tfs);
+				if (next != skipBlock(in))
+					return false;
+			}
+			else
+				next = decodeTail(in, count, previousDocId, docIds, tfs);
+			for (uint32_t j = 0; j < count; ++j) {
+				if (docIds[j] != postings[i + j].first || tfs[j] != postings[i + j].second)
+					return false;
+			}
+			previousDocId = docIds[count - 1];
+			in = next;
+		}
+		if (in != encoded.data() + encoded.size() - 1)
+			return false;
+
+		Postings decoded;
+		decodePostings(encoded.data(), (uint32_t)postings.size(), decoded);
+		return decoded == postings;
+	}
+
+	// Run a shell command in ROUND_TRIP_INDEX_DIRECTORY (the programs are in ..), return what it prints
+	static std::string run(const std::string& command) {
+		std::string output;
+		FILE* pipe = popen(("cd " + std::string(ROUND_TRIP_INDEX_DIRECTORY) + " && " + command).c_str(), "r");
+		if (pipe == NULL)
+			return output;
+		char buffer[4096];
+		size_t size = 0;
+		while ((size = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+			output.append(buffer, size);
+		pclose(pipe);
+		return output;
+	}
+
+	// Write documents to fileName in ROUND_TRIP_INDEX_DIRECTORY as TREC XML, with the DOCNOs doc-1, doc-2, ...
+	static void writeCorpus(const std::string& fileName, const std::vector<std::string>& documents) {
+		std::ofstream file((std::string(ROUND_TRIP_INDEX_DIRECTORY) + "/" + fileName).c_str());
+		for (size_t i = 0; i < documents.size(); ++i)
+			file << "<DOC>\n<DOCNO> doc-" << i + 1 << " </DOCNO>\n<TEXT>\n" << documents[i] << "\n</TEXT>\n</DOC>\n";
+	}
+
+	// Results of the queries (one per line) in one ./searchEngine --server, options added to its command line
+	static std::string search(const std::string& queries, const std::string& options) {
+		return run("printf '" + queries + "' | ../searchEngine --server --threads=1 " + options + " 2>/dev/null");
+	}
+
+	// Overwrite size bytes of a file at offset
+	static void patchFile(const std::string& fileName, uint64_t offset, const void* data, size_t size) {
+		std::fstream file(fileName.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary);
+		file.seekp(offset);
+		file.write((const char*)data, size);
+	}
+
+public:
+	RoundTripChecks() : random(12345) {
+		this->checkCount = 0;
+		this->failureCount = 0;
+	}
+
+	// postingsCodec.h
+	void checkPostingsCodec() {
+		this->check(postingsRoundTrip(Postings()), "postings: none");
+
+		// Full blocks of every bit width, for the docId gaps and for the tfs
+		for (uint32_t bits = 0; bits <= 32; ++bits) {
+			uint32_t largest = bits == 32 ? 0x80000000 : (uint32_t)((1ull << bits) - 1); // Needs exactly bits bits
+			Postings postings = this->randomPostings(POSTINGS_BLOCK_SIZE, std::min<uint32_t>(largest, 1 << 20), 3);
+			postings[0].second = 1;
+			if (bits > 0) { // One gap of largest, the docIds after it move along
+				uint32_t position = this->random() % POSTINGS_BLOCK_SIZE;
+				uint32_t previousDocId = position == 0 ? 0 : postings[position - 1].first;
+				uint32_t shift = previousDocId + largest + 1 - postings[position].first;
+				for (uint32_t i = position; i < POSTINGS_BLOCK_SIZE; ++i)
+					postings[i].first += shift;
+			}
+			std::vector<uint8_t> encoded;
+			encodePostings(postings, encoded);
+			this->check(encoded[0] == bits && postingsRoundTrip(postings), "postings: docId gaps of " + std::to_string(bits) + " bits");
+
+			postings = this->randomPostings(POSTINGS_BLOCK_SIZE, 3, std::min<uint32_t>(largest, 1 << 20));
+			if (bits == 32)
+				postings[this->random() % POSTINGS_BLOCK_SIZE].second = 0xFFFFFFFF; // tf - 1 = 0xFFFFFFFE
+			else
+				postings[this->random() % POSTINGS_BLOCK_SIZE].second = largest + 1;
+			encoded.clear();
+			encodePostings(postings, encoded);
+			this->check(encoded[1] == bits && postingsRoundTrip(postings), "postings: tfs of " + std::to_string(bits) + " bits");
+		}
+
+		// Zero bit widths: consecutive docIds with tf 1 are only the 2 bytes of the widths
+		Postings consecutive = this->randomPostings(POSTINGS_BLOCK_SIZE, 0, 0);
+		std::vector<uint8_t> encoded;
+		encodePostings(consecutive, encoded);
+		this->check(encoded.size() == 2 && postingsRoundTrip(consecutive), "postings: zero bit width");
+
+		// Tails of 1..127 variable byte postings, alone and after a full block, with gaps and tfs of up to 5 bytes
+		bool tailsSame = true;
+		for (uint32_t count = 1; count < 2 * POSTINGS_BLOCK_SIZE; ++count) {
+			if (count != POSTINGS_BLOCK_SIZE && !postingsRoundTrip(this->randomPostings(count, count % 2 == 0 ? 1000 : 1 << 24, count % 3 == 0 ? 0xFFFFFFFE : 10)))
+				tailsSame = false;
+		}
+		this->check(tailsSame, "postings: tails of 1 to 127");
+		Postings largeGaps;
+		largeGaps.push_back(std::pair<uint32_t, uint32_t>(0xFFFFFFF0, 1)); // A gap of 32 bits in a tail
+		largeGaps.push_back(std::pair<uint32_t, uint32_t>(0xFFFFFFFE, 0xFFFFFFFF));
+		this->check(postingsRoundTrip(largeGaps), "postings: 32-bit gaps in a tail");
+
+		// Many blocks with different widths
+		Postings many = this->randomPostings(10000, 50, 5);
+		for (size_t i = 3000; i < 3200; ++i)
+			many[i].second = 100000;
+		this->check(postingsRoundTrip(many), "postings: 10000");
+	}
+
+	// textCompressor.h
+	void checkTextCompressor() {
+		this->check(textRoundTrip(""), "text: empty");
+		this->check(compress("").size() == 1, "text: empty is one token");
+		for (size_t size = 1; size <= 20; ++size)
+			this->check(textRoundTrip(this->wordText(size)), "text: " + std::to_string(size) + " bytes");
+
+		std::string incompressible = this->randomText(100000);
+		this->check(textRoundTrip(incompressible), "text: incompressible");
+		this->check(compress(incompressible).size() <= incompressible.size() + incompressible.size() / 255 + 16, "text: incompressible grows by the lengths only");
+
+		std::string words = this->wordText(300000);
+		this->check(textRoundTrip(words), "text: words");
+		this->check(compress(words).size() < words.size() / 2, "text: words compress to less than half");
+
+		// Matches that overlap what they copy (offset < length), and lengths with extra bytes of 255
+		this->check(textRoundTrip(std::string(100000, ' ')), "text: run of one byte");
+		std::string pattern;
+		for (size_t i = 0; i < 50000; ++i)
+			pattern += "ab";
+		this->check(textRoundTrip(pattern), "text: run of 2 bytes");
+		pattern.clear();
+		for (size_t i = 0; i < 10000; ++i)
+			pattern += "abcdefg";
+		this->check(textRoundTrip(pattern), "text: run of 7 bytes");
+		for (size_t length = 4; length <= 300; length += length < 24 ? 1 : 37) {
+			std::string prefix = this->randomText(length);
+			this->check(textRoundTrip(prefix + prefix + this->randomText(3)), "text: match of " + std::to_string(length) + " bytes");
+		}
+		this->check(textRoundTrip(this->randomText(270) + "wall street"), "text: 270 literals");
+
+		// Repeats closer and farther than the largest offset
+		std::string far = this->randomText(COMPRESSOR_MAX_OFFSET + 5000);
+		this->check(textRoundTrip(far + far), "text: repeat around the largest offset");
+
+		// Truncated and corrupt blocks are rejected, never read or written out of bounds
+		std::string text = this->wordText(5000);
+		std::vector<uint8_t> compressed = compress(text);
+		this->check(decompresses(compressed, text.size()), "text: sample decompresses");
+		this->check(!decompresses(compressed, text.size() - 1) && !decompresses(compressed, text.size() + 1), "text: wrong size rejected");
+		bool truncatedRejected = true;
+		for (size_t size = 0; size < compressed.size(); ++size) {
+			std::vector<uint8_t> truncated(compressed.begin(), compressed.begin() + size);
+			if (decompresses(truncated, text.size()))
+				truncatedRejected = false;
+		}
+		this->check(truncatedRejected, "text: every truncation rejected");
+		std::vector<uint8_t> corrupt = compress("wall street wall street wall street");
+		corrupt[1 + 12] = 0xFF; // The offset of the first match, now past the start of the output
+		corrupt[1 + 12 + 1] = 0xFF;
+		this->check(!decompresses(corrupt, 35), "text: offset before the start rejected");
+		corrupt.assign(64, 0xFF); // Lengths that never end
+		this->check(!decompresses(corrupt, 1000), "text: endless length rejected");
+		for (uint32_t i = 0; i < 1000; ++i) {
+			corrupt = compressed;
+			corrupt[this->random() % corrupt.size()] ^= (uint8_t)(1 + this->random() % 255);
+			decompresses(corrupt, text.size()); // May or may not decode, but must stay in bounds
+		}
+	}
+
+	// documentStore.h
+	void checkDocumentStore() {
+		std::vector<std::string> documents;
+		documents.push_back("");
+		documents.push_back("wall street");
+		for (uint32_t i = 0; i < 20; ++i)
+			documents.push_back(this->wordText(10000)); // The 7th of these crosses 64 KB, and ends the first block
+		documents.push_back("");
+		documents.push_back(this->wordText(200000)); // Larger than a block
+		documents.push_back(this->randomText(70000));
+		documents.push_back("the end");
+
+		DocumentStoreWriter writer;
+		for (size_t i = 0; i < documents.size(); ++i)
+			writer.add(documents[i]);
+		this->check(writer.save(ROUND_TRIP_STORE_FILE_NAME), "store: saved");
+
+		uint32_t blockCount = 0;
+		{
+			DocumentStore store;
+			this->check(store.open(ROUND_TRIP_STORE_FILE_NAME), "store: opened");
+			this->check(store.getDocumentCount() == documents.size(), "store: document count");
+			bool same = true;
+			bool crossed = false; // A document goes past DOCUMENT_STORE_BLOCK_SIZE in its block
+			std::string text;
+			for (uint32_t docId = 1; docId <= documents.size(); ++docId) {
+				StoredDocument document;
+				if (!store.getDocument(docId, document) || !store.readBlock(document.block, text)
+					|| (uint64_t)document.offset + document.length > text.size())
+				{
+					same = false;
+					continue;
+				}
+				if (text.compare(document.offset, document.length, documents[docId - 1]) != 0)
+					same = false;
+				if (document.offset < DOCUMENT_STORE_BLOCK_SIZE && document.offset + document.length > DOCUMENT_STORE_BLOCK_SIZE)
+					crossed = true;
+				blockCount = std::max(blockCount, document.block + 1);
+			}
+			this->check(same, "store: every document reads back");
+			this->check(crossed, "store: a document spans the 64 KB block boundary");
+			StoredDocument document;
+			this->check(!store.getDocument(0, document) && !store.getDocument((uint32_t)documents.size() + 1, document), "store: no such docId");
+			this->check(!store.readBlock(blockCount, text), "store: no such block");
+		}
+
+		// Header: magic, version, document count, block count, then the block offsets, the document table and the blocks
+		uint64_t blocksStart = 16 + ((uint64_t)blockCount + 1) * 8 + documents.size() * sizeof(StoredDocument);
+		std::ifstream file(ROUND_TRIP_STORE_FILE_NAME, std::ifstream::binary);
+		std::vector<uint64_t> blockOffsets(blockCount + 1);
+		file.seekg(16);
+		file.read((char*)blockOffsets.data(), blockOffsets.size() * 8);
+		file.close();
+
+		// A block that ends early (its end offset moved back)
+		uint64_t shortEnd = blockOffsets[1] - 10;
+		patchFile(ROUND_TRIP_STORE_FILE_NAME, 16 + 8, &shortEnd, 8);
+		{
+			DocumentStore store;
+			std::string text;
+			this->check(store.open(ROUND_TRIP_STORE_FILE_NAME) && !store.readBlock(0, text), "store: truncated block rejected");
+		}
+		patchFile(ROUND_TRIP_STORE_FILE_NAME, 16 + 8, &blockOffsets[1], 8);
+
+		// A wrong decompressed size
+		uint32_t wrongSize = 12345;
+		patchFile(ROUND_TRIP_STORE_FILE_NAME, blocksStart + blockOffsets[1], &wrongSize, 4);
+		{
+			DocumentStore store;
+			std::string text;
+			this->check(store.open(ROUND_TRIP_STORE_FILE_NAME) && !store.readBlock(1, text), "store: wrong block size rejected");
+			this->check(store.readBlock(0, text), "store: other blocks still read");
+		}
+
+		// Compressed bytes overwritten
+		std::vector<uint8_t> garbage(100, 0xFF);
+		patchFile(ROUND_TRIP_STORE_FILE_NAME, blocksStart + blockOffsets[0] + 4, garbage.data(), garbage.size());
+		{
+			DocumentStore store;
+			std::string text;
+			this->check(store.open(ROUND_TRIP_STORE_FILE_NAME) && !store.readBlock(0, text), "store: corrupt block rejected");
+		}
+
+		// A file cut short isn't opened
+		truncate(ROUND_TRIP_STORE_FILE_NAME, blocksStart + blockOffsets[blockCount] - 1);
+		{
+			DocumentStore store;
+			this->check(!store.open(ROUND_TRIP_STORE_FILE_NAME), "store: truncated file rejected");
+		}
+		unlink(ROUND_TRIP_STORE_FILE_NAME);
+	}
+
+	// searchEngine.h: the result cache
+	void checkResultCache() {
+		// "wall st*" is wall and one of stock, street in the and and phrase modes, "wall stock street" needs all three
+		std::vector<std::string> documents;
+		documents.push_back("wall street");
+		documents.push_back("wall stock");
+		documents.push_back("wall street stock");
+		documents.push_back("street stock");
+		documents.push_back("wall stock street");
+		writeCorpus("corpus.xml", documents);
+		run("../indexer --positions corpus.xml > /dev/null");
+
+		const char* modes[] = {"and", "phrase"};
+		for (size_t i = 0; i < 2; ++i) {
+			std::string options = std::string("--mode=") + modes[i] + " --k=3";
+			std::string wildcard = search("wall st*\\n", options);
+			std::string words = search("wall stock street\\n", options);
+			this->check(!wildcard.empty() && wildcard != words, std::string("result cache: ") + modes[i] + " wildcard and words differ");
+			this->check(search("wall st*\\nwall stock street\\n", options + " --result-cache=16") == wildcard + words,
+				std::string("result cache: ") + modes[i] + " wildcard not the same query as its expansions");
+		}
+	}
+
+	// return true if every check passed
+	bool report() const {
+		if (this->failureCount > 0)
+			std::cout << this->failureCount << " of " << this->checkCount << " checks failed" << std::endl;
+		else
+			std::cout << "All " << this->checkCount << " checks passed" << std::endl;
+		return this->failureCount == 0;
+	}
+};
+
+int main() {
+	RoundTripChecks checks;
+	checks.checkPostingsCodec();
+	checks.checkTextCompressor();
+	checks.checkDocumentStore();
+
+	mkdir(ROUND_TRIP_INDEX_DIRECTORY, 0755);
+	checks.checkResultCache();
+	if (system((std::string("rm -rf ") + ROUND_TRIP_INDEX_DIRECTORY).c_str()) != 0)
+		std::cout << "Can't remove " << ROUND_TRIP_INDEX_DIRECTORY << std::endl;
+	return checks.report() ? 0 : 1;
+}
@@ -1,326 +1,620 @@
 #include <iostream>
-#include <fstream>
 #include <sstream>
 #include <vector>
 #include <string>
-#include <unordered_map>
-#include <cmath>
-#include <algorithm>
-
-// Extract words from a text string
-std::vector<std::string> extractWords(const std::string& text) {
-	std::vector<std::string> words;
-
-	std::string word;
-	for (size_t i = 0; i < text.size(); ++i){
-		if (std::isalpha(text[i]))
-			word += std::tolower(text[i]);
-		else if (std::isdigit(text[i]))
-			word += text[i];
-		// else if (text[i] == '-') { // Some words have '-', such as "well-being"
-		// 	if (i > 0 && std::isalnum(text[i - 1])) { // Ignore words starting with '-'
-		// 		word += text[i];
-		// 	}
-		// }
-		else {
-			if (word.length() > 0) {
-				if (word.length() > 255) { // Length is stored in uint8_t, so truncate the word if its length > 255
-					word = word.substr(0, 255);
-				}
-				words.push_back(word);
-			}
-			word = "";
-		}
-	}
-	if (word.length() > 0)
-		words.push_back(word);
-
-	return words;
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "searchEngine.h"
+
+volatile sig_atomic_t serverStopRequested = 0; // Set by SIGINT / SIGTERM
+
+void requestServerStop(int) {
+	serverStopRequested = 1;
 }
 
-// Used for sorting the docId and its relevance score
-bool sortScoreCompare(const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
-	return a.second > b.second;
-}
-
-// There are four .bin index files:
-// 1. index_docLengths.bin: Document lengths for calculating scores. 4 bytes uint32_t each document length
-// 2. index_docNo.bin: DOCNO file, for showing DOCNO after retrieving docId. String splited by \0 (docNo1 \0 docNo2 \0 ...)
-// 3. index_words.bin: Words and their postings index, for seeking and reading word postings. Stored as 4 bytes word count + (wordLength(uint8_t), word, pos(uint32_t), docCount(uint32_t))
-// 4. index_wordPostings.bin: Word postings file, stored as (docId1, tf1, docId2, tf2, ...) each 4 bytes
+const char* const METRICS_REQUEST = ":metrics"; // Server request for the engine metrics
 
-class SearchEngine {
+// Long-running mode: the index is loaded once, then newline-delimited queries from stdin and from an optional
+// Unix domain socket are answered by a fixed pool of worker threads, each with its own QueryContext.
+// Every answer is the result lines followed by a blank line. Answers to stdin are printed in the order of the queries.
+// The line ":metrics" is answered with the engine metrics as one JSON line (see queryTrace.h) instead of results.
+// The server stops at the end of stdin (or at SIGINT / SIGTERM when listening on a socket), then reports QPS and latency.
+class QueryServer {
 
 private:
-	std::ifstream wordPostingsFile; // Word postings file
-
-	uint32_t totalDocuments; // number of documents in total, initialize after loading index_docLengths.bin
-	float averageDocumentLength; // Average length of all the documents, used for BM25
-	std::unordered_map<uint32_t, uint32_t> docIdToLength; // docId -> documentLength
-
-	// word -> (pos, docCount)
-	// -- pos: how many documents before the word's first document
-	// -- docCount: how many documents the word appears in
-	std::unordered_map<std::string, std::pair<uint32_t, uint32_t> > wordToPostingsIndex;
-
-	// DOCNO list ["WSJ870323-0139", ...]
-	std::vector<std::string> vecDocNo;
+	struct Job {
+		std::string query;
+		std::function<void(const std::string&)> respond; // Called by the worker with the answer
+	};
+
+	SearchEngine& engine;
+	uint32_t threadCount;
+	std::string socketPath;
+
+	std::deque<Job> jobs;
+	std::mutex jobsMutex;
+	std::condition_variable jobsCondition;
+	bool stopping;
+	std::vector<std::thread> workers;
+	std::vector<std::vector<uint32_t> > workerLatencies; // Query latencies in microseconds, one list per worker
+
+	// Answers to stdin wait here until all the earlier ones are printed
+	std::map<uint64_t, std::string> pendingOutput;
+	uint64_t nextOutputIndex;
+	std::mutex outputMutex;
+
+	// A client connected to the socket
+	struct Connection {
+		int fd;
+		std::thread thread;
+		bool finished; // Set by the connection's thread when the client disconnects
+	};
+
+	int listenFd;
+	std::list<Connection> connections;
+	std::mutex connectionsMutex;
+
+	void runWorker(uint32_t workerIndex) {
+		QueryContext context;
+		while (true) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(this->jobsMutex);
+				while (this->jobs.empty() && !this->stopping)
+					this->jobsCondition.wait(lock);
+				if (this->jobs.empty())
+					return; // Stopping, and every job is done
+				job = this->jobs.front();
+				this->jobs.pop_front();
+			}
 
-public:
-	SearchEngine() {
-	}
+			if (job.query == METRICS_REQUEST) {
+				job.respond(this->engine.getMetricsJson() + "\n\n");
+				continue;
+			}
 
-	void load() {
-		this->loadWords(); // load word postings index from disk
-		this->loadDocNo(); // load DOCNO to a string list
-		this->loadDocLengths();
+			uint64_t latencyMicroseconds = 0;
+			std::string answer = this->engine.answerQuery(job.query, context, latencyMicroseconds) + "\n";
+			this->workerLatencies[workerIndex].push_back((uint32_t)latencyMicroseconds);
 
-		wordPostingsFile.open("index_wordPostings.bin");
+			job.respond(answer);
+		}
 	}
 
-	// Load document lengths and get: 1. totalDocuments 2. average document length 3. docIdToLength (Used for BM25)
-	void loadDocLengths() {
-		std::ifstream docLengthsFile;
-		docLengthsFile.open("index_docLengths.bin");
-
-		docLengthsFile.seekg(0, std::fstream::end);
-		long fileSize = docLengthsFile.tellg();
-		docLengthsFile.seekg(0, std::fstream::beg);
-
-		char* buffer = new char[fileSize];
-		docLengthsFile.read(buffer, fileSize);
-
-		docLengthsFile.close();
-
-		char* pointer = buffer;
-
-		uint32_t length = 0;
-		uint32_t docId = 0;
-		uint32_t totalLength = 0;
-		while (pointer < buffer + fileSize)
+	void submit(const std::string& query, std::function<void(const std::string&)> respond) {
+		Job job;
+		job.query = query;
+		job.respond = respond;
 		{
-			length = *reinterpret_cast<uint32_t*>(pointer);
-			pointer += 4;
-
-			++docId;
-
-			this->docIdToLength[docId] = length;
-			totalLength += length;
+			std::lock_guard<std::mutex> lock(this->jobsMutex);
+			this->jobs.push_back(job);
 		}
-		
-		delete[] buffer;
+		this->jobsCondition.notify_one();
+	}
 
-		this->totalDocuments = docId;
-		this->averageDocumentLength = (float)totalLength / this->totalDocuments;
+	// Print the answer to stdin query number outputIndex, and any later ones that are ready
+	void writeOrderedOutput(uint64_t outputIndex, const std::string& answer) {
+		std::lock_guard<std::mutex> lock(this->outputMutex);
+		this->pendingOutput[outputIndex] = answer;
+		std::map<uint64_t, std::string>::iterator it = this->pendingOutput.find(this->nextOutputIndex);
+		while (it != this->pendingOutput.end()) {
+			std::cout << it->second;
+			this->pendingOutput.erase(it);
+			++this->nextOutputIndex;
+			it = this->pendingOutput.find(this->nextOutputIndex);
+		}
+		std::cout << std::flush;
 	}
 
-	// Get document length(how many words in doc) with docId: 1, 2, 3, ... (read from the postings)
-	uint32_t getDocumentLength(uint32_t docId) {
-		std::unordered_map<uint32_t, uint32_t>::iterator itr = this->docIdToLength.find(docId);
-		if (itr != this->docIdToLength.end()) {
-			return itr->second;
+	bool startListening() {
+		this->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (this->listenFd < 0)
+			return false;
+
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, this->socketPath.c_str(), sizeof(address.sun_path) - 1);
+		unlink(this->socketPath.c_str());
+
+		if (bind(this->listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(this->listenFd, 64) != 0) {
+			close(this->listenFd);
+			this->listenFd = -1;
+			return false;
 		}
-		return 0;
+		return true;
 	}
 
-	// Load words and get the postings offset (this->wordToPostingsIndex)
-	void loadWords() {
-		std::ifstream wordsFile;
-		wordsFile.open("index_words.bin");
+	// Join the threads of the clients that have disconnected
+	void cleanUpConnections() {
+		std::lock_guard<std::mutex> lock(this->connectionsMutex);
+		std::list<Connection>::iterator it = this->connections.begin();
+		while (it != this->connections.end()) {
+			if (it->finished) {
+				it->thread.join();
+				close(it->fd);
+				it = this->connections.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
 
-		// Get how many bytes the words.bin have
-		wordsFile.seekg(0, std::ifstream::end);
-		long fileSize = wordsFile.tellg();
-		wordsFile.seekg(0, std::ifstream::beg);
+	void acceptConnections() {
+		while (!serverStopRequested) {
+			this->cleanUpConnections();
+
+			struct pollfd pollFd;
+			pollFd.fd = this->listenFd;
+			pollFd.events = POLLIN;
+			if (poll(&pollFd, 1, 100) <= 0) // Wake up every 100ms to check for stop
+				continue;
+
+			int connectionFd = accept(this->listenFd, NULL, NULL);
+			if (connectionFd < 0)
+				continue;
+
+			std::lock_guard<std::mutex> lock(this->connectionsMutex);
+			this->connections.push_back(Connection());
+			Connection& connection = this->connections.back();
+			connection.fd = connectionFd;
+			connection.finished = false;
+			connection.thread = std::thread(&QueryServer::serveConnection, this, &connection);
+		}
+	}
 
-		// Batch reading is faster than reading byte by byte
-		char* buffer = new char[fileSize];
-		wordsFile.read(buffer, fileSize);
-		
-		wordsFile.close();
+	void serveConnection(Connection* connection) {
+		this->answerClient(connection->fd);
+		std::lock_guard<std::mutex> lock(this->connectionsMutex);
+		connection->finished = true;
+	}
 
-		char* pointer = buffer;
+	// Read queries from a client, one line each, and send back each answer before reading the next query
+	void answerClient(int connectionFd) {
+		std::string received;
+		char buffer[4096];
+		while (true) {
+			ssize_t bytesRead = read(connectionFd, buffer, sizeof(buffer));
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+			if (bytesRead <= 0)
+				break;
+			received.append(buffer, bytesRead);
+
+			size_t lineEnd = 0;
+			while ((lineEnd = received.find('\n')) != std::string::npos) {
+				std::string query = received.substr(0, lineEnd);
+				received.erase(0, lineEnd + 1);
+
+				std::shared_ptr<std::promise<std::string> > answer(new std::promise<std::string>());
+				std::future<std::string> futureAnswer = answer->get_future();
+				this->submit(query, [answer](const std::string& text) { answer->set_value(text); });
+
+				std::string text = futureAnswer.get();
+				size_t sent = 0;
+				while (sent < text.size()) {
+					ssize_t bytesSent = send(connectionFd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+					if (bytesSent <= 0)
+						return;
+					sent += bytesSent;
+				}
+			}
+		}
+	}
 
-		uint32_t wordCount = *reinterpret_cast<uint32_t*>(pointer);
-		pointer += 4;
+	void reportStats(double seconds) {
+		std::vector<uint32_t> latencies;
+		for (size_t i = 0; i < this->workerLatencies.size(); ++i)
+			latencies.insert(latencies.end(), this->workerLatencies[i].begin(), this->workerLatencies[i].end());
+		std::sort(latencies.begin(), latencies.end());
+
+		std::cerr << "Queries: " << latencies.size() << ", threads: " << this->threadCount
+			<< ", time: " << seconds << "s, QPS: " << (seconds > 0 ? latencies.size() / seconds : 0) << std::endl;
+		if (latencies.empty())
+			return;
+		std::cerr << "Latency (us): p50 " << latencies[latencies.size() * 50 / 100]
+			<< ", p95 " << latencies[latencies.size() * 95 / 100]
+			<< ", p99 " << latencies[latencies.size() * 99 / 100]
+			<< ", max " << latencies.back() << std::endl;
+		this->engine.reportCacheStats();
+	}
 
-		for (uint32_t i = 0; i < wordCount; ++i) {
-			uint8_t wordLength = *pointer; //*reinterpret_cast<uint8_t*>(pointer);
-			++pointer;
+public:
+	QueryServer(SearchEngine& engine, uint32_t threadCount, const std::string& socketPath) : engine(engine) {
+		this->threadCount = threadCount > 0 ? threadCount : 1;
+		this->socketPath = socketPath;
+		this->stopping = false;
+		this->nextOutputIndex = 0;
+		this->listenFd = -1;
+	}
 
-			std::string word(pointer, wordLength);
-			pointer += wordLength;
+	void run() {
+		std::chrono::steady_clock::time_point timeBegin = std::chrono::steady_clock::now();
+
+		// No SA_RESTART, so that a signal also interrupts reading stdin
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = requestServerStop;
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+
+		this->workerLatencies.resize(this->threadCount);
+		for (uint32_t i = 0; i < this->threadCount; ++i)
+			this->workers.push_back(std::thread(&QueryServer::runWorker, this, i));
+
+		std::thread acceptThread;
+		if (this->socketPath.length() > 0) {
+			if (this->startListening())
+				acceptThread = std::thread(&QueryServer::acceptConnections, this);
+			else
+				std::cerr << "Can't listen on " << this->socketPath << std::endl;
+		}
 
-			uint32_t pos = *reinterpret_cast<uint32_t*>(pointer);
-			pointer += 4;
+		std::string query;
+		uint64_t queryIndex = 0;
+		while (!serverStopRequested && std::getline(std::cin, query)) {
+			uint64_t outputIndex = queryIndex++;
+			this->submit(query, [this, outputIndex](const std::string& answer) { this->writeOrderedOutput(outputIndex, answer); });
+		}
 
-			uint32_t docCount = *reinterpret_cast<uint32_t*>(pointer);
-			pointer += 4;
+		if (acceptThread.joinable()) {
+			// Keep serving the socket until SIGINT / SIGTERM
+			while (!serverStopRequested)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			acceptThread.join();
+			close(this->listenFd);
+			unlink(this->socketPath.c_str());
+
+			// Wake up the clients' threads and wait for them
+			{
+				std::lock_guard<std::mutex> lock(this->connectionsMutex);
+				for (std::list<Connection>::iterator it = this->connections.begin(); it != this->connections.end(); ++it)
+					shutdown(it->fd, SHUT_RDWR);
+			}
+			for (std::list<Connection>::iterator it = this->connections.begin(); it != this->connections.end(); ++it) {
+				it->thread.join();
+				close(it->fd);
+			}
+			this->connections.clear();
+		}
 
-			this->wordToPostingsIndex[word] = std::pair<uint32_t, uint32_t>(pos, docCount);
+		// Finish the queued queries, then stop the workers
+		{
+			std::lock_guard<std::mutex> lock(this->jobsMutex);
+			this->stopping = true;
 		}
+		this->jobsCondition.notify_all();
+		for (size_t i = 0; i < this->workers.size(); ++i)
+			this->workers[i].join();
 
-		delete[] buffer;
+		std::chrono::steady_clock::time_point timeEnd = std::chrono::steady_clock::now();
+		if (this->engine.getOptions().shardIndex < 0) // The coordinator reports for its shard workers
+			this->reportStats(std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeBegin).count() / 1e6);
 	}
+};
 
-	// Load DocNo.bin and push_back to this->vecDocNo
-	void loadDocNo() {
-		std::ifstream docNoFile; 
-		docNoFile.open("index_docNo.bin");
-
-		// Get the file size
-		docNoFile.seekg(0, std::ifstream::end);
-		long fileSize = docNoFile.tellg();
-		docNoFile.seekg(0, std::ifstream::beg);
-
-		// Create a buffer and load the entire file
-		char* buffer = new char[fileSize];
-		docNoFile.read(buffer, fileSize);
-
-		docNoFile.close();
+// Scatter-gather over document-partitioned shards (see shards.h): a worker process ./searchEngine --shard=K --server --threads=1
+// for every shard, connected with pipes. Every query is written to all the workers first, so that the shards are searched at
+// the same time, then their answers are read and merged into the top k. Workers score with the statistics of the whole
+// collection and answer with docIds of the collection, so the results are the same as one index of all the documents.
+class ShardCoordinator {
 
-		char* pointer = buffer;
+private:
+	// A worker process, its stdin and its stdout
+	struct ShardWorker {
+		pid_t pid;
+		int queryFd;
+		FILE* answers;
+	};
+
+	SearchOptions options;
+	std::vector<ShardWorker> workers;
+	std::vector<uint32_t> latencies; // Query latencies in microseconds
+
+	bool startWorker(uint32_t shardIndex) {
+		std::vector<std::string> arguments;
+		arguments.push_back("/proc/self/exe");
+		arguments.push_back("--shard=" + std::to_string(shardIndex));
+		arguments.push_back("--server");
+		arguments.push_back("--threads=1");
+		arguments.push_back(std::string("--mode=") + getQueryModeName(this->options.queryMode));
+		arguments.push_back("--k=" + std::to_string(this->options.topK));
+		arguments.push_back("--budget=" + std::to_string(this->options.postingsBudget));
+		arguments.push_back("--result-cache=" + std::to_string(this->options.resultCacheBytes >> 20));
+		arguments.push_back("--postings-cache=" + std::to_string(this->options.postingsCacheBytes >> 20));
+		arguments.push_back("--query-threads=" + std::to_string(this->options.queryThreads));
+		arguments.push_back("--parallel-postings=" + std::to_string(this->options.parallelPostings));
+		// Every worker appends its own lines, with its shard
+		if (!this->options.traceFileName.empty())
+			arguments.push_back("--trace=" + this->options.traceFileName);
+		if (!this->options.metricsFileName.empty())
+			arguments.push_back("--metrics=" + this->options.metricsFileName);
+
+		int queryPipe[2];
+		int answerPipe[2];
+		if (pipe(queryPipe) != 0)
+			return false;
+		if (pipe(answerPipe) != 0) {
+			close(queryPipe[0]);
+			close(queryPipe[1]);
+			return false;
+		}
 
-		while (pointer < buffer + fileSize) {
-			std::string docNo(pointer);
-			this->vecDocNo.push_back(docNo);
-			pointer += (docNo.size() + 1); // +1 for the '\0' between pointers
+		pid_t pid = fork();
+		if (pid == 0) {
+			dup2(queryPipe[0], 0);
+			dup2(answerPipe[1], 1);
+			close(queryPipe[0]);
+			close(queryPipe[1]);
+			close(answerPipe[0]);
+			close(answerPipe[1]);
+			for (size_t i = 0; i < this->workers.size(); ++i) { // Only the coordinator talks to the other workers
+				close(this->workers[i].queryFd);
+				fclose(this->workers[i].answers);
+			}
+			std::vector<char*> argv;
+			for (size_t i = 0; i < arguments.size(); ++i)
+				argv.push_back(const_cast<char*>(arguments[i].c_str()));
+			argv.push_back(NULL);
+			execv(argv[0], argv.data());
+			_exit(127);
+		}
+		close(queryPipe[0]);
+		close(answerPipe[1]);
+		if (pid < 0) {
+			close(queryPipe[1]);
+			close(answerPipe[0]);
+			return false;
 		}
 
-		delete[] buffer; // Release the buffer
+		ShardWorker worker;
+		worker.pid = pid;
+		worker.queryFd = queryPipe[1];
+		worker.answers = fdopen(answerPipe[0], "r");
+		this->workers.push_back(worker);
+		return true;
 	}
 
-	// Get word postings. input: word
-	// return: [(docId1, tf1), (docId2, tf2), ...], e.g. [(2, 3), (3, 6), ...]
-	std::vector<std::pair<uint32_t, uint32_t> > getWordPostings(const std::string& word) {
-		std::vector<std::pair<uint32_t, uint32_t> > postings;
-
-		std::unordered_map<std::string, std::pair<uint32_t, uint32_t> >::iterator postingsIndexIt = this->wordToPostingsIndex.find(word);
-		if (postingsIndexIt == this->wordToPostingsIndex.end()) {
-			return postings; // Can't find the word, return empty vector
+	// Read the answer of a worker: "docId score docNo" lines, then a blank line
+	// return false if the worker is gone
+	bool readAnswer(ShardWorker& worker, std::vector<std::pair<uint32_t, float> >& results, std::unordered_map<uint32_t, std::string>& docNos) {
+		char* line = NULL;
+		size_t capacity = 0;
+		ssize_t length = 0;
+		bool answered = false;
+		while ((length = getline(&line, &capacity, worker.answers)) > 0) {
+			if (line[0] == '\n') {
+				answered = true;
+				break;
+			}
+			char* end = NULL;
+			uint32_t docId = (uint32_t)std::strtoul(line, &end, 10);
+			float score = std::strtof(end, &end);
+			while (*end == ' ')
+				++end;
+			results.push_back(std::pair<uint32_t, float>(docId, score));
+			docNos[docId] = std::string(end, line + length - end - 1); // Without the '\n'
 		}
+		free(line);
+		return answered;
+	}
 
-		std::pair<uint32_t, uint32_t> postingsIndexPair = postingsIndexIt->second;
-		uint32_t pos = postingsIndexPair.first;
-		uint32_t docCount = postingsIndexPair.second;
-
-		// Seek and read wordPostings.bin to find the postings(docId and tf) of this word
-		wordPostingsFile.seekg(sizeof(uint32_t) * pos * 2, std::ifstream::beg); // * 2 because every doc has docId and term frequency
-		for (uint32_t i = 0; i < docCount; ++i) {
-			uint32_t docId = 0;
-			uint32_t tf = 0;
-			wordPostingsFile.read((char*)&docId, 4);
-			wordPostingsFile.read((char*)&tf, 4);
+	// Send the query to every worker, then merge their results
+	// return false if a worker is gone
+	bool search(const std::string& query, std::string& answer) {
+		std::string line = query + "\n";
+		for (size_t i = 0; i < this->workers.size(); ++i) {
+			if (write(this->workers[i].queryFd, line.data(), line.size()) != (ssize_t)line.size())
+				return false;
+		}
 
-			postings.push_back(std::pair<uint32_t, uint32_t>(docId, tf));
+		std::vector<std::pair<uint32_t, float> > results;
+		std::unordered_map<uint32_t, std::string> docNos;
+		for (size_t i = 0; i < this->workers.size(); ++i) {
+			if (!this->readAnswer(this->workers[i], results, docNos))
+				return false;
 		}
 
-		return postings;
+		// The same k as the workers: all the results of the exhaustive mode unless --k is given
+		uint32_t k = this->options.topK;
+		if (k == 0 && this->options.queryMode != QUERY_MODE_EXHAUSTIVE)
+			k = DEFAULT_TOP_K;
+		std::sort(results.begin(), results.end(), sortScoreCompare);
+		if (k > 0 && results.size() > k)
+			results.resize(k);
+
+		std::ostringstream output;
+		for (size_t i = 0; i < results.size(); ++i)
+			output << docNos[results[i].first] << " " << results[i].second << "\n";
+		answer = output.str();
+		return true;
 	}
 
-	// tf_td: number of the term appears in doc
-	// docLength: how many words in the document
-	// idf: inverted document frequency (calculated by total document and documents contain the word)
-	float getRankingScore(uint32_t tf_td, uint32_t docLength, float idf) {
-		// TF-IDF
-		// float tf_td_normalized = (float)tf_td / docLength;
-		// float idf = (float)this->totalDocuments / docCountContainWord;
-		// return tf_td_normalized * idf;
-
-		// BM25 - in the slides (but it will produce negative value when docCountContainWord > 1/2 totalDocuments, then the ranking is wrong)
-		// float w_t = std::log2f((this->totalDocuments - docCountContainWord + 0.5f) / (docCountContainWord + 0.5f));
-		// float k1 = 1.2f;
-		// float k3 = 7;
-		// float b = 0.75f;
-		// float K = k1 * ((1 - b) + (b * docLength / this->averageDocumentLength));
-		// float w_dt = w_t * ((k1 + 1) * tf_td / (K + tf_td)) * ((k3 + 1) * tf_tq / (k3 + tf_tq));
-		// return w_dt;
-
-		// Okapi BM25 https://en.wikipedia.org/wiki/Okapi_BM25
-		float k1 = 1.2f;
-		float b = 0.75f;
-		float K = k1 * ((1 - b) + b * (docLength / this->averageDocumentLength));
-		float score = idf * (tf_td * (k1 + 1) / (tf_td + K));
-		return score;
+	void stop() {
+		for (size_t i = 0; i < this->workers.size(); ++i) {
+			close(this->workers[i].queryFd); // The worker stops at the end of its stdin
+			fclose(this->workers[i].answers);
+			waitpid(this->workers[i].pid, NULL, 0);
+		}
+		this->workers.clear();
 	}
 
-	// input: query (multiple words) e.g. italy commercial
-	// output: a list of sorted docId and score. e.g. [(1, 2.5), (10, 2.1), ...]
-	std::vector<std::pair<uint32_t, float> > getSortedRelevantDocuments(const std::string& query) {
-		std::vector<std::string> words = extractWords(query);
-
-		std::unordered_map<uint32_t, float> mapDocIdScore;
-		for (std::vector<std::string>::iterator itrWords = words.begin(); itrWords != words.end(); ++itrWords) {
-			std::string word = *itrWords;
-			for (size_t i = 0; i < word.length(); ++i)
-				word[i] = std::tolower(word[i]);
-
-			std::vector<std::pair<uint32_t, uint32_t> > postings = this->getWordPostings(word);
-			uint32_t docCountContainWord = postings.size();
+public:
+	ShardCoordinator(const SearchOptions& options) {
+		this->options = options;
+	}
 
-			// Okapi BM25 https://en.wikipedia.org/wiki/Okapi_BM25
-			float idf = std::log((this->totalDocuments - docCountContainWord + 0.5) / (docCountContainWord + 0.5) + 1); // Ensure positive
+	~ShardCoordinator() {
+		this->stop();
+	}
 
-			for (size_t i = 0; i < postings.size(); ++i) {
-				uint32_t docId = postings[i].first; // docId (1, 2, 3, ...)
-				uint32_t tf_td = postings[i].second; // term frequency in doc
-	
-				uint32_t docLength = this->getDocumentLength(docId);
-
-				float score = this->getRankingScore(tf_td, docLength, idf);
-
-				// Add score to mapDocIdScore
-				if (score > 0) {
-					std::unordered_map<uint32_t, float>::iterator itrMapDocIdScore = mapDocIdScore.find(docId);
-					if (itrMapDocIdScore != mapDocIdScore.end()) {
-						itrMapDocIdScore->second += score;
-					}
-					else {
-						mapDocIdScore[docId] = score;
-					}
-				}
-			}	
+	// Start a worker for every shard of the manifest
+	// return false if there's no manifest or a worker can't be started
+	bool start() {
+		ShardManifest manifest;
+		if (!manifest.load()) {
+			std::cerr << "Can't read " << SHARD_MANIFEST_NAME << " (./indexer --shards=N)" << std::endl;
+			return false;
 		}
-
-		std::vector<std::pair<uint32_t, float> > vecDocIdScore; // docId and score: [(docId1, score1), (docId2, score2), ...]
-		for (std::unordered_map<uint32_t, float>::iterator itrMapDocIdScore = mapDocIdScore.begin(); itrMapDocIdScore != mapDocIdScore.end(); ++itrMapDocIdScore) {
-			vecDocIdScore.push_back(std::pair<uint32_t, float>(itrMapDocIdScore->first, itrMapDocIdScore->second));			
+		signal(SIGPIPE, SIG_IGN); // A worker that exits shows up as a failed write
+		for (uint32_t i = 0; i < manifest.shards.size(); ++i) {
+			if (!this->startWorker(i)) {
+				std::cerr << "Can't start the worker of shard " << i << std::endl;
+				return false;
+			}
 		}
-
-		// Sort by score
-		std::sort(vecDocIdScore.begin(), vecDocIdScore.end(), sortScoreCompare);
-
-		return vecDocIdScore;
+		return true;
 	}
 
-
-	void run() {
-		// std::string query = "rosenfield wall street unilateral representation";
-		// std::string query = "hello";
+	// Answer the queries from stdin, one at a time. In server mode every answer is followed by a blank line,
+	// otherwise only the first query is answered, like ./searchEngine.
+	void run(bool server) {
+		std::chrono::steady_clock::time_point timeBegin = std::chrono::steady_clock::now();
 		std::string query;
-		std::getline(std::cin, query);
-		std::vector<std::pair<uint32_t, float> > vecDocIdScore = this->getSortedRelevantDocuments(query);
-
-		// Print the sorted list of docNo and score
-		for (size_t i = 0; i < vecDocIdScore.size(); ++i) {
-			uint32_t docId = vecDocIdScore[i].first;
-			std::string docNo = this->vecDocNo[docId - 1];
-			float score = vecDocIdScore[i].second;
-
-			std::cout << docNo << " " << score << std::endl;
+		std::string answer;
+		while (std::getline(std::cin, query)) {
+			std::chrono::steady_clock::time_point queryBegin = std::chrono::steady_clock::now();
+			if (!this->search(query, answer)) {
+				std::cerr << "A shard worker stopped" << std::endl;
+				break;
+			}
+			std::chrono::steady_clock::time_point queryEnd = std::chrono::steady_clock::now();
+			this->latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(queryEnd - queryBegin).count());
+
+			std::cout << answer << (server ? "\n" : "") << std::flush;
+			if (!server) {
+				if (this->options.showTime)
+					std::cerr << "Query time: " << this->latencies.back() << "us" << std::endl;
+				break;
+			}
+		}
+		this->stop();
+
+		if (server) {
+			double seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - timeBegin).count() / 1e6;
+			std::sort(this->latencies.begin(), this->latencies.end());
+			std::cerr << "Queries: " << this->latencies.size() << ", time: " << seconds << "s, QPS: " << (seconds > 0 ? this->latencies.size() / seconds : 0) << std::endl;
+			if (!this->latencies.empty()) {
+				std::cerr << "Latency (us): p50 " << this->latencies[this->latencies.size() * 50 / 100]
+					<< ", p95 " << this->latencies[this->latencies.size() * 95 / 100]
+					<< ", p99 " << this->latencies[this->latencies.size() * 99 / 100]
+					<< ", max " << this->latencies.back() << std::endl;
+			}
 		}
-
-		this->wordPostingsFile.close();
 	}
 };
 
-int main() {
+int main(int argc, char* argv[]) {
 	
 	// std::chrono::steady_clock::time_point time_begin = std::chrono::steady_clock::now();
 
-	SearchEngine engine;
-	engine.load();
-	engine.run();
+	SearchOptions options;
+	bool server = false;
+	bool useShards = false;
+	uint32_t threadCount = std::thread::hardware_concurrency();
+	std::string socketPath = "";
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--mode=exhaustive")
+			options.queryMode = QUERY_MODE_EXHAUSTIVE;
+		else if (arg == "--mode=bmw")
+			options.queryMode = QUERY_MODE_BLOCK_MAX_WAND;
+		else if (arg == "--mode=taat")
+			options.queryMode = QUERY_MODE_TERM_AT_A_TIME;
+		else if (arg == "--mode=saat")
+			options.queryMode = QUERY_MODE_SCORE_AT_A_TIME;
+		else if (arg == "--mode=and")
+			options.queryMode = QUERY_MODE_CONJUNCTIVE;
+		else if (arg == "--mode=phrase")
+			options.queryMode = QUERY_MODE_PHRASE;
+		else if (arg == "--mode=quantized")
+			options.queryMode = QUERY_MODE_QUANTIZED;
+		else if (arg.compare(0, 9, "--budget=") == 0)
+			options.postingsBudget = std::strtoull(arg.c_str() + 9, NULL, 10);
+		else if (arg.compare(0, 4, "--k=") == 0)
+			options.topK = (uint32_t)std::strtoul(arg.c_str() + 4, NULL, 10);
+		else if (arg == "--time")
+			options.showTime = true;
+		else if (arg == "--server")
+			server = true;
+		else if (arg.compare(0, 10, "--threads=") == 0)
+			threadCount = (uint32_t)std::strtoul(arg.c_str() + 10, NULL, 10);
+		else if (arg.compare(0, 16, "--query-threads=") == 0)
+			options.queryThreads = std::max(1u, (uint32_t)std::strtoul(arg.c_str() + 16, NULL, 10));
+		else if (arg.compare(0, 20, "--parallel-postings=") == 0)
+			options.parallelPostings = std::strtoull(arg.c_str() + 20, NULL, 10);
+		else if (arg.compare(0, 9, "--socket=") == 0)
+			socketPath = arg.substr(9);
+		else if (arg.compare(0, 15, "--result-cache=") == 0)
+			options.resultCacheBytes = std::strtoull(arg.c_str() + 15, NULL, 10) << 20;
+		else if (arg.compare(0, 17, "--postings-cache=") == 0)
+			options.postingsCacheBytes = std::strtoull(arg.c_str() + 17, NULL, 10) << 20;
+		else if (arg == "--snippets")
+			options.showSnippets = true;
+		else if (arg.compare(0, 14, "--store-cache=") == 0)
+			options.storeCacheBytes = std::strtoull(arg.c_str() + 14, NULL, 10) << 20;
+		else if (arg.compare(0, 8, "--trace=") == 0)
+			options.traceFileName = arg.substr(8);
+		else if (arg.compare(0, 10, "--metrics=") == 0)
+			options.metricsFileName = arg.substr(10);
+		else if (arg == "--shards")
+			useShards = true;
+		else if (arg.compare(0, 8, "--shard=") == 0)
+			options.shardIndex = (int32_t)std::strtol(arg.c_str() + 8, NULL, 10);
+		else {
+			std::cout << "Usage: ./searchEngine [--mode=exhaustive|bmw|taat|saat|and|phrase|quantized] [--k=10] [--budget=postings] [--time]" << std::endl;
+			std::cout << "                      [--server [--threads=N] [--socket=path]] [--result-cache=MB] [--postings-cache=MB]" << std::endl;
+			std::cout << "                      [--trace=file|-] [--metrics=file] [--shards] [--query-threads=N] [--parallel-postings=N]" << std::endl;
+			std::cout << "                      [--snippets [--store-cache=MB]]" << std::endl;
+			return 0;
+		}
+	}
+
+	// Coordinator of the shard workers, it doesn't load an index itself
+	if (useShards) {
+		if (options.showSnippets) {
+			std::cout << "--snippets can't be used with --shards, the shards have no document store (./indexer --store)" << std::endl;
+			return 1;
+		}
+		if (!socketPath.empty()) {
+			std::cout << "--socket can't be used with --shards, the queries are read from stdin" << std::endl;
+			return 1;
+		}
+		ShardCoordinator coordinator(options);
+		if (!coordinator.start())
+			return 1;
+		coordinator.run(server);
+		return 0;
+	}
+
+	SearchEngine engine(options);
+	if (!engine.load())
+		return 1;
+	if (server) {
+		QueryServer queryServer(engine, threadCount, socketPath);
+		queryServer.run();
+	}
+	else {
+		engine.run();
+	}
+	engine.writeMetrics();
 
 	// std::chrono::steady_clock::time_point time_end = std::chrono::steady_clock::now();
 
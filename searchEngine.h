@@ -0,0 +1,2348 @@
+#ifndef SEARCH_ENGINE_H
+#define SEARCH_ENGINE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <map>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "postingsCodec.h"
+#include "indexFile.h"
+#include "postingsCursor.h"
+#include "postingsReader.h"
+#include "ranking.h"
+#include "tokenizer.h"
+#include "queryCache.h"
+#include "segments.h"
+#include "queryTrace.h"
+#include "shards.h"
+#include "workStealingPool.h"
+#include "frontCodedDictionary.h"
+#include "documentStore.h"
+#include "quantizedScoring.h"
+
+// The search engine: loads an index (the four index_*.bin files, index.bin, segments or a shard) and answers queries.
+// Used by ./searchEngine (searchEngine.cpp, which adds the query server and the shard coordinator) and by the search
+// library (searchLibrary.h).
+
+// Used for sorting the docId and its relevance score
+// Equal scores are sorted by docId, so that all the query modes give the same order
+inline bool sortScoreCompare(const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
+	return a.second > b.second || (a.second == b.second && a.first < b.first);
+}
+
+// Used for sorting impact segments, highest impact first
+inline bool compareImpactSegments(const ImpactSegment* a, const ImpactSegment* b) {
+	return a->impact > b->impact;
+}
+
+// Keeps the k best (docId, score) seen so far. The worst one is on the top of the heap.
+class TopKHeap {
+
+private:
+	uint32_t k;
+	std::vector<std::pair<uint32_t, float> > heap;
+
+public:
+	TopKHeap(uint32_t k) {
+		this->k = k;
+		this->heap.reserve(k + 1);
+	}
+
+	// A document must score more than this to get in
+	float threshold() const {
+		return this->heap.size() < this->k ? 0 : this->heap[0].second;
+	}
+
+	void push(uint32_t docId, float score) {
+		std::pair<uint32_t, float> item(docId, score);
+		if (this->heap.size() < this->k) {
+			this->heap.push_back(item);
+			std::push_heap(this->heap.begin(), this->heap.end(), sortScoreCompare);
+		}
+		else if (this->k > 0 && sortScoreCompare(item, this->heap[0])) {
+			std::pop_heap(this->heap.begin(), this->heap.end(), sortScoreCompare);
+			this->heap.back() = item;
+			std::push_heap(this->heap.begin(), this->heap.end(), sortScoreCompare);
+		}
+	}
+
+	// The k best, sorted by score
+	std::vector<std::pair<uint32_t, float> > getSortedResults() const {
+		std::vector<std::pair<uint32_t, float> > results = this->heap;
+		std::sort(results.begin(), results.end(), sortScoreCompare);
+		return results;
+	}
+};
+
+enum QueryMode {
+	QUERY_MODE_EXHAUSTIVE = 0, // Score every posting of every query word
+	QUERY_MODE_BLOCK_MAX_WAND = 1, // Document-at-a-time Block-Max WAND, needs index.bin
+	QUERY_MODE_TERM_AT_A_TIME = 2, // Term-at-a-time into a dense accumulator array, then a top k heap
+	QUERY_MODE_SCORE_AT_A_TIME = 3, // Impact-ordered segments, highest impact first, within a postings budget. Needs ./indexer --impacts
+	QUERY_MODE_CONJUNCTIVE = 4, // Only documents containing every query word (AND), needs index.bin
+	QUERY_MODE_PHRASE = 5, // Only documents containing the query words next to each other, in order. Needs ./indexer --positions
+	QUERY_MODE_QUANTIZED = 6 // Term-at-a-time adding the precomputed, quantized BM25 scores of the postings. Needs ./indexer --quantized
+};
+
+const char* const QUERY_MODE_NAMES[] = {"exhaustive", "bmw", "taat", "saat", "and", "phrase", "quantized"}; // Same as --mode=
+
+inline const char* getQueryModeName(QueryMode queryMode) {
+	return QUERY_MODE_NAMES[queryMode];
+}
+
+const uint32_t DEFAULT_TOP_K = 10; // Used by the modes that need a k when none is given
+
+// Snippets (--snippets): a window of this many words of every result, from index_store.bin, with the query words highlighted
+const size_t SNIPPET_WORDS = 30;
+const char* const SNIPPET_HIGHLIGHT_START = "<b>";
+const char* const SNIPPET_HIGHLIGHT_END = "</b>";
+const uint64_t DEFAULT_STORE_CACHE_BYTES = 16 << 20; // Decompressed blocks of the document store
+
+// A wildcard (e.g. rosenf*) is replaced by at most this many of the words starting with its prefix, those in the most documents
+const size_t WILDCARD_MAX_WORDS = 64;
+
+// Intra-query parallelism (exhaustive and taat): queries with at least this many postings are scored by the work-stealing pool,
+// in about PARALLEL_RANGES_PER_THREAD docId ranges per thread, so that a thread that's done early can steal the rest
+const uint64_t DEFAULT_PARALLEL_POSTINGS = 200000;
+const uint32_t PARALLEL_RANGES_PER_THREAD = 4;
+
+// The dense accumulator array is cleared lazily in pages of 4096 documents:
+// a page is zeroed the first time a query touches it, and only touched pages are scanned for the top k
+const uint32_t ACCUMULATOR_PAGE_BITS = 12;
+const uint32_t ACCUMULATOR_PAGE_SIZE = 1 << ACCUMULATOR_PAGE_BITS;
+
+// Dense score accumulators for term-at-a-time (float) and score-at-a-time (integer impacts) queries,
+// indexed by docId, reused by every query
+template <typename Score>
+class ScoreAccumulator {
+
+private:
+	std::vector<Score> scores; // docId -> score
+	std::vector<uint8_t> pageTouched; // page -> whether the page has been zeroed for the current query
+	std::vector<uint32_t> touchedPages; // Pages touched by the current query
+
+	void touchPage(uint32_t page) {
+		if (!this->pageTouched[page]) {
+			memset(&this->scores[(size_t)page * ACCUMULATOR_PAGE_SIZE], 0, ACCUMULATOR_PAGE_SIZE * sizeof(Score));
+			this->pageTouched[page] = 1;
+			this->touchedPages.push_back(page);
+		}
+	}
+
+public:
+	void resize(uint32_t totalDocuments) {
+		uint32_t pageCount = (totalDocuments >> ACCUMULATOR_PAGE_BITS) + 1; // docId starts from 1
+		this->scores.assign((size_t)pageCount * ACCUMULATOR_PAGE_SIZE, 0);
+		this->pageTouched.assign(pageCount, 0);
+		this->touchedPages.clear();
+	}
+
+	bool isEmpty() const {
+		return this->scores.empty();
+	}
+
+	void add(uint32_t docId, Score score) {
+		this->touchPage(docId >> ACCUMULATOR_PAGE_BITS);
+		this->scores[docId] += score;
+	}
+
+	// Add the quantized impacts of a block of postings (integer accumulators only, see quantizedScoring.h).
+	// docIds are increasing, so a page is only checked when it changes.
+	template <typename Impact>
+	void addImpacts(const uint32_t* docIds, const Impact* impacts, uint32_t count) {
+		uint32_t lastPage = 0xFFFFFFFF;
+		for (uint32_t i = 0; i < count; ++i) {
+			uint32_t page = docIds[i] >> ACCUMULATOR_PAGE_BITS;
+			if (page != lastPage) {
+				this->touchPage(page);
+				lastPage = page;
+			}
+		}
+		accumulateImpacts(this->scores.data(), docIds, impacts, count);
+	}
+
+	// Push every scored document of the touched pages to the heap, and get ready for the next query
+	void selectTopK(TopKHeap& topKHeap) {
+		std::sort(this->touchedPages.begin(), this->touchedPages.end());
+		for (size_t i = 0; i < this->touchedPages.size(); ++i) {
+			uint32_t page = this->touchedPages[i];
+			uint32_t start = page << ACCUMULATOR_PAGE_BITS;
+			const Score* pageScores = &this->scores[start];
+			for (uint32_t j = 0; j < ACCUMULATOR_PAGE_SIZE; ++j) {
+				if ((float)pageScores[j] > topKHeap.threshold())
+					topKHeap.push(start + j, (float)pageScores[j]);
+			}
+			this->pageTouched[page] = 0;
+		}
+		this->touchedPages.clear();
+	}
+};
+
+// Integer scores: jump to the next score above the k-th best with a SIMD compare, instead of testing every document of the page
+template <>
+inline void ScoreAccumulator<uint32_t>::selectTopK(TopKHeap& topKHeap) {
+	std::sort(this->touchedPages.begin(), this->touchedPages.end());
+	for (size_t i = 0; i < this->touchedPages.size(); ++i) {
+		uint32_t page = this->touchedPages[i];
+		uint32_t start = page << ACCUMULATOR_PAGE_BITS;
+		const uint32_t* pageScores = &this->scores[start];
+		uint32_t j = findScoreAbove(pageScores, 0, ACCUMULATOR_PAGE_SIZE, (uint32_t)topKHeap.threshold());
+		while (j < ACCUMULATOR_PAGE_SIZE) {
+			topKHeap.push(start + j, (float)pageScores[j]);
+			j = findScoreAbove(pageScores, j + 1, ACCUMULATOR_PAGE_SIZE, (uint32_t)topKHeap.threshold());
+		}
+		this->pageTouched[page] = 0;
+	}
+	this->touchedPages.clear();
+}
+
+// Upper bounds are summed in a different order than the real scores, so allow for float rounding
+// when comparing them with the threshold
+const float UPPER_BOUND_SLACK = 1.00001f;
+
+// Scratch state of one query thread. The SearchEngine is read-only after load(), so any number of threads
+// can query it at the same time, each with its own QueryContext.
+struct QueryContext {
+	std::vector<uint8_t> postingsBuffer; // Postings read from index_wordPostings.bin
+	std::vector<std::vector<uint8_t> > postingsBuffers; // Postings of all the words of a query, read in one batch
+	BatchReader postingsReader; // For the batches, with its own io_uring instance (see postingsReader.h)
+	ScoreAccumulator<float> scoreAccumulator; // For the term-at-a-time mode, allocated by the first query
+	ScoreAccumulator<uint32_t> impactAccumulator; // For the score-at-a-time mode, allocated by the first query
+	QueryTrace* trace; // Breakdown of the current query, NULL unless tracing is on
+
+	QueryContext() {
+		this->trace = NULL;
+	}
+};
+
+// Command line options of the search engine
+struct SearchOptions {
+	QueryMode queryMode;
+	uint32_t topK; // How many results to output, 0 for all
+	bool showTime; // Output the query time to stderr
+	uint64_t postingsBudget; // Score-at-a-time: maximum number of postings processed per query, 0 for no limit
+	uint64_t resultCacheBytes; // Memory of the query result cache, 0 to disable it
+	uint64_t postingsCacheBytes; // Memory of the decoded postings cache, 0 to disable it
+	std::string traceFileName; // JSON line of every query's trace (see queryTrace.h), empty to disable tracing
+	std::string metricsFileName; // JSON line of the engine metrics at exit, empty for none
+	int32_t shardIndex; // Search index_shard_K.bin as a worker of ./searchEngine --shards (see shards.h), -1 otherwise
+	uint32_t queryThreads; // Threads that can score one query together, 1 for no intra-query parallelism
+	uint64_t parallelPostings; // Queries with at least this many postings are scored in parallel
+	bool showSnippets; // Output a snippet of every result (of the first DEFAULT_TOP_K without --k) from index_store.bin
+	uint64_t storeCacheBytes; // Memory of the decompressed document store blocks, 0 to disable it
+
+	SearchOptions() {
+		this->queryMode = QUERY_MODE_EXHAUSTIVE;
+		this->topK = 0;
+		this->showTime = false;
+		this->postingsBudget = 0;
+		this->resultCacheBytes = 0;
+		this->postingsCacheBytes = 0;
+		this->shardIndex = -1;
+		this->queryThreads = std::max(1u, std::thread::hardware_concurrency());
+		this->parallelPostings = DEFAULT_PARALLEL_POSTINGS;
+		this->showSnippets = false;
+		this->storeCacheBytes = DEFAULT_STORE_CACHE_BYTES;
+	}
+};
+
+// Read size bytes at offset, return false if the file is shorter. Safe to call from many threads on one file descriptor.
+inline bool preadFully(int fd, void* buffer, size_t size, uint64_t offset) {
+	char* pointer = (char*)buffer;
+	while (size > 0) {
+		ssize_t bytesRead = pread(fd, pointer, size, (off_t)offset);
+		if (bytesRead < 0 && errno == EINTR)
+			continue;
+		if (bytesRead <= 0)
+			return false;
+		pointer += bytesRead;
+		size -= bytesRead;
+		offset += bytesRead;
+	}
+	return true;
+}
+
+// A memory-mapped index.bin container (see indexFile.h): the whole index, or one segment of it (see segments.h).
+// Its documents have docIds 1, 2, 3, ... in the container, and docIdBase + 1, docIdBase + 2, ... in the search engine.
+struct IndexSegment {
+	IndexFile indexFile;
+	uint32_t docIdBase; // Number of documents in the segments before this one
+	uint32_t documentCount;
+	uint64_t totalLength;
+	PostingsFormat postingsFormat;
+
+	const uint8_t* postingsData; // Postings section
+	const TermEntry* termEntries; // Sorted words, termCount + 1 entries
+	uint32_t termCount;
+	const char* termStrings;
+	const uint32_t* docLengths; // docId - 1 -> documentLength
+	const uint64_t* docNoOffsets; // DOCNO offsets, documentCount + 1 entries
+	const char* docNoStrings;
+	const TermBlockMax* termBlockMax; // Maximum scores, parallel to termEntries
+	const BlockMaxEntry* blockMaxEntries;
+	const BlockBoundEntry* blockBounds; // Parallel to blockMaxEntries (optional)
+
+	const ImpactStats* impactStats; // Impact-ordered index (optional)
+	const TermImpacts* termImpacts; // Parallel to termEntries
+	const ImpactSegment* impactSegments;
+	const uint8_t* impactPostings;
+
+	const QuantizedStats* quantizedStats; // Quantized index (optional)
+	const uint64_t* quantizedOffsets; // Parallel to termEntries
+	const uint8_t* quantizedImpacts;
+
+	const uint8_t* positionsData; // Positional index (optional)
+	const uint64_t* positionBlocks; // Parallel to blockMaxEntries
+
+	const CollectionStats* collectionStats; // Only in a shard (see shards.h) or a first tier
+	const uint32_t* collectionDocCounts; // Parallel to termEntries, only in a shard or a first tier
+	const float* tierBounds; // Parallel to termEntries, only in a first tier (index_tier1.bin)
+
+	// With more than one segment, the maximum scores of the container are computed with the segment's own statistics, so
+	// upper bounds are recomputed with the statistics of all the segments from blockBounds, without the idf
+	std::vector<TermBlockMax> termBoundList;
+	std::vector<BlockMaxEntry> blockBoundList;
+
+	// Memory-map the container and point to its sections, nothing is copied
+	// return false if there's no valid container
+	bool open(const std::string& fileName, uint32_t docIdBase) {
+		if (!this->indexFile.open(fileName))
+			return false;
+
+		const IndexStats* stats = (const IndexStats*)this->indexFile.getSection(SECTION_STATS);
+		this->docLengths = (const uint32_t*)this->indexFile.getSection(SECTION_DOC_LENGTHS);
+		this->docNoOffsets = (const uint64_t*)this->indexFile.getSection(SECTION_DOCNO_OFFSETS);
+		this->docNoStrings = (const char*)this->indexFile.getSection(SECTION_DOCNO);
+		this->postingsData = this->indexFile.getSection(SECTION_POSTINGS);
+		this->termEntries = (const TermEntry*)this->indexFile.getSection(SECTION_TERMS);
+		this->termStrings = (const char*)this->indexFile.getSection(SECTION_TERM_STRINGS);
+		this->termBlockMax = (const TermBlockMax*)this->indexFile.getSection(SECTION_TERM_BLOCK_MAX); // Optional
+		this->blockMaxEntries = (const BlockMaxEntry*)this->indexFile.getSection(SECTION_BLOCK_MAX);
+		this->blockBounds = (const BlockBoundEntry*)this->indexFile.getSection(SECTION_BLOCK_BOUNDS);
+		this->impactStats = (const ImpactStats*)this->indexFile.getSection(SECTION_IMPACT_STATS); // Optional
+		this->termImpacts = (const TermImpacts*)this->indexFile.getSection(SECTION_IMPACT_TERMS);
+		this->impactSegments = (const ImpactSegment*)this->indexFile.getSection(SECTION_IMPACT_SEGMENTS);
+		this->impactPostings = this->indexFile.getSection(SECTION_IMPACT_POSTINGS);
+		this->quantizedStats = (const QuantizedStats*)this->indexFile.getSection(SECTION_QUANTIZED_STATS); // Optional
+		this->quantizedOffsets = (const uint64_t*)this->indexFile.getSection(SECTION_QUANTIZED_OFFSETS);
+		this->quantizedImpacts = this->indexFile.getSection(SECTION_QUANTIZED_IMPACTS);
+		this->positionsData = this->indexFile.getSection(SECTION_POSITIONS); // Optional
+		this->positionBlocks = (const uint64_t*)this->indexFile.getSection(SECTION_POSITION_BLOCKS);
+		this->collectionStats = (const CollectionStats*)this->indexFile.getSection(SECTION_COLLECTION_STATS); // Optional
+		this->collectionDocCounts = (const uint32_t*)this->indexFile.getSection(SECTION_COLLECTION_DOC_COUNTS);
+		this->tierBounds = (const float*)this->indexFile.getSection(SECTION_TIER_BOUNDS); // Optional
+		if (stats == NULL || this->docLengths == NULL || this->docNoOffsets == NULL || this->docNoStrings == NULL
+			|| this->postingsData == NULL || this->termEntries == NULL || this->termStrings == NULL) {
+			std::cerr << fileName << " is missing sections" << std::endl;
+			return false;
+		}
+
+		this->docIdBase = docIdBase;
+		this->documentCount = (uint32_t)stats->totalDocuments;
+		this->totalLength = stats->totalLength;
+		this->termCount = stats->termCount;
+		this->postingsFormat = (PostingsFormat)stats->postingsFormat;
+		return true;
+	}
+
+	bool hasBlockMax() const {
+		return this->termBlockMax != NULL && this->blockMaxEntries != NULL;
+	}
+
+	// How many documents contain the word at termIndex, in the whole collection for a shard
+	uint32_t getCollectionDocCount(uint32_t termIndex) const {
+		return this->collectionDocCounts != NULL ? this->collectionDocCounts[termIndex] : this->termEntries[termIndex].docCount;
+	}
+
+	// Ask the kernel to start reading the postings of the word at termIndex, so that the page faults of
+	// the postings of all the query words don't wait for one disk read after another
+	void prefetchPostings(uint32_t termIndex) const {
+		static const uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+		uintptr_t begin = (uintptr_t)(this->postingsData + this->termEntries[termIndex].postingsOffset) & ~(pageSize - 1);
+		uintptr_t end = (uintptr_t)(this->postingsData + this->termEntries[termIndex + 1].postingsOffset);
+		if (end > begin)
+			madvise((void*)begin, end - begin, MADV_WILLNEED);
+	}
+
+	// Recompute the upper bounds of the blocks with the average document length of all the segments, without the idf
+	// return false if the container has no block bounds
+	bool computeBlockBounds(float averageDocumentLength) {
+		if (!this->hasBlockMax() || this->blockBounds == NULL)
+			return false;
+
+		this->termBoundList.resize(this->termCount);
+		for (uint32_t i = 0; i < this->termCount; ++i) {
+			TermBlockMax& termBound = this->termBoundList[i];
+			termBound.blockOffset = this->termBlockMax[i].blockOffset;
+			termBound.maxScore = 0;
+			termBound.reserved = 0;
+
+			uint32_t blockCount = (this->termEntries[i].docCount + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE;
+			if (this->blockBoundList.size() < termBound.blockOffset + blockCount)
+				this->blockBoundList.resize(termBound.blockOffset + blockCount);
+			for (uint64_t j = termBound.blockOffset; j < termBound.blockOffset + blockCount; ++j) {
+				BlockMaxEntry& block = this->blockBoundList[j];
+				block.lastDocId = this->blockMaxEntries[j].lastDocId;
+				block.maxScore = getBM25Score(this->blockBounds[j].maxTf, this->blockBounds[j].minDocLength, 1, averageDocumentLength);
+				termBound.maxScore = std::max(termBound.maxScore, block.maxScore);
+			}
+		}
+		return true;
+	}
+
+	std::string_view getTerm(uint32_t index) const {
+		return std::string_view(this->termStrings + this->termEntries[index].termOffset, 
+			this->termEntries[index + 1].termOffset - this->termEntries[index].termOffset);
+	}
+
+	// Binary search the sorted words, return the index of the first word >= word (termCount if there's none)
+	uint32_t findTermLowerBound(std::string_view word) const {
+		uint32_t low = 0;
+		uint32_t high = this->termCount;
+		while (low < high) {
+			uint32_t middle = low + (high - low) / 2;
+			if (this->getTerm(middle) < word)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		return low;
+	}
+
+	// return the index of the word or termCount if not found
+	uint32_t findTermEntry(const std::string& word) const {
+		uint32_t index = this->findTermLowerBound(word);
+		return index < this->termCount && this->getTerm(index) == word ? index : this->termCount;
+	}
+
+	// Call function(word, docCount) for every word starting with prefix, in sorted order
+	// (docCount in the whole collection for a shard, so that every shard picks the same words for a wildcard)
+	template <typename Function>
+	void forEachPrefix(std::string_view prefix, Function function) const {
+		for (uint32_t index = this->findTermLowerBound(prefix); index < this->termCount; ++index) {
+			std::string_view term = this->getTerm(index);
+			if (term.compare(0, prefix.length(), prefix) != 0)
+				break;
+			function(term, this->getCollectionDocCount(index));
+		}
+	}
+};
+
+// There are four .bin index files:
+// 1. index_docLengths.bin: Document lengths for calculating scores. 4 bytes uint32_t each document length
+// 2. index_docNo.bin: DOCNO file, for showing DOCNO after retrieving docId. String splited by \0 (docNo1 \0 docNo2 \0 ...)
+// 3. index_words.bin: Words and their postings index, for seeking and reading word postings. Stored as 4 bytes word count + (wordLength(uint8_t), word, pos(uint32_t), docCount(uint32_t))
+//		The same words, sorted and front-coded, are in index_dictionary.bin (see frontCodedDictionary.h), which is searched
+//		in place instead of loading index_words.bin into a hash map
+// 4. index_wordPostings.bin: Word postings file, stored as (docId1, tf1, docId2, tf2, ...) each 4 bytes,
+//		or compressed (starts with COMPRESSED_POSTINGS_MAGIC, see postingsCodec.h)
+// Or a single index.bin container with all of them (see indexFile.h), which is memory-mapped and used in place.
+// Or segments, each of them a container (see segments.h).
+// The segments are used if there's a manifest, otherwise index.bin if it exists.
+
+class SearchEngine {
+
+private:
+	int wordPostingsFd; // Word postings file, read with pread() so that queries can run in parallel
+	PostingsFormat postingsFormat; // Detected from the beginning of the word postings file
+
+	bool useContainer; // Loaded from index.bin or segments instead of the four index_*.bin files
+	std::vector<std::unique_ptr<IndexSegment> > segments; // index.bin, or the live segments in document order
+
+	SearchOptions options;
+	QueryMode queryMode; // options.queryMode, or the exhaustive mode if the index doesn't have what it needs
+
+	uint32_t totalDocuments; // number of documents in total, initialize after loading index_docLengths.bin
+	uint32_t collectionDocuments; // Number of documents for the idf: totalDocuments, or the documents of all the shards for a shard
+	uint32_t docIdOffset; // Documents in the shards before this one, for a shard
+	float averageDocumentLength; // Average length of all the documents (of all the shards for a shard), used for BM25
+	const uint32_t* docLengths; // docId - 1 -> documentLength. Points to docLengthList or into index.bin
+	std::vector<uint32_t> docLengthList; // Document lengths loaded from index_docLengths.bin, or of all the segments
+	std::vector<uint64_t> deletedDocuments; // Bitmap of the deleted docIds of all the segments, empty if there's none
+
+	// word -> (pos, docCount)
+	// -- pos: how many documents before the word's first document
+	// -- docCount: how many documents the word appears in
+	// Only loaded when there's no index_dictionary.bin (an index from an older indexer)
+	std::unordered_map<std::string, std::pair<uint32_t, uint32_t> > wordToPostingsIndex;
+
+	// Sorted words of the four-file index, memory-mapped
+	FrontCodedDictionary dictionary;
+
+	// Compressed postings: sorted byte offsets of all the words' postings and the file size, so that
+	// the byte length of a word's postings is known before reading them. Not needed with the dictionary,
+	// where a word's postings end where the next word's start.
+	std::vector<uint64_t> postingsOffsets;
+	uint64_t postingsFileSize;
+
+	// DOCNO list ["WSJ870323-0139", ...]
+	std::vector<std::string> vecDocNo;
+
+	// Normalized query -> results, and word -> decoded postings (see queryCache.h). Safe for concurrent queries.
+	ConcurrentCache<std::vector<std::pair<uint32_t, float> > > resultCache;
+	ConcurrentCache<std::vector<std::pair<uint32_t, uint32_t> > > postingsCache;
+
+	EngineMetrics metrics;
+	TraceWriter traceWriter; // Open if tracing is on
+
+	std::unique_ptr<WorkStealingPool> queryPool; // Scores the long queries in parallel, NULL with one query thread
+
+	std::unique_ptr<IndexSegment> tierSegment; // index_tier1.bin, searched before index.bin (see searchFirstTier), NULL if there's none
+	std::atomic<uint64_t> tierAnswers; // Queries answered by the first tier
+	std::atomic<uint64_t> tierFallbacks; // Queries the first tier couldn't answer, searched in the full index
+
+	DocumentStore documentStore; // index_store.bin, for the snippets
+	ConcurrentCache<std::string> storeBlockCache; // Block number -> decompressed block of the document store
+
+public:
+	SearchEngine(const SearchOptions& options) 
+		: resultCache(options.resultCacheBytes, false), postingsCache(options.postingsCacheBytes, true), storeBlockCache(options.storeCacheBytes, false)
+	{
+		this->options = options;
+		this->queryMode = options.queryMode;
+		this->wordPostingsFd = -1;
+		this->postingsFormat = POSTINGS_FORMAT_RAW;
+		this->postingsFileSize = 0;
+		this->useContainer = false;
+		this->totalDocuments = 0;
+		this->collectionDocuments = 0;
+		this->docIdOffset = 0;
+		this->averageDocumentLength = 0;
+		this->docLengths = NULL;
+		this->tierAnswers = 0;
+		this->tierFallbacks = 0;
+	}
+
+	~SearchEngine() {
+		if (this->wordPostingsFd >= 0)
+			close(this->wordPostingsFd);
+	}
+
+	const SearchOptions& getOptions() const {
+		return this->options;
+	}
+
+	uint32_t getTotalDocuments() const {
+		return this->totalDocuments;
+	}
+
+	// The query mode used, after load()
+	QueryMode getQueryMode() const {
+		return this->queryMode;
+	}
+
+	// Load the index in the working directory
+	// return false if there's none
+	bool load() {
+		std::chrono::steady_clock::time_point timeBegin = std::chrono::steady_clock::now();
+		if (this->options.traceFileName.length() > 0 && !this->traceWriter.open(this->options.traceFileName))
+			std::cerr << "Can't open " << this->options.traceFileName << ", queries are not traced" << std::endl;
+
+		bool loaded = false;
+		if (this->options.shardIndex >= 0) {
+			loaded = this->loadShard((uint32_t)this->options.shardIndex);
+			if (!loaded)
+				std::cerr << "Can't open " << getShardFileName((uint32_t)this->options.shardIndex) << std::endl;
+		}
+		else {
+			loaded = this->loadSegments();
+			if (!loaded && this->loadContainer()) {
+				this->loadTier(); // Only for a single index.bin
+				loaded = true;
+			}
+			if (!loaded && (access("index_words.bin", R_OK) != 0 || access("index_wordPostings.bin", R_OK) != 0))
+				std::cerr << "No index in the working directory (see ./indexer)" << std::endl;
+			else if (!loaded) {
+				loaded = true;
+				// Only words in the same order as index_words.bin, otherwise the dictionary is from another index
+				if (!this->dictionary.open(DICTIONARY_FILE_NAME) || this->dictionary.getWordCount() != this->getFileWordCount())
+					this->loadWords(); // load word postings index from disk
+				this->loadDocNo(); // load DOCNO to a string list
+				this->loadDocLengths();
+
+				this->wordPostingsFd = open("index_wordPostings.bin", O_RDONLY);
+				this->detectPostingsFormat();
+				this->loadPostingsOffsets();
+			}
+			this->collectionDocuments = this->totalDocuments;
+		}
+		if (!loaded)
+			return false;
+
+		std::string reason;
+		this->queryMode = this->getAvailableQueryMode(reason);
+		if (!reason.empty())
+			std::cerr << reason << ", using the exhaustive mode" << std::endl;
+
+		if (this->options.showSnippets && this->options.shardIndex < 0) {
+			if (!this->documentStore.open(STORE_FILE_NAME) || this->documentStore.getDocumentCount() != this->totalDocuments) {
+				std::cerr << "No document store of this index (./indexer --store), no snippets" << std::endl;
+				this->options.showSnippets = false;
+			}
+		}
+
+		if (this->options.queryThreads > 1)
+			this->queryPool.reset(new WorkStealingPool(this->options.queryThreads - 1)); // The query's own thread is the last one
+
+		std::chrono::steady_clock::time_point timeEnd = std::chrono::steady_clock::now();
+		this->metrics.recordLoad(std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeBegin).count());
+		return true;
+	}
+
+	// Memory-map index.bin (or a shard) and point to its sections, nothing is copied
+	// return false if there's no valid index.bin
+	bool loadContainer(const std::string& fileName = INDEX_FILE_NAME) {
+		std::unique_ptr<IndexSegment> segment(new IndexSegment());
+		if (!segment->open(fileName, 0))
+			return false;
+
+		this->totalDocuments = segment->documentCount;
+		this->averageDocumentLength = getAverageDocumentLength(segment->totalLength, segment->documentCount);
+		this->docLengths = segment->docLengths;
+		this->segments.push_back(std::move(segment));
+		this->useContainer = true;
+		return true;
+	}
+
+	// Memory-map the first tier of index.bin, if there's one built with the same documents
+	void loadTier() {
+		if (access(TIER1_FILE_NAME, F_OK) != 0)
+			return;
+		std::unique_ptr<IndexSegment> tier(new IndexSegment());
+		if (!tier->open(TIER1_FILE_NAME, 0))
+			return;
+
+		const IndexSegment& index = *this->segments[0];
+		uint64_t boundsSize = 0;
+		tier->indexFile.getSection(SECTION_TIER_BOUNDS, boundsSize);
+		if (tier->tierBounds == NULL || boundsSize != (uint64_t)tier->termCount * sizeof(float) || !tier->hasBlockMax() 
+			|| tier->collectionStats == NULL || tier->documentCount != index.documentCount 
+			|| tier->collectionStats->totalDocuments != index.documentCount || tier->collectionStats->totalLength != index.totalLength) 
+		{
+			std::cerr << TIER1_FILE_NAME << " doesn't match " << INDEX_FILE_NAME << ", searching without it" << std::endl;
+			return;
+		}
+		this->tierSegment = std::move(tier);
+	}
+
+	// Memory-map a shard, with the statistics of the whole collection. Its docIds stay 1, 2, 3, ... in the shard, and
+	// docIdOffset is added to the results.
+	// return false if there's no valid shard
+	bool loadShard(uint32_t shardIndex) {
+		if (!this->loadContainer(getShardFileName(shardIndex)))
+			return false;
+		const CollectionStats* collectionStats = this->segments[0]->collectionStats;
+		if (collectionStats == NULL || this->segments[0]->collectionDocCounts == NULL)
+			return false;
+
+		this->collectionDocuments = (uint32_t)collectionStats->totalDocuments;
+		this->averageDocumentLength = getAverageDocumentLength(collectionStats->totalLength, collectionStats->totalDocuments);
+		this->docIdOffset = collectionStats->docIdOffset;
+		return true;
+	}
+
+	// Memory-map the live segments of the manifest, and combine their statistics and deleted documents
+	// return false if there's no manifest
+	bool loadSegments() {
+		if (access(SEGMENT_MANIFEST_NAME, F_OK) != 0)
+			return false;
+
+		// A merge can't delete the segments while they are being opened
+		SegmentLock lock(SEGMENT_LOCK_NAME, false);
+		SegmentManifest manifest;
+		if (!manifest.load())
+			return false;
+
+		uint64_t totalLength = 0;
+		for (size_t i = 0; i < manifest.segments.size(); ++i) {
+			std::unique_ptr<IndexSegment> segment(new IndexSegment());
+			if (!segment->open(getSegmentFileName(manifest.segments[i].segmentId), this->totalDocuments)) {
+				std::cerr << "Can't open segment " << manifest.segments[i].segmentId << std::endl;
+				continue;
+			}
+			this->docLengthList.insert(this->docLengthList.end(), segment->docLengths, segment->docLengths + segment->documentCount);
+			totalLength += segment->totalLength;
+
+			if (manifest.segments[i].deletedCount > 0) {
+				DeletedDocuments deleted;
+				deleted.load(getDeletedDocumentsFileName(manifest.segments[i].segmentId), segment->documentCount);
+				this->deletedDocuments.resize((this->totalDocuments + segment->documentCount) / 64 + 1, 0);
+				for (uint32_t docId = 1; docId <= segment->documentCount; ++docId) {
+					if (deleted.isDeleted(docId)) {
+						uint32_t globalDocId = this->totalDocuments + docId;
+						this->deletedDocuments[globalDocId >> 6] |= (uint64_t)1 << (globalDocId & 63);
+					}
+				}
+			}
+
+			this->totalDocuments += segment->documentCount;
+			this->segments.push_back(std::move(segment));
+		}
+		if (!this->deletedDocuments.empty())
+			this->deletedDocuments.resize(this->totalDocuments / 64 + 1, 0);
+
+		this->docLengths = this->docLengthList.data();
+		this->averageDocumentLength = this->totalDocuments > 0 ? getAverageDocumentLength(totalLength, this->totalDocuments) : 1;
+		if (this->segments.size() > 1) {
+			for (size_t i = 0; i < this->segments.size(); ++i)
+				this->segments[i]->computeBlockBounds(this->averageDocumentLength);
+		}
+		this->useContainer = true;
+		return true;
+	}
+
+	// Compressed postings file starts with a magic number. A raw one starts with the first docId,
+	// which can't be that large.
+	void detectPostingsFormat() {
+		uint32_t magic = 0;
+		preadFully(this->wordPostingsFd, &magic, 4, 0);
+		this->postingsFormat = magic == COMPRESSED_POSTINGS_MAGIC ? POSTINGS_FORMAT_COMPRESSED : POSTINGS_FORMAT_RAW;
+	}
+
+	// The postings of every word follow each other, so a word's postings end where the next ones start
+	void loadPostingsOffsets() {
+		if (this->postingsFormat != POSTINGS_FORMAT_COMPRESSED)
+			return;
+		struct stat fileStat;
+		if (fstat(this->wordPostingsFd, &fileStat) != 0)
+			return;
+		this->postingsFileSize = (uint64_t)fileStat.st_size;
+		if (this->dictionary.isOpen())
+			return;
+
+		this->postingsOffsets.reserve(this->wordToPostingsIndex.size() + 1);
+		for (std::unordered_map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = this->wordToPostingsIndex.begin(); it != this->wordToPostingsIndex.end(); ++it)
+			this->postingsOffsets.push_back(it->second.first);
+		std::sort(this->postingsOffsets.begin(), this->postingsOffsets.end());
+		this->postingsOffsets.push_back((uint64_t)fileStat.st_size);
+	}
+
+	// Byte length of the postings at offset in index_wordPostings.bin
+	uint32_t getPostingsByteLength(uint64_t offset, uint32_t docCount) const {
+		if (this->postingsFormat != POSTINGS_FORMAT_COMPRESSED)
+			return docCount * 2 * sizeof(uint32_t);
+		std::vector<uint64_t>::const_iterator next = std::upper_bound(this->postingsOffsets.begin(), this->postingsOffsets.end(), offset);
+		return next != this->postingsOffsets.end() ? (uint32_t)(*next - offset) : 0;
+	}
+
+	// Decode the postings read from index_wordPostings.bin (the 4 bytes byteLength then the blocks if compressed)
+	// return false if they are cut short
+	bool decodeFilePostings(const uint8_t* data, uint32_t size, uint32_t docCount, std::vector<std::pair<uint32_t, uint32_t> >& postings, QueryTrace* trace) {
+		if (trace != NULL) {
+			trace->postingsDecoded += docCount;
+			trace->postingsBytes += size;
+		}
+		if (this->postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+			if (size < 4 || 4 + (uint64_t)*(const uint32_t*)data > size)
+				return false;
+			decodePostings(data + 4, docCount, postings);
+			return true;
+		}
+
+		if (size < (uint64_t)docCount * 8)
+			return false;
+		const uint32_t* values = (const uint32_t*)data;
+		postings.reserve(docCount);
+		for (uint32_t i = 0; i < docCount; ++i) {
+			uint32_t docId = values[i * 2];
+			uint32_t tf = values[i * 2 + 1];
+
+			postings.push_back(std::pair<uint32_t, uint32_t>(docId, tf));
+		}
+		return true;
+	}
+
+	// Load document lengths and get: 1. totalDocuments 2. average document length 3. docIdToLength (Used for BM25)
+	void loadDocLengths() {
+		std::ifstream docLengthsFile;
+		docLengthsFile.open("index_docLengths.bin");
+
+		docLengthsFile.seekg(0, std::fstream::end);
+		long fileSize = docLengthsFile.tellg();
+		docLengthsFile.seekg(0, std::fstream::beg);
+
+		char* buffer = new char[fileSize];
+		docLengthsFile.read(buffer, fileSize);
+
+		docLengthsFile.close();
+
+		char* pointer = buffer;
+
+		uint32_t length = 0;
+		uint32_t docId = 0;
+		uint64_t totalLength = 0;
+		this->docLengthList.reserve(fileSize / 4);
+		while (pointer < buffer + fileSize)
+		{
+			length = *reinterpret_cast<uint32_t*>(pointer);
+			pointer += 4;
+
+			++docId;
+
+			this->docLengthList.push_back(length);
+			totalLength += length;
+		}
+		
+		delete[] buffer;
+
+		this->docLengths = this->docLengthList.data();
+		this->totalDocuments = docId;
+		this->averageDocumentLength = (float)((double)totalLength / this->totalDocuments);
+	}
+
+	// Get document length(how many words in doc) with docId: 1, 2, 3, ... (read from the postings)
+	uint32_t getDocumentLength(uint32_t docId) {
+		if (docId == 0 || docId > this->totalDocuments)
+			return 0;
+		return this->docLengths[docId - 1];
+	}
+
+	// Whether the document with this docId was deleted from its segment
+	bool isDeleted(uint32_t docId) const {
+		return !this->deletedDocuments.empty() && ((this->deletedDocuments[docId >> 6] >> (docId & 63)) & 1);
+	}
+
+	// The segment containing docId: the last one with docIdBase < docId
+	const IndexSegment& getSegment(uint32_t docId) const {
+		size_t low = 0;
+		size_t high = this->segments.size();
+		while (low + 1 < high) {
+			size_t middle = low + (high - low) / 2;
+			if (this->segments[middle]->docIdBase < docId)
+				low = middle;
+			else
+				high = middle;
+		}
+		return *this->segments[low];
+	}
+
+	// Get DOCNO with docId: 1, 2, 3, ...
+	const char* getDocNo(uint32_t docId) {
+		if (this->useContainer) {
+			const IndexSegment& segment = this->getSegment(docId);
+			return segment.docNoStrings + segment.docNoOffsets[docId - segment.docIdBase - 1];
+		}
+		return this->vecDocNo[docId - 1].c_str();
+	}
+
+	// The text of a document from the document store, through the block cache
+	// return false if it's not in the store
+	bool getDocumentText(uint32_t docId, std::string& text) {
+		StoredDocument document;
+		if (!this->documentStore.getDocument(docId, document))
+			return false;
+		std::string key = std::to_string(document.block);
+		std::shared_ptr<const std::string> block = this->storeBlockCache.get(key);
+		if (!block) {
+			std::shared_ptr<std::string> decompressed = std::make_shared<std::string>();
+			if (!this->documentStore.readBlock(document.block, *decompressed))
+				return false;
+			block = decompressed;
+			this->storeBlockCache.put(key, block, block->size());
+		}
+		if ((uint64_t)document.offset + document.length > block->size())
+			return false;
+		text.assign(*block, document.offset, document.length);
+		return true;
+	}
+
+	// The SNIPPET_WORDS words of the text with the most different query words (then the most query words), around them,
+	// with the query words highlighted and the whitespace collapsed. The start of the text if it has none.
+	// e.g. "... the <b>wall</b> <b>street</b> journal said ..."
+	std::string getSnippet(const std::string& text, const std::vector<std::string>& words) {
+		std::string lowered = text; // Lowercased in place by the tokenizer, the words have the same offsets as in text
+		Tokenizer tokenizer(&lowered[0], lowered.length());
+		std::vector<std::pair<size_t, size_t> > tokens; // (start, end) of every word in the text
+		std::vector<int32_t> matches; // Word -> index of its query word, -1 if it's not one
+		std::string_view word;
+		while (tokenizer.next(word)) {
+			size_t start = word.data() - lowered.data();
+			tokens.push_back(std::pair<size_t, size_t>(start, start + word.length()));
+			int32_t match = -1;
+			for (size_t i = 0; i < words.size() && match < 0; ++i) {
+				if (word == words[i])
+					match = (int32_t)i;
+			}
+			matches.push_back(match);
+		}
+		if (tokens.empty())
+			return "";
+
+		// Slide the window over the words, counting the query words in it
+		size_t windowSize = std::min(SNIPPET_WORDS, tokens.size());
+		std::vector<uint32_t> counts(words.size(), 0);
+		uint32_t distinct = 0;
+		uint32_t hits = 0;
+		size_t bestStart = 0;
+		uint32_t bestDistinct = 0;
+		uint32_t bestHits = 0;
+		for (size_t end = 0; end < tokens.size(); ++end) {
+			if (matches[end] >= 0) {
+				if (counts[matches[end]]++ == 0)
+					++distinct;
+				++hits;
+			}
+			if (end >= windowSize && matches[end - windowSize] >= 0) {
+				if (--counts[matches[end - windowSize]] == 0)
+					--distinct;
+				--hits;
+			}
+			if (end + 1 >= windowSize && (distinct > bestDistinct || (distinct == bestDistinct && hits > bestHits))) {
+				bestStart = end + 1 - windowSize;
+				bestDistinct = distinct;
+				bestHits = hits;
+			}
+		}
+
+		// Center the query words of the window
+		if (bestHits > 0) {
+			size_t firstHit = bestStart;
+			while (matches[firstHit] < 0)
+				++firstHit;
+			size_t lastHit = bestStart + windowSize - 1;
+			while (matches[lastHit] < 0)
+				--lastHit;
+			size_t margin = (windowSize - (lastHit - firstHit + 1)) / 2;
+			bestStart = std::min(firstHit - std::min(firstHit, margin), tokens.size() - windowSize);
+		}
+
+		std::string snippet;
+		if (bestStart > 0)
+			snippet += "... ";
+		size_t position = tokens[bestStart].first;
+		for (size_t i = bestStart; i < bestStart + windowSize; ++i) {
+			// The text between the words, whitespace collapsed to a space
+			for (; position < tokens[i].first; ++position) {
+				if (!isspace((unsigned char)text[position]))
+					snippet += text[position];
+				else if (snippet.empty() || snippet.back() != ' ')
+					snippet += ' ';
+			}
+			if (matches[i] >= 0)
+				snippet += SNIPPET_HIGHLIGHT_START;
+			snippet.append(text, tokens[i].first, tokens[i].second - tokens[i].first);
+			if (matches[i] >= 0)
+				snippet += SNIPPET_HIGHLIGHT_END;
+			position = tokens[i].second;
+		}
+		if (bestStart + windowSize < tokens.size())
+			snippet += " ...";
+		return snippet;
+	}
+
+	// Find the query words in every segment
+	// termIndexes: set to the index of every word in the terms of every segment (termCount if it's not there)
+	// return: the idf of every word, from the number of documents containing it in all the segments
+	std::vector<float> findQueryWords(const std::vector<std::string>& words, std::vector<std::vector<uint32_t> >& termIndexes) {
+		std::vector<uint32_t> docCounts(words.size(), 0);
+		termIndexes.assign(this->segments.size(), std::vector<uint32_t>(words.size()));
+		for (size_t i = 0; i < this->segments.size(); ++i) {
+			const IndexSegment& segment = *this->segments[i];
+			for (size_t j = 0; j < words.size(); ++j) {
+				termIndexes[i][j] = segment.findTermEntry(words[j]);
+				if (termIndexes[i][j] != segment.termCount)
+					docCounts[j] += segment.getCollectionDocCount(termIndexes[i][j]);
+			}
+		}
+
+		std::vector<float> idfs(words.size());
+		for (size_t j = 0; j < words.size(); ++j)
+			idfs[j] = getIdf(this->collectionDocuments, docCounts[j]);
+		return idfs;
+	}
+
+	// Point a cursor to the postings of a word in a segment. The maximum scores are the segment's own with only one
+	// segment, otherwise the bounds recomputed with the statistics of all the segments.
+	void initCursor(const IndexSegment& segment, uint32_t termIndex, float idf, PostingsCursor& cursor) {
+		const TermEntry& entry = segment.termEntries[termIndex];
+		if (this->segments.size() == 1) {
+			const TermBlockMax& blockMax = segment.termBlockMax[termIndex];
+			cursor.init(segment.postingsFormat, segment.postingsData + entry.postingsOffset, entry.docCount,
+				segment.blockMaxEntries + blockMax.blockOffset, idf, blockMax.maxScore);
+		}
+		else {
+			const TermBlockMax& bound = segment.termBoundList[termIndex];
+			cursor.init(segment.postingsFormat, segment.postingsData + entry.postingsOffset, entry.docCount,
+				segment.blockBoundList.data() + bound.blockOffset, idf, bound.maxScore * idf, idf);
+		}
+	}
+
+	// idf of a word in docCount documents of the index, or of the whole collection for a shard
+	float getWordIdf(const std::string& word, uint32_t docCount) {
+		if (this->options.shardIndex >= 0 && !this->segments.empty()) {
+			uint32_t termIndex = this->segments[0]->findTermEntry(word);
+			if (termIndex != this->segments[0]->termCount)
+				docCount = this->segments[0]->getCollectionDocCount(termIndex);
+		}
+		return getIdf(this->collectionDocuments, docCount);
+	}
+
+	// Whether every segment has the maximum scores for Block-Max WAND and AND queries (and their bounds, with more than one segment)
+	bool hasBlockMax() const {
+		for (size_t i = 0; i < this->segments.size(); ++i) {
+			if (!this->segments[i]->hasBlockMax() || (this->segments.size() > 1 && this->segments[i]->termBoundList.size() != this->segments[i]->termCount))
+				return false;
+		}
+		return this->useContainer;
+	}
+
+	// The selected query mode, or the exhaustive mode if the index doesn't have what it needs (with the reason why)
+	QueryMode getAvailableQueryMode(std::string& reason) const {
+		QueryMode queryMode = this->options.queryMode;
+		if (queryMode == QUERY_MODE_BLOCK_MAX_WAND && !this->hasBlockMax())
+			reason = "Block-Max WAND needs index.bin (./indexer --container)";
+		else if (queryMode == QUERY_MODE_CONJUNCTIVE && !this->hasBlockMax())
+			reason = "AND queries need index.bin (./indexer --container)";
+		else if (queryMode == QUERY_MODE_PHRASE && !(this->hasBlockMax() && this->hasPositions()))
+			reason = "Phrase queries need a positional index (./indexer --positions)";
+		else if (queryMode == QUERY_MODE_SCORE_AT_A_TIME && !(this->useContainer && this->segments.size() == 1 && this->segments[0]->impactStats != NULL 
+			&& this->segments[0]->termImpacts != NULL && this->segments[0]->impactSegments != NULL && this->segments[0]->impactPostings != NULL))
+			reason = "Score-at-a-time needs an impact-ordered index.bin (./indexer --impacts)";
+		else if (queryMode == QUERY_MODE_QUANTIZED && !(this->useContainer && this->segments.size() == 1 && this->segments[0]->quantizedStats != NULL
+			&& this->segments[0]->quantizedOffsets != NULL && this->segments[0]->quantizedImpacts != NULL))
+			reason = "Quantized queries need a quantized index.bin (./indexer --quantized=8 or 16)";
+		return reason.empty() ? queryMode : QUERY_MODE_EXHAUSTIVE;
+	}
+
+	// Whether every segment has the positional index
+	bool hasPositions() const {
+		for (size_t i = 0; i < this->segments.size(); ++i) {
+			if (this->segments[i]->positionsData == NULL || this->segments[i]->positionBlocks == NULL)
+				return false;
+		}
+		return this->useContainer;
+	}
+
+	// Find where the postings of the word are in index_wordPostings.bin
+	// offset: byte offset of the postings
+	// byteLength: byte length of the postings
+	// return false if the word doesn't exist
+	bool findWord(const std::string& word, uint64_t& offset, uint32_t& byteLength, uint32_t& docCount) {
+		uint32_t pos = 0;
+		if (this->dictionary.isOpen()) {
+			uint32_t wordIndex = 0;
+			if (!this->dictionary.find(word, wordIndex, pos, docCount))
+				return false;
+			if (this->postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+				uint32_t nextPos = 0;
+				uint64_t end = this->dictionary.getPos(wordIndex + 1, nextPos) ? nextPos : this->postingsFileSize;
+				offset = pos;
+				byteLength = end > offset ? (uint32_t)(end - offset) : 0;
+				return true;
+			}
+		}
+		else {
+			std::unordered_map<std::string, std::pair<uint32_t, uint32_t> >::iterator postingsIndexIt = this->wordToPostingsIndex.find(word);
+			if (postingsIndexIt == this->wordToPostingsIndex.end()) {
+				return false;
+			}
+			pos = postingsIndexIt->second.first;
+			docCount = postingsIndexIt->second.second;
+		}
+
+		if (this->postingsFormat == POSTINGS_FORMAT_COMPRESSED)
+			offset = pos; // pos is the byte offset
+		else
+			offset = (uint64_t)pos * 2 * sizeof(uint32_t); // * 2 because every doc has docId and term frequency
+		byteLength = this->getPostingsByteLength(offset, docCount);
+		return true;
+	}
+
+	// Word count at the start of index_words.bin
+	uint32_t getFileWordCount() const {
+		uint32_t wordCount = 0;
+		std::ifstream wordsFile("index_words.bin", std::ios::binary);
+		wordsFile.read(reinterpret_cast<char*>(&wordCount), 4);
+		return wordsFile ? wordCount : 0;
+	}
+
+	// Load words and get the postings offset (this->wordToPostingsIndex)
+	void loadWords() {
+		std::ifstream wordsFile;
+		wordsFile.open("index_words.bin");
+
+		// Get how many bytes the words.bin have
+		wordsFile.seekg(0, std::ifstream::end);
+		long fileSize = wordsFile.tellg();
+		wordsFile.seekg(0, std::ifstream::beg);
+
+		// Batch reading is faster than reading byte by byte
+		char* buffer = new char[fileSize];
+		wordsFile.read(buffer, fileSize);
+		
+		wordsFile.close();
+
+		char* pointer = buffer;
+
+		uint32_t wordCount = *reinterpret_cast<uint32_t*>(pointer);
+		pointer += 4;
+
+		for (uint32_t i = 0; i < wordCount; ++i) {
+			uint8_t wordLength = *pointer; //*reinterpret_cast<uint8_t*>(pointer);
+			++pointer;
+
+			std::string word(pointer, wordLength);
+			pointer += wordLength;
+
+			uint32_t pos = *reinterpret_cast<uint32_t*>(pointer);
+			pointer += 4;
+
+			uint32_t docCount = *reinterpret_cast<uint32_t*>(pointer);
+			pointer += 4;
+
+			this->wordToPostingsIndex[word] = std::pair<uint32_t, uint32_t>(pos, docCount);
+		}
+
+		delete[] buffer;
+	}
+
+	// Load DocNo.bin and push_back to this->vecDocNo
+	void loadDocNo() {
+		std::ifstream docNoFile; 
+		docNoFile.open("index_docNo.bin");
+
+		// Get the file size
+		docNoFile.seekg(0, std::ifstream::end);
+		long fileSize = docNoFile.tellg();
+		docNoFile.seekg(0, std::ifstream::beg);
+
+		// Create a buffer and load the entire file
+		char* buffer = new char[fileSize];
+		docNoFile.read(buffer, fileSize);
+
+		docNoFile.close();
+
+		char* pointer = buffer;
+
+		while (pointer < buffer + fileSize) {
+			std::string docNo(pointer);
+			this->vecDocNo.push_back(docNo);
+			pointer += (docNo.size() + 1); // +1 for the '\0' between pointers
+		}
+
+		delete[] buffer; // Release the buffer
+	}
+
+	// Get word postings. input: word
+	// return: [(docId1, tf1), (docId2, tf2), ...], e.g. [(2, 3), (3, 6), ...]
+	// With segments, the postings of all the segments (including the deleted documents), with their global docIds
+	std::vector<std::pair<uint32_t, uint32_t> > getWordPostings(const std::string& word, QueryContext& context) {
+		std::vector<std::pair<uint32_t, uint32_t> > postings;
+		QueryTrace* trace = context.trace;
+
+		if (this->useContainer) {
+			// Decode in place from the memory-mapped postings
+			for (size_t i = 0; i < this->segments.size(); ++i) {
+				const IndexSegment& segment = *this->segments[i];
+				PhaseTimer lookupTimer(trace, QUERY_PHASE_LOOKUP);
+				uint32_t index = segment.findTermEntry(word);
+				lookupTimer.stop();
+				if (index == segment.termCount)
+					continue;
+
+				PhaseTimer postingsTimer(trace, QUERY_PHASE_POSTINGS);
+				size_t start = postings.size();
+				uint32_t docCount = segment.termEntries[index].docCount;
+				const uint8_t* data = segment.postingsData + segment.termEntries[index].postingsOffset;
+				if (segment.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+					decodePostings(data + 4, docCount, postings); // + 4 to skip the byteLength
+					if (trace != NULL)
+						trace->postingsBytes += 4 + *(const uint32_t*)data;
+				}
+				else {
+					const uint32_t* values = (const uint32_t*)data;
+					postings.reserve(start + docCount);
+					for (uint32_t j = 0; j < docCount; ++j)
+						postings.push_back(std::pair<uint32_t, uint32_t>(values[j * 2], values[j * 2 + 1]));
+					if (trace != NULL)
+						trace->postingsBytes += (uint64_t)docCount * 8;
+				}
+				if (segment.docIdBase > 0) {
+					for (size_t j = start; j < postings.size(); ++j)
+						postings[j].first += segment.docIdBase;
+				}
+			}
+			if (trace != NULL)
+				trace->postingsDecoded += postings.size();
+			return postings;
+		}
+
+		uint64_t offset = 0;
+		uint32_t byteLength = 0;
+		uint32_t docCount = 0;
+		PhaseTimer lookupTimer(trace, QUERY_PHASE_LOOKUP);
+		bool found = this->findWord(word, offset, byteLength, docCount);
+		lookupTimer.stop();
+		if (!found) {
+			return postings; // Can't find the word, return empty vector
+		}
+
+		// All the postings in one read
+		PhaseTimer postingsTimer(trace, QUERY_PHASE_POSTINGS);
+		context.postingsBuffer.resize(byteLength);
+		if (!preadFully(this->wordPostingsFd, context.postingsBuffer.data(), context.postingsBuffer.size(), offset))
+			return postings;
+		this->decodeFilePostings(context.postingsBuffer.data(), (uint32_t)context.postingsBuffer.size(), docCount, postings, trace);
+		return postings;
+	}
+
+	// The postings of all the words of a query, through the postings cache. The words that aren't cached are
+	// fetched together: read from index_wordPostings.bin in one batch, or prefetched from the memory-mapped index.bin,
+	// so that their disk reads overlap instead of waiting for each other.
+	std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > > getQueryPostings(const std::vector<std::string>& words, QueryContext& context) {
+		std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > > wordPostings(words.size());
+		std::vector<size_t> missingWords; // Indexes of the words that aren't cached
+		for (size_t i = 0; i < words.size(); ++i) {
+			wordPostings[i] = this->postingsCache.get(words[i]);
+			if (!wordPostings[i])
+				missingWords.push_back(i);
+			else if (context.trace != NULL)
+				++context.trace->postingsCacheHits;
+		}
+
+		// One word has nothing to overlap with
+		if (missingWords.size() > 1 && !this->useContainer) {
+			this->readWordPostings(words, missingWords, wordPostings, context);
+			return wordPostings;
+		}
+		if (missingWords.size() > 1) {
+			for (size_t i = 0; i < missingWords.size(); ++i) {
+				for (size_t j = 0; j < this->segments.size(); ++j) {
+					uint32_t termIndex = this->segments[j]->findTermEntry(words[missingWords[i]]);
+					if (termIndex != this->segments[j]->termCount)
+						this->segments[j]->prefetchPostings(termIndex);
+				}
+			}
+		}
+		for (size_t i = 0; i < missingWords.size(); ++i) {
+			const std::string& word = words[missingWords[i]];
+			wordPostings[missingWords[i]] = std::make_shared<const std::vector<std::pair<uint32_t, uint32_t> > >(this->getWordPostings(word, context));
+			this->postingsCache.put(word, wordPostings[missingWords[i]], wordPostings[missingWords[i]]->size() * sizeof(std::pair<uint32_t, uint32_t>));
+		}
+		return wordPostings;
+	}
+
+	// Read the postings of the missing words from index_wordPostings.bin with one batch of reads (see postingsReader.h),
+	// decoding every word's postings as soon as they arrive, while the others are still being read
+	void readWordPostings(const std::vector<std::string>& words, const std::vector<size_t>& missingWords, 
+		std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > >& wordPostings, QueryContext& context) 
+	{
+		std::vector<ReadRequest> requests;
+		std::vector<size_t> requestWords; // Request -> index of its word
+		std::vector<uint32_t> docCounts; // Request -> docCount of its word
+		PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+		for (size_t i = 0; i < missingWords.size(); ++i) {
+			uint64_t offset = 0;
+			uint32_t byteLength = 0;
+			uint32_t docCount = 0;
+			if (!this->findWord(words[missingWords[i]], offset, byteLength, docCount)) {
+				wordPostings[missingWords[i]] = std::make_shared<const std::vector<std::pair<uint32_t, uint32_t> > >();
+				this->postingsCache.put(words[missingWords[i]], wordPostings[missingWords[i]], 0);
+				continue;
+			}
+			ReadRequest request;
+			request.offset = offset;
+			request.size = byteLength;
+			request.buffer = NULL;
+			request.succeeded = false;
+			requests.push_back(request);
+			requestWords.push_back(missingWords[i]);
+			docCounts.push_back(docCount);
+		}
+		lookupTimer.stop();
+
+		PhaseTimer postingsTimer(context.trace, QUERY_PHASE_POSTINGS);
+		if (context.postingsBuffers.size() < requests.size())
+			context.postingsBuffers.resize(requests.size());
+		for (size_t i = 0; i < requests.size(); ++i) {
+			context.postingsBuffers[i].resize(requests[i].size);
+			requests[i].buffer = context.postingsBuffers[i].data();
+		}
+
+		context.postingsReader.start(this->wordPostingsFd, requests);
+		size_t index = 0;
+		while (context.postingsReader.next(index)) {
+			std::shared_ptr<std::vector<std::pair<uint32_t, uint32_t> > > postings = std::make_shared<std::vector<std::pair<uint32_t, uint32_t> > >();
+			const ReadRequest& request = requests[index];
+			if (request.succeeded)
+				this->decodeFilePostings(request.buffer, request.size, docCounts[index], *postings, context.trace);
+			wordPostings[requestWords[index]] = postings;
+			if (request.succeeded)
+				this->postingsCache.put(words[requestWords[index]], postings, postings->size() * sizeof(std::pair<uint32_t, uint32_t>));
+		}
+	}
+
+	// tf_td: number of the term appears in doc
+	// docLength: how many words in the document
+	// idf: inverted document frequency (calculated by total document and documents contain the word)
+	float getRankingScore(uint32_t tf_td, uint32_t docLength, float idf) {
+		// TF-IDF
+		// float tf_td_normalized = (float)tf_td / docLength;
+		// float idf = (float)this->totalDocuments / docCountContainWord;
+		// return tf_td_normalized * idf;
+
+		// BM25 - in the slides (but it will produce negative value when docCountContainWord > 1/2 totalDocuments, then the ranking is wrong)
+		// float w_t = std::log2f((this->totalDocuments - docCountContainWord + 0.5f) / (docCountContainWord + 0.5f));
+		// float k1 = 1.2f;
+		// float k3 = 7;
+		// float b = 0.75f;
+		// float K = k1 * ((1 - b) + (b * docLength / this->averageDocumentLength));
+		// float w_dt = w_t * ((k1 + 1) * tf_td / (K + tf_td)) * ((k3 + 1) * tf_tq / (k3 + tf_tq));
+		// return w_dt;
+
+		// Okapi BM25 https://en.wikipedia.org/wiki/Okapi_BM25 (in ranking.h, shared with the indexer)
+		return getBM25Score(tf_td, docLength, idf, this->averageDocumentLength);
+	}
+
+	// extractQueryWords with the wildcards expanded, timed in the query trace
+	// groups: if not NULL, set to the indexes in words of every query word: the word itself, or the expansions of a wildcard
+	// (none if no word starts with its prefix). e.g. "wall st*" -> words [wall, stock, street], groups [[0], [1, 2]]
+	std::vector<std::string> tokenize(const std::string& query, QueryContext& context, std::vector<std::vector<size_t> >* groups = NULL) {
+		PhaseTimer timer(context.trace, QUERY_PHASE_TOKENIZE);
+		std::vector<std::string> queryWords = extractQueryWords(query);
+		std::vector<std::string> words;
+		for (size_t i = 0; i < queryWords.size(); ++i) {
+			size_t firstWord = words.size();
+			if (queryWords[i].back() == '*')
+				this->expandWildcard(queryWords[i].substr(0, queryWords[i].length() - 1), words);
+			else
+				words.push_back(queryWords[i]);
+			if (groups != NULL) {
+				groups->push_back(std::vector<size_t>());
+				for (size_t j = firstWord; j < words.size(); ++j)
+					groups->back().push_back(j);
+			}
+		}
+		return words;
+	}
+
+	// Add the words starting with prefix (a wildcard like rosenf*) to words: the WILDCARD_MAX_WORDS that are in the most
+	// documents, in sorted order. The words are a range of the sorted dictionary (or of index.bin's sorted words).
+	void expandWildcard(const std::string& prefix, std::vector<std::string>& words) {
+		std::unordered_map<std::string, uint32_t> wordDocCounts; // word -> docCount in all the segments
+		if (this->useContainer) {
+			for (size_t i = 0; i < this->segments.size(); ++i) {
+				this->segments[i]->forEachPrefix(prefix, [&](std::string_view word, uint32_t docCount) {
+					wordDocCounts[std::string(word)] += docCount;
+				});
+			}
+		}
+		else if (this->dictionary.isOpen()) {
+			this->dictionary.forEachPrefix(prefix, [&](std::string_view word, uint32_t, uint32_t docCount) {
+				wordDocCounts[std::string(word)] = docCount;
+			});
+		}
+		else {
+			// No sorted words, look at all of them
+			for (std::unordered_map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = this->wordToPostingsIndex.begin(); it != this->wordToPostingsIndex.end(); ++it) {
+				if (it->first.compare(0, prefix.length(), prefix) == 0)
+					wordDocCounts[it->first] = it->second.second;
+			}
+		}
+
+		// (docCount, word), the most documents first
+		std::vector<std::pair<uint32_t, std::string> > candidates;
+		candidates.reserve(wordDocCounts.size());
+		for (std::unordered_map<std::string, uint32_t>::iterator it = wordDocCounts.begin(); it != wordDocCounts.end(); ++it)
+			candidates.push_back(std::pair<uint32_t, std::string>(it->second, it->first));
+		std::sort(candidates.begin(), candidates.end(), [](const std::pair<uint32_t, std::string>& a, const std::pair<uint32_t, std::string>& b) {
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		});
+		if (candidates.size() > WILDCARD_MAX_WORDS)
+			candidates.resize(WILDCARD_MAX_WORDS);
+
+		std::vector<std::string> expanded;
+		for (size_t i = 0; i < candidates.size(); ++i)
+			expanded.push_back(candidates[i].second);
+		std::sort(expanded.begin(), expanded.end());
+		words.insert(words.end(), expanded.begin(), expanded.end());
+	}
+
+	// input: query (multiple words) e.g. italy commercial, k (0 for all)
+	// output: a list of sorted docId and score. e.g. [(1, 2.5), (10, 2.1), ...], the k best only when scored in parallel
+	std::vector<std::pair<uint32_t, float> > getSortedRelevantDocuments(const std::string& query, uint32_t k, QueryContext& context) {
+		std::vector<std::string> words = this->tokenize(query, context);
+		for (std::vector<std::string>::iterator itrWords = words.begin(); itrWords != words.end(); ++itrWords) {
+			for (size_t i = 0; i < itrWords->length(); ++i)
+				(*itrWords)[i] = std::tolower((*itrWords)[i]);
+		}
+		std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > > wordPostings = this->getQueryPostings(words, context);
+		if (this->isParallelQuery(wordPostings))
+			return this->getTopDocumentsParallel(words, wordPostings, k, context);
+
+		std::unordered_map<uint32_t, float> mapDocIdScore;
+		for (size_t wordIndex = 0; wordIndex < words.size(); ++wordIndex) {
+			const std::string& word = words[wordIndex];
+			const std::vector<std::pair<uint32_t, uint32_t> >& postings = *wordPostings[wordIndex];
+			uint32_t docCountContainWord = postings.size();
+
+			// Okapi BM25 https://en.wikipedia.org/wiki/Okapi_BM25
+			float idf = this->getWordIdf(word, docCountContainWord);
+
+			PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+			if (context.trace != NULL)
+				context.trace->documentsScored += postings.size();
+			for (size_t i = 0; i < postings.size(); ++i) {
+				uint32_t docId = postings[i].first; // docId (1, 2, 3, ...)
+				uint32_t tf_td = postings[i].second; // term frequency in doc
+				if (this->isDeleted(docId))
+					continue;
+	
+				uint32_t docLength = this->getDocumentLength(docId);
+
+				float score = this->getRankingScore(tf_td, docLength, idf);
+
+				// Add score to mapDocIdScore
+				if (score > 0) {
+					std::unordered_map<uint32_t, float>::iterator itrMapDocIdScore = mapDocIdScore.find(docId);
+					if (itrMapDocIdScore != mapDocIdScore.end()) {
+						itrMapDocIdScore->second += score;
+					}
+					else {
+						mapDocIdScore[docId] = score;
+					}
+				}
+			}	
+		}
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		std::vector<std::pair<uint32_t, float> > vecDocIdScore; // docId and score: [(docId1, score1), (docId2, score2), ...]
+		for (std::unordered_map<uint32_t, float>::iterator itrMapDocIdScore = mapDocIdScore.begin(); itrMapDocIdScore != mapDocIdScore.end(); ++itrMapDocIdScore) {
+			vecDocIdScore.push_back(std::pair<uint32_t, float>(itrMapDocIdScore->first, itrMapDocIdScore->second));			
+		}
+
+		// Sort by score
+		std::sort(vecDocIdScore.begin(), vecDocIdScore.end(), sortScoreCompare);
+
+		return vecDocIdScore;
+	}
+
+	// Block-Max WAND (Ding and Suel, 2011), document-at-a-time with dynamic pruning.
+	// Cursors are kept sorted by docId. The pivot is the first cursor where the sum of the words' maximum scores
+	// can beat the current k-th best score, and the block maximum scores then decide whether the pivot document
+	// is scored or whole blocks are skipped. Gives the same top k as getSortedRelevantDocuments.
+	// The segments are searched one after another into the same top k, so later segments start with a high threshold.
+	// input: query (multiple words), k
+	// output: the k best docId and score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsBlockMaxWand(const std::string& query, uint32_t k, QueryContext& context) {
+		std::vector<std::string> words = this->tokenize(query, context);
+		std::vector<std::vector<uint32_t> > termIndexes;
+		PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+		std::vector<float> idfs = this->findQueryWords(words, termIndexes);
+		lookupTimer.stop();
+
+		TopKHeap topKHeap(k);
+		PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+		for (size_t i = 0; i < this->segments.size(); ++i)
+			this->searchSegmentBlockMaxWand(*this->segments[i], termIndexes[i], idfs, topKHeap, context.trace);
+		scoringTimer.stop();
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		return topKHeap.getSortedResults();
+	}
+
+	// Add what the cursors of a query decoded to its trace
+	void traceCursors(const std::vector<PostingsCursor>& cursors, uint64_t documentsScored, QueryTrace* trace) {
+		if (trace == NULL)
+			return;
+		for (size_t i = 0; i < cursors.size(); ++i) {
+			trace->postingsDecoded += cursors[i].decodedPostings;
+			trace->postingsBytes += cursors[i].decodedBytes;
+		}
+		trace->documentsScored += documentsScored;
+	}
+
+	// Block-Max WAND over one segment
+	void searchSegmentBlockMaxWand(const IndexSegment& segment, const std::vector<uint32_t>& termIndexes, const std::vector<float>& idfs, 
+		TopKHeap& topKHeap, QueryTrace* trace) 
+	{
+		// One cursor for each query word (in query order, so that scores are added in the same order as the exhaustive mode)
+		std::vector<PostingsCursor> cursors(termIndexes.size());
+		std::vector<PostingsCursor*> sortedCursors;
+		for (size_t i = 0; i < termIndexes.size(); ++i) {
+			if (termIndexes[i] == segment.termCount)
+				continue;
+			this->initCursor(segment, termIndexes[i], idfs[i], cursors[i]);
+			sortedCursors.push_back(&cursors[i]);
+		}
+
+		size_t cursorCount = sortedCursors.size();
+		uint64_t documentsScored = 0;
+		while (true) {
+			// Insertion sort, the cursors are almost sorted after moving one or a few of them
+			for (size_t i = 1; i < cursorCount; ++i) {
+				PostingsCursor* cursor = sortedCursors[i];
+				size_t j = i;
+				for (; j > 0 && sortedCursors[j - 1]->docId() > cursor->docId(); --j)
+					sortedCursors[j] = sortedCursors[j - 1];
+				sortedCursors[j] = cursor;
+			}
+
+			// Find the pivot
+			float threshold = topKHeap.threshold();
+			float upperBound = 0;
+			size_t pivot = cursorCount;
+			for (size_t i = 0; i < cursorCount && sortedCursors[i]->docId() != END_DOC_ID; ++i) {
+				upperBound += sortedCursors[i]->maxScore;
+				if (upperBound * UPPER_BOUND_SLACK > threshold) {
+					pivot = i;
+					break;
+				}
+			}
+			if (pivot == cursorCount)
+				break; // No more document can get into the top k
+
+			uint32_t pivotDocId = sortedCursors[pivot]->docId();
+			while (pivot + 1 < cursorCount && sortedCursors[pivot + 1]->docId() == pivotDocId)
+				++pivot;
+
+			// Tighter upper bound with the maximum scores of the blocks containing the pivot document
+			float blockUpperBound = 0;
+			for (size_t i = 0; i <= pivot; ++i)
+				blockUpperBound += sortedCursors[i]->blockMaxScore(pivotDocId);
+
+			if (blockUpperBound * UPPER_BOUND_SLACK > threshold) {
+				if (sortedCursors[0]->docId() == pivotDocId) {
+					// All the cursors before the pivot are on the pivot document, score it
+					uint32_t docLength = segment.docLengths[pivotDocId - 1];
+					float score = 0;
+					for (size_t i = 0; i < cursors.size(); ++i) {
+						if (cursors[i].docId() == pivotDocId) {
+							score += this->getRankingScore(cursors[i].tf(), docLength, cursors[i].idf);
+							cursors[i].next();
+						}
+					}
+					if (!this->isDeleted(segment.docIdBase + pivotDocId))
+						topKHeap.push(segment.docIdBase + pivotDocId, score);
+					++documentsScored;
+				}
+				else {
+					// Move the cursors before the pivot up to the pivot document
+					for (size_t i = 0; i < pivot; ++i) {
+						if (sortedCursors[i]->docId() < pivotDocId)
+							sortedCursors[i]->nextGEQ(pivotDocId);
+					}
+				}
+			}
+			else {
+				// No document can get into the top k until one of the blocks ends or the next cursor starts
+				uint32_t nextDocId = END_DOC_ID;
+				for (size_t i = 0; i <= pivot; ++i)
+					nextDocId = std::min(nextDocId, sortedCursors[i]->blockLastDocId());
+				if (nextDocId != END_DOC_ID)
+					++nextDocId;
+				if (pivot + 1 < cursorCount)
+					nextDocId = std::min(nextDocId, sortedCursors[pivot + 1]->docId());
+				if (nextDocId <= pivotDocId)
+					nextDocId = pivotDocId + 1;
+				sortedCursors[pivot]->nextGEQ(nextDocId);
+			}
+		}
+		this->traceCursors(cursors, documentsScored, trace);
+	}
+
+	// Term-at-a-time: add the scores of every word's postings into the dense accumulator array, then pick the top k with a heap.
+	// Scores are added in query word order like getSortedRelevantDocuments, so the results are the same.
+	// input: query (multiple words), k
+	// output: the k best docId and score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsTermAtATime(const std::string& query, uint32_t k, QueryContext& context) {
+		if (context.scoreAccumulator.isEmpty())
+			context.scoreAccumulator.resize(this->totalDocuments);
+
+		std::vector<std::string> words = this->tokenize(query, context);
+
+		uint32_t docIds[POSTINGS_BLOCK_SIZE];
+		float tfs[POSTINGS_BLOCK_SIZE];
+		float docLengths[POSTINGS_BLOCK_SIZE];
+		float scores[POSTINGS_BLOCK_SIZE];
+
+		std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > > wordPostings = this->getQueryPostings(words, context);
+		if (this->isParallelQuery(wordPostings))
+			return this->getTopDocumentsParallel(words, wordPostings, k, context);
+
+		for (size_t wordIndex = 0; wordIndex < words.size(); ++wordIndex) {
+			const std::vector<std::pair<uint32_t, uint32_t> >& postings = *wordPostings[wordIndex];
+			float idf = this->getWordIdf(words[wordIndex], (uint32_t)postings.size());
+
+			PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+			if (context.trace != NULL)
+				context.trace->documentsScored += postings.size();
+			for (size_t start = 0; start < postings.size(); start += POSTINGS_BLOCK_SIZE) {
+				uint32_t count = (uint32_t)std::min(postings.size() - start, (size_t)POSTINGS_BLOCK_SIZE);
+
+				// Gather, then score without branches so that the compiler vectorizes the loop
+				for (uint32_t i = 0; i < count; ++i) {
+					docIds[i] = postings[start + i].first;
+					tfs[i] = (float)postings[start + i].second;
+					docLengths[i] = (float)this->getDocumentLength(docIds[i]);
+				}
+				this->getRankingScores(tfs, docLengths, idf, count, scores);
+
+				for (uint32_t i = 0; i < count; ++i) {
+					if (!this->isDeleted(docIds[i]))
+						context.scoreAccumulator.add(docIds[i], scores[i]);
+				}
+			}
+		}
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		TopKHeap topKHeap(k);
+		context.scoreAccumulator.selectTopK(topKHeap);
+		return topKHeap.getSortedResults();
+	}
+
+	// Whether a query is worth scoring in parallel: only with enough postings to keep the threads busy for much longer
+	// than it takes to hand out the tasks, so short queries stay on their own thread
+	bool isParallelQuery(const std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > >& wordPostings) const {
+		if (!this->queryPool)
+			return false;
+		uint64_t postingsCount = 0;
+		for (size_t i = 0; i < wordPostings.size(); ++i)
+			postingsCount += wordPostings[i]->size();
+		return postingsCount >= this->options.parallelPostings;
+	}
+
+	// Intra-query parallelism for the exhaustive and term-at-a-time modes. The docId space is split into ranges, each of them
+	// a task of the work-stealing pool: the postings of every query word within the range (found with a binary search, the
+	// postings are sorted by docId) are scored into the task's own accumulators, in query word order, and the range's k best
+	// documents are kept. The best of all the ranges are then merged. Every document gets the same sum of scores as on one
+	// thread, so the results are the same as getSortedRelevantDocuments and getTopDocumentsTermAtATime.
+	// input: query words, their postings, k (0 for all)
+	// output: the k best docId and score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsParallel(const std::vector<std::string>& words, 
+		const std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > >& wordPostings, uint32_t k, QueryContext& context) 
+	{
+		std::vector<float> idfs(words.size());
+		uint64_t postingsCount = 0;
+		for (size_t i = 0; i < words.size(); ++i) {
+			idfs[i] = this->getWordIdf(words[i], (uint32_t)wordPostings[i]->size());
+			postingsCount += wordPostings[i]->size();
+		}
+		if (context.trace != NULL)
+			context.trace->documentsScored += postingsCount;
+
+		// docIds 1 ... totalDocuments, in ranges of whole accumulator pages
+		uint32_t rangeCount = this->queryPool->getConcurrency() * PARALLEL_RANGES_PER_THREAD;
+		uint32_t rangeSize = (this->totalDocuments / rangeCount + ACCUMULATOR_PAGE_SIZE) & ~(ACCUMULATOR_PAGE_SIZE - 1);
+		rangeCount = this->totalDocuments / rangeSize + 1;
+
+		std::vector<std::vector<std::pair<uint32_t, float> > > rangeResults(rangeCount);
+		std::vector<std::function<void()> > tasks;
+		for (uint32_t i = 0; i < rangeCount; ++i) {
+			uint32_t begin = std::max(i * rangeSize, 1u);
+			uint32_t end = (uint32_t)std::min((uint64_t)(i + 1) * rangeSize, (uint64_t)this->totalDocuments + 1);
+			std::vector<std::pair<uint32_t, float> >* results = &rangeResults[i];
+			tasks.push_back([this, &wordPostings, &idfs, begin, end, k, results]() {
+				this->scoreDocIdRange(wordPostings, idfs, begin, end, k, *results);
+			});
+		}
+		PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+		this->queryPool->runAll(tasks);
+		scoringTimer.stop();
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		std::vector<std::pair<uint32_t, float> > results;
+		for (uint32_t i = 0; i < rangeCount; ++i)
+			results.insert(results.end(), rangeResults[i].begin(), rangeResults[i].end());
+		std::sort(results.begin(), results.end(), sortScoreCompare);
+		if (k > 0 && results.size() > k)
+			results.resize(k);
+		return results;
+	}
+
+	// One task of getTopDocumentsParallel: score the documents begin ... end - 1, and output the k best (all if k is 0), sorted
+	void scoreDocIdRange(const std::vector<std::shared_ptr<const std::vector<std::pair<uint32_t, uint32_t> > > >& wordPostings,
+		const std::vector<float>& idfs, uint32_t begin, uint32_t end, uint32_t k, std::vector<std::pair<uint32_t, float> >& results)
+	{
+		std::vector<float> rangeScores(end - begin, 0);
+		uint32_t docIds[POSTINGS_BLOCK_SIZE];
+		float tfs[POSTINGS_BLOCK_SIZE];
+		float docLengths[POSTINGS_BLOCK_SIZE];
+		float scores[POSTINGS_BLOCK_SIZE];
+
+		for (size_t wordIndex = 0; wordIndex < wordPostings.size(); ++wordIndex) {
+			const std::vector<std::pair<uint32_t, uint32_t> >& postings = *wordPostings[wordIndex];
+			size_t start = std::lower_bound(postings.begin(), postings.end(), std::pair<uint32_t, uint32_t>(begin, 0)) - postings.begin();
+			while (start < postings.size() && postings[start].first < end) {
+				uint32_t count = 0;
+				for (; count < POSTINGS_BLOCK_SIZE && start + count < postings.size() && postings[start + count].first < end; ++count) {
+					docIds[count] = postings[start + count].first;
+					tfs[count] = (float)postings[start + count].second;
+					docLengths[count] = (float)this->getDocumentLength(docIds[count]);
+				}
+				this->getRankingScores(tfs, docLengths, idfs[wordIndex], count, scores);
+
+				for (uint32_t i = 0; i < count; ++i) {
+					if (scores[i] > 0 && !this->isDeleted(docIds[i]))
+						rangeScores[docIds[i] - begin] += scores[i];
+				}
+				start += count;
+			}
+		}
+
+		if (k == 0) {
+			for (uint32_t i = 0; i < end - begin; ++i) {
+				if (rangeScores[i] > 0)
+					results.push_back(std::pair<uint32_t, float>(begin + i, rangeScores[i]));
+			}
+			std::sort(results.begin(), results.end(), sortScoreCompare);
+			return;
+		}
+		TopKHeap topKHeap(k);
+		for (uint32_t i = 0; i < end - begin; ++i) {
+			if (rangeScores[i] > topKHeap.threshold())
+				topKHeap.push(begin + i, rangeScores[i]);
+		}
+		results = topKHeap.getSortedResults();
+	}
+
+	// BM25 of many postings at once, same as getRankingScore
+	void getRankingScores(const float* tfs, const float* docLengths, float idf, uint32_t count, float* scores) {
+		const float k1 = BM25_K1;
+		const float b = BM25_B;
+		const float averageDocumentLength = this->averageDocumentLength;
+		for (uint32_t i = 0; i < count; ++i) {
+			float K = k1 * ((1 - b) + b * (docLengths[i] / averageDocumentLength));
+			scores[i] = idf * (tfs[i] * (k1 + 1) / (tfs[i] + K));
+		}
+	}
+
+	// Score-at-a-time ("anytime", like JASS): the impact segments of all the query words are processed from the
+	// highest impact to the lowest, adding integer impacts to the accumulators, until postingsBudget postings are processed.
+	// With no budget the ranking is the BM25 ranking up to quantization; with a budget it's the best one reachable in time.
+	// input: query (multiple words), k, postingsBudget (0 for no limit)
+	// output: the k best docId and (dequantized) score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsScoreAtATime(const std::string& query, uint32_t k, uint64_t postingsBudget, QueryContext& context) {
+		if (context.impactAccumulator.isEmpty())
+			context.impactAccumulator.resize(this->totalDocuments);
+
+		std::vector<std::string> words = this->tokenize(query, context);
+		const IndexSegment& index = *this->segments[0]; // Only with a single index.bin
+
+		// Segments of all the query words, highest impact first (stable, so query word order for equal impacts)
+		PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+		std::vector<const ImpactSegment*> segments;
+		for (size_t i = 0; i < words.size(); ++i) {
+			uint32_t termIndex = index.findTermEntry(words[i]);
+			if (termIndex == index.termCount)
+				continue;
+			const TermImpacts& termImpacts = index.termImpacts[termIndex];
+			for (uint32_t j = 0; j < termImpacts.segmentCount; ++j)
+				segments.push_back(&index.impactSegments[termImpacts.segmentOffset + j]);
+		}
+		std::stable_sort(segments.begin(), segments.end(), compareImpactSegments);
+		lookupTimer.stop();
+
+		PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+		uint32_t docIds[POSTINGS_BLOCK_SIZE];
+		uint32_t tfs[POSTINGS_BLOCK_SIZE];
+		uint64_t postingsProcessed = 0;
+		uint64_t postingsBytes = 0;
+
+		for (size_t i = 0; i < segments.size(); ++i) {
+			const ImpactSegment* segment = segments[i];
+			uint32_t impact = segment->impact;
+			uint32_t docCount = segment->docCount;
+			if (postingsBudget > 0 && postingsProcessed + docCount > postingsBudget)
+				docCount = (uint32_t)(postingsBudget - postingsProcessed); // Stop in the middle of the segment
+
+			const uint8_t* data = index.impactPostings + segment->postingsOffset;
+			uint32_t previousDocId = 0;
+			for (uint32_t start = 0; start < docCount; start += POSTINGS_BLOCK_SIZE) {
+				uint32_t count = std::min(segment->docCount - start, POSTINGS_BLOCK_SIZE);
+				if (count == POSTINGS_BLOCK_SIZE)
+					data = decodeBlock(data, previousDocId, docIds, tfs);
+				else
+					data = decodeTail(data, count, previousDocId, docIds, tfs);
+				previousDocId = docIds[count - 1];
+
+				count = std::min(count, docCount - start);
+				for (uint32_t j = 0; j < count; ++j)
+					context.impactAccumulator.add(docIds[j], impact);
+			}
+
+			postingsBytes += data - (index.impactPostings + segment->postingsOffset);
+			postingsProcessed += docCount;
+			if (postingsBudget > 0 && postingsProcessed >= postingsBudget)
+				break;
+		}
+
+		scoringTimer.stop();
+		if (context.trace != NULL) {
+			context.trace->postingsDecoded += postingsProcessed;
+			context.trace->postingsBytes += postingsBytes;
+			context.trace->documentsScored += postingsProcessed;
+		}
+		if (this->options.showTime)
+			std::cerr << "Postings processed: " << postingsProcessed << std::endl;
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		TopKHeap topKHeap(k);
+		context.impactAccumulator.selectTopK(topKHeap);
+		std::vector<std::pair<uint32_t, float> > results = topKHeap.getSortedResults();
+		for (size_t i = 0; i < results.size(); ++i)
+			results[i].second = dequantizeScore((uint32_t)results[i].second, index.impactStats->maxScore, index.impactStats->bits);
+		return results;
+	}
+
+	// Quantized term-at-a-time: like getTopDocumentsTermAtATime, but the BM25 score of every posting was computed by the indexer
+	// and quantized to 8 or 16 bits (./indexer --quantized), so scoring a block of postings is decoding its docIds and adding
+	// their impacts to the integer accumulators (see quantizedScoring.h), with no document length or division per posting.
+	// The ranking is the BM25 ranking up to quantization: every score is within QuantizedStats::maxError of BM25 per query word.
+	// input: query (multiple words), k
+	// output: the k best docId and (dequantized) score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsQuantized(const std::string& query, uint32_t k, QueryContext& context) {
+		if (context.impactAccumulator.isEmpty())
+			context.impactAccumulator.resize(this->totalDocuments);
+
+		std::vector<std::string> words = this->tokenize(query, context);
+		const IndexSegment& index = *this->segments[0]; // Only with a single index.bin
+		const QuantizedStats& stats = *index.quantizedStats;
+
+		uint32_t docIds[POSTINGS_BLOCK_SIZE];
+		uint32_t tfs[POSTINGS_BLOCK_SIZE];
+		uint64_t postingsProcessed = 0;
+		uint64_t postingsBytes = 0;
+
+		for (size_t wordIndex = 0; wordIndex < words.size(); ++wordIndex) {
+			PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+			uint32_t termIndex = index.findTermEntry(words[wordIndex]);
+			lookupTimer.stop();
+			if (termIndex == index.termCount)
+				continue;
+
+			PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+			const TermEntry& entry = index.termEntries[termIndex];
+			const uint8_t* impacts = index.quantizedImpacts + index.quantizedOffsets[termIndex] * (stats.bits / 8);
+			const uint8_t* postings = index.postingsData + entry.postingsOffset;
+			const uint8_t* data = index.postingsFormat == POSTINGS_FORMAT_COMPRESSED ? postings + 4 : postings; // + 4 to skip the byteLength
+			uint32_t previousDocId = 0;
+			for (uint32_t start = 0; start < entry.docCount; start += POSTINGS_BLOCK_SIZE) {
+				uint32_t count = std::min(entry.docCount - start, POSTINGS_BLOCK_SIZE);
+				if (index.postingsFormat == POSTINGS_FORMAT_COMPRESSED) {
+					if (count == POSTINGS_BLOCK_SIZE)
+						data = decodeBlock(data, previousDocId, docIds, tfs);
+					else
+						data = decodeTail(data, count, previousDocId, docIds, tfs);
+					previousDocId = docIds[count - 1];
+				}
+				else {
+					const uint32_t* values = (const uint32_t*)data + (uint64_t)start * 2;
+					for (uint32_t i = 0; i < count; ++i)
+						docIds[i] = values[i * 2];
+				}
+
+				if (stats.bits == 8)
+					context.impactAccumulator.addImpacts(docIds, impacts + start, count);
+				else
+					context.impactAccumulator.addImpacts(docIds, (const uint16_t*)impacts + start, count);
+			}
+			postingsProcessed += entry.docCount;
+			if (index.postingsFormat == POSTINGS_FORMAT_COMPRESSED)
+				postingsBytes += data - postings;
+			else
+				postingsBytes += (uint64_t)entry.docCount * 8;
+			postingsBytes += (uint64_t)entry.docCount * (stats.bits / 8);
+		}
+
+		if (context.trace != NULL) {
+			context.trace->postingsDecoded += postingsProcessed;
+			context.trace->postingsBytes += postingsBytes;
+			context.trace->documentsScored += postingsProcessed;
+		}
+		if (this->options.showTime)
+			std::cerr << "Postings processed: " << postingsProcessed << ", scores within " << stats.maxError * words.size() << " of BM25" << std::endl;
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		TopKHeap topKHeap(k);
+		context.impactAccumulator.selectTopK(topKHeap);
+		std::vector<std::pair<uint32_t, float> > results = topKHeap.getSortedResults();
+		for (size_t i = 0; i < results.size(); ++i)
+			results[i].second = dequantizeScore((uint32_t)results[i].second, stats.maxScore, stats.bits);
+		return results;
+	}
+
+	// Conjunctive (AND) query: only the documents containing every query word are scored, with BM25 like getSortedRelevantDocuments.
+	// The cursors are intersected from the rarest word: the other cursors jump to its documents with nextGEQ (galloping over
+	// the block skip pointers, then a SIMD search in the block), so only the blocks around the rarest word's documents are
+	// decoded, and the cost follows the rarest word's list instead of the sum of all the lists.
+	// A wildcard matches a document containing any of its expansions: its words are one group, whose cursors move together,
+	// and the groups are intersected instead of the words.
+	// phrase: the words must also be at consecutive positions, in query order
+	// input: query (multiple words), k
+	// output: the k best docId and score, sorted
+	std::vector<std::pair<uint32_t, float> > getTopDocumentsConjunctive(const std::string& query, uint32_t k, bool phrase, QueryContext& context) {
+		std::vector<std::vector<size_t> > groups;
+		std::vector<std::string> words = this->tokenize(query, context, &groups);
+		if (words.empty())
+			return std::vector<std::pair<uint32_t, float> >();
+		std::vector<std::vector<uint32_t> > termIndexes;
+		PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+		std::vector<float> idfs = this->findQueryWords(words, termIndexes);
+		lookupTimer.stop();
+
+		TopKHeap topKHeap(k);
+		PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+		for (size_t i = 0; i < this->segments.size(); ++i)
+			this->searchSegmentConjunctive(*this->segments[i], termIndexes[i], idfs, groups, phrase, topKHeap, context.trace);
+		scoringTimer.stop();
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		return topKHeap.getSortedResults();
+	}
+
+	// Conjunctive query over one segment. A group's docId is the smallest docId of its cursors, and a document matching
+	// every group is scored with all the words it contains.
+	// groups: the indexes in termIndexes of every query word (more than one for a wildcard, see tokenize)
+	void searchSegmentConjunctive(const IndexSegment& segment, const std::vector<uint32_t>& termIndexes, const std::vector<float>& idfs, 
+		const std::vector<std::vector<size_t> >& groups, bool phrase, TopKHeap& topKHeap, QueryTrace* trace) 
+	{
+		// One cursor for each query word in the segment, in query order
+		std::vector<PostingsCursor> cursors;
+		cursors.reserve(termIndexes.size());
+		std::vector<const uint64_t*> cursorPositionBlocks;
+		std::vector<std::vector<size_t> > groupCursors(groups.size()); // group -> its cursors
+		std::vector<uint64_t> groupSizes(groups.size(), 0);
+		std::vector<size_t> order; // Groups from the rarest
+		for (size_t g = 0; g < groups.size(); ++g) {
+			for (size_t j = 0; j < groups[g].size(); ++j) {
+				size_t i = groups[g][j];
+				if (termIndexes[i] == segment.termCount)
+					continue;
+				cursors.emplace_back();
+				this->initCursor(segment, termIndexes[i], idfs[i], cursors.back());
+				cursorPositionBlocks.push_back(phrase ? segment.positionBlocks + segment.termBlockMax[termIndexes[i]].blockOffset : NULL);
+				groupCursors[g].push_back(cursors.size() - 1);
+				groupSizes[g] += cursors.back().size();
+			}
+			if (groupCursors[g].empty())
+				return; // No document of the segment contains the word (or any word of the wildcard)
+			order.push_back(g);
+		}
+		std::stable_sort(order.begin(), order.end(), [&groupSizes](size_t a, size_t b) { return groupSizes[a] < groupSizes[b]; });
+
+		auto groupDocId = [&](size_t g) {
+			uint32_t docId = END_DOC_ID;
+			for (size_t j = 0; j < groupCursors[g].size(); ++j)
+				docId = std::min(docId, cursors[groupCursors[g][j]].docId());
+			return docId;
+		};
+		auto groupNextGEQ = [&](size_t g, uint32_t target) {
+			for (size_t j = 0; j < groupCursors[g].size(); ++j)
+				cursors[groupCursors[g][j]].nextGEQ(target);
+			return groupDocId(g);
+		};
+
+		std::vector<std::vector<uint32_t> > positions(groups.size());
+		std::vector<uint32_t> wordPositions;
+		size_t rarest = order[0];
+		uint64_t documentsScored = 0;
+		uint32_t candidate = groupDocId(rarest);
+		while (candidate != END_DOC_ID) {
+			size_t i = 1;
+			uint32_t docId = candidate;
+			for (; i < order.size(); ++i) {
+				docId = groupNextGEQ(order[i], candidate);
+				if (docId != candidate)
+					break;
+			}
+			if (i < order.size()) {
+				candidate = groupNextGEQ(rarest, docId); // Not in all the groups, go to the next possible document
+				continue;
+			}
+
+			bool matched = !this->isDeleted(segment.docIdBase + candidate);
+			if (matched && phrase) {
+				// The positions of a group are those of its words in the document (a position has only one word)
+				for (size_t g = 0; g < groups.size(); ++g) {
+					positions[g].clear();
+					for (size_t j = 0; j < groupCursors[g].size(); ++j) {
+						size_t c = groupCursors[g][j];
+						if (cursors[c].docId() != candidate)
+							continue;
+						cursors[c].getPositions(segment.positionsData, cursorPositionBlocks[c], wordPositions);
+						positions[g].insert(positions[g].end(), wordPositions.begin(), wordPositions.end());
+					}
+					if (groupCursors[g].size() > 1)
+						std::sort(positions[g].begin(), positions[g].end());
+				}
+				matched = this->hasPhrase(positions);
+			}
+			if (matched) {
+				uint32_t docLength = segment.docLengths[candidate - 1];
+				float score = 0;
+				for (size_t j = 0; j < cursors.size(); ++j) {
+					if (cursors[j].docId() == candidate)
+						score += this->getRankingScore(cursors[j].tf(), docLength, cursors[j].idf);
+				}
+				topKHeap.push(segment.docIdBase + candidate, score);
+				++documentsScored;
+			}
+			candidate = groupNextGEQ(rarest, candidate + 1);
+		}
+		this->traceCursors(cursors, documentsScored, trace);
+	}
+
+	// Whether the words are next to each other: a position p of the first word with p + i in the positions of word i
+	bool hasPhrase(const std::vector<std::vector<uint32_t> >& positions) {
+		for (size_t i = 0; i < positions[0].size(); ++i) {
+			uint32_t start = positions[0][i];
+			size_t j = 1;
+			for (; j < positions.size(); ++j) {
+				if (!std::binary_search(positions[j].begin(), positions[j].end(), start + (uint32_t)j))
+					break;
+			}
+			if (j == positions.size())
+				return true;
+		}
+		return false;
+	}
+
+	// Run the query for the k best documents (0 for all), or return the results of the same normalized query and k from the result cache
+	std::vector<std::pair<uint32_t, float> > search(const std::string& query, uint32_t topK, QueryContext& context) {
+		if (!this->resultCache.isEnabled())
+			return this->searchWithoutCache(query, topK, context);
+
+		// k, then the words after extractWords, so that "Wall  Street" and "wall street" are the same query.
+		// The expansions of a wildcard are joined by '|', since they are one query word in the and and phrase modes
+		// e.g. "wall st*" -> "10 wall stock|street", "wall stock street" -> "10 wall stock street"
+		std::vector<std::vector<size_t> > groups;
+		std::vector<std::string> words = this->tokenize(query, context, &groups);
+		std::string cacheKey = std::to_string(topK);
+		for (size_t i = 0; i < groups.size(); ++i) {
+			cacheKey += ' ';
+			for (size_t j = 0; j < groups[i].size(); ++j) {
+				if (j > 0)
+					cacheKey += '|';
+				cacheKey += words[groups[i][j]];
+			}
+		}
+
+		std::shared_ptr<const std::vector<std::pair<uint32_t, float> > > cached = this->resultCache.get(cacheKey);
+		if (cached) {
+			if (context.trace != NULL)
+				context.trace->resultCacheHit = true;
+			return *cached;
+		}
+
+		std::shared_ptr<const std::vector<std::pair<uint32_t, float> > > results 
+			= std::make_shared<const std::vector<std::pair<uint32_t, float> > >(this->searchWithoutCache(query, topK, context));
+		this->resultCache.put(cacheKey, results, results->size() * sizeof(std::pair<uint32_t, float>));
+		return *results;
+	}
+
+	// Search the first tier (index_tier1.bin, see ./indexer --tier1) for the k best documents, with the same results as index.bin.
+	// The tier has the best postings of every word, and for every word the largest score of its postings left out (its bound).
+	// Every document of the tier gets an upper bound: its scores in the tier, plus the bounds of the words it's missing from the tier.
+	// The ones that can still beat the k-th best are scored exactly, looking up the missing words in index.bin.
+	// A document in no tier list scores at most the sum of all the bounds, so the tier only answers the query when the k-th best
+	// beats that sum.
+	// return false if the query must be searched in index.bin instead
+	bool searchFirstTier(const std::string& query, uint32_t k, QueryContext& context, std::vector<std::pair<uint32_t, float> >& results) {
+		std::vector<std::string> words = this->tokenize(query, context);
+		if (words.empty() || words.size() > 64)
+			return false;
+		for (std::vector<std::string>::iterator itrWords = words.begin(); itrWords != words.end(); ++itrWords) {
+			for (size_t i = 0; i < itrWords->length(); ++i)
+				(*itrWords)[i] = std::tolower((*itrWords)[i]);
+		}
+
+		const IndexSegment& index = *this->segments[0];
+		const IndexSegment& tier = *this->tierSegment;
+		PhaseTimer lookupTimer(context.trace, QUERY_PHASE_LOOKUP);
+		std::vector<std::vector<uint32_t> > termIndexes;
+		std::vector<float> idfs = this->findQueryWords(words, termIndexes);
+		std::vector<uint32_t> tierTerms(words.size(), tier.termCount);
+		std::vector<float> bounds(words.size(), 0); // Largest score of the postings of the word that aren't in the tier
+		float unseenBound = 0;
+		for (size_t j = 0; j < words.size(); ++j) {
+			if (termIndexes[0][j] == index.termCount)
+				continue;
+			tierTerms[j] = tier.findTermEntry(words[j]);
+			if (tierTerms[j] == tier.termCount)
+				return false;
+			bounds[j] = tier.tierBounds[tierTerms[j]];
+			unseenBound += bounds[j];
+		}
+		lookupTimer.stop();
+
+		// Merge the tier lists in docId order. Every document in them is a candidate, with the tf of every query word (0 if the
+		// document isn't in the word's tier list), its score in the tier (added in query word order, a lower bound of its score)
+		// and its upper bound with the bounds of the words it's missing from the tier
+		PhaseTimer scoringTimer(context.trace, QUERY_PHASE_SCORING);
+		std::vector<PostingsCursor> tierCursors(words.size());
+		for (size_t j = 0; j < words.size(); ++j) {
+			if (tierTerms[j] != tier.termCount)
+				this->initCursor(tier, tierTerms[j], idfs[j], tierCursors[j]);
+		}
+		std::vector<uint32_t> candidateDocIds;
+		std::vector<uint32_t> candidateTfs; // words.size() for each candidate
+		std::vector<float> tierScores;
+		std::vector<float> upperBounds;
+		std::vector<bool> missingWords; // Whether the candidate is missing from the tier list of a word with a bound
+		while (true) {
+			uint32_t docId = END_DOC_ID;
+			for (size_t j = 0; j < words.size(); ++j) {
+				if (tierTerms[j] != tier.termCount)
+					docId = std::min(docId, tierCursors[j].docId());
+			}
+			if (docId == END_DOC_ID)
+				break;
+
+			uint32_t docLength = index.docLengths[docId - 1];
+			float score = 0;
+			float missingBound = 0;
+			for (size_t j = 0; j < words.size(); ++j) {
+				uint32_t tf = 0;
+				if (tierTerms[j] != tier.termCount && tierCursors[j].docId() == docId) {
+					tf = tierCursors[j].tf();
+					tierCursors[j].next();
+					score += this->getRankingScore(tf, docLength, idfs[j]);
+				}
+				else
+					missingBound += bounds[j];
+				candidateTfs.push_back(tf);
+			}
+			candidateDocIds.push_back(docId);
+			tierScores.push_back(score);
+			upperBounds.push_back((score + missingBound) * UPPER_BOUND_SLACK);
+			missingWords.push_back(missingBound > 0);
+		}
+
+		// The k-th best score is at least the k-th best tier score, and at most the k-th best upper bound
+		if (candidateDocIds.size() < k && unseenBound > 0)
+			return false; // A document in no tier list may be in the top k
+		float minimumThreshold = 0;
+		if (candidateDocIds.size() >= k && k > 0) {
+			std::vector<float> kthScores(tierScores);
+			std::nth_element(kthScores.begin(), kthScores.begin() + (k - 1), kthScores.end(), std::greater<float>());
+			minimumThreshold = kthScores[k - 1];
+			kthScores = upperBounds;
+			std::nth_element(kthScores.begin(), kthScores.begin() + (k - 1), kthScores.end(), std::greater<float>());
+			if (unseenBound > 0 && unseenBound * UPPER_BOUND_SLACK >= kthScores[k - 1])
+				return false; // A document in no tier list may beat the k-th best
+		}
+
+		// Score the candidates that can get into the top k exactly, looking up the words they are missing in index.bin
+		// (in docId order, so the cursors only move forward), then add all the scores again in query word order
+		TopKHeap topKHeap(k);
+		std::vector<PostingsCursor> indexCursors(words.size());
+		for (size_t j = 0; j < words.size(); ++j) {
+			if (bounds[j] > 0)
+				this->initCursor(index, termIndexes[0][j], idfs[j], indexCursors[j]);
+		}
+		uint64_t documentsScored = 0;
+		for (size_t i = 0; i < candidateDocIds.size(); ++i) {
+			if (upperBounds[i] < minimumThreshold || upperBounds[i] < topKHeap.threshold())
+				continue;
+			uint32_t docId = candidateDocIds[i];
+			float score = tierScores[i];
+			if (missingWords[i]) {
+				uint32_t docLength = index.docLengths[docId - 1];
+				score = 0;
+				for (size_t j = 0; j < words.size(); ++j) {
+					uint32_t tf = candidateTfs[i * words.size() + j];
+					if (tf == 0 && bounds[j] > 0) {
+						indexCursors[j].nextGEQ(docId);
+						if (indexCursors[j].docId() == docId)
+							tf = indexCursors[j].tf();
+					}
+					if (tf > 0)
+						score += this->getRankingScore(tf, docLength, idfs[j]);
+				}
+			}
+			topKHeap.push(docId, score);
+			++documentsScored;
+		}
+		tierCursors.insert(tierCursors.end(), indexCursors.begin(), indexCursors.end());
+		this->traceCursors(tierCursors, documentsScored, context.trace);
+		scoringTimer.stop();
+
+		// A document in no tier list may beat the k-th best (or fill the top k)
+		float threshold = topKHeap.threshold();
+		if (unseenBound > 0 && (threshold == 0 || unseenBound * UPPER_BOUND_SLACK >= threshold))
+			return false;
+
+		PhaseTimer topKTimer(context.trace, QUERY_PHASE_TOP_K);
+		results = topKHeap.getSortedResults();
+		return true;
+	}
+
+	// Run the query with the selected query mode
+	std::vector<std::pair<uint32_t, float> > searchWithoutCache(const std::string& query, uint32_t topK, QueryContext& context) {
+		QueryMode queryMode = this->queryMode;
+		// Block-Max WAND already skips most of what the first tier would save, so only the modes scoring every posting use it
+		if (this->tierSegment && ((queryMode == QUERY_MODE_EXHAUSTIVE && topK > 0) || queryMode == QUERY_MODE_TERM_AT_A_TIME)) {
+			std::vector<std::pair<uint32_t, float> > results;
+			if (this->searchFirstTier(query, topK > 0 ? topK : DEFAULT_TOP_K, context, results)) {
+				this->tierAnswers.fetch_add(1, std::memory_order_relaxed);
+				return results;
+			}
+			this->tierFallbacks.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		if (queryMode == QUERY_MODE_BLOCK_MAX_WAND)
+			return this->getTopDocumentsBlockMaxWand(query, topK > 0 ? topK : DEFAULT_TOP_K, context);
+		if (queryMode == QUERY_MODE_TERM_AT_A_TIME)
+			return this->getTopDocumentsTermAtATime(query, topK > 0 ? topK : DEFAULT_TOP_K, context);
+		if (queryMode == QUERY_MODE_CONJUNCTIVE || queryMode == QUERY_MODE_PHRASE)
+			return this->getTopDocumentsConjunctive(query, topK > 0 ? topK : DEFAULT_TOP_K, queryMode == QUERY_MODE_PHRASE, context);
+		if (queryMode == QUERY_MODE_SCORE_AT_A_TIME)
+			return this->getTopDocumentsScoreAtATime(query, topK > 0 ? topK : DEFAULT_TOP_K, this->options.postingsBudget, context);
+		if (queryMode == QUERY_MODE_QUANTIZED)
+			return this->getTopDocumentsQuantized(query, topK > 0 ? topK : DEFAULT_TOP_K, context);
+
+		std::vector<std::pair<uint32_t, float> > vecDocIdScore = this->getSortedRelevantDocuments(query, topK, context);
+		if (topK > 0 && vecDocIdScore.size() > topK)
+			vecDocIdScore.resize(topK);
+		return vecDocIdScore;
+	}
+
+	// Hit rates of the enabled caches
+	void reportCacheStats() {
+		if (this->resultCache.isEnabled())
+			this->reportCacheStats("Result cache", this->resultCache.getStats());
+		if (this->postingsCache.isEnabled())
+			this->reportCacheStats("Postings cache", this->postingsCache.getStats());
+		if (this->tierSegment)
+			std::cerr << "First tier: answered " << this->tierAnswers.load() << ", fallbacks " << this->tierFallbacks.load() << std::endl;
+		if (this->options.showSnippets && this->storeBlockCache.isEnabled())
+			this->reportCacheStats("Document store cache", this->storeBlockCache.getStats());
+	}
+
+	void reportCacheStats(const char* name, const CacheStats& stats) {
+		std::cerr << name << ": hits " << stats.hits << ", misses " << stats.misses << ", hit rate " << stats.hitRate() * 100 << "%"
+			<< ", entries " << stats.entries << ", " << stats.bytes / 1048576.0 << "/" << stats.capacityBytes / 1048576.0 << " MB"
+			<< ", evictions " << stats.evictions << ", rejected " << stats.rejected << std::endl;
+	}
+
+	// The sorted list of docNo and score, a line for each document
+	// With snippets, the first results are followed by a line with their snippet, indented (never blank)
+	// A shard worker writes "docId score docNo" instead, with the docId in the collection and the exact score, for the coordinator
+	std::string formatResults(const std::vector<std::pair<uint32_t, float> >& vecDocIdScore, const std::vector<std::string>& words) {
+		std::ostringstream output;
+		if (this->options.shardIndex >= 0) {
+			char score[32];
+			for (size_t i = 0; i < vecDocIdScore.size(); ++i) {
+				snprintf(score, sizeof(score), "%.9g", vecDocIdScore[i].second); // Enough digits to read back the same float
+				output << this->docIdOffset + vecDocIdScore[i].first << " " << score << " " << this->getDocNo(vecDocIdScore[i].first) << "\n";
+			}
+			return output.str();
+		}
+		for (size_t i = 0; i < vecDocIdScore.size(); ++i) {
+			uint32_t docId = vecDocIdScore[i].first;
+			const char* docNo = this->getDocNo(docId);
+			float score = vecDocIdScore[i].second;
+
+			output << docNo << " " << score << "\n";
+
+			if (this->options.showSnippets && i < (this->options.topK > 0 ? this->options.topK : DEFAULT_TOP_K)) {
+				std::string text;
+				std::string snippet = this->getDocumentText(docId, text) ? this->getSnippet(text, words) : "";
+				if (!snippet.empty())
+					output << "    " << snippet << "\n";
+			}
+		}
+		return output.str();
+	}
+
+	// Search and format the results, updating the metrics (and writing the query's trace if tracing is on)
+	// latencyMicroseconds: set to the time of the query
+	std::string answerQuery(const std::string& query, QueryContext& context, uint64_t& latencyMicroseconds) {
+		QueryTrace trace;
+		if (this->traceWriter.isOpen()) {
+			trace.clear(query);
+			context.trace = &trace;
+		}
+
+		std::chrono::steady_clock::time_point timeBegin = std::chrono::steady_clock::now();
+		std::vector<std::pair<uint32_t, float> > vecDocIdScore = this->search(query, this->options.topK, context);
+		std::vector<std::string> words;
+		if (this->options.showSnippets)
+			words = this->tokenize(query, context);
+		PhaseTimer formatTimer(context.trace, QUERY_PHASE_FORMAT);
+		std::string answer = this->formatResults(vecDocIdScore, words);
+		formatTimer.stop();
+		std::chrono::steady_clock::time_point timeEnd = std::chrono::steady_clock::now();
+
+		latencyMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(timeEnd - timeBegin).count();
+		this->metrics.recordQuery(latencyMicroseconds, (uint32_t)vecDocIdScore.size());
+		if (context.trace != NULL) {
+			trace.totalNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeBegin).count();
+			trace.resultCount = (uint32_t)vecDocIdScore.size();
+			this->traceWriter.write(trace.toJson(getQueryModeName(this->queryMode), this->options.shardIndex));
+			context.trace = NULL;
+		}
+		return answer;
+	}
+
+	// The engine metrics and the cache statistics as one JSON line
+	std::string getMetricsJson() {
+		std::ostringstream json;
+		json << "{\"mode\": \"" << getQueryModeName(this->queryMode) << "\"";
+		if (this->options.shardIndex >= 0)
+			json << ", \"shard\": " << this->options.shardIndex;
+		json << ", \"documents\": " << this->totalDocuments << ", \"segments\": " << this->segments.size() << ", " << this->metrics.getJsonFields();
+		const char* cacheNames[] = {"resultCache", "postingsCache", "storeCache"};
+		CacheStats cacheStats[] = {this->resultCache.getStats(), this->postingsCache.getStats(), this->storeBlockCache.getStats()};
+		for (uint32_t i = 0; i < 3; ++i) {
+			json << ", \"" << cacheNames[i] << "\": {\"hits\": " << cacheStats[i].hits << ", \"misses\": " << cacheStats[i].misses
+				<< ", \"hitRate\": " << cacheStats[i].hitRate() << ", \"entries\": " << cacheStats[i].entries << ", \"bytes\": " << cacheStats[i].bytes
+				<< ", \"evictions\": " << cacheStats[i].evictions << "}";
+		}
+		if (this->tierSegment)
+			json << ", \"tier\": {\"answered\": " << this->tierAnswers.load() << ", \"fallbacks\": " << this->tierFallbacks.load() << "}";
+		json << "}";
+		return json.str();
+	}
+
+	// Append the metrics to the metrics file, if there's one
+	void writeMetrics() {
+		if (this->options.metricsFileName.empty())
+			return;
+		std::ofstream file(this->options.metricsFileName.c_str(), std::ofstream::app);
+		file << this->getMetricsJson() << std::endl;
+	}
+
+	void run() {
+		// std::string query = "rosenfield wall street unilateral representation";
+		// std::string query = "hello";
+		std::string query;
+		std::getline(std::cin, query);
+
+		QueryContext context;
+		uint64_t latencyMicroseconds = 0;
+		std::string answer = this->answerQuery(query, context, latencyMicroseconds);
+
+		// Print the sorted list of docNo and score
+		std::cout << answer << std::flush;
+
+		if (this->options.showTime)
+			std::cerr << "Query time: " << latencyMicroseconds << "us" << std::endl;
+	}
+};
+
+#endif
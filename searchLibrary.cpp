@@ -0,0 +1,70 @@
+#include "searchLibrary.h"
+#include "searchEngine.h"
+
+// The search library is a thin layer over SearchEngine: after load() the engine is read-only, and all the state of
+// a query is in its QueryContext, so an Index is a loaded engine and a Searcher is a QueryContext.
+
+Index::Index() {
+}
+
+Index::~Index() {
+}
+
+std::shared_ptr<const Index> Index::open(const IndexOptions& options, std::string* error) {
+	SearchOptions searchOptions;
+	uint32_t modeCount = sizeof(QUERY_MODE_NAMES) / sizeof(QUERY_MODE_NAMES[0]);
+	uint32_t mode = 0;
+	while (mode < modeCount && options.queryMode != QUERY_MODE_NAMES[mode])
+		++mode;
+	if (mode == modeCount) {
+		if (error != NULL)
+			*error = "Unknown query mode " + options.queryMode;
+		return std::shared_ptr<const Index>();
+	}
+	searchOptions.queryMode = (QueryMode)mode;
+	searchOptions.postingsBudget = options.postingsBudget;
+	searchOptions.resultCacheBytes = options.resultCacheBytes;
+	searchOptions.postingsCacheBytes = options.postingsCacheBytes;
+	searchOptions.queryThreads = std::max(1u, options.queryThreads);
+	searchOptions.parallelPostings = options.parallelPostings;
+
+	std::shared_ptr<Index> index(new Index());
+	index->engine.reset(new SearchEngine(searchOptions));
+	if (!index->engine->load()) {
+		if (error != NULL)
+			*error = "No index in the working directory";
+		return std::shared_ptr<const Index>();
+	}
+	return index;
+}
+
+uint32_t Index::getDocumentCount() const {
+	return this->engine->getTotalDocuments();
+}
+
+std::string Index::getQueryMode() const {
+	return getQueryModeName(this->engine->getQueryMode());
+}
+
+Searcher::Searcher(std::shared_ptr<const Index> index) : index(index), context(new QueryContext()) {
+}
+
+Searcher::~Searcher() {
+}
+
+std::vector<SearchResult> Searcher::search(const std::string& query, uint32_t k) {
+	std::vector<SearchResult> results;
+	this->search(query, k, results);
+	return results;
+}
+
+void Searcher::search(const std::string& query, uint32_t k, std::vector<SearchResult>& results) {
+	SearchEngine& engine = *this->index->engine;
+	std::vector<std::pair<uint32_t, float> > vecDocIdScore = engine.search(query, k, *this->context);
+	results.resize(vecDocIdScore.size());
+	for (size_t i = 0; i < vecDocIdScore.size(); ++i) {
+		results[i].docId = vecDocIdScore[i].first;
+		results[i].docNo = engine.getDocNo(vecDocIdScore[i].first);
+		results[i].score = vecDocIdScore[i].second;
+	}
+}
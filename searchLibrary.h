@@ -0,0 +1,99 @@
+#ifndef SEARCH_LIBRARY_H
+#define SEARCH_LIBRARY_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Search library (libsearch.a and libsearch.so, built with make lib): the search engine of ./searchEngine without
+// the command line, the server or any output, to embed in another program.
+//
+// -- Index: a loaded index, immutable and shared by all the threads (through shared_ptr<const Index>)
+// -- Searcher: the scratch buffers of one thread (postings buffers, score accumulators, its io_uring instance),
+//    cheap to create. Every thread querying an index has its own Searcher, and they don't wait for each other:
+//    with the default options (no caches, no intra-query threads), a query takes no locks.
+//
+// e.g.
+//   std::string error;
+//   std::shared_ptr<const Index> index = Index::open(IndexOptions(), &error);
+//   Searcher searcher(index); // On every thread
+//   std::vector<SearchResult> results = searcher.search("wall street", 10);
+//
+// Build with -I<this directory> and link with -lsearch -pthread.
+
+class SearchEngine;
+struct QueryContext;
+
+struct SearchResult {
+	uint32_t docId; // 1, 2, 3, ... in the index
+	std::string docNo;
+	float score; // BM25
+};
+
+struct IndexOptions {
+	std::string queryMode; // exhaustive, bmw, taat, saat, and, phrase or quantized, the same as ./searchEngine --mode=
+	uint64_t postingsBudget; // Score-at-a-time: maximum number of postings processed per query, 0 for no limit
+	uint64_t resultCacheBytes; // Memory of the query result cache, 0 to disable it (a cache takes a lock per lookup)
+	uint64_t postingsCacheBytes; // Memory of the decoded postings cache, 0 to disable it
+	uint32_t queryThreads; // Threads that can score one query together (shared by all the Searchers), 1 for none
+	uint64_t parallelPostings; // Queries with at least this many postings are scored in parallel, with queryThreads > 1
+
+	IndexOptions() {
+		this->queryMode = "exhaustive";
+		this->postingsBudget = 0;
+		this->resultCacheBytes = 0;
+		this->postingsCacheBytes = 0;
+		this->queryThreads = 1;
+		this->parallelPostings = 200000;
+	}
+};
+
+class Index {
+
+private:
+	std::unique_ptr<SearchEngine> engine;
+
+	Index();
+
+	friend class Searcher;
+
+public:
+	~Index();
+
+	Index(const Index&) = delete;
+	Index& operator=(const Index&) = delete;
+
+	// Load the index in the working directory, as ./indexer saved it (the four index_*.bin files, index.bin or segments)
+	// error: set to why, if it can't be loaded
+	// return NULL if there's no index or the options aren't valid
+	static std::shared_ptr<const Index> open(const IndexOptions& options = IndexOptions(), std::string* error = NULL);
+
+	uint32_t getDocumentCount() const;
+
+	// The query mode used: the selected one, or exhaustive if the index doesn't have what it needs (e.g. bmw without index.bin)
+	std::string getQueryMode() const;
+};
+
+class Searcher {
+
+private:
+	std::shared_ptr<const Index> index;
+	std::unique_ptr<QueryContext> context;
+
+public:
+	explicit Searcher(std::shared_ptr<const Index> index);
+	~Searcher();
+
+	Searcher(const Searcher&) = delete;
+	Searcher& operator=(const Searcher&) = delete;
+
+	// The k best documents for the query, best first, with the same scores and order as ./searchEngine --k=k
+	// (k = 0: all the matching documents in the exhaustive mode, 10 in the others)
+	std::vector<SearchResult> search(const std::string& query, uint32_t k);
+
+	// The same, into results, so a thread can reuse its vector
+	void search(const std::string& query, uint32_t k, std::vector<SearchResult>& results);
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Incremental indexing with immutable segments.
+//
+// ./indexer --segment batch.xml adds the documents of batch.xml as a new segment: an index.bin container (see indexFile.h)
+// named index_segment_N.bin, which is never changed after it's written. The live segments are listed in document order
+// in the manifest index_segments.txt, and the global docId of a document is the number of documents in the segments
+// before it + its docId in its segment. The search engine searches all of them with the collection statistics of all
+// the segments (totalDocuments, average document length, docCount of the words), so the scores are the same as one index
+// of all the documents.
+// -- Deletions: index_segment_N.del is a bitmap of the deleted docIds of segment N. Deleted documents are skipped by the
+//    queries (but still counted in the statistics, like in Lucene) until their segment is merged.
+// -- Merges: TieredMergePolicy picks MERGE_FACTOR adjacent segments of the same size tier, or a segment with many deleted
+//    documents, and the indexer rewrites them as one segment without the deleted documents, in the background.
+//    Adjacent segments keep the documents in the order they were added.
+// -- The manifest is replaced atomically (written to a temporary file, then renamed) while holding an exclusive lock on
+//    index_segments.lock. The search engine holds a shared lock while opening the segments, so a merge never deletes
+//    a segment that is being opened (a segment deleted after it's memory-mapped stays readable).
+//
+// Manifest format (text): nextSegmentId on the first line, then a line "segmentId documentCount deletedCount" for each segment
+// e.g.
+// 7
+// 5 80000 12
+// 6 1000 0
+
+const char* const SEGMENT_MANIFEST_NAME = "index_segments.txt";
+const char* const SEGMENT_LOCK_NAME = "index_segments.lock";
+const char* const SEGMENT_MERGE_LOCK_NAME = "index_segments.merge.lock"; // Held by the process running the merges
+const uint32_t MERGE_FACTOR = 4; // Segments merged at once, and the size ratio between tiers
+const uint32_t MIN_TIER_DOCUMENTS = 1000; // Segments smaller than this are all in the first tier
+const double MAX_DELETED_RATIO = 0.3; // A segment with more deleted documents than this is rewritten without them
+
+inline std::string getSegmentFileName(uint64_t segmentId) {
+	return "index_segment_" + std::to_string(segmentId) + ".bin";
+}
+
+inline std::string getDeletedDocumentsFileName(uint64_t segmentId) {
+	return "index_segment_" + std::to_string(segmentId) + ".del";
+}
+
+struct SegmentInfo {
+	uint64_t segmentId;
+	uint32_t documentCount;
+	uint32_t deletedCount;
+
+	uint32_t liveCount() const {
+		return this->documentCount - this->deletedCount;
+	}
+};
+
+class SegmentManifest {
+
+public:
+	uint64_t nextSegmentId;
+	std::vector<SegmentInfo> segments; // In document order
+
+	SegmentManifest() {
+		this->nextSegmentId = 1;
+	}
+
+	// Return false if there's no manifest
+	bool load() {
+		std::ifstream file(SEGMENT_MANIFEST_NAME);
+		if (!file || !(file >> this->nextSegmentId))
+			return false;
+		this->segments.clear();
+		SegmentInfo segment;
+		while (file >> segment.segmentId >> segment.documentCount >> segment.deletedCount)
+			this->segments.push_back(segment);
+		return true;
+	}
+
+	bool save() const {
+		std::string temporaryName = std::string(SEGMENT_MANIFEST_NAME) + ".tmp";
+		{
+			std::ofstream file(temporaryName.c_str());
+			file << this->nextSegmentId << "\n";
+			for (size_t i = 0; i < this->segments.size(); ++i)
+				file << this->segments[i].segmentId << " " << this->segments[i].documentCount << " " << this->segments[i].deletedCount << "\n";
+			if (!file.flush())
+				return false;
+		}
+		return std::rename(temporaryName.c_str(), SEGMENT_MANIFEST_NAME) == 0;
+	}
+
+	// Index of the segment in segments, or segments.size() if it's not live
+	size_t find(uint64_t segmentId) const {
+		for (size_t i = 0; i < this->segments.size(); ++i) {
+			if (this->segments[i].segmentId == segmentId)
+				return i;
+		}
+		return this->segments.size();
+	}
+};
+
+// flock() on a lock file, released when destroyed
+class SegmentLock {
+
+private:
+	int fd;
+	bool locked;
+
+public:
+	// exclusive: for changing the manifest, otherwise shared (for reading it)
+	// wait: wait for the lock, otherwise isLocked() is false if another process has it
+	SegmentLock(const char* fileName, bool exclusive, bool wait = true) {
+		this->fd = ::open(fileName, O_RDWR | O_CREAT, 0644);
+		this->locked = this->fd >= 0 && flock(this->fd, (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB)) == 0;
+	}
+
+	~SegmentLock() {
+		if (this->fd >= 0)
+			::close(this->fd); // Releases the lock
+	}
+
+	SegmentLock(const SegmentLock&) = delete;
+	SegmentLock& operator=(const SegmentLock&) = delete;
+
+	bool isLocked() const {
+		return this->locked;
+	}
+};
+
+// Bitmap of the deleted documents of a segment, bit docId - 1 for docId 1, 2, 3, ...
+class DeletedDocuments {
+
+private:
+	std::vector<uint8_t> bits;
+	uint32_t count;
+
+public:
+	DeletedDocuments() {
+		this->count = 0;
+	}
+
+	// A missing file means no document is deleted
+	void load(const std::string& fileName, uint32_t documentCount) {
+		this->bits.assign((documentCount + 7) / 8, 0);
+		this->count = 0;
+		std::ifstream file(fileName.c_str(), std::ifstream::binary);
+		if (file)
+			file.read((char*)this->bits.data(), this->bits.size());
+		for (size_t i = 0; i < this->bits.size(); ++i)
+			this->count += __builtin_popcount(this->bits[i]);
+	}
+
+	bool save(const std::string& fileName) const {
+		std::string temporaryName = fileName + ".tmp";
+		{
+			std::ofstream file(temporaryName.c_str(), std::ofstream::binary);
+			file.write((const char*)this->bits.data(), this->bits.size());
+			if (!file.flush())
+				return false;
+		}
+		return std::rename(temporaryName.c_str(), fileName.c_str()) == 0;
+	}
+
+	bool isDeleted(uint32_t docId) const {
+		return (this->bits[(docId - 1) >> 3] >> ((docId - 1) & 7)) & 1;
+	}
+
+	// Return false if it was already deleted
+	bool remove(uint32_t docId) {
+		if (this->isDeleted(docId))
+			return false;
+		this->bits[(docId - 1) >> 3] |= 1 << ((docId - 1) & 7);
+		++this->count;
+		return true;
+	}
+
+	uint32_t getCount() const {
+		return this->count;
+	}
+};
+
+// Decides which segments to merge. Segments are grouped into tiers by their number of live documents, each tier MERGE_FACTOR
+// times larger than the previous one, and MERGE_FACTOR adjacent segments of the same tier are merged into one of the next tier.
+// So a document is rewritten about log(documents) / log(MERGE_FACTOR) times, and there are at most about
+// (MERGE_FACTOR - 1) segments per tier.
+class TieredMergePolicy {
+
+public:
+	static uint32_t getTier(uint32_t liveCount) {
+		if (liveCount < MIN_TIER_DOCUMENTS)
+			return 0;
+		return 1 + (uint32_t)(std::log((double)liveCount / MIN_TIER_DOCUMENTS) / std::log((double)MERGE_FACTOR));
+	}
+
+	// Choose the next merge: count segments from first. Return false if there's nothing to merge.
+	// The smallest tier with MERGE_FACTOR adjacent segments goes first, since it's the cheapest merge.
+	static bool selectMerge(const std::vector<SegmentInfo>& segments, size_t& first, size_t& count) {
+		bool found = false;
+		uint32_t bestTier = 0;
+		for (size_t i = 0; i + MERGE_FACTOR <= segments.size(); ++i) {
+			uint32_t tier = getTier(segments[i].liveCount());
+			size_t j = i + 1;
+			while (j < i + MERGE_FACTOR && getTier(segments[j].liveCount()) == tier)
+				++j;
+			if (j == i + MERGE_FACTOR && (!found || tier < bestTier)) {
+				found = true;
+				bestTier = tier;
+				first = i;
+				count = MERGE_FACTOR;
+			}
+		}
+		if (found)
+			return true;
+
+		// Reclaim the space of deleted documents
+		for (size_t i = 0; i < segments.size(); ++i) {
+			if (segments[i].deletedCount > 0 && segments[i].deletedCount >= segments[i].documentCount * MAX_DELETED_RATIO) {
+				first = i;
+				count = 1;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Remove the manifest, the live segments and their deleted documents, when an index.bin or the four index_*.bin files
+// replace them (the search engine searches the segments first). Waits for a merge running in the background to finish.
+// return the number of segments removed
+inline size_t removeSegments() {
+	if (access(SEGMENT_MANIFEST_NAME, F_OK) != 0)
+		return 0;
+	SegmentLock mergeLock(SEGMENT_MERGE_LOCK_NAME, true);
+	SegmentLock lock(SEGMENT_LOCK_NAME, true);
+	SegmentManifest manifest;
+	if (!manifest.load())
+		return 0;
+	for (size_t i = 0; i < manifest.segments.size(); ++i) {
+		unlink(getSegmentFileName(manifest.segments[i].segmentId).c_str());
+		unlink(getDeletedDocumentsFileName(manifest.segments[i].segmentId).c_str());
+	}
+	unlink(SEGMENT_MANIFEST_NAME);
+	return manifest.segments.size();
+}
+
+#endif
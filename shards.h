@@ -0,0 +1,82 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+// Document-partitioned shards.
+//
+// ./indexer --shards=N input.xml splits the documents into N ranges of consecutive docIds and saves each one as an
+// index.bin container (see indexFile.h) named index_shard_K.bin, for K = 0 ... N - 1. Shard K holds documents
+// docIdOffset + 1 ... docIdOffset + documentCount of the collection, with docIds 1 ... documentCount in the shard.
+// Every shard also stores the statistics of the whole collection (SECTION_COLLECTION_STATS and SECTION_COLLECTION_DOC_COUNTS),
+// and its maximum scores and impacts are computed with them, so its scores are the same as one index of all the documents.
+//
+// ./searchEngine --shards starts a worker process for every shard (./searchEngine --shard=K --server), sends every query to
+// all of them through pipes, and merges their top k lists. Workers answer with the docId in the collection and the exact score,
+// so the merged results are in the same order as one index of all the documents.
+//
+// Manifest format (text): shardCount on the first line, then a line "docIdOffset documentCount" for each shard
+// e.g.
+// 2
+// 0 86000
+// 86000 86000
+
+const char* const SHARD_MANIFEST_NAME = "index_shards.txt";
+
+inline std::string getShardFileName(uint32_t shardIndex) {
+	return "index_shard_" + std::to_string(shardIndex) + ".bin";
+}
+
+struct ShardInfo {
+	uint32_t docIdOffset; // Number of documents in the shards before this one
+	uint32_t documentCount;
+};
+
+class ShardManifest {
+
+public:
+	std::vector<ShardInfo> shards;
+
+	// Split documentCount documents into shardCount shards of (almost) the same size
+	void split(uint32_t documentCount, uint32_t shardCount) {
+		this->shards.clear();
+		for (uint32_t i = 0; i < shardCount; ++i) {
+			ShardInfo shard;
+			shard.docIdOffset = (uint32_t)((uint64_t)documentCount * i / shardCount);
+			shard.documentCount = (uint32_t)((uint64_t)documentCount * (i + 1) / shardCount) - shard.docIdOffset;
+			this->shards.push_back(shard);
+		}
+	}
+
+	// Return false if there's no manifest
+	bool load() {
+		std::ifstream file(SHARD_MANIFEST_NAME);
+		uint32_t shardCount = 0;
+		if (!file || !(file >> shardCount))
+			return false;
+		this->shards.clear();
+		ShardInfo shard;
+		while (this->shards.size() < shardCount && file >> shard.docIdOffset >> shard.documentCount)
+			this->shards.push_back(shard);
+		return this->shards.size() == shardCount;
+	}
+
+	bool save() const {
+		std::string temporaryName = std::string(SHARD_MANIFEST_NAME) + ".tmp";
+		{
+			std::ofstream file(temporaryName.c_str());
+			file << this->shards.size() << "\n";
+			for (size_t i = 0; i < this->shards.size(); ++i)
+				file << this->shards[i].docIdOffset << " " << this->shards[i].documentCount << "\n";
+			if (!file.flush())
+				return false;
+		}
+		return std::rename(temporaryName.c_str(), SHARD_MANIFEST_NAME) == 0;
+	}
+};
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef TERM_DICTIONARY_H
+#define TERM_DICTIONARY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// In-memory structures of the indexer:
+// -- Arena: bump allocator over large slabs, everything is freed at once
+// -- TermDictionary: interns every word into the arena once, and maps it to a dense termId (0, 1, 2, ...)
+// -- PostingsPool / PositionsPool: the postings / positions of every termId in linked blocks allocated from an arena
+// -- BulkWriter: writes whole buffers to a file descriptor
+//
+// Compared with std::unordered_map<std::string, std::vector<...> >, a word costs one arena string and a few bytes in
+// a flat hash table instead of a hash node, a std::string and a separately growing vector (3 heap allocations or more).
+
+const size_t ARENA_SLAB_SIZE = 1 << 20;
+
+class Arena {
+
+private:
+	std::vector<char*> slabs;
+	char* current; // Free space in the last slab
+	size_t remaining;
+	uint64_t allocatedBytes; // Size of all the slabs
+	uint64_t usedBytes; // Bytes given out by allocate()
+
+public:
+	Arena() {
+		this->current = NULL;
+		this->remaining = 0;
+		this->allocatedBytes = 0;
+		this->usedBytes = 0;
+	}
+
+	~Arena() {
+		this->clear();
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	// Return size bytes, aligned to 8 bytes
+	char* allocate(size_t size) {
+		size = (size + 7) & ~(size_t)7;
+		if (size > this->remaining) {
+			size_t slabSize = std::max(size, ARENA_SLAB_SIZE);
+			this->current = new char[slabSize];
+			this->remaining = slabSize;
+			this->slabs.push_back(this->current);
+			this->allocatedBytes += slabSize;
+		}
+		char* result = this->current;
+		this->current += size;
+		this->remaining -= size;
+		this->usedBytes += size;
+		return result;
+	}
+
+	uint64_t memoryUsage() const {
+		return this->allocatedBytes;
+	}
+
+	uint64_t getUsedBytes() const {
+		return this->usedBytes;
+	}
+
+	size_t slabCount() const {
+		return this->slabs.size();
+	}
+
+	void clear() {
+		for (size_t i = 0; i < this->slabs.size(); ++i)
+			delete[] this->slabs[i];
+		this->slabs.clear();
+		this->current = NULL;
+		this->remaining = 0;
+		this->allocatedBytes = 0;
+		this->usedBytes = 0;
+	}
+};
+
+// Interns words and gives them dense termIds in the order they are first added
+class TermDictionary {
+
+private:
+	Arena arena; // Word strings
+	std::vector<const char*> termData;
+	std::vector<uint8_t> termLengths; // Words are at most 255 bytes (MAX_WORD_LENGTH)
+	std::vector<uint32_t> table; // Open addressing hash table of termId + 1 (0: empty), size is a power of 2
+
+	static uint32_t hash(std::string_view word) {
+		uint32_t h = 2166136261u; // FNV-1a
+		for (size_t i = 0; i < word.length(); ++i) {
+			h ^= (uint8_t)word[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	void grow() {
+		std::vector<uint32_t> newTable(std::max<size_t>(this->table.size() * 2, 1024), 0);
+		size_t mask = newTable.size() - 1;
+		for (uint32_t termId = 0; termId < this->termData.size(); ++termId) {
+			size_t slot = hash(this->getTerm(termId)) & mask;
+			while (newTable[slot] != 0)
+				slot = (slot + 1) & mask;
+			newTable[slot] = termId + 1;
+		}
+		this->table.swap(newTable);
+	}
+
+public:
+	// Return the termId of the word, adding it if it's new
+	uint32_t getOrAdd(std::string_view word) {
+		if ((this->termData.size() + 1) * 2 > this->table.size()) // Keep the load factor <= 0.5
+			this->grow();
+
+		size_t mask = this->table.size() - 1;
+		size_t slot = hash(word) & mask;
+		while (this->table[slot] != 0) {
+			uint32_t termId = this->table[slot] - 1;
+			if (this->getTerm(termId) == word)
+				return termId;
+			slot = (slot + 1) & mask;
+		}
+
+		uint32_t termId = (uint32_t)this->termData.size();
+		char* data = this->arena.allocate(word.length());
+		memcpy(data, word.data(), word.length());
+		this->termData.push_back(data);
+		this->termLengths.push_back((uint8_t)word.length());
+		this->table[slot] = termId + 1;
+		return termId;
+	}
+
+	std::string_view getTerm(uint32_t termId) const {
+		return std::string_view(this->termData[termId], this->termLengths[termId]);
+	}
+
+	uint32_t size() const {
+		return (uint32_t)this->termData.size();
+	}
+
+	// termIds sorted by their words
+	std::vector<uint32_t> getSortedTermIds() const {
+		std::vector<uint32_t> termIds(this->size());
+		for (uint32_t i = 0; i < termIds.size(); ++i)
+			termIds[i] = i;
+		std::sort(termIds.begin(), termIds.end(), [this](uint32_t a, uint32_t b) { return this->getTerm(a) < this->getTerm(b); });
+		return termIds;
+	}
+
+	// usedOnly: count only the used part of the arena slabs, not the free space at the end of the last slab
+	uint64_t memoryUsage(bool usedOnly = false) const {
+		return (usedOnly ? this->arena.getUsedBytes() : this->arena.memoryUsage()) + this->termData.capacity() * sizeof(const char*)
+			+ this->termLengths.capacity() + this->table.capacity() * 4;
+	}
+
+	void clear() {
+		this->arena.clear();
+		std::vector<const char*>().swap(this->termData);
+		std::vector<uint8_t>().swap(this->termLengths);
+		std::vector<uint32_t>().swap(this->table);
+	}
+};
+
+// Same layout as a raw posting in index_wordPostings.bin
+struct Posting {
+	uint32_t docId;
+	uint32_t tf;
+};
+
+const uint32_t POSTINGS_POOL_FIRST_BLOCK = 2; // Most words appear in only 1 or 2 documents
+const uint32_t POSTINGS_POOL_MAX_BLOCK = 256;
+
+// Values of every termId (postings or positions), appended in order.
+// A word's values are a linked list of blocks, every block twice as large as the previous one up to 256 values,
+// so short lists waste little space and long lists have few blocks. Blocks are never moved or copied.
+template <typename Value>
+class BlockPool {
+
+protected:
+	struct Block {
+		Block* next;
+		uint32_t capacity;
+		uint32_t size;
+		// Followed by capacity Values
+
+		Value* values() {
+			return reinterpret_cast<Value*>(this + 1);
+		}
+	};
+
+	struct TermBlocks {
+		Block* first;
+		Block* last;
+		uint32_t count;
+	};
+
+	Arena arena;
+	std::vector<TermBlocks> terms;
+	uint64_t blockCount;
+
+	Block* newBlock(uint32_t capacity) {
+		Block* block = reinterpret_cast<Block*>(this->arena.allocate(sizeof(Block) + capacity * sizeof(Value)));
+		block->next = NULL;
+		block->capacity = capacity;
+		block->size = 0;
+		++this->blockCount;
+		return block;
+	}
+
+	// The last value of termId, or NULL if there's none
+	Value* getLast(uint32_t termId) {
+		if (termId >= this->terms.size() || this->terms[termId].last == NULL)
+			return NULL;
+		Block* last = this->terms[termId].last;
+		return &last->values()[last->size - 1];
+	}
+
+public:
+	BlockPool() {
+		this->blockCount = 0;
+	}
+
+	void append(uint32_t termId, const Value& value) {
+		if (termId >= this->terms.size())
+			this->terms.resize(termId + 1, TermBlocks{NULL, NULL, 0});
+
+		TermBlocks& term = this->terms[termId];
+		if (term.last == NULL) {
+			term.first = term.last = this->newBlock(POSTINGS_POOL_FIRST_BLOCK);
+		}
+		else if (term.last->size == term.last->capacity) {
+			term.last->next = this->newBlock(std::min(term.last->capacity * 2, POSTINGS_POOL_MAX_BLOCK));
+			term.last = term.last->next;
+		}
+		term.last->values()[term.last->size++] = value;
+		++term.count;
+	}
+
+	uint32_t getCount(uint32_t termId) const {
+		return termId < this->terms.size() ? this->terms[termId].count : 0;
+	}
+
+	// Call function(const Value* values, uint32_t count) for every block of termId, in order
+	template <typename Function>
+	void forEachBlock(uint32_t termId, Function function) const {
+		if (termId >= this->terms.size())
+			return;
+		for (Block* block = this->terms[termId].first; block != NULL; block = block->next)
+			function(block->values(), block->size);
+	}
+
+	// Overwrite the values of termId in place with getCount(termId) values, e.g. to reorder them
+	void replace(uint32_t termId, const Value* values) {
+		if (termId >= this->terms.size())
+			return;
+		for (Block* block = this->terms[termId].first; block != NULL; block = block->next) {
+			std::copy(values, values + block->size, block->values());
+			values += block->size;
+		}
+	}
+
+	// usedOnly: count only the used part of the arena slabs, not the free space at the end of the last slab
+	uint64_t memoryUsage(bool usedOnly = false) const {
+		return (usedOnly ? this->arena.getUsedBytes() : this->arena.memoryUsage()) + this->terms.capacity() * sizeof(TermBlocks);
+	}
+
+	uint64_t getBlockCount() const {
+		return this->blockCount;
+	}
+
+	void clear() {
+		this->arena.clear();
+		std::vector<TermBlocks>().swap(this->terms);
+		this->blockCount = 0;
+	}
+};
+
+// Postings of every termId, appended in docId order
+class PostingsPool : public BlockPool<Posting> {
+
+public:
+	// Add a document to the postings of termId, or add 1 to its tf if it's already the last document
+	// Return true if it's a new posting
+	bool add(uint32_t termId, uint32_t docId) {
+		Posting* last = this->getLast(termId);
+		if (last != NULL && last->docId == docId) {
+			++last->tf;
+			return false;
+		}
+		this->append(termId, Posting{docId, 1});
+		return true;
+	}
+
+	uint32_t getDocCount(uint32_t termId) const {
+		return this->getCount(termId);
+	}
+
+	// Copy the postings of termId to a vector (replacing its content)
+	void getPostings(uint32_t termId, std::vector<std::pair<uint32_t, uint32_t> >& postings) const {
+		postings.clear();
+		postings.reserve(this->getDocCount(termId));
+		this->forEachBlock(termId, [&postings](const Posting* blockPostings, uint32_t count) {
+			for (uint32_t i = 0; i < count; ++i)
+				postings.push_back(std::pair<uint32_t, uint32_t>(blockPostings[i].docId, blockPostings[i].tf));
+		});
+	}
+};
+
+// Positions (word index in the document, from 0) of every termId, in the order of its postings,
+// tf positions for each posting
+class PositionsPool : public BlockPool<uint32_t> {
+
+public:
+	// Copy the positions of termId to a vector (replacing its content)
+	void getPositions(uint32_t termId, std::vector<uint32_t>& positions) const {
+		positions.clear();
+		positions.reserve(this->getCount(termId));
+		this->forEachBlock(termId, [&positions](const uint32_t* blockPositions, uint32_t count) {
+			positions.insert(positions.end(), blockPositions, blockPositions + count);
+		});
+	}
+};
+
+const size_t BULK_WRITER_BUFFER_SIZE = 1 << 20;
+
+// Collects small writes in a large buffer and writes whole buffers to the file
+// A write that fails (e.g. the disk is full) marks the file as failed: close() then returns false and removes the file,
+// so a failed save never leaves a truncated file behind
+class BulkWriter {
+
+private:
+	std::string fileName;
+	int fd;
+	std::vector<char> buffer;
+	size_t used;
+	uint64_t position; // Bytes written so far, including the buffer
+	bool failed; // The file couldn't be opened or a write failed
+
+	// Write all the bytes at the end of the file (offset < 0) or at offset, retrying when interrupted by a signal
+	void writeAll(const char* bytes, size_t size, int64_t offset = -1) {
+		while (size > 0 && !this->failed) {
+			ssize_t result = offset < 0 ? ::write(this->fd, bytes, size) : pwrite(this->fd, bytes, size, offset);
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result <= 0) {
+				this->failed = true;
+				break;
+			}
+			bytes += result;
+			size -= result;
+			if (offset >= 0)
+				offset += result;
+		}
+	}
+
+	void flush() {
+		this->writeAll(this->buffer.data(), this->used);
+		this->used = 0;
+	}
+
+public:
+	BulkWriter(const std::string& fileName) : buffer(BULK_WRITER_BUFFER_SIZE) {
+		this->fileName = fileName;
+		this->fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		this->used = 0;
+		this->position = 0;
+		this->failed = this->fd < 0;
+	}
+
+	~BulkWriter() {
+		this->close();
+	}
+
+	BulkWriter(const BulkWriter&) = delete;
+	BulkWriter& operator=(const BulkWriter&) = delete;
+
+	void write(const void* data, size_t size) {
+		this->position += size;
+		if (size >= this->buffer.size()) { // Too large to buffer, write it directly
+			this->flush();
+			this->writeAll((const char*)data, size);
+			return;
+		}
+		if (this->used + size > this->buffer.size())
+			this->flush();
+		memcpy(this->buffer.data() + this->used, data, size);
+		this->used += size;
+	}
+
+	bool isOpen() const {
+		return this->fd >= 0;
+	}
+
+	uint64_t tell() const {
+		return this->position;
+	}
+
+	// Overwrite bytes that were already written (e.g. a count known only at the end)
+	void writeAt(uint64_t offset, const void* data, size_t size) {
+		this->flush();
+		this->writeAll((const char*)data, size, (int64_t)offset);
+	}
+
+	// Return false if the file couldn't be written completely, and then remove it
+	bool close() {
+		if (this->fd < 0)
+			return !this->failed;
+		this->flush();
+		if (::close(this->fd) != 0)
+			this->failed = true;
+		this->fd = -1;
+		if (this->failed)
+			unlink(this->fileName.c_str());
+		return !this->failed;
+	}
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef TEXT_COMPRESSOR_H
+#define TEXT_COMPRESSOR_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// LZ77 compressor for the blocks of the document store (see documentStore.h), in the LZ4 block format:
+// a block is a list of sequences, each some literal bytes followed by a match (a copy of earlier output).
+// Sequence: token (1 byte: literal length in the high 4 bits, match length - 4 in the low 4 bits, 15 means more length bytes follow),
+//   [more literal length bytes], literals, match offset (2 bytes), [more match length bytes]
+//   A length byte of 255 means another one follows. The last sequence has literals only.
+// e.g. "the wall street, the wall" -> literals "the wall street, " then a match of 8 bytes 17 bytes back
+//
+// Matches are found with a hash table of the last position of every 4 bytes, so compressing is one pass and decompressing
+// is mostly fixed-size copies of 16 bytes. Text compresses to about half its size.
+
+const uint32_t COMPRESSOR_HASH_BITS = 14;
+const uint32_t COMPRESSOR_MIN_MATCH = 4;
+const uint32_t COMPRESSOR_MAX_OFFSET = 65535;
+
+// Write a length that didn't fit in the 4 bits of the token, as bytes of 255 and the rest
+inline void writeExtraLength(size_t length, std::vector<uint8_t>& output) {
+	while (length >= 255) {
+		output.push_back(255);
+		length -= 255;
+	}
+	output.push_back((uint8_t)length);
+}
+
+inline void writeSequence(const uint8_t* literals, size_t literalLength, uint32_t offset, size_t matchLength, std::vector<uint8_t>& output) {
+	size_t matchCode = matchLength > 0 ? matchLength - COMPRESSOR_MIN_MATCH : 0;
+	output.push_back((uint8_t)((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15)));
+	if (literalLength >= 15)
+		writeExtraLength(literalLength - 15, output);
+	output.insert(output.end(), literals, literals + literalLength);
+	if (matchLength == 0)
+		return; // The last sequence
+	output.push_back((uint8_t)(offset & 0xFF));
+	output.push_back((uint8_t)(offset >> 8));
+	if (matchCode >= 15)
+		writeExtraLength(matchCode - 15, output);
+}
+
+// Compress size bytes of input, appending them to output
+inline void compressText(const uint8_t* input, size_t size, std::vector<uint8_t>& output) {
+	std::vector<uint32_t> table(1 << COMPRESSOR_HASH_BITS, 0); // Hash of 4 bytes -> their last position + 1, 0 for none
+	size_t position = 0;
+	size_t anchor = 0; // Start of the literals not written yet
+	while (position + COMPRESSOR_MIN_MATCH <= size) {
+		uint32_t sequence = 0;
+		memcpy(&sequence, input + position, 4);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - COMPRESSOR_HASH_BITS);
+		uint32_t candidate = table[hash];
+		table[hash] = (uint32_t)position + 1;
+		if (candidate == 0 || position - (candidate - 1) > COMPRESSOR_MAX_OFFSET || memcmp(input + candidate - 1, input + position, 4) != 0) {
+			++position;
+			continue;
+		}
+
+		size_t matchStart = candidate - 1;
+		size_t matchLength = COMPRESSOR_MIN_MATCH;
+		while (position + matchLength < size && input[matchStart + matchLength] == input[position + matchLength])
+			++matchLength;
+		writeSequence(input + anchor, position - anchor, (uint32_t)(position - matchStart), matchLength, output);
+		position += matchLength;
+		anchor = position;
+	}
+	writeSequence(input + anchor, size - anchor, 0, 0, output);
+}
+
+// Read a length of the token's 4 bits plus its extra bytes
+// return false if the input ends first
+inline bool readLength(const uint8_t*& input, const uint8_t* end, size_t& length) {
+	if (length < 15)
+		return true;
+	while (input < end) {
+		uint8_t byte = *input++;
+		length += byte;
+		if (byte != 255)
+			return true;
+	}
+	return false;
+}
+
+// Decompress a block into output, which must be exactly the size of the original
+// return false if the block isn't valid or is truncated
+inline bool decompressText(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize) {
+	const uint8_t* end = input + inputSize;
+	size_t position = 0;
+	while (input < end) {
+		uint8_t token = *input++;
+		size_t literalLength = token >> 4;
+		if (!readLength(input, end, literalLength) || literalLength > (size_t)(end - input) || literalLength > outputSize - position)
+			return false;
+		// Most literal runs and matches are short: copy 16 bytes at once when there's room after them in both buffers
+		if (literalLength <= 16 && end - input >= 16 && outputSize - position >= 16)
+			memcpy(output + position, input, 16);
+		else
+			memcpy(output + position, input, literalLength);
+		input += literalLength;
+		position += literalLength;
+		if (input == end)
+			return position == outputSize; // The last sequence
+
+		if (end - input < 2)
+			return false;
+		size_t offset = input[0] | ((size_t)input[1] << 8);
+		input += 2;
+		size_t matchLength = token & 0x0F;
+		if (!readLength(input, end, matchLength))
+			return false;
+		matchLength += COMPRESSOR_MIN_MATCH;
+		if (offset == 0 || offset > position || matchLength > outputSize - position)
+			return false;
+		const uint8_t* source = output + position - offset;
+		if (offset >= 16 && matchLength <= 16 && outputSize - position >= 16)
+			memcpy(output + position, source, 16);
+		else if (offset >= matchLength)
+			memcpy(output + position, source, matchLength);
+		else {
+			// Byte by byte when the match overlaps what it copies (e.g. a run of spaces)
+			for (size_t i = 0; i < matchLength; ++i)
+				output[position + i] = source[i];
+		}
+		position += matchLength;
+	}
+	return false; // The last sequence (literals only) is missing, the block is truncated
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef TOKEN_STREAM_H
+#define TOKEN_STREAM_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "postingsCodec.h"
+#include "termDictionary.h"
+
+// Binary token stream: a corpus after parsing and tokenizing, written by ./parser --tokens=FILE and read by ./indexer FILE
+// instead of the XML, so a corpus is parsed once and can then be indexed many times (e.g. with different index formats).
+//
+// Format: magic "SETK", version (4 bytes), then a record for every document:
+//   DOCNO length (vbyte) + DOCNO (0 bytes if the document has none), token count (vbyte), tokens
+// A token is the vbyte termId of its word. termIds are given in the order words first appear in the stream (0, 1, 2, ...),
+// and the first time a word appears its termId is followed by the word length (1 byte) and the word, so every word is
+// stored once.
+// e.g. <DOC><DOCNO> WSJ870324-0001 </DOCNO> The wall, the street </DOC>
+//   -> 9 "wsj870324", 6, 0 9 "wsj870324", 1 4 "0001", 2 3 "the", 3 4 "wall", 2, 4 6 "street"
+
+const char TOKEN_STREAM_MAGIC[4] = {'S', 'E', 'T', 'K'};
+const uint32_t TOKEN_STREAM_VERSION = 1;
+
+class TokenStreamWriter {
+
+private:
+	BulkWriter file;
+	TermDictionary terms; // Words written so far
+	std::string docNo; // Of the current document
+	std::vector<uint8_t> tokens; // Tokens of the current document
+	uint32_t tokenCount;
+	std::vector<uint8_t> header; // Of the current document's record
+
+public:
+	TokenStreamWriter(const std::string& fileName) : file(fileName) {
+		this->tokenCount = 0;
+		this->file.write(TOKEN_STREAM_MAGIC, 4);
+		this->file.write(&TOKEN_STREAM_VERSION, 4);
+	}
+
+	void setDocNo(std::string_view docNo) {
+		this->docNo.assign(docNo.data(), docNo.length());
+	}
+
+	// Add the next word of the current document
+	void addToken(std::string_view word) {
+		uint32_t termCount = this->terms.size();
+		uint32_t termId = this->terms.getOrAdd(word);
+		writeVByte(termId, this->tokens);
+		if (termId == termCount) { // A new word
+			this->tokens.push_back((uint8_t)word.length());
+			this->tokens.insert(this->tokens.end(), word.begin(), word.end());
+		}
+		++this->tokenCount;
+	}
+
+	// Write the current document's record and start the next document
+	void endDocument() {
+		this->header.clear();
+		writeVByte((uint32_t)this->docNo.length(), this->header);
+		this->header.insert(this->header.end(), this->docNo.begin(), this->docNo.end());
+		writeVByte(this->tokenCount, this->header);
+		this->file.write(this->header.data(), this->header.size());
+		this->file.write(this->tokens.data(), this->tokens.size());
+
+		this->docNo.clear();
+		this->tokens.clear();
+		this->tokenCount = 0;
+	}
+
+	bool isOpen() const {
+		return this->file.isOpen();
+	}
+
+	uint64_t getBytesWritten() const {
+		return this->file.tell();
+	}
+
+	// Return false if the file couldn't be written completely (it's removed then)
+	bool close() {
+		return this->file.close();
+	}
+};
+
+// Reads a token stream in place from a memory mapping
+class TokenStreamReader {
+
+private:
+	const uint8_t* data;
+	size_t size;
+	const uint8_t* position; // Next byte to read
+	const uint8_t* end;
+	std::vector<std::string_view> terms; // termId -> word, pointing into the mapping
+	bool truncated; // The stream ended in the middle of a record
+
+	// A vbyte number that must end before the end of the stream
+	bool readNumber(uint32_t& value) {
+		value = 0;
+		for (uint32_t shift = 0; this->position < this->end && shift < 35; shift += 7) {
+			uint8_t byte = *this->position++;
+			value |= (uint32_t)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		this->truncated = true;
+		return false;
+	}
+
+	// A string of length bytes, pointing into the mapping
+	bool readString(uint32_t length, std::string_view& text) {
+		if ((size_t)(this->end - this->position) < length) {
+			this->truncated = true;
+			return false;
+		}
+		text = std::string_view((const char*)this->position, length);
+		this->position += length;
+		return true;
+	}
+
+public:
+	TokenStreamReader() {
+		this->data = NULL;
+		this->size = 0;
+		this->position = NULL;
+		this->end = NULL;
+		this->truncated = false;
+	}
+
+	~TokenStreamReader() {
+		if (this->data != NULL)
+			munmap((void*)this->data, this->size);
+	}
+
+	TokenStreamReader(const TokenStreamReader&) = delete;
+	TokenStreamReader& operator=(const TokenStreamReader&) = delete;
+
+	// Whether the file starts with the token stream magic (otherwise it's parsed as XML)
+	static bool isTokenStream(const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		char magic[4];
+		bool isStream = pread(fd, magic, 4, 0) == 4 && memcmp(magic, TOKEN_STREAM_MAGIC, 4) == 0;
+		::close(fd);
+		return isStream;
+	}
+
+	// Memory-map the stream and check its header
+	// return false if it's not a token stream of this version
+	bool open(const std::string& fileName) {
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		struct stat fileStat;
+		if (fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size < 8) {
+			if (fd >= 0)
+				::close(fd);
+			return false;
+		}
+		this->size = fileStat.st_size;
+		void* mapping = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapping == MAP_FAILED)
+			return false;
+		this->data = (const uint8_t*)mapping;
+		madvise(mapping, this->size, MADV_SEQUENTIAL);
+
+		uint32_t version = 0;
+		memcpy(&version, this->data + 4, 4);
+		if (memcmp(this->data, TOKEN_STREAM_MAGIC, 4) != 0 || version != TOKEN_STREAM_VERSION)
+			return false;
+		this->position = this->data + 8;
+		this->end = this->data + this->size;
+		return true;
+	}
+
+	// Start the next document
+	// docNo: empty if the document has none
+	// tokenCount: number of tokens to read with nextToken()
+	// return false at the end of the stream
+	bool nextDocument(std::string_view& docNo, uint32_t& tokenCount) {
+		if (this->position == this->end)
+			return false;
+		uint32_t docNoLength = 0;
+		return this->readNumber(docNoLength) && this->readString(docNoLength, docNo) && this->readNumber(tokenCount);
+	}
+
+	// termId of the next token of the document, its word is getTerm(termId)
+	// return false if the stream is truncated
+	bool nextToken(uint32_t& termId) {
+		if (!this->readNumber(termId))
+			return false;
+		if (termId == this->terms.size()) { // A new word
+			if (this->position == this->end) {
+				this->truncated = true;
+				return false;
+			}
+			uint32_t wordLength = *this->position++;
+			std::string_view word;
+			if (!this->readString(wordLength, word))
+				return false;
+			this->terms.push_back(word);
+		}
+		else if (termId > this->terms.size()) {
+			this->truncated = true; // Not a valid stream
+			return false;
+		}
+		return true;
+	}
+
+	std::string_view getTerm(uint32_t termId) const {
+		return this->terms[termId];
+	}
+
+	// Whether the stream ended in the middle of a record, or isn't valid
+	bool isTruncated() const {
+		return this->truncated;
+	}
+};
+
+#endif
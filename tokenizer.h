@@ -0,0 +1,171 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define TOKENIZER_AVX2
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#define TOKENIZER_SSE2
+#endif
+
+// Tokenizer shared by the parser, the indexer and the search engine.
+//
+// A word is a run of ASCII letters and digits, lowercased. Everything else (spaces, punctuation, bytes >= 0x80) splits words.
+// Words longer than MAX_WORD_LENGTH are truncated, since the length is stored in 1 byte in index_words.bin.
+// e.g. "The Wall-Street 1987's" -> ["the", "wall", "street", "1987", "s"]
+//
+// The text is scanned 32 bytes at a time: a SIMD kernel (AVX2, or SSE2 twice) classifies the bytes into a bitmask of
+// letters/digits and lowercases them in place, then word boundaries are found with bit scans.
+// Words are returned as std::string_view into the text, so nothing is copied or allocated.
+// Build with -mavx2 for the AVX2 kernel, or -DNO_SIMD for the scalar one.
+
+const size_t MAX_WORD_LENGTH = 255;
+const size_t TOKENIZER_CHUNK_SIZE = 32;
+
+// Classify 32 bytes: return a bitmask of the letters and digits (bit i for byte i), and lowercase the letters in place.
+// Lowercasing is just | 0x20 for ASCII letters, and digits already have that bit, so every letter/digit gets | 0x20.
+inline uint32_t classifyChunk(char* chunk) {
+#if defined(TOKENIZER_AVX2)
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk));
+	__m256i caseBit = _mm256_set1_epi8(0x20);
+	__m256i lower = _mm256_or_si256(v, caseBit);
+	// Signed compares, so bytes >= 0x80 are negative and never in a range
+	__m256i isLetter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+	__m256i isDigit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	__m256i isWord = _mm256_or_si256(isLetter, isDigit);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(chunk), _mm256_or_si256(v, _mm256_and_si256(isWord, caseBit)));
+	return (uint32_t)_mm256_movemask_epi8(isWord);
+#elif defined(TOKENIZER_SSE2)
+	uint32_t mask = 0;
+	__m128i caseBit = _mm_set1_epi8(0x20);
+	for (uint32_t half = 0; half < 2; ++half) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk + half * 16));
+		__m128i lower = _mm_or_si128(v, caseBit);
+		__m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+		__m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+		__m128i isWord = _mm_or_si128(isLetter, isDigit);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(chunk + half * 16), _mm_or_si128(v, _mm_and_si128(isWord, caseBit)));
+		mask |= (uint32_t)_mm_movemask_epi8(isWord) << (half * 16);
+	}
+	return mask;
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < TOKENIZER_CHUNK_SIZE; ++i) {
+		char c = chunk[i];
+		char lower = c | 0x20;
+		if ((lower >= 'a' && lower <= 'z') || (c >= '0' && c <= '9')) {
+			chunk[i] = lower;
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+class Tokenizer {
+
+private:
+	char* text;
+	size_t length;
+	size_t position; // Where to look for the next word
+
+	size_t chunkStart; // Start of the classified chunk, a multiple of 32 from the text start
+	uint32_t chunkMask; // Letters and digits in the chunk
+
+	void loadChunk(size_t start) {
+		this->chunkStart = start;
+		if (start + TOKENIZER_CHUNK_SIZE <= this->length) {
+			this->chunkMask = classifyChunk(this->text + start);
+			return;
+		}
+		// The last chunk is shorter than 32 bytes. The padding zeros are not letters/digits, so they end the last word.
+		char padded[TOKENIZER_CHUNK_SIZE];
+		size_t size = this->length - start;
+		memset(padded, 0, sizeof(padded));
+		memcpy(padded, this->text + start, size);
+		this->chunkMask = classifyChunk(padded);
+		memcpy(this->text + start, padded, size);
+	}
+
+	// The first position >= this->position that is a letter/digit (isWord) or not (!isWord), or length if none
+	size_t find(bool isWord) {
+		size_t pos = this->position;
+		while (pos < this->length) {
+			if (pos >= this->chunkStart + TOKENIZER_CHUNK_SIZE)
+				this->loadChunk(pos - pos % TOKENIZER_CHUNK_SIZE);
+
+			uint32_t bits = isWord ? this->chunkMask : ~this->chunkMask;
+			bits &= 0xFFFFFFFFu << (pos - this->chunkStart);
+			if (bits != 0)
+				return std::min(this->chunkStart + __builtin_ctz(bits), this->length);
+			pos = this->chunkStart + TOKENIZER_CHUNK_SIZE;
+		}
+		return this->length;
+	}
+
+public:
+	// The words of text are lowercased in place while tokenizing
+	Tokenizer(char* text, size_t length) {
+		this->text = text;
+		this->length = length;
+		this->position = 0;
+		this->chunkStart = 0;
+		this->chunkMask = 0;
+		if (length > 0)
+			this->loadChunk(0);
+	}
+
+	// Get the next word. Return false after the last word.
+	// The word points into the text, and is valid as long as the text is.
+	bool next(std::string_view& word) {
+		size_t start = this->find(true);
+		if (start >= this->length)
+			return false;
+		this->position = start;
+		size_t end = this->find(false);
+		this->position = end;
+
+		word = std::string_view(this->text + start, std::min(end - start, MAX_WORD_LENGTH));
+		return true;
+	}
+};
+
+// Extract words from a text string (copies them, for short texts like queries)
+inline std::vector<std::string> extractWords(const std::string& text) {
+	std::vector<std::string> words;
+
+	std::string buffer = text;
+	Tokenizer tokenizer(&buffer[0], buffer.length());
+	std::string_view word;
+	while (tokenizer.next(word))
+		words.push_back(std::string(word));
+
+	return words;
+}
+
+// Extract the words of a query. A word directly followed by '*' is a wildcard and keeps the '*', e.g. "Rosenf* trial" -> ["rosenf*", "trial"]
+inline std::vector<std::string> extractQueryWords(const std::string& text) {
+	std::vector<std::string> words;
+
+	std::string buffer = text;
+	Tokenizer tokenizer(&buffer[0], buffer.length());
+	std::string_view word;
+	while (tokenizer.next(word)) {
+		size_t end = word.data() - buffer.data() + word.length();
+		words.push_back(std::string(word));
+		if (end < buffer.length() && buffer[end] == '*')
+			words.back() += '*';
+	}
+
+	return words;
+}
+
+#endif
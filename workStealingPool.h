@@ -0,0 +1,157 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+// Thread pool for the tasks of one query (intra-query parallelism), e.g. the docId ranges of a query with long postings lists.
+//
+// Every worker has its own deque of tasks: it takes the newest task of its own deque, and when that's empty it steals the
+// oldest task of another worker's deque, so a worker that finishes its ranges early takes over ranges of a busier one.
+// runAll() spreads the tasks over the deques and then runs tasks itself until all of them are done, so a query thread
+// never just waits: with every worker busy with other queries, it runs its own tasks alone.
+
+class WorkStealingPool {
+
+private:
+	// A batch of tasks of one runAll()
+	struct TaskGroup {
+		std::atomic<uint32_t> remaining; // Only decreased under the mutex, so runAll() can't return while a task still uses the group
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	// One per worker, and one more for the tasks stolen by runAll() callers
+	struct TaskQueue {
+		std::deque<Task> tasks;
+		std::mutex mutex;
+	};
+
+	std::vector<std::unique_ptr<TaskQueue> > queues;
+	std::vector<std::thread> workers;
+	std::atomic<uint32_t> queuedTasks; // Tasks in all the deques
+	std::atomic<uint32_t> nextQueue; // Round robin over the deques for new tasks
+	std::mutex idleMutex;
+	std::condition_variable idleCondition;
+	bool stopping;
+
+	// Take the newest task of this worker's deque, or steal the oldest one of another deque
+	bool takeTask(uint32_t queueIndex, Task& task) {
+		if (this->queuedTasks.load(std::memory_order_acquire) == 0)
+			return false;
+		for (uint32_t i = 0; i < this->queues.size(); ++i) {
+			TaskQueue& queue = *this->queues[(queueIndex + i) % this->queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty())
+				continue;
+			if (i == 0) {
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
+			}
+			else {
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			}
+			this->queuedTasks.fetch_sub(1, std::memory_order_acq_rel);
+			return true;
+		}
+		return false;
+	}
+
+	static void runTask(Task& task) {
+		task.function();
+		TaskGroup* group = task.group;
+		std::lock_guard<std::mutex> lock(group->mutex);
+		if (group->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			group->finished.notify_all();
+	}
+
+	void runWorker(uint32_t workerIndex) {
+		Task task;
+		while (true) {
+			if (this->takeTask(workerIndex, task)) {
+				runTask(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(this->idleMutex);
+			while (this->queuedTasks.load(std::memory_order_acquire) == 0 && !this->stopping)
+				this->idleCondition.wait(lock);
+			if (this->stopping && this->queuedTasks.load(std::memory_order_acquire) == 0)
+				return;
+		}
+	}
+
+public:
+	// threadCount worker threads, besides the threads calling runAll()
+	WorkStealingPool(uint32_t threadCount) {
+		this->queuedTasks = 0;
+		this->nextQueue = 0;
+		this->stopping = false;
+		for (uint32_t i = 0; i <= threadCount; ++i)
+			this->queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+		for (uint32_t i = 0; i < threadCount; ++i)
+			this->workers.push_back(std::thread(&WorkStealingPool::runWorker, this, i));
+	}
+
+	~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> lock(this->idleMutex);
+			this->stopping = true;
+		}
+		this->idleCondition.notify_all();
+		for (size_t i = 0; i < this->workers.size(); ++i)
+			this->workers[i].join();
+	}
+
+	WorkStealingPool(const WorkStealingPool&) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+	// Number of threads that can run the tasks of a query: the workers and the calling thread
+	uint32_t getConcurrency() const {
+		return (uint32_t)this->workers.size() + 1;
+	}
+
+	// Run all the tasks and return when they are done. Safe to call from many threads at the same time.
+	void runAll(const std::vector<std::function<void()> >& functions) {
+		TaskGroup group;
+		group.remaining = (uint32_t)functions.size();
+		uint32_t callerQueue = (uint32_t)this->workers.size(); // The extra deque
+		for (size_t i = 0; i < functions.size(); ++i) {
+			Task task;
+			task.function = functions[i];
+			task.group = &group;
+			uint32_t queueIndex = this->nextQueue.fetch_add(1, std::memory_order_relaxed) % this->queues.size();
+			TaskQueue& queue = *this->queues[queueIndex];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			this->queuedTasks.fetch_add(1, std::memory_order_acq_rel); // Before the task can be taken, so the count never goes below 0
+			queue.tasks.push_back(task);
+		}
+		{
+			// Idle workers check queuedTasks under this mutex, so none of them misses the notification
+			std::lock_guard<std::mutex> lock(this->idleMutex);
+		}
+		this->idleCondition.notify_all();
+
+		// Help until every task of the group has been taken, then wait for the ones still running
+		Task task;
+		while (group.remaining.load(std::memory_order_acquire) > 0 && this->takeTask(callerQueue, task))
+			runTask(task);
+		std::unique_lock<std::mutex> lock(group.mutex);
+		while (group.remaining.load(std::memory_order_acquire) > 0)
+			group.finished.wait(lock);
+	}
+};
+
+#endif